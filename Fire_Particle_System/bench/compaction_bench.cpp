@@ -0,0 +1,130 @@
+// Compares the legacy two-pass particle update (integrate, then a backward loop of swap-and-pop
+// kills over an array of structs) with the single-pass SIMD compaction in
+// ParticleSystem::process_particles, at different particle counts and per-frame death rates.
+//
+// Usage: compaction_bench [frames]
+// Build in Release, the numbers are meaningless with a debug build.
+
+#include "ParticleSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace
+{
+const float dt = 1.0f / 60.0f;
+
+/// The update as it used to be: integrate everything, then kill dead particles one at a time by
+/// swapping them with the back of the array.
+void legacyProcessParticles(std::vector<Particle>& particles, float dt)
+{
+	for(unsigned i = 0; i < particles.size(); ++i)
+	{
+		Particle& particle = particles[i];
+		particle.pos += particle.velocity * dt;
+		particle.lifetime += dt;
+	}
+	for(int i = int(particles.size()) - 1; i >= 0; --i)
+	{
+		if(particles[i].lifetime > particles[i].life_length)
+		{
+			std::swap(particles[i], particles.back());
+			particles.pop_back();
+		}
+	}
+}
+
+/// A particle with a uniformly distributed age. With life_length = dt / deathRate, a steady
+/// population loses `deathRate` of its particles every frame.
+Particle makeParticle(std::mt19937& rng, float deathRate, bool newborn)
+{
+	std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+	Particle particle;
+	particle.pos = glm::vec3(dist(rng), dist(rng), dist(rng));
+	particle.velocity = glm::vec3(dist(rng), dist(rng), dist(rng)) * 10.0f;
+	particle.life_length = dt / deathRate;
+	particle.lifetime = newborn ? 0.0f : (dist(rng) * 0.5f + 0.5f) * particle.life_length;
+	return particle;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+double benchLegacy(int count, float deathRate, int frames)
+{
+	std::mt19937 rng(1234);
+	std::vector<Particle> particles;
+	particles.reserve(count);
+	for(int i = 0; i < count; i++)
+	{
+		particles.push_back(makeParticle(rng, deathRate, false));
+	}
+
+	Clock::duration total(0);
+	for(int frame = 0; frame < frames; frame++)
+	{
+		Clock::time_point start = Clock::now();
+		legacyProcessParticles(particles, dt);
+		total += Clock::now() - start;
+
+		// Respawn outside the timed region to keep the population steady
+		while(int(particles.size()) < count)
+		{
+			particles.push_back(makeParticle(rng, deathRate, true));
+		}
+	}
+	return std::chrono::duration<double, std::nano>(total).count() / (double(count) * frames);
+}
+
+double benchCompaction(int count, float deathRate, int frames)
+{
+	std::mt19937 rng(1234);
+	ParticleSystem particleSystem(count);
+	for(int i = 0; i < count; i++)
+	{
+		particleSystem.spawn(makeParticle(rng, deathRate, false));
+	}
+
+	Clock::duration total(0);
+	for(int frame = 0; frame < frames; frame++)
+	{
+		Clock::time_point start = Clock::now();
+		particleSystem.process_particles(dt);
+		total += Clock::now() - start;
+
+		while(particleSystem.get_particle_count() < count)
+		{
+			particleSystem.spawn(makeParticle(rng, deathRate, true));
+		}
+	}
+	return std::chrono::duration<double, std::nano>(total).count() / (double(count) * frames);
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+#ifndef NDEBUG
+	printf("Warning: this is not an optimised build, timings will not be representative.\n\n");
+#endif
+	const int frames = argc > 1 ? std::max(1, atoi(argv[1])) : 100;
+	const int counts[] = { 10000, 100000, 1000000 };
+	const float deathRates[] = { 0.0f, 0.01f, 0.1f, 0.5f };
+
+	printf("%10s %8s %16s %16s %8s\n", "particles", "deaths", "two-pass ns/p", "compact ns/p", "speedup");
+	for(int count : counts)
+	{
+		for(float deathRate : deathRates)
+		{
+			// A zero death rate means immortal particles
+			const float rate = deathRate > 0.0f ? deathRate : 1e-9f;
+			const double legacy = benchLegacy(count, rate, frames);
+			const double compact = benchCompaction(count, rate, frames);
+			printf("%10d %7.0f%% %16.3f %16.3f %7.2fx\n", count, deathRate * 100.0f, legacy, compact,
+			       legacy / compact);
+		}
+	}
+	return 0;
+}
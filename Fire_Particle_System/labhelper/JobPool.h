@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace labhelper
+{
+///////////////////////////////////////////////////////////////////////////
+/// A small work-stealing pool for data-parallel loops.
+///
+/// parallelFor() cuts [0, count) into chunks of `grain` elements and deals
+/// contiguous runs of chunks to one queue per thread. Each thread drains its
+/// own queue from the front and, once it is empty, steals chunks from the
+/// back of the other queues. The calling thread takes part in the work and
+/// the call returns once every chunk has run.
+///
+/// The chunk boundaries only depend on `count` and `grain`, never on the
+/// number of threads, so a body that writes each element from its own chunk
+/// gives the same result for any thread count.
+///////////////////////////////////////////////////////////////////////////
+class JobPool
+{
+public:
+	typedef std::function<void(int begin, int end)> RangeFunction;
+
+	/// Starts the pool with `threadCount` threads including the caller, 0 uses
+	/// one thread per hardware thread.
+	explicit JobPool(int threadCount = 0);
+	~JobPool();
+
+	JobPool(const JobPool&) = delete;
+	JobPool& operator=(const JobPool&) = delete;
+
+	/// Restarts the workers, must not be called from inside parallelFor()
+	void setThreadCount(int threadCount);
+	int getThreadCount() const { return threadCount; }
+
+	/// Number of hardware threads, at least 1
+	static int getHardwareThreadCount();
+
+	/// Calls `body(begin, end)` once per chunk of [0, count) and waits for all of them
+	void parallelFor(int count, int grain, const RangeFunction& body);
+
+private:
+	/// Chunk range [begin, end) packed into one word, so the owner and the
+	/// thieves can claim chunks with a single compare-and-swap. Padded to a
+	/// cache line to keep the queues from false sharing.
+	struct Queue
+	{
+		std::atomic<uint64_t> range;
+		char padding[64 - sizeof(std::atomic<uint64_t>)];
+	};
+
+	void startWorkers();
+	void stopWorkers();
+	void workerLoop(int queueIndex, uint64_t seenGeneration);
+	void runChunks(int queueIndex);
+	bool popLocal(int queueIndex, uint32_t& chunk);
+	bool steal(int queueIndex, uint32_t& chunk);
+
+	int threadCount = 1;
+	std::vector<std::thread> workers;
+	std::unique_ptr<Queue[]> queues;
+
+	std::mutex mutex;
+	std::condition_variable wakeCondition;
+	std::condition_variable doneCondition;
+	uint64_t generation = 0;
+	int busyWorkers = 0;
+	bool quit = false;
+
+	// The job currently being run
+	const RangeFunction* jobBody = nullptr;
+	int jobCount = 0;
+	int jobGrain = 1;
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// Runs `body` over the chunks of [0, count) on `pool`, or on the calling
+/// thread with the same chunking when `pool` is null.
+///////////////////////////////////////////////////////////////////////////
+void parallelFor(JobPool* pool, int count, int grain, const JobPool::RangeFunction& body);
+} // namespace labhelper
@@ -0,0 +1,141 @@
+#include "DepthSort.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+const int radixBits = 11;
+const uint32_t radixSize = 1u << radixBits;
+const uint32_t radixMask = radixSize - 1;
+const int radixPasses = 3; // 3 * 11 bits covers the 32 bit key
+
+/// Maps a float to a uint32 with the same ordering: negative floats have all bits flipped,
+/// positive floats only the sign bit.
+inline uint32_t floatToSortableKey(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	const uint32_t mask = (bits & 0x80000000u) ? 0xffffffffu : 0x80000000u;
+	return bits ^ mask;
+}
+
+inline void ensureSize(std::vector<uint32_t>& buffer, uint32_t count)
+{
+	if(buffer.size() < count)
+	{
+		buffer.resize(count);
+	}
+}
+} // namespace
+
+const uint32_t* DepthSorter::sort(const float* depth, uint32_t count, bool coherent)
+{
+	ensureSize(keys, count);
+	ensureSize(indices, count);
+	ensureSize(keysTemp, count);
+	ensureSize(indicesTemp, count);
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		keys[i] = floatToSortableKey(depth[i]);
+		indices[i] = i;
+	}
+
+	// Allow roughly as much work as a couple of radix passes before giving up on the repair. A
+	// failed repair leaves the (key, index) pairs partially sorted, which the radix sort handles.
+	repaired = coherent && insertionRepair(count, uint64_t(count) * 2 + 64);
+	if(!repaired)
+	{
+		radixSort(count);
+	}
+	return indices.data();
+}
+
+bool DepthSorter::insertionRepair(uint32_t count, uint64_t budget)
+{
+	uint64_t shifts = 0;
+	for(uint32_t i = 1; i < count; i++)
+	{
+		const uint32_t key = keys[i];
+		const uint32_t index = indices[i];
+		uint32_t j = i;
+		while(j > 0 && keys[j - 1] > key)
+		{
+			keys[j] = keys[j - 1];
+			indices[j] = indices[j - 1];
+			j--;
+		}
+		keys[j] = key;
+		indices[j] = index;
+
+		shifts += i - j;
+		if(shifts > budget)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void DepthSorter::radixSort(uint32_t count)
+{
+	if(count < 2)
+	{
+		return;
+	}
+
+	// Histogram all digits in a single sweep
+	histograms.assign(radixPasses * radixSize, 0);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		const uint32_t key = keys[i];
+		for(int pass = 0; pass < radixPasses; pass++)
+		{
+			histograms[pass * radixSize + ((key >> (pass * radixBits)) & radixMask)]++;
+		}
+	}
+
+	uint32_t* srcKeys = keys.data();
+	uint32_t* srcIndices = indices.data();
+	uint32_t* dstKeys = keysTemp.data();
+	uint32_t* dstIndices = indicesTemp.data();
+
+	for(int pass = 0; pass < radixPasses; pass++)
+	{
+		uint32_t* histogram = &histograms[pass * radixSize];
+		const int shift = pass * radixBits;
+
+		// Every key shares this digit, the pass would not move anything
+		if(histogram[(srcKeys[0] >> shift) & radixMask] == count)
+		{
+			continue;
+		}
+
+		// Exclusive prefix sum turns counts into output offsets
+		uint32_t sum = 0;
+		for(uint32_t bucket = 0; bucket < radixSize; bucket++)
+		{
+			const uint32_t bucketCount = histogram[bucket];
+			histogram[bucket] = sum;
+			sum += bucketCount;
+		}
+
+		for(uint32_t i = 0; i < count; i++)
+		{
+			const uint32_t key = srcKeys[i];
+			const uint32_t destination = histogram[(key >> shift) & radixMask]++;
+			dstKeys[destination] = key;
+			dstIndices[destination] = srcIndices[i];
+		}
+
+		std::swap(srcKeys, dstKeys);
+		std::swap(srcIndices, dstIndices);
+	}
+
+	// An odd number of scatter passes leaves the result in the temporaries
+	if(srcKeys != keys.data())
+	{
+		keys.swap(keysTemp);
+		indices.swap(indicesTemp);
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// Thin wrappers around the SIMD instruction set used by the particle kernels. The widest
+// available set is picked at compile time (AVX -> 8 lanes, SSE2 -> 4 lanes), with a scalar
+// fallback so the project still builds on targets without x86 intrinsics.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define PARTICLE_SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PARTICLE_SIMD_SSE
+#endif
+
+namespace simd
+{
+#if defined(PARTICLE_SIMD_AVX)
+
+const int width = 8;
+typedef __m256 float_v;
+
+inline float_v set1(float v) { return _mm256_set1_ps(v); }
+inline float_v load(const float* p) { return _mm256_load_ps(p); }
+inline void store(float* p, float_v v) { _mm256_store_ps(p, v); }
+inline void storeu(float* p, float_v v) { _mm256_storeu_ps(p, v); }
+inline float_v add(float_v a, float_v b) { return _mm256_add_ps(a, b); }
+inline float_v mul(float_v a, float_v b) { return _mm256_mul_ps(a, b); }
+inline float_v madd(float_v a, float_v b, float_v c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+/// One bit per lane, set where a <= b
+inline int cmple_mask(float_v a, float_v b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+
+#elif defined(PARTICLE_SIMD_SSE)
+
+const int width = 4;
+typedef __m128 float_v;
+
+inline float_v set1(float v) { return _mm_set1_ps(v); }
+inline float_v load(const float* p) { return _mm_load_ps(p); }
+inline void store(float* p, float_v v) { _mm_store_ps(p, v); }
+inline void storeu(float* p, float_v v) { _mm_storeu_ps(p, v); }
+inline float_v add(float_v a, float_v b) { return _mm_add_ps(a, b); }
+inline float_v mul(float_v a, float_v b) { return _mm_mul_ps(a, b); }
+inline float_v madd(float_v a, float_v b, float_v c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+/// One bit per lane, set where a <= b
+inline int cmple_mask(float_v a, float_v b) { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+
+#else
+
+const int width = 1;
+typedef float float_v;
+
+inline float_v set1(float v) { return v; }
+inline float_v load(const float* p) { return *p; }
+inline void store(float* p, float_v v) { *p = v; }
+inline void storeu(float* p, float_v v) { *p = v; }
+inline float_v add(float_v a, float_v b) { return a + b; }
+inline float_v mul(float_v a, float_v b) { return a * b; }
+inline float_v madd(float_v a, float_v b, float_v c) { return a * b + c; }
+/// One bit per lane, set where a <= b
+inline int cmple_mask(float_v a, float_v b) { return a <= b ? 1 : 0; }
+
+#endif
+
+/// Mask with every lane bit set
+const int full_mask = (1 << width) - 1;
+} // namespace simd
@@ -1,8 +1,119 @@
 #include "ParticleSystem.h"
-#include <algorithm> 
+#include "ParticleSimd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+///////////////////////////////////////////////////////////////////////
+// Structure-of-arrays storage
+///////////////////////////////////////////////////////////////////////
+
+void ParticleSoA::allocate(int capacity)
+{
+    // Round up to whole SIMD blocks so the kernels never need a scalar tail
+    this->capacity = (capacity + lane_padding - 1) / lane_padding * lane_padding;
+    count = 0;
+
+    // One allocation for all eight attribute arrays, with slack to align the first one
+    const int numArrays = 8;
+    const size_t slack = alignment / sizeof(float);
+    storage.assign(numArrays * size_t(this->capacity) + slack, 0.0f);
+
+    uintptr_t address = reinterpret_cast<uintptr_t>(storage.data());
+    address = (address + alignment - 1) & ~uintptr_t(alignment - 1);
+    float* base = reinterpret_cast<float*>(address);
+
+    float** arrays[numArrays] = { &px, &py, &pz, &vx, &vy, &vz, &lifetime, &life_length };
+    for (int i = 0; i < numArrays; i++)
+    {
+        *arrays[i] = base + size_t(i) * this->capacity;
+    }
+}
+
+void ParticleSoA::push_back(const Particle& particle)
+{
+    px[count] = particle.pos.x;
+    py[count] = particle.pos.y;
+    pz[count] = particle.pos.z;
+    vx[count] = particle.velocity.x;
+    vy[count] = particle.velocity.y;
+    vz[count] = particle.velocity.z;
+    lifetime[count] = particle.lifetime;
+    life_length[count] = particle.life_length;
+    count++;
+}
+
+void ParticleSoA::move(int src, int dst)
+{
+    px[dst] = px[src];
+    py[dst] = py[src];
+    pz[dst] = pz[src];
+    vx[dst] = vx[src];
+    vy[dst] = vy[src];
+    vz[dst] = vz[src];
+    lifetime[dst] = lifetime[src];
+    life_length[dst] = life_length[src];
+}
+
+Particle ParticleSoA::get(int id) const
+{
+    Particle particle;
+    particle.pos = glm::vec3(px[id], py[id], pz[id]);
+    particle.velocity = glm::vec3(vx[id], vy[id], vz[id]);
+    particle.lifetime = lifetime[id];
+    particle.life_length = life_length[id];
+    return particle;
+}
+
+void ParticleSoA::move_range(int src, int dst, int n)
+{
+    float* arrays[] = { px, py, pz, vx, vy, vz, lifetime, life_length };
+    for (float* array : arrays)
+    {
+        memmove(array + dst, array + src, n * sizeof(float));
+    }
+}
+
+void ParticleSoA::gather(const ParticleSoA& src, const uint32_t* order, int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        const uint32_t id = order[i];
+        px[i] = src.px[id];
+        py[i] = src.py[id];
+        pz[i] = src.pz[id];
+        vx[i] = src.vx[id];
+        vy[i] = src.vy[id];
+        vz[i] = src.vz[id];
+        lifetime[i] = src.lifetime[id];
+        life_length[i] = src.life_length[id];
+    }
+}
+
+void ParticleSoA::swap(ParticleSoA& other)
+{
+    std::swap(px, other.px);
+    std::swap(py, other.py);
+    std::swap(pz, other.pz);
+    std::swap(vx, other.vx);
+    std::swap(vy, other.vy);
+    std::swap(vz, other.vz);
+    std::swap(lifetime, other.lifetime);
+    std::swap(life_length, other.life_length);
+    std::swap(count, other.count);
+    std::swap(capacity, other.capacity);
+    storage.swap(other.storage);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Particle system
+///////////////////////////////////////////////////////////////////////
+
 ParticleSystem::ParticleSystem(int capacity) : max_size(capacity)
 {
-	gl_data_temp_buffer.resize(max_size);
+	particles.allocate(max_size);
+	gl_depth_temp_buffer.resize(max_size);
 }
 
 ParticleSystem::~ParticleSystem()
@@ -21,7 +132,20 @@ void ParticleSystem::init_gpu_data()
 
     // Allocate GPU memory space, each particle requires a vec4 (4 floats)
     GLsizeiptr bufferSize = max_size * sizeof(glm::vec4);
-    glBufferData(GL_ARRAY_BUFFER, bufferSize, nullptr, GL_DYNAMIC_DRAW);
+    if (GLEW_ARB_buffer_storage)
+    {
+        // One region per frame in flight, mapped once for the lifetime of the buffer. Coherent
+        // mapping makes the writes visible to the GPU without explicit flushes.
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, bufferSize * num_upload_regions, nullptr, flags);
+        gl_mapped_data = static_cast<glm::vec4*>(
+            glMapBufferRange(GL_ARRAY_BUFFER, 0, bufferSize * num_upload_regions, flags));
+    }
+    if (gl_mapped_data == nullptr)
+    {
+        glBufferData(GL_ARRAY_BUFFER, bufferSize, nullptr, GL_DYNAMIC_DRAW);
+        gl_data_temp_buffer.resize(max_size);
+    }
 
     // Setting vertex attributes
     glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)0);
@@ -31,76 +155,247 @@ void ParticleSystem::init_gpu_data()
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void ParticleSystem::process_particles(float dt)
+glm::vec4* ParticleSystem::begin_upload()
 {
-    // First loop: Update alive particles
-    for (unsigned i = 0; i < particles.size(); ++i) 
+    if (gl_mapped_data == nullptr)
     {
-        Particle& particle = particles[i];
-        particle.pos += particle.velocity * dt;
-        particle.lifetime += dt;
+        return gl_data_temp_buffer.data();
     }
-    // Second loop: Kill dead particles (iterate backwards to handle index changes)
-    for (int i = particles.size() - 1; i >= 0; --i) {
-        const Particle& particle = particles[i];
-        if (particle.lifetime > particle.life_length) {
-            kill(i);
+
+    // The previous region's draw has been issued by now, fence it so we know when it is free again
+    if (gl_upload_region >= 0)
+    {
+        gl_upload_fences[gl_upload_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    gl_upload_region = (gl_upload_region + 1) % num_upload_regions;
+
+    // Normally the region was released two frames ago and this returns at once
+    GLsync& fence = gl_upload_fences[gl_upload_region];
+    if (fence != nullptr)
+    {
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        while (result == GL_TIMEOUT_EXPIRED)
+        {
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
         }
+        glDeleteSync(fence);
+        fence = nullptr;
     }
+    return gl_mapped_data + size_t(gl_upload_region) * max_size;
 }
 
-void ParticleSystem::submit_to_gpu(const glm::mat4& viewMat)
+void ParticleSystem::end_upload(unsigned int num_particles)
 {
-    unsigned int num_active_particles = particles.size();
-    if (num_active_particles == 0)
+    glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+    if (gl_mapped_data == nullptr)
     {
+        GLsizeiptr dataSize = num_particles * sizeof(glm::vec4);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, dataSize, gl_data_temp_buffer.data());
         return;
     }
 
-    // Extract and convert particle data
-    for (unsigned int i = 0; i < num_active_particles; i++)
+    // Point the vao at the region that was just written
+    const size_t offset = size_t(gl_upload_region) * max_size * sizeof(glm::vec4);
+    glBindVertexArray(gl_vao);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)offset);
+    glBindVertexArray(0);
+}
+
+namespace
+{
+/// Integrates particles [begin, end) and compacts the survivors to the front of the range, keeping
+/// their order. Returns the number of survivors. `begin` must be a multiple of simd::width.
+int integrate_and_compact(ParticleSoA& p, int begin, int end, float dt)
+{
+    // Survivors are compacted towards the front with a write cursor, so each particle is touched
+    // once per frame. The arrays are padded to whole blocks, so the last block may integrate unused
+    // lanes past `count`, which is harmless as they are never compacted.
+    const simd::float_v vdt = simd::set1(dt);
+    int write = begin;
+
+    for (int i = begin; i < end; i += simd::width)
     {
-        const Particle& particle = particles[i];
+        const simd::float_v vx = simd::load(p.vx + i);
+        const simd::float_v vy = simd::load(p.vy + i);
+        const simd::float_v vz = simd::load(p.vz + i);
+        const simd::float_v lifeLength = simd::load(p.life_length + i);
+        const simd::float_v px = simd::madd(vx, vdt, simd::load(p.px + i));
+        const simd::float_v py = simd::madd(vy, vdt, simd::load(p.py + i));
+        const simd::float_v pz = simd::madd(vz, vdt, simd::load(p.pz + i));
+        const simd::float_v lifetime = simd::add(simd::load(p.lifetime + i), vdt);
 
-        // Convert particle positions to view space
-        glm::vec4 viewSpacePos = viewMat * glm::vec4(particle.pos, 1.0f);
+        // A particle survives while lifetime <= life_length
+        const int aliveMask = simd::cmple_mask(lifetime, lifeLength);
+        const int lanes = std::min(simd::width, end - i);
 
-        // Normalized lifespan: 0 = just created, 1 = about to die
-        float normalizedLifetime = particle.lifetime / particle.life_length;
-        normalizedLifetime = glm::clamp(normalizedLifetime, 0.0f, 1.0f);
+        if (lanes == simd::width && aliveMask == simd::full_mask)
+        {
+            // The whole block survives: write it straight to the cursor. The cursor never passes
+            // `i`, so this cannot clobber blocks that have not been read yet.
+            simd::storeu(p.px + write, px);
+            simd::storeu(p.py + write, py);
+            simd::storeu(p.pz + write, pz);
+            simd::storeu(p.lifetime + write, lifetime);
+            if (write != i)
+            {
+                simd::storeu(p.vx + write, vx);
+                simd::storeu(p.vy + write, vy);
+                simd::storeu(p.vz + write, vz);
+                simd::storeu(p.life_length + write, lifeLength);
+            }
+            write += simd::width;
+            continue;
+        }
 
-        // Pack the data into a vec4: xyz is the view space position, w is the normalized lifetime
-        gl_data_temp_buffer[i] = glm::vec4(viewSpacePos.x, viewSpacePos.y, viewSpacePos.z, normalizedLifetime);
+        simd::store(p.px + i, px);
+        simd::store(p.py + i, py);
+        simd::store(p.pz + i, pz);
+        simd::store(p.lifetime + i, lifetime);
+
+        // Branchless compaction: always copy to the cursor, only advance it for survivors
+        for (int lane = 0; lane < lanes; lane++)
+        {
+            p.move(i + lane, write);
+            write += (aliveMask >> lane) & 1;
+        }
     }
+    return write - begin;
+}
 
-    // Sort particles by depth
-    std::sort(gl_data_temp_buffer.begin(),
-        std::next(gl_data_temp_buffer.begin(), num_active_particles),
-        [](const glm::vec4& lhs, const glm::vec4& rhs) {
-            return lhs.z < rhs.z;
+/// Particles per job, a multiple of every SIMD width
+const int job_grain = 4096;
+} // namespace
+
+void ParticleSystem::process_particles(float dt)
+{
+    // Each chunk integrates and compacts its own range in parallel, then the surviving runs are
+    // closed up in chunk order. The chunks only depend on `job_grain`, so the result is the same
+    // for any number of threads.
+    ParticleSoA& p = particles;
+    const int count = p.count;
+    const int numChunks = (count + job_grain - 1) / job_grain;
+    chunk_survivors.resize(numChunks);
+
+    labhelper::parallelFor(job_pool, count, job_grain, [&](int begin, int end) {
+        chunk_survivors[begin / job_grain] = integrate_and_compact(p, begin, end, dt);
+    });
+
+    int write = 0;
+    for (int chunk = 0; chunk < numChunks; chunk++)
+    {
+        const int begin = chunk * job_grain;
+        const int survivors = chunk_survivors[chunk];
+        if (write != begin && survivors > 0)
+        {
+            p.move_range(begin, write, survivors);
+        }
+        write += survivors;
+    }
+    p.count = write;
+}
+
+void ParticleSystem::submit_to_gpu(const glm::mat4& viewMat)
+{
+    unsigned int num_active_particles = particles.count;
+    if (num_active_particles == 0)
+    {
+        return;
+    }
+
+    const float lag = render_lag;
+    const uint32_t* order = nullptr;
+    if (depth_sort)
+    {
+        // The sort only needs the view space depth, which is the third row of the view matrix
+        const float mx = viewMat[0][2], my = viewMat[1][2], mz = viewMat[2][2], mw = viewMat[3][2];
+        labhelper::parallelFor(job_pool, num_active_particles, job_grain, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                const float x = particles.px[i] - particles.vx[i] * lag;
+                const float y = particles.py[i] - particles.vy[i] * lag;
+                const float z = particles.pz[i] - particles.vz[i] * lag;
+                gl_depth_temp_buffer[i] = mx * x + my * y + mz * z + mw;
+            }
         });
 
-    // Upload data to GPU
-    glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
-    GLsizeiptr dataSize = num_active_particles * sizeof(glm::vec4);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, dataSize, gl_data_temp_buffer.data());
+        // Sort particles by depth, back to front
+        const bool coherent = incremental_sort && view_is_coherent(viewMat);
+        order = depth_sorter.sort(gl_depth_temp_buffer.data(), num_active_particles, coherent);
+        last_view_mat = viewMat;
+        has_last_view = true;
+
+        // Keep the storage in draw order so next frame starts out nearly sorted. Compaction and
+        // spawning both preserve the relative order of the survivors.
+        if (incremental_sort)
+        {
+            labhelper::parallelFor(job_pool, num_active_particles, job_grain, [&](int begin, int end) {
+                sorted_particles.gather(particles, order, begin, end);
+            });
+            sorted_particles.count = particles.count;
+            particles.swap(sorted_particles);
+            order = nullptr;
+        }
+    }
+
+    // Extract and convert particle data in sorted order, straight into the upload region
+    glm::vec4* destination = begin_upload();
+    labhelper::parallelFor(job_pool, num_active_particles, job_grain, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            const unsigned int id = order ? order[i] : i;
+
+            // Convert particle positions to view space
+            const glm::vec3 pos = glm::vec3(particles.px[id], particles.py[id], particles.pz[id]) -
+                                  glm::vec3(particles.vx[id], particles.vy[id], particles.vz[id]) * lag;
+            glm::vec4 viewSpacePos = viewMat * glm::vec4(pos, 1.0f);
+
+            // Normalized lifespan: 0 = just created, 1 = about to die
+            float normalizedLifetime = (particles.lifetime[id] - lag) / particles.life_length[id];
+            normalizedLifetime = glm::clamp(normalizedLifetime, 0.0f, 1.0f);
+
+            // Pack the data into a vec4: xyz is the view space position, w is the normalized lifetime
+            destination[i] = glm::vec4(viewSpacePos.x, viewSpacePos.y, viewSpacePos.z, normalizedLifetime);
+        }
+    });
+
+    end_upload(num_active_particles);
 }
 
-void ParticleSystem::spawn(Particle particle)
+void ParticleSystem::set_incremental_sort(bool enabled)
 {
-    if (particles.size() < max_size)
+    if (enabled && sorted_particles.capacity < particles.capacity)
     {
-        particles.push_back(particle);
+        sorted_particles.allocate(max_size);
     }
+    incremental_sort = enabled;
 }
 
-void ParticleSystem::kill(int id)
+bool ParticleSystem::view_is_coherent(const glm::mat4& viewMat) const
 {
-    if (id < 0 || id >= particles.size())
+    if (!has_last_view)
     {
-        return;
+        return false;
     }
-    // Swap with last element and pop
-    std::swap(particles[id], particles.back());
-    particles.pop_back();
-}
\ No newline at end of file
+
+    // Small rotations and translations keep most pairs of particles in the same depth order
+    const float threshold = 0.05f;
+    for (int column = 0; column < 4; column++)
+    {
+        for (int row = 0; row < 4; row++)
+        {
+            if (std::abs(viewMat[column][row] - last_view_mat[column][row]) > threshold)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void ParticleSystem::spawn(Particle particle)
+{
+    if (particles.count < max_size)
+    {
+        particles.push_back(particle);
+    }
+}
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <GL/glew.h>
+#include <cstdint>
 #include <vector>
 #include <glm/detail/type_vec3.hpp>
 #include <glm/mat4x4.hpp>
+#include "DepthSort.h"
+#include "JobPool.h"
 
 struct Particle
 {
@@ -13,6 +16,55 @@ struct Particle
 	float life_length;
 };
 
+/// Structure-of-arrays particle storage. Each attribute lives in its own array, aligned to
+/// `alignment` bytes and padded to a multiple of `lane_padding` floats, so the update kernels can
+/// run aligned SIMD loads and stores over whole blocks without a scalar tail.
+struct ParticleSoA
+{
+	static const int alignment = 32;
+	static const int lane_padding = 8;
+
+	float* px = nullptr;
+	float* py = nullptr;
+	float* pz = nullptr;
+	float* vx = nullptr;
+	float* vy = nullptr;
+	float* vz = nullptr;
+	float* lifetime = nullptr;
+	float* life_length = nullptr;
+
+	int count = 0;
+	int capacity = 0;
+
+	ParticleSoA() = default;
+	ParticleSoA(const ParticleSoA&) = delete;
+	ParticleSoA& operator=(const ParticleSoA&) = delete;
+
+	/// Allocates room for `capacity` particles, rounded up to whole SIMD blocks
+	void allocate(int capacity);
+
+	/// Appends a particle, the caller is responsible for checking the capacity
+	void push_back(const Particle& particle);
+
+	/// Copies the particle at index `src` over the particle at index `dst`
+	void move(int src, int dst);
+
+	/// Gathers the attributes of particle `id` back into a `Particle`
+	Particle get(int id) const;
+
+	/// Copies `n` particles starting at index `src` to index `dst`, the ranges may overlap
+	void move_range(int src, int dst, int n);
+
+	/// Fills indices [begin, end) with the particles of `src` taken in `order`, leaves `count` alone
+	void gather(const ParticleSoA& src, const uint32_t* order, int begin, int end);
+
+	/// Exchanges the storage of two containers without copying
+	void swap(ParticleSoA& other);
+
+private:
+	std::vector<float> storage;
+};
+
 class ParticleSystem
 {
 public:
@@ -28,28 +80,68 @@ public:
 	void spawn(Particle particle);
 
 	/// Updates all the particles' positions depending on their speed, their lifetimes, and kills any
-	/// that are past their life_length
+	/// that are past their life_length. Survivors are compacted in place and keep their order.
 	void process_particles(float dt);
 
-	/// Updates the vertex buffer with the current particle properties, and renders them
+	/// Updates the vertex buffer with the current particle properties, and renders them. With
+	/// ARB_buffer_storage the vertices are written straight into a persistently mapped ring of
+	/// `num_upload_regions` regions, so the upload never waits for the previous frame's draw.
 	void submit_to_gpu(const glm::mat4& viewMat);
 
 	GLuint getVAO() const { return gl_vao; }
-	GLsizei get_particle_count() const { return static_cast<GLsizei>(particles.size()); }
+	GLsizei get_particle_count() const { return static_cast<GLsizei>(particles.count); }
+
+	/// When enabled the particles are stored in last frame's draw order, so while the camera barely
+	/// moves the depth sort only has to repair a nearly sorted sequence
+	void set_incremental_sort(bool enabled);
+	bool get_incremental_sort() const { return incremental_sort; }
+
+	/// Disables the back to front sort, for blending modes that do not depend on draw order
+	void set_depth_sort(bool enabled) { depth_sort = enabled; }
+	bool get_depth_sort() const { return depth_sort; }
+
+	/// Draws every particle `seconds` behind its simulated state. A particle moves by velocity * dt
+	/// in a step, so a lag of (1 - alpha) * dt draws the blend of the last two steps of a fixed
+	/// timestep without keeping the previous positions around.
+	void set_render_lag(float seconds) { render_lag = seconds; }
 
-	std::vector<Particle> particles;
+	/// Splits the update and the view transform over `pool`, null runs them on the calling thread
+	void set_job_pool(labhelper::JobPool* pool) { job_pool = pool; }
 
 private:
-	/// Deletes a particle at position `id` by swapping it with the last
-	/// particle in the array and reducing the size by 1.
-	/// (Care with indexes, as this can change the particle an index refers to)
-	void kill(int id);
+	/// Returns where this frame's vertices go, waiting for the ring region to be released if needed
+	glm::vec4* begin_upload();
+
+	/// Makes the vertices written since begin_upload() the ones the vao draws
+	void end_upload(unsigned int num_particles);
+
+	/// True if `viewMat` is close enough to last frame's view that the previous order is a good guess
+	bool view_is_coherent(const glm::mat4& viewMat) const;
 
 	// Members
-	//std::vector<Particle> particles;
+	ParticleSoA particles;
 	int max_size;
 
 	GLuint gl_vao = 0;
 	GLuint gl_buffer = 0;
+
+	// Upload ring, gl_data_temp_buffer is only used when persistent mapping is unavailable
+	static const int num_upload_regions = 3;
+	glm::vec4* gl_mapped_data = nullptr;
+	GLsync gl_upload_fences[num_upload_regions] = {};
+	int gl_upload_region = -1;
 	std::vector<glm::vec4> gl_data_temp_buffer;
+
+	labhelper::JobPool* job_pool = nullptr;
+	std::vector<int> chunk_survivors;
+	float render_lag = 0.0f;
+
+	// Depth sorting
+	DepthSorter depth_sorter;
+	std::vector<float> gl_depth_temp_buffer;
+	ParticleSoA sorted_particles;
+	bool depth_sort = true;
+	bool incremental_sort = false;
+	bool has_last_view = false;
+	glm::mat4 last_view_mat;
 };
@@ -10,6 +10,9 @@ public:
 	int height;
 	bool isComplete;
 	GLenum colorTargetType = GL_RGBA16F;
+	// GL_DEPTH24_STENCIL8 is attached as a depth-stencil buffer. Match the default framebuffer to
+	// blit its depth into this one.
+	GLenum depthTargetType = GL_DEPTH_COMPONENT32;
 
 	FboInfo(int numberOfColorBuffers = 1);
 		
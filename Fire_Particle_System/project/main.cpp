@@ -20,6 +20,8 @@ using namespace glm;
 
 #include <Model.h>
 #include "hdr.h"
+#include "JobPool.h"
+#include "FixedTimestep.h"
 #include "fbo.h"
 #include "heightfield.h"
 
@@ -41,7 +43,12 @@ void drawParticles(const mat4& viewMatrix, const mat4& projectionMatrix);
 void drawExplodeParticles(const mat4& viewMatrix, const mat4& projectionMatrix);
 void generateParticlesPerFrame();
 void updateFighterTransform();
-void generateEngineParticles();
+void generateEngineParticles(float dt);
+void simulateParticles();
+void beginParticleOIT();
+void compositeParticleOIT();
+void beginParticleTimer();
+void endParticleTimer(int mode);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Various globals
@@ -60,8 +67,26 @@ bool g_isMouseDragging = false;
 // Particle System
 //ParticleSystem* particleSystem = nullptr;
 ParticleSystem particleSystem(10000);
+labhelper::JobPool jobPool;
+int workerThreads = 1;
 GLuint particleShaderProgram = 0;
 
+// Weighted blended order-independent transparency. Target 0 accumulates the weighted premultiplied
+// colors and alphas, target 1 holds the revealage in r. 32-bit floats, dense particle clouds
+// overflow the sums in half floats.
+FboInfo oitFB(2);
+GLuint particleOITShaderProgram = 0;
+GLuint oitCompositeProgram = 0;
+bool useParticleOIT = false;
+
+// Particle pass timings in ms, smoothed. [0] = sorted alpha blending, [1] = OIT.
+float particleCPUTime[2] = { 0.0f, 0.0f };
+float particleGPUTime[2] = { 0.0f, 0.0f };
+GLuint particleTimerQueries[2] = { 0, 0 }; // Alternating, each one is read a frame after it ends
+int particleTimerModes[2] = { -1, -1 };    // Mode measured by each query, -1 once it has been read
+int particleTimerFrame = 0;
+std::chrono::high_resolution_clock::time_point particleTimerStart;
+
 // Aircraft engine exhaust port location
 glm::vec3 particleSpawnOffset = glm::vec3(8.0f, 4.0f, 0.0f);
 
@@ -79,7 +104,14 @@ GLuint explosionTexture = 0;
 float particleBaseSize = 20.0f;      
 float particleSpeedMultiplier = 15.0f;
 float particleLifespan = 3.0f;
-int particlesPerFrame = 64;
+float particlesPerSecond = 3840.0f;
+labhelper::RateAccumulator engineEmission;
+
+// The particles are simulated at a fixed rate, whatever the frame rate
+labhelper::FixedTimestep simulationClock(60.0f, 4);
+float simulationRate = 60.0f;
+int maxSimulationSteps = 4;
+bool interpolateParticles = true;
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -223,6 +255,20 @@ void loadShaders(bool is_reload)
 		particleShaderProgram = shader;
 	}
 
+	shader = labhelper::loadShaderProgram("../project/particle.vert", "../project/particle_oit.frag", is_reload);
+	if (shader != 0)
+	{
+		glDeleteProgram(particleOITShaderProgram);
+		particleOITShaderProgram = shader;
+	}
+
+	shader = labhelper::loadShaderProgram("../project/fullscreenQuad.vert", "../project/oit_composite.frag", is_reload);
+	if (shader != 0)
+	{
+		glDeleteProgram(oitCompositeProgram);
+		oitCompositeProgram = shader;
+	}
+
 }
 
 
@@ -288,10 +334,24 @@ void initialize()
 	glEnable(GL_DEPTH_TEST);	// enable Z-buffering 
 	glEnable(GL_CULL_FACE);		// enables backface culling
 
+	///////////////////////////////////////////////////////////////////////
+	// Setup Framebuffer for order-independent transparency
+	///////////////////////////////////////////////////////////////////////
+	// The scene depth is blitted in before the particles, which needs matching depth formats
+	GLint depthBits = 0, stencilBits = 0;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_DEPTH, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+	glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_STENCIL, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+	oitFB.colorTargetType = GL_RGBA32F;
+	oitFB.depthTargetType = stencilBits > 0 ? GL_DEPTH24_STENCIL8 : (depthBits == 32 ? GL_DEPTH_COMPONENT32 : GL_DEPTH_COMPONENT24);
+	glGenQueries(2, particleTimerQueries);
+
 	///////////////////////////////////////////////////////////////////////
 	// Initialize Particle System
 	///////////////////////////////////////////////////////////////////////
 	particleSystem.init_gpu_data();
+	workerThreads = jobPool.getThreadCount();
+	particleSystem.set_job_pool(&jobPool);
 
 	//generateTestParticles();
 }
@@ -354,14 +414,16 @@ void generateParticlesPerFrame()
 	}
 }
 
-void generateEngineParticles()
+void generateEngineParticles(float dt)
 {
 	if (!isMovingForward) 
 	{
+		engineEmission.reset();
 		return;
 	}
 
-	for (int i = 0; i < particlesPerFrame; i++)
+	const int count = engineEmission.take(particlesPerSecond, dt);
+	for (int i = 0; i < count; i++)
 	{
 		const float theta = labhelper::uniform_randf(0.f, 2.f * M_PI);
 		const float u = labhelper::uniform_randf(0.95f, 1.f);
@@ -607,10 +669,95 @@ void display(void)
 	// Rendering Particle Systems
 	///////////////////////////////////////////////////////////////////////////
 	//drawParticles(viewMatrix, projMatrix);
+	beginParticleTimer();
 	drawExplodeParticles(viewMatrix, projMatrix);
+	endParticleTimer(useParticleOIT ? 1 : 0);
 	debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// Times the particle pass on the CPU and, through a query read back a frame later, on the GPU
+///////////////////////////////////////////////////////////////////////////////
+void beginParticleTimer()
+{
+	const int previous = 1 - particleTimerFrame;
+	GLint resultAvailable = 0;
+	if (particleTimerModes[previous] >= 0)
+	{
+		glGetQueryObjectiv(particleTimerQueries[previous], GL_QUERY_RESULT_AVAILABLE, &resultAvailable);
+	}
+	if (resultAvailable)
+	{
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(particleTimerQueries[previous], GL_QUERY_RESULT, &elapsed);
+		float& gpuTime = particleGPUTime[particleTimerModes[previous]];
+		gpuTime = mix(gpuTime, float(elapsed) * 1e-6f, 0.05f);
+		particleTimerModes[previous] = -1;
+	}
+
+	particleTimerStart = std::chrono::high_resolution_clock::now();
+	glBeginQuery(GL_TIME_ELAPSED, particleTimerQueries[particleTimerFrame]);
+}
+
+void endParticleTimer(int mode)
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	std::chrono::duration<float, std::milli> cpuTime = std::chrono::high_resolution_clock::now() - particleTimerStart;
+	particleCPUTime[mode] = mix(particleCPUTime[mode], cpuTime.count(), 0.05f);
+
+	particleTimerModes[particleTimerFrame] = mode;
+	particleTimerFrame = 1 - particleTimerFrame;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Redirects the particle draw into the OIT targets, depth tested against the scene drawn so far
+///////////////////////////////////////////////////////////////////////////////
+void beginParticleOIT()
+{
+	if (oitFB.width != windowWidth || oitFB.height != windowHeight)
+	{
+		oitFB.resize(windowWidth, windowHeight);
+	}
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, oitFB.framebufferId);
+	glBlitFramebuffer(0, 0, windowWidth, windowHeight, 0, 0, windowWidth, windowHeight, GL_DEPTH_BUFFER_BIT,
+	                  GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, oitFB.framebufferId);
+
+	const float clearAccumulation[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	const float clearRevealage[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	glClearBufferfv(GL_COLOR, 0, clearAccumulation);
+	glClearBufferfv(GL_COLOR, 1, clearRevealage);
+
+	glEnable(GL_BLEND);
+	glBlendFunci(0, GL_ONE, GL_ONE);
+	glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Blends the resolved OIT targets over the default framebuffer
+///////////////////////////////////////////////////////////////////////////////
+void compositeParticleOIT()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, windowWidth, windowHeight);
+
+	glUseProgram(oitCompositeProgram);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, oitFB.colorTextureTargets[0]);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, oitFB.colorTextureTargets[1]);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+	labhelper::drawFullScreenQuad();
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
 void drawParticles(const mat4& viewMatrix, const mat4& projectionMatrix)
 {
 	glEnable(GL_BLEND);
@@ -620,11 +767,7 @@ void drawParticles(const mat4& viewMatrix, const mat4& projectionMatrix)
 	glUseProgram(particleShaderProgram);
 	labhelper::setUniformSlow(particleShaderProgram, "projectionMatrix", projectionMatrix);
 
-	// Generate new particles every frame
-	//generateParticlesPerFrame();
-	generateEngineParticles();
-
-	particleSystem.process_particles(deltaTime);
+	simulateParticles();
 	particleSystem.submit_to_gpu(viewMatrix);
 
 	// render
@@ -637,10 +780,21 @@ void drawParticles(const mat4& viewMatrix, const mat4& projectionMatrix)
 	glUseProgram(0);
 }
 
+/// Runs the simulation steps due this frame, the emission is spread over the steps
+void simulateParticles()
+{
+	const float dt = simulationClock.getStepSize();
+	for (int i = 0; i < simulationClock.getFrameSteps(); i++)
+	{
+		generateEngineParticles(dt);
+		particleSystem.process_particles(dt);
+	}
+	particleSystem.set_render_lag(interpolateParticles ? simulationClock.getRenderLag() : 0.0f);
+}
+
 void drawExplodeParticles(const mat4& viewMatrix, const mat4& projectionMatrix)
 {
-	generateEngineParticles();
-	particleSystem.process_particles(deltaTime);
+	simulateParticles();
 
 	// no particles, no rendering
 	if (particleSystem.get_particle_count() == 0) 
@@ -649,28 +803,41 @@ void drawExplodeParticles(const mat4& viewMatrix, const mat4& projectionMatrix)
 	}
 
 	glEnable(GL_PROGRAM_POINT_SIZE);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (useParticleOIT)
+	{
+		beginParticleOIT();
+	}
+	else
+	{
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
 	glDepthMask(GL_FALSE);
 
 	// particle shader program
-	glUseProgram(particleShaderProgram);
-	labhelper::setUniformSlow(particleShaderProgram, "P", projectionMatrix);
+	const GLuint program = useParticleOIT ? particleOITShaderProgram : particleShaderProgram;
+	glUseProgram(program);
+	labhelper::setUniformSlow(program, "P", projectionMatrix);
 
 	// 设置屏幕尺寸（用于点大小缩放）
-	labhelper::setUniformSlow(particleShaderProgram, "screen_x", float(windowWidth));
-	labhelper::setUniformSlow(particleShaderProgram, "screen_y", float(windowHeight));
+	labhelper::setUniformSlow(program, "screen_x", float(windowWidth));
+	labhelper::setUniformSlow(program, "screen_y", float(windowHeight));
 
 	// Bind the explosion texture to texture unit 0
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, explosionTexture);
-	labhelper::setUniformSlow(particleShaderProgram, "colortexture", 0);
+	labhelper::setUniformSlow(program, "colortexture", 0);
 
 	particleSystem.submit_to_gpu(viewMatrix);
 	glBindVertexArray(particleSystem.getVAO());
 	glDrawArrays(GL_POINTS, 0, particleSystem.get_particle_count());
 	glBindVertexArray(0);
 
+	if (useParticleOIT)
+	{
+		compositeParticleOIT();
+	}
+
 	// Restoring OpenGL state
 	glDepthMask(GL_TRUE);             
 	glDisable(GL_BLEND);               
@@ -858,6 +1025,35 @@ void gui()
 	ImGui::Text("Particle System");
 	ImGui::DragFloat3("Particle spawn offset", &particleSpawnOffset.x, 0.1f, -20.0f, 20.0f);
 	ImGui::Text("Active particles: %d", particleSystem.get_particle_count());
+	ImGui::SliderFloat("Particles per second", &particlesPerSecond, 0.0f, 20000.0f);
+	if(ImGui::SliderFloat("Simulation rate (Hz)", &simulationRate, 10.0f, 240.0f))
+	{
+		simulationClock.setStepRate(simulationRate);
+	}
+	if(ImGui::SliderInt("Max steps per frame", &maxSimulationSteps, 1, 16))
+	{
+		simulationClock.setMaxStepsPerFrame(maxSimulationSteps);
+	}
+	ImGui::Checkbox("Interpolate particles", &interpolateParticles);
+	ImGui::Text("Steps this frame: %d, dropped: %llu", simulationClock.getFrameSteps(),
+	            (unsigned long long)simulationClock.getDroppedStepCount());
+	bool incrementalSort = particleSystem.get_incremental_sort();
+	if(ImGui::Checkbox("Incremental depth sort", &incrementalSort))
+	{
+		particleSystem.set_incremental_sort(incrementalSort);
+	}
+	if(ImGui::SliderInt("Worker threads", &workerThreads, 1, labhelper::JobPool::getHardwareThreadCount()))
+	{
+		jobPool.setThreadCount(workerThreads);
+	}
+	// OIT blends in any order, so the depth sort is skipped
+	if(ImGui::Checkbox("Order-independent transparency", &useParticleOIT))
+	{
+		particleSystem.set_depth_sort(!useParticleOIT);
+	}
+	ImGui::Text("Particle pass    CPU ms   GPU ms");
+	ImGui::Text("  Sorted blend  %7.3f  %7.3f", particleCPUTime[0], particleGPUTime[0]);
+	ImGui::Text("  Weighted OIT  %7.3f  %7.3f", particleCPUTime[1], particleGPUTime[1]);
 
 	// ----------------- Spacecraft control information ---------
 	ImGui::Separator();
@@ -877,15 +1073,16 @@ int main(int argc, char* argv[])
 	initialize();
 
 	bool stopRendering = false;
-	auto startTime = std::chrono::system_clock::now();
+	auto startTime = std::chrono::steady_clock::now();
 
 	while (!stopRendering)
 	{
 		//update currentTime
-		std::chrono::duration<float> timeSinceStart = std::chrono::system_clock::now() - startTime;
+		std::chrono::duration<float> timeSinceStart = std::chrono::steady_clock::now() - startTime;
 		previousTime = currentTime;
 		currentTime = timeSinceStart.count();
 		deltaTime = currentTime - previousTime;
+		simulationClock.advance(deltaTime);
 
 		// Inform imgui of new frame
 		ImGui_ImplSdlGL3_NewFrame(g_window);
@@ -916,6 +1113,14 @@ int main(int argc, char* argv[])
 	labhelper::freeModel(fighterModel);
 	labhelper::freeModel(landingpadModel);
 
+	// Free the OIT targets and particle timers
+	glDeleteQueries(2, particleTimerQueries);
+	glDeleteProgram(particleOITShaderProgram);
+	glDeleteProgram(oitCompositeProgram);
+	glDeleteFramebuffers(1, &oitFB.framebufferId);
+	glDeleteTextures(GLsizei(oitFB.colorTextureTargets.size()), oitFB.colorTextureTargets.data());
+	glDeleteTextures(1, &oitFB.depthBuffer);
+
 	// Shut down everything. This includes the window and all other subsystems.
 	labhelper::shutDown(g_window);
 	return 0;
@@ -0,0 +1,21 @@
+#version 420
+// Resolves the weighted blended OIT targets over the opaque image. Drawn with
+// glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA), so the alpha output is the revealage, the
+// fraction of the background that stays visible.
+layout(binding = 0) uniform sampler2D accumulationTexture;
+layout(binding = 1) uniform sampler2D revealageTexture;
+layout(location = 0) out vec4 fragmentColor;
+
+void main()
+{
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	float revealage = texelFetch(revealageTexture, texel, 0).r;
+	if(revealage >= 1.0)
+	{
+		// No particle covered this pixel
+		discard;
+	}
+	vec4 accumulation = texelFetch(accumulationTexture, texel, 0);
+	vec3 averageColor = accumulation.rgb / max(accumulation.a, 1e-5);
+	fragmentColor = vec4(averageColor, revealage);
+}
@@ -0,0 +1,159 @@
+// Benchmark of the pressure solvers of FluidSolver: Jacobi sweeps against multigrid V-cycles on
+// the same smoke plume. The plume is run up with the default solver first, then every variant
+// steps on from a copy of that state and reports its pressure time and residuals as JSON.
+//
+// Usage: fluid_bench [resolution=64] [steps=10] [threads=0]
+// Build in Release, the numbers are meaningless with a debug build. threads=0 uses one thread per
+// hardware thread.
+
+#include "FluidSolver.h"
+#include "JobPool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace
+{
+struct Variant
+{
+	const char* name;
+	PressureSolverType solver;
+	int jacobiIterations;
+	int cycles;
+};
+
+struct BenchResult
+{
+	const char* name;
+	double pressureMs;             // Average pressure stage time per step
+	double totalMs;                // Average step time
+	std::vector<float> residuals;  // Of the last step, before the solve and after each cycle
+};
+
+/// The solver state a variant starts from
+struct Snapshot
+{
+	std::vector<glm::vec3> velocities;
+	std::vector<float> density;
+	std::vector<float> pressure;
+};
+
+Snapshot takeSnapshot(const GridFlowField& grid, const FluidSolver& solver)
+{
+	Snapshot snapshot;
+	snapshot.velocities = grid.velocities;
+	snapshot.density = solver.getDensity();
+	snapshot.pressure = solver.getPressure();
+	return snapshot;
+}
+
+void restoreSnapshot(const Snapshot& snapshot, GridFlowField& grid, FluidSolver& solver)
+{
+	grid.velocities = snapshot.velocities;
+	solver.getDensity() = snapshot.density;
+	solver.getPressure() = snapshot.pressure;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+#ifndef NDEBUG
+	fprintf(stderr, "Warning: this is not an optimised build, timings will not be representative.\n");
+#endif
+	const int resolution = argc > 1 ? std::max(8, atoi(argv[1])) : 64;
+	const int steps = argc > 2 ? std::max(1, atoi(argv[2])) : 10;
+	const int threads = argc > 3 ? std::max(0, atoi(argv[3])) : 0;
+	const float deltaTime = 1.0f / 60.0f;
+	const int warmupSteps = 60;
+
+	// The flow field bounds of the smoke demo
+	const glm::vec3 boundsMin(-10.2f, 29.8f, -10.2f);
+	const glm::vec3 boundsMax(10.2f, 70.2f, 10.2f);
+	GridFlowField grid(glm::ivec3(resolution), boundsMin, boundsMax);
+	labhelper::JobPool pool(threads);
+	FluidSolver solver;
+	solver.setJobPool(&pool);
+	solver.initialize(&grid);
+
+	FluidParameters params;
+	params.sourceCenter = glm::vec3(0.0f, boundsMin.y + 0.05f * (boundsMax.y - boundsMin.y), 0.0f);
+	solver.setParameters(params);
+	for(int i = 0; i < warmupSteps; i++)
+	{
+		solver.step(deltaTime);
+	}
+	const Snapshot start = takeSnapshot(grid, solver);
+
+	const Variant variants[] = {
+		{ "jacobi_40", PressureSolverType::JACOBI, 40, 0 },
+		{ "jacobi_200", PressureSolverType::JACOBI, 200, 0 },
+		{ "multigrid_1_cycle", PressureSolverType::MULTIGRID, 0, 1 },
+		{ "multigrid_2_cycles", PressureSolverType::MULTIGRID, 0, 2 },
+		{ "multigrid_3_cycles", PressureSolverType::MULTIGRID, 0, 3 },
+	};
+	std::vector<BenchResult> results;
+	for(const Variant& variant : variants)
+	{
+		restoreSnapshot(start, grid, solver);
+		FluidParameters variantParams = params;
+		variantParams.pressureSolver = variant.solver;
+		variantParams.pressureIterations = variant.jacobiIterations;
+		variantParams.multigrid.cycles = variant.cycles;
+		// The residual costs a pass over the grid, only the last step measures it
+		variantParams.trackPressureResidual = false;
+		solver.setParameters(variantParams);
+
+		BenchResult result;
+		result.name = variant.name;
+		result.pressureMs = 0.0;
+		result.totalMs = 0.0;
+		for(int i = 0; i < steps; i++)
+		{
+			if(i == steps - 1)
+			{
+				variantParams.trackPressureResidual = true;
+				solver.setParameters(variantParams);
+			}
+			solver.step(deltaTime);
+			if(i < steps - 1 || steps == 1)
+			{
+				result.pressureMs += solver.getTimings().pressure;
+				result.totalMs += solver.getTimings().total();
+			}
+		}
+		const int timedSteps = std::max(1, steps - 1);
+		result.pressureMs /= timedSteps;
+		result.totalMs /= timedSteps;
+		result.residuals = solver.getPressureResiduals();
+		results.push_back(result);
+	}
+
+	printf("{\n");
+	printf("  \"resolution\": %d,\n", resolution);
+	printf("  \"steps\": %d,\n", steps);
+	printf("  \"threads\": %d,\n", pool.getThreadCount());
+	printf("  \"multigrid_levels\": %d,\n", params.multigrid.levels);
+	printf("  \"variants\": [\n");
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& r = results[i];
+		printf("    {\n");
+		printf("      \"name\": \"%s\",\n", r.name);
+		printf("      \"pressure_ms\": %.3f,\n", r.pressureMs);
+		printf("      \"step_ms\": %.3f,\n", r.totalMs);
+		printf("      \"residuals\": [");
+		for(size_t j = 0; j < r.residuals.size(); j++)
+		{
+			printf("%s%.4g", j > 0 ? ", " : "", r.residuals[j]);
+		}
+		printf("]\n");
+		printf("    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+	printf("  ]\n");
+	printf("}\n");
+	return 0;
+}
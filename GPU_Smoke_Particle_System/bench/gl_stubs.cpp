@@ -0,0 +1,98 @@
+// Link-time stand-ins for the OpenGL and GLEW symbols referenced by the particle sources, so the
+// benchmark builds and runs without an OpenGL library or context. The benchmark only drives the
+// CPU simulation, none of these are ever called. Every GLEW entry point is a null function pointer
+// and every extension flag is false.
+//
+// A GL call added to one of the linked sources shows up as an undefined reference to
+// __glew<Name> (or gl<Name> for OpenGL 1.1), add it below.
+
+#include <GL/glew.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// OpenGL 1.1, exported by the GL library itself
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" {
+void GLAPIENTRY glBindTexture(GLenum, GLuint) {}
+void GLAPIENTRY glDeleteTextures(GLsizei, const GLuint*) {}
+void GLAPIENTRY glDrawElements(GLenum, GLsizei, GLenum, const void*) {}
+void GLAPIENTRY glGenTextures(GLsizei n, GLuint* textures)
+{
+	for(GLsizei i = 0; i < n; i++)
+	{
+		textures[i] = 0;
+	}
+}
+GLenum GLAPIENTRY glGetError(void)
+{
+	return GL_NO_ERROR;
+}
+void GLAPIENTRY glGetTexImage(GLenum, GLint, GLenum, GLenum, void*) {}
+void GLAPIENTRY glLineWidth(GLfloat) {}
+void GLAPIENTRY glTexParameteri(GLenum, GLenum, GLint) {}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GLEW extension flags
+///////////////////////////////////////////////////////////////////////////////
+
+GLboolean __GLEW_VERSION_1_2 = GL_FALSE;
+GLboolean __GLEW_ARB_buffer_storage = GL_FALSE;
+GLboolean __GLEW_ARB_compute_shader = GL_FALSE;
+
+///////////////////////////////////////////////////////////////////////////////
+// GLEW function pointers
+///////////////////////////////////////////////////////////////////////////////
+PFNGLACTIVETEXTUREPROC __glewActiveTexture = nullptr;
+PFNGLATTACHSHADERPROC __glewAttachShader = nullptr;
+PFNGLBINDBUFFERPROC __glewBindBuffer = nullptr;
+PFNGLBINDBUFFERBASEPROC __glewBindBufferBase = nullptr;
+PFNGLBINDIMAGETEXTUREPROC __glewBindImageTexture = nullptr;
+PFNGLBINDVERTEXARRAYPROC __glewBindVertexArray = nullptr;
+PFNGLBUFFERDATAPROC __glewBufferData = nullptr;
+PFNGLBUFFERSTORAGEPROC __glewBufferStorage = nullptr;
+PFNGLBUFFERSUBDATAPROC __glewBufferSubData = nullptr;
+PFNGLCLIENTWAITSYNCPROC __glewClientWaitSync = nullptr;
+PFNGLCOMPILESHADERPROC __glewCompileShader = nullptr;
+PFNGLCOPYBUFFERSUBDATAPROC __glewCopyBufferSubData = nullptr;
+PFNGLCREATEPROGRAMPROC __glewCreateProgram = nullptr;
+PFNGLCREATESHADERPROC __glewCreateShader = nullptr;
+PFNGLDELETEBUFFERSPROC __glewDeleteBuffers = nullptr;
+PFNGLDELETEPROGRAMPROC __glewDeleteProgram = nullptr;
+PFNGLDELETEQUERIESPROC __glewDeleteQueries = nullptr;
+PFNGLDELETESHADERPROC __glewDeleteShader = nullptr;
+PFNGLDELETESYNCPROC __glewDeleteSync = nullptr;
+PFNGLDELETEVERTEXARRAYSPROC __glewDeleteVertexArrays = nullptr;
+PFNGLDISPATCHCOMPUTEPROC __glewDispatchCompute = nullptr;
+PFNGLDRAWARRAYSINDIRECTPROC __glewDrawArraysIndirect = nullptr;
+PFNGLENABLEVERTEXATTRIBARRAYPROC __glewEnableVertexAttribArray = nullptr;
+PFNGLFENCESYNCPROC __glewFenceSync = nullptr;
+PFNGLGENBUFFERSPROC __glewGenBuffers = nullptr;
+PFNGLGENQUERIESPROC __glewGenQueries = nullptr;
+PFNGLGENVERTEXARRAYSPROC __glewGenVertexArrays = nullptr;
+PFNGLGETBUFFERSUBDATAPROC __glewGetBufferSubData = nullptr;
+PFNGLGETPROGRAMINFOLOGPROC __glewGetProgramInfoLog = nullptr;
+PFNGLGETPROGRAMIVPROC __glewGetProgramiv = nullptr;
+PFNGLGETQUERYOBJECTIVPROC __glewGetQueryObjectiv = nullptr;
+PFNGLGETQUERYOBJECTUI64VPROC __glewGetQueryObjectui64v = nullptr;
+PFNGLGETSHADERINFOLOGPROC __glewGetShaderInfoLog = nullptr;
+PFNGLGETSHADERIVPROC __glewGetShaderiv = nullptr;
+PFNGLGETUNIFORMLOCATIONPROC __glewGetUniformLocation = nullptr;
+PFNGLLINKPROGRAMPROC __glewLinkProgram = nullptr;
+PFNGLMAPBUFFERPROC __glewMapBuffer = nullptr;
+PFNGLMAPBUFFERRANGEPROC __glewMapBufferRange = nullptr;
+PFNGLMEMORYBARRIERPROC __glewMemoryBarrier = nullptr;
+PFNGLQUERYCOUNTERPROC __glewQueryCounter = nullptr;
+PFNGLSHADERSOURCEPROC __glewShaderSource = nullptr;
+PFNGLTEXIMAGE3DPROC __glewTexImage3D = nullptr;
+PFNGLTEXSUBIMAGE3DPROC __glewTexSubImage3D = nullptr;
+PFNGLUNIFORM1FPROC __glewUniform1f = nullptr;
+PFNGLUNIFORM1IPROC __glewUniform1i = nullptr;
+PFNGLUNIFORM1UIPROC __glewUniform1ui = nullptr;
+PFNGLUNIFORM3FPROC __glewUniform3f = nullptr;
+PFNGLUNIFORM3FVPROC __glewUniform3fv = nullptr;
+PFNGLUNIFORM3IVPROC __glewUniform3iv = nullptr;
+PFNGLUNIFORMMATRIX4FVPROC __glewUniformMatrix4fv = nullptr;
+PFNGLUNMAPBUFFERPROC __glewUnmapBuffer = nullptr;
+PFNGLUSEPROGRAMPROC __glewUseProgram = nullptr;
+PFNGLVERTEXATTRIBPOINTERPROC __glewVertexAttribPointer = nullptr;
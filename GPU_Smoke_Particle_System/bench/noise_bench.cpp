@@ -0,0 +1,185 @@
+// Microbenchmark of the noise functions in project/Noise.h against the sin-hash value noise that
+// FlowField::noise3D() used before them. Every variant evaluates the same random points, the
+// results are printed as JSON.
+//
+// Usage: noise_bench [points=65536] [rounds=20]
+// Build in Release, the numbers are meaningless with a debug build. Configure with SMOKE_USE_AVX2
+// to measure the 8 wide batch functions.
+
+#include "Noise.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace
+{
+typedef std::chrono::steady_clock Clock;
+
+/// The value noise of FlowField::noise3D() before the switch to Noise.h, kept as the baseline
+float legacyNoise3D(const glm::vec3& p)
+{
+	glm::vec3 i = floor(p);
+	glm::vec3 f = p - i;
+
+	f = f * f * (3.0f - 2.0f * f);
+
+	float n = i.x + i.y * 57.0f + i.z * 113.0f;
+
+	auto hash = [](float v) {
+		const auto scaled = sin(v) * 43758.5453f;
+		return scaled - floor(scaled);
+	};
+	float a = hash(n);
+	float b = hash(n + 1.0f);
+	float c = hash(n + 57.0f);
+	float d = hash(n + 58.0f);
+	float e = hash(n + 113.0f);
+	float f_val = hash(n + 114.0f);
+	float g = hash(n + 170.0f);
+	float h = hash(n + 171.0f);
+
+	float k0 = glm::mix(a, b, f.x);
+	float k1 = glm::mix(c, d, f.x);
+	float k2 = glm::mix(e, f_val, f.x);
+	float k3 = glm::mix(g, h, f.x);
+
+	float k4 = glm::mix(k0, k1, f.y);
+	float k5 = glm::mix(k2, k3, f.y);
+
+	return glm::mix(k4, k5, f.z) * 2.0f - 1.0f;
+}
+
+struct Points
+{
+	std::vector<float> x, y, z;
+	std::vector<float> result, dx, dy, dz;
+};
+
+struct BenchResult
+{
+	const char* name;
+	double nsPerPoint;
+	double checksum; // Sum of the results, keeps the work from being optimised away
+};
+
+template <typename Function>
+BenchResult run(const char* name, Points& points, int rounds, Function evaluate)
+{
+	const int count = int(points.x.size());
+	evaluate(points); // Warm-up
+	Clock::time_point start = Clock::now();
+	for(int round = 0; round < rounds; round++)
+	{
+		evaluate(points);
+	}
+	const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+	BenchResult result;
+	result.name = name;
+	result.nsPerPoint = ns / (double(count) * rounds);
+	result.checksum = 0.0;
+	for(int i = 0; i < count; i++)
+	{
+		result.checksum += points.result[i];
+	}
+	return result;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+#ifndef NDEBUG
+	fprintf(stderr, "Warning: this is not an optimised build, timings will not be representative.\n");
+#endif
+	const int count = argc > 1 ? std::max(noise::batchWidth, atoi(argv[1])) : 65536;
+	const int rounds = argc > 2 ? std::max(1, atoi(argv[2])) : 20;
+
+	// Spread like the turbulence samples of a flow field a few hundred units across
+	Points points;
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> coordinate(-50.0f, 50.0f);
+	for(int i = 0; i < count; i++)
+	{
+		points.x.push_back(coordinate(rng));
+		points.y.push_back(coordinate(rng));
+		points.z.push_back(coordinate(rng));
+	}
+	points.result.resize(count);
+	points.dx.resize(count);
+	points.dy.resize(count);
+	points.dz.resize(count);
+
+	const BenchResult results[] = {
+		run("legacy_value_noise", points, rounds,
+		    [](Points& p) {
+			    for(size_t i = 0; i < p.x.size(); i++)
+			    {
+				    p.result[i] = legacyNoise3D(glm::vec3(p.x[i], p.y[i], p.z[i]));
+			    }
+		    }),
+		run("simplex3", points, rounds,
+		    [](Points& p) {
+			    for(size_t i = 0; i < p.x.size(); i++)
+			    {
+				    p.result[i] = noise::simplex3(glm::vec3(p.x[i], p.y[i], p.z[i]));
+			    }
+		    }),
+		run("simplex3_gradient", points, rounds,
+		    [](Points& p) {
+			    for(size_t i = 0; i < p.x.size(); i++)
+			    {
+				    glm::vec3 gradient;
+				    p.result[i] = noise::simplex3(glm::vec3(p.x[i], p.y[i], p.z[i]), gradient);
+				    p.dx[i] = gradient.x;
+			    }
+		    }),
+		run("perlin3", points, rounds,
+		    [](Points& p) {
+			    for(size_t i = 0; i < p.x.size(); i++)
+			    {
+				    p.result[i] = noise::perlin3(glm::vec3(p.x[i], p.y[i], p.z[i]));
+			    }
+		    }),
+		run("simplex3_batch", points, rounds,
+		    [](Points& p) {
+			    noise::simplex3Batch(p.x.data(), p.y.data(), p.z.data(), p.result.data(), int(p.x.size()));
+		    }),
+		run("simplex3_gradient_batch", points, rounds,
+		    [](Points& p) {
+			    noise::simplex3Batch(p.x.data(), p.y.data(), p.z.data(), p.result.data(), p.dx.data(),
+			                         p.dy.data(), p.dz.data(), int(p.x.size()));
+		    }),
+		run("perlin3_batch", points, rounds,
+		    [](Points& p) {
+			    noise::perlin3Batch(p.x.data(), p.y.data(), p.z.data(), p.result.data(), int(p.x.size()));
+		    }),
+	};
+
+	const double baseline = results[0].nsPerPoint;
+	printf("{\n");
+	printf("  \"points\": %d,\n", count);
+	printf("  \"rounds\": %d,\n", rounds);
+	printf("  \"batch_width\": %d,\n", noise::batchWidth);
+	printf("  \"variants\": [\n");
+	const int numResults = int(sizeof(results) / sizeof(results[0]));
+	for(int i = 0; i < numResults; i++)
+	{
+		const BenchResult& r = results[i];
+		printf("    {\n");
+		printf("      \"name\": \"%s\",\n", r.name);
+		printf("      \"ns_per_point\": %.3f,\n", r.nsPerPoint);
+		printf("      \"speedup_vs_legacy\": %.2f,\n", r.nsPerPoint > 0.0 ? baseline / r.nsPerPoint : 0.0);
+		printf("      \"checksum\": %.6g\n", r.checksum);
+		printf("    }%s\n", i + 1 < numResults ? "," : "");
+	}
+	printf("  ]\n");
+	printf("}\n");
+	return 0;
+}
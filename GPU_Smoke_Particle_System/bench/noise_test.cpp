@@ -0,0 +1,391 @@
+// Regression test of the simplex noise in project/Noise.h and project_others/noise.glsl.
+//
+// - The corner offsets of simplexCornerOffsets() match the ones of a simplex picked by ranking the
+//   axes, and the o1/o2 lines of noise.glsl compute the same table.
+// - simplex3(), its gradient and curl3() are continuous at the lattice points and where two or
+//   three offsets tie, the places where a wrong corner table makes the noise jump.
+// - curl3() is divergence-free.
+//
+// Usage: noise_test <path to noise.glsl>
+// Prints one line per failure and exits with 1 if there was any.
+
+#include "Noise.h"
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+int failures = 0;
+
+void fail(const std::string& message)
+{
+	printf("FAIL: %s\n", message.c_str());
+	failures++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Evaluator for the integer expressions of the corner offsets in noise.glsl, which only use
+// literals, the comparison results xy, yz and xz, parentheses and &, ^ and |
+///////////////////////////////////////////////////////////////////////////////
+class BitExpression
+{
+public:
+	BitExpression(const std::string& text, int xy, int yz, int xz)
+	    : text(text), position(0), xy(xy), yz(yz), xz(xz), valid(true)
+	{
+	}
+
+	/// Value of the whole expression, false if it does not parse
+	bool evaluate(int& value)
+	{
+		value = parseOr();
+		skipSpaces();
+		return valid && position == text.size();
+	}
+
+private:
+	std::string text;
+	size_t position;
+	int xy, yz, xz;
+	bool valid;
+
+	void skipSpaces()
+	{
+		while(position < text.size() && text[position] == ' ')
+		{
+			position++;
+		}
+	}
+
+	bool accept(char c)
+	{
+		skipSpaces();
+		if(position < text.size() && text[position] == c)
+		{
+			position++;
+			return true;
+		}
+		return false;
+	}
+
+	// GLSL precedence: & binds tighter than ^, which binds tighter than |
+	int parseOr()
+	{
+		int value = parseXor();
+		while(accept('|'))
+		{
+			value |= parseXor();
+		}
+		return value;
+	}
+
+	int parseXor()
+	{
+		int value = parseAnd();
+		while(accept('^'))
+		{
+			value ^= parseAnd();
+		}
+		return value;
+	}
+
+	int parseAnd()
+	{
+		int value = parsePrimary();
+		while(accept('&'))
+		{
+			value &= parsePrimary();
+		}
+		return value;
+	}
+
+	int parsePrimary()
+	{
+		if(accept('('))
+		{
+			const int value = parseOr();
+			valid = valid && accept(')');
+			return value;
+		}
+		skipSpaces();
+		const size_t start = position;
+		while(position < text.size() && (isalnum(text[position]) || text[position] == '_'))
+		{
+			position++;
+		}
+		const std::string token = text.substr(start, position - start);
+		if(token == "xy")
+			return xy;
+		if(token == "yz")
+			return yz;
+		if(token == "xz")
+			return xz;
+		if(!token.empty() && isdigit(token[0]))
+			return atoi(token.c_str());
+		valid = false;
+		return 0;
+	}
+};
+
+/// The three component expressions of `ivec3 <name> = ivec3(...);` in `source`
+bool findOffsetExpressions(const std::string& source, const std::string& name, std::string components[3])
+{
+	const std::string prefix = "ivec3 " + name + " = ivec3(";
+	const size_t start = source.find(prefix);
+	if(start == std::string::npos)
+	{
+		return false;
+	}
+	const size_t end = source.find(");", start);
+	const std::string arguments = source.substr(start + prefix.size(), end - start - prefix.size());
+
+	// Split at the commas outside parentheses
+	int count = 0;
+	int depth = 0;
+	std::string current;
+	for(size_t i = 0; i < arguments.size(); i++)
+	{
+		const char c = arguments[i];
+		depth += c == '(' ? 1 : c == ')' ? -1 : 0;
+		if(c == ',' && depth == 0)
+		{
+			if(count == 3)
+				return false;
+			components[count++] = current;
+			current.clear();
+		}
+		else
+		{
+			current += c;
+		}
+	}
+	if(count != 2)
+	{
+		return false;
+	}
+	components[2] = current;
+	return true;
+}
+
+/// Corner offsets from ranking the axes: the second corner steps along the axis that wins both of
+/// its comparisons, the third along the two that win at least one. False for contradictory
+/// comparisons, which no point produces.
+bool rankedOffsets(int xy, int yz, int xz, int first[3], int second[3])
+{
+	const int rank[3] = { xy + xz, (1 - xy) + yz, (1 - xz) + (1 - yz) };
+	if(rank[0] == rank[1] || rank[1] == rank[2] || rank[0] == rank[2])
+	{
+		return false;
+	}
+	for(int axis = 0; axis < 3; axis++)
+	{
+		first[axis] = int(rank[axis] == 2);
+		second[axis] = int(rank[axis] >= 1);
+	}
+	return true;
+}
+
+std::string describe(int xy, int yz, int xz)
+{
+	std::ostringstream s;
+	s << "xy=" << xy << " yz=" << yz << " xz=" << xz;
+	return s.str();
+}
+
+void testCornerTable(const std::string& glslSource)
+{
+	std::string glsl[2][3];
+	if(!findOffsetExpressions(glslSource, "o1", glsl[0]) || !findOffsetExpressions(glslSource, "o2", glsl[1]))
+	{
+		fail("noise.glsl: no 'ivec3 o1 = ivec3(...)' and 'ivec3 o2 = ivec3(...)' lines in simplex3()");
+		return;
+	}
+
+	for(int bits = 0; bits < 8; bits++)
+	{
+		const int xy = bits & 1;
+		const int yz = (bits >> 1) & 1;
+		const int xz = (bits >> 2) & 1;
+
+		int32_t cpu[2][3];
+		noise::simplexCornerOffsets(xy, yz, xz, cpu[0], cpu[1]);
+
+		for(int corner = 0; corner < 2; corner++)
+		{
+			for(int axis = 0; axis < 3; axis++)
+			{
+				int value = 0;
+				BitExpression expression(glsl[corner][axis], xy, yz, xz);
+				if(!expression.evaluate(value))
+				{
+					fail("noise.glsl: cannot evaluate '" + glsl[corner][axis] + "'");
+					return;
+				}
+				if(value != cpu[corner][axis])
+				{
+					fail("noise.glsl and Noise.cpp disagree on corner " + std::to_string(corner + 1) + " for "
+					     + describe(xy, yz, xz));
+				}
+			}
+		}
+
+		int expected[2][3];
+		if(rankedOffsets(xy, yz, xz, expected[0], expected[1])
+		   && (memcmp(expected[0], cpu[0], sizeof(expected[0])) != 0
+		       || memcmp(expected[1], cpu[1], sizeof(expected[1])) != 0))
+		{
+			fail("simplexCornerOffsets does not follow the axis ranking for " + describe(xy, yz, xz));
+		}
+	}
+}
+
+float largestComponent(const glm::vec3& v)
+{
+	return std::max(std::fabs(v.x), std::max(std::fabs(v.y), std::fabs(v.z)));
+}
+
+/// Largest change of `field` over a step of `h` from `p` in any of 26 directions
+template <typename Field>
+float largestStep(Field field, const glm::vec3& p, float h)
+{
+	const glm::vec3 value = field(p);
+	float largest = 0.0f;
+	for(int dx = -1; dx <= 1; dx++)
+	{
+		for(int dy = -1; dy <= 1; dy++)
+		{
+			for(int dz = -1; dz <= 1; dz++)
+			{
+				if(dx != 0 || dy != 0 || dz != 0)
+				{
+					const glm::vec3 direction = glm::normalize(glm::vec3(float(dx), float(dy), float(dz)));
+					largest = std::max(largest, largestComponent(field(p + h * direction) - value));
+				}
+			}
+		}
+	}
+	return largest;
+}
+
+/// Points on the faces between the simplices of a cell: lattice points, and points where two or
+/// all three offsets from the first corner are equal (equal world coordinates give equal offsets)
+std::vector<glm::vec3> tiePoints()
+{
+	std::vector<glm::vec3> points;
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> coordinate(-8.0f, 8.0f);
+	std::uniform_int_distribution<int> lattice(-8, 8);
+	for(int i = 0; i < 200; i++)
+	{
+		const float a = coordinate(rng);
+		const float b = coordinate(rng);
+		points.push_back(glm::vec3(float(lattice(rng)), float(lattice(rng)), float(lattice(rng))));
+		points.push_back(glm::vec3(a, a, b));
+		points.push_back(glm::vec3(b, a, a));
+		points.push_back(glm::vec3(a, b, a));
+		points.push_back(glm::vec3(a, a, a));
+	}
+	return points;
+}
+
+template <typename Field>
+void testContinuity(const char* name, Field field, float tolerance)
+{
+	const float h = 1e-3f;
+	const std::vector<glm::vec3> points = tiePoints();
+	float worst = 0.0f;
+	for(size_t i = 0; i < points.size(); i++)
+	{
+		const float step = largestStep(field, points[i], h);
+		worst = std::max(worst, step);
+		if(step > tolerance)
+		{
+			std::ostringstream s;
+			s << name << " jumps by " << step << " next to (" << points[i].x << ", " << points[i].y << ", "
+			  << points[i].z << ")";
+			fail(s.str());
+		}
+	}
+	printf("%s: largest change over a %g step at %d tie points is %g\n", name, h, int(points.size()), worst);
+}
+
+glm::vec3 simplexValue(const glm::vec3& p)
+{
+	return glm::vec3(noise::simplex3(p));
+}
+
+glm::vec3 simplexGradient(const glm::vec3& p)
+{
+	glm::vec3 gradient;
+	noise::simplex3(p, gradient);
+	return gradient;
+}
+
+/// Central difference divergence of curl3() at random points, against the size of the derivatives
+/// it sums
+void testDivergence()
+{
+	const float h = 1e-3f;
+	std::mt19937 rng(5678);
+	std::uniform_real_distribution<float> coordinate(-8.0f, 8.0f);
+	float worstDivergence = 0.0f;
+	float largestDerivative = 0.0f;
+	for(int i = 0; i < 1000; i++)
+	{
+		const glm::vec3 p(coordinate(rng), coordinate(rng), coordinate(rng));
+		glm::vec3 derivatives; // d vx / dx, d vy / dy, d vz / dz
+		for(int axis = 0; axis < 3; axis++)
+		{
+			glm::vec3 step(0.0f);
+			step[axis] = h;
+			derivatives[axis] = (noise::curl3(p + step)[axis] - noise::curl3(p - step)[axis]) / (2.0f * h);
+		}
+		worstDivergence = std::max(worstDivergence, std::fabs(derivatives.x + derivatives.y + derivatives.z));
+		largestDerivative = std::max(largestDerivative, largestComponent(derivatives));
+	}
+	printf("curl3: largest divergence %g, largest derivative %g\n", worstDivergence, largestDerivative);
+	if(worstDivergence > 0.01f * largestDerivative)
+	{
+		std::ostringstream s;
+		s << "curl3 has a divergence of " << worstDivergence << " against derivatives up to " << largestDerivative;
+		fail(s.str());
+	}
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: noise_test <path to noise.glsl>\n");
+		return 2;
+	}
+	std::ifstream file(argv[1]);
+	if(!file)
+	{
+		fprintf(stderr, "Cannot open %s\n", argv[1]);
+		return 2;
+	}
+	std::stringstream source;
+	source << file.rdbuf();
+
+	// The tolerances are far above the change over a step with the steepest slopes, and far below
+	// the jump of a wrong corner
+	testCornerTable(source.str());
+	testContinuity("simplex3", simplexValue, 0.02f);
+	testContinuity("simplex3 gradient", simplexGradient, 0.5f);
+	testContinuity("curl3", noise::curl3, 0.5f);
+	testDivergence();
+
+	printf("%s: %d failure(s)\n", failures == 0 ? "PASSED" : "FAILED", failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,505 @@
+// Headless benchmark of the CPU particle simulation. Runs the two emitters of the demos at a fixed
+// time step without a window or GL context and prints the results as JSON:
+//   engine: the fighter exhaust of generateEngineParticles() through ParticleSystem::process_particles
+//   smoke:  the smoke emitter of generateSmokeParticles() through SmokePhysics, the FlowField and
+//           BoundaryManager collisions
+//   smoke_scalar: the same through SmokePhysics' scalar fallback
+//   smoke_sdf: smoke with a sphere baked into an SdfCollider in its way
+//   smoke_terrain: smoke over hills in a HeightGrid that rise into the bottom of the box
+// batch_matches_scalar checks that the batch and the scalar SmokePhysics paths agree bit for bit.
+// sdf_bake_ms is the time SdfCollider takes to bake the sphere. terrain_height_ns and
+// terrain_normal_ns are the costs per position of the batch HeightGrid queries over the hills.
+// Each scenario first runs one particle lifetime untimed, so the timed frames see a steady
+// population.
+//
+// Usage: particle_bench [frames] [particles per frame] [threads] [uniform|vortex|upward|turbulent|curl|grid]
+// threads = 0 uses one per hardware thread. Build in Release, the numbers are meaningless with a
+// debug build.
+
+#include "ParticleSystem.h"
+#include "SmokePhysics.h"
+#include "FlowField.h"
+#include "BoundaryManager.h"
+#include "SdfCollider.h"
+#include "HeightGrid.h"
+#include "JobPool.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+const float dt = 1.0f / 60.0f;
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchResult
+{
+	const char* name;
+	int frames;
+	double meanParticles;  // Over the timed frames
+	double nsPerFrame;
+	double nsPerParticleStep;
+	double particlesPerSecond; // Particle steps simulated per second of wall time
+};
+
+/// Peak resident set size of the process so far, in bytes
+size_t peakMemoryBytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return counters.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 0;
+	}
+#ifdef __APPLE__
+	return size_t(usage.ru_maxrss);        // Bytes
+#else
+	return size_t(usage.ru_maxrss) * 1024; // Kilobytes
+#endif
+#endif
+}
+
+BenchResult makeResult(const char* name, int frames, double particleSteps, Clock::duration total)
+{
+	const double ns = std::chrono::duration<double, std::nano>(total).count();
+	BenchResult result;
+	result.name = name;
+	result.frames = frames;
+	result.meanParticles = particleSteps / frames;
+	result.nsPerFrame = ns / frames;
+	result.nsPerParticleStep = particleSteps > 0.0 ? ns / particleSteps : 0.0;
+	result.particlesPerSecond = ns > 0.0 ? particleSteps * 1e9 / ns : 0.0;
+	return result;
+}
+
+/// The exhaust emitter of the fire demo, with the fighter standing still at its start position
+void emitEngineParticles(ParticleSystem& particleSystem, std::mt19937& rng, int count)
+{
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const glm::mat4 fighterModelMatrix = glm::translate(glm::vec3(0.0f, 15.0f, 0.0f));
+	const glm::vec3 particleSpawnOffset = glm::vec3(8.0f, 4.0f, 0.0f);
+
+	for(int i = 0; i < count; i++)
+	{
+		const float theta = unit(rng) * glm::two_pi<float>();
+		const float u = 0.95f + 0.05f * unit(rng);
+		glm::vec3 direction = glm::vec3(u, sqrtf(1.0f - u * u) * cosf(theta) * 0.3f,
+		                                sqrtf(1.0f - u * u) * sinf(theta) * 0.3f);
+
+		Particle particle;
+		particle.pos = glm::vec3(fighterModelMatrix * glm::vec4(particleSpawnOffset, 1.0f));
+		particle.pos += (glm::vec3(unit(rng), unit(rng), unit(rng)) - 0.5f) * 0.4f;
+		particle.velocity = glm::mat3(fighterModelMatrix) * direction * 15.0f;
+		particle.lifetime = 0.0f;
+		particle.life_length = 3.0f;
+		particleSystem.spawn(particle);
+	}
+}
+
+/// The CPU branch of the smoke demo's emitter: a disc at the bottom of the boundary, velocities in a
+/// 45 degree cone
+void emitSmokeParticles(std::vector<Particle>& particles, BoundaryManager& boundary, std::mt19937& rng,
+                        int count, float lifeLength, size_t capacity)
+{
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const float coneHalfAngle = glm::radians(22.5f);
+	const float baseSpeed = 10.0f;
+	const float speedVariation = 0.3f;
+
+	for(int i = 0; i < count && particles.size() < capacity; i++)
+	{
+		const float phi = unit(rng) * glm::two_pi<float>();
+		const float cosTheta = glm::mix(cosf(coneHalfAngle), 1.0f, unit(rng));
+		const float sinTheta = sqrtf(1.0f - cosTheta * cosTheta);
+		glm::vec3 direction = glm::vec3(sinTheta * cosf(phi), cosTheta, sinTheta * sinf(phi));
+		const float speed = baseSpeed * glm::mix(1.0f - speedVariation, 1.0f + speedVariation, unit(rng));
+
+		Particle particle;
+		particle.pos = boundary.generateSpawnPosition(2.0f);
+		particle.velocity = direction * speed;
+		particle.lifetime = 0.0f;
+		particle.life_length = lifeLength;
+		particles.push_back(particle);
+	}
+}
+
+BenchResult benchEngine(int frames, int particlesPerFrame, labhelper::JobPool* pool)
+{
+	const float lifeLength = 3.0f;
+	const int warmupFrames = int(std::ceil(lifeLength / dt));
+	std::mt19937 rng(1234);
+	ParticleSystem particleSystem(particlesPerFrame * (warmupFrames + 2));
+	particleSystem.setJobPool(pool);
+
+	double particleSteps = 0.0;
+	Clock::duration total(0);
+	for(int frame = 0; frame < warmupFrames + frames; frame++)
+	{
+		Clock::time_point start = Clock::now();
+		emitEngineParticles(particleSystem, rng, particlesPerFrame);
+		const int count = particleSystem.get_particle_count();
+		particleSystem.process_particles(dt);
+		if(frame >= warmupFrames)
+		{
+			total += Clock::now() - start;
+			particleSteps += count;
+		}
+	}
+	return makeResult("engine", frames, particleSteps, total);
+}
+
+/// Triangles of a closed sphere wound counter-clockwise seen from outside
+std::vector<glm::vec3> sphereTriangles(const glm::vec3& center, float radius, int rings, int segments)
+{
+	auto point = [&](int ring, int segment) {
+		const float theta = glm::pi<float>() * ring / rings;
+		const float phi = glm::two_pi<float>() * segment / segments;
+		return center + radius * glm::vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+	};
+	std::vector<glm::vec3> triangles;
+	for(int ring = 0; ring < rings; ring++)
+	{
+		for(int segment = 0; segment < segments; segment++)
+		{
+			const glm::vec3 a = point(ring, segment), b = point(ring, segment + 1);
+			const glm::vec3 c = point(ring + 1, segment), d = point(ring + 1, segment + 1);
+			if(ring > 0)
+			{
+				triangles.insert(triangles.end(), { a, b, c });
+			}
+			if(ring < rings - 1)
+			{
+				triangles.insert(triangles.end(), { b, d, c });
+			}
+		}
+	}
+	return triangles;
+}
+
+/// A sphere in the middle of the smoke column, with the collision response of the smoke demo
+void bakeSphereCollider(SdfCollider& collider, labhelper::JobPool* pool)
+{
+	CollisionResponse response;
+	response.restitution = 0.2f;
+	response.friction = 0.1f;
+	collider.setCollisionResponse(response);
+	collider.setJobPool(pool);
+	collider.addTriangles(sphereTriangles(glm::vec3(0.0f, 46.0f, 0.0f), 3.0f, 32, 64));
+	SdfBakeSettings settings;
+	settings.voxelSize = 0.1f;
+	settings.bandWidth = 1.0f;
+	collider.bake(settings);
+}
+
+/// Rolling 16-bit quantised hills 40 units across under the smoke column, rising from 26 to 32 so
+/// their tops reach into the box
+void buildHillTerrain(HeightGrid& ground)
+{
+	const int size = 512;
+	std::vector<float> heights(size_t(size) * size);
+	for(int z = 0; z < size; z++)
+	{
+		for(int x = 0; x < size; x++)
+		{
+			const float u = float(x) / (size - 1) * glm::two_pi<float>() * 3.0f;
+			const float v = float(z) / (size - 1) * glm::two_pi<float>() * 3.0f;
+			heights[size_t(z) * size + x] = 0.5f + 0.5f * sinf(u) * cosf(v);
+		}
+	}
+	ground.build(heights.data(), size, size, true);
+	ground.setTransform(glm::translate(glm::vec3(0.0f, 26.0f, 0.0f)) * glm::scale(glm::vec3(20.0f, 1.0f, 20.0f)),
+	                    6.0f);
+	CollisionResponse response;
+	response.restitution = 0.2f;
+	response.friction = 0.1f;
+	ground.setCollisionResponse(response);
+}
+
+/// Nanoseconds per position of the batch heightAt(), or normalAt() with `normals`, over random
+/// positions in the smoke column
+double benchTerrainQueries(const HeightGrid& ground, bool normals)
+{
+	const int count = 1 << 16;
+	const int repeats = 64;
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> spread(-10.0f, 10.0f);
+	std::vector<float> x(count), z(count), outX(count), outY(count), outZ(count);
+	for(int i = 0; i < count; i++)
+	{
+		x[i] = spread(rng);
+		z[i] = spread(rng);
+	}
+	double checksum = 0.0;
+	Clock::time_point start = Clock::now();
+	for(int repeat = 0; repeat < repeats; repeat++)
+	{
+		if(normals)
+		{
+			ground.normalAt(x.data(), z.data(), outX.data(), outY.data(), outZ.data(), count);
+		}
+		else
+		{
+			ground.heightAt(x.data(), z.data(), outY.data(), count);
+		}
+		checksum += outY[repeat];
+	}
+	const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	// Keeps the queries from being optimised away
+	if(checksum == -1.0)
+	{
+		fprintf(stderr, "%f\n", checksum);
+	}
+	return ns / (double(count) * repeats);
+}
+
+BenchResult benchSmoke(const char* name, int frames, int particlesPerFrame, labhelper::JobPool* pool,
+                       FlowFieldType flowType, bool scalarFallback,
+                       const IntegratorSettings& integrator = IntegratorSettings(),
+                       const SdfCollider* collider = nullptr, const HeightGrid* ground = nullptr)
+{
+	const float lifeLength = 5.0f;
+	const int warmupFrames = int(std::ceil(lifeLength / dt));
+	const size_t capacity = size_t(particlesPerFrame) * (warmupFrames + 2);
+	std::mt19937 rng(1234);
+
+	BoundaryManager boundary(glm::vec3(0.0f, 50.0f, 0.0f), glm::vec3(10.0f, 20.0f, 10.0f));
+	const BoundingBox& bounds = boundary.getBoundingBox();
+
+	FlowField flowField;
+	flowField.setJobPool(pool);
+	flowField.initialize(bounds.min_bounds - glm::vec3(0.2f), bounds.max_bounds + glm::vec3(0.2f));
+	if(flowType == FlowFieldType::CUSTOM_GRID)
+	{
+		flowField.generateGridFromSimpleFlow(FlowFieldType::TURBULENT, 0.0f);
+	}
+	flowField.setFlowFieldType(flowType);
+
+	// The defaults of the smoke demo
+	SmokePhysics physics(PhysicsParameters(2.5f, 0.5f, 1.0f, 1.0f));
+	physics.setFlowField(&flowField);
+	physics.setJobPool(pool);
+	physics.setScalarFallback(scalarFallback);
+	physics.setIntegratorSettings(integrator);
+	physics.setCollider(collider);
+	physics.setTerrain(ground);
+
+	std::vector<Particle> particles;
+	particles.reserve(capacity);
+
+	double particleSteps = 0.0;
+	Clock::duration total(0);
+	for(int frame = 0; frame < warmupFrames + frames; frame++)
+	{
+		const float time = frame * dt;
+		Clock::time_point start = Clock::now();
+		emitSmokeParticles(particles, boundary, rng, particlesPerFrame, lifeLength, capacity);
+		const size_t count = particles.size();
+		physics.updateParticles(particles, dt, time);
+		if(!scalarFallback)
+		{
+			boundary.handleCollisions(particles, pool);
+		}
+		for(int i = int(particles.size()) - 1; i >= 0; --i)
+		{
+			Particle& particle = particles[i];
+			particle.lifetime += dt;
+			if(scalarFallback)
+			{
+				boundary.checkAndHandleCollision(particle);
+			}
+			if(particle.lifetime > particle.life_length)
+			{
+				particle = particles.back();
+				particles.pop_back();
+			}
+		}
+		if(frame >= warmupFrames)
+		{
+			total += Clock::now() - start;
+			particleSteps += double(count);
+		}
+	}
+	return makeResult(name, frames, particleSteps, total);
+}
+
+/// Steps the same particles through the batch and the scalar SmokePhysics paths and boundary
+/// collisions and compares the results. The particles start inside and around the flow field, so
+/// both the sampled and the out of bounds cases are covered.
+bool batchMatchesScalar(labhelper::JobPool* pool, FlowFieldType flowType, const IntegratorSettings& integrator,
+                        const SdfCollider* collider = nullptr, const HeightGrid* ground = nullptr)
+{
+	BoundaryManager boundary(glm::vec3(0.0f, 50.0f, 0.0f), glm::vec3(10.0f, 20.0f, 10.0f));
+	const BoundingBox& bounds = boundary.getBoundingBox();
+	CollisionResponse response;
+	response.restitution = 0.6f;
+	response.friction = 0.2f;
+	boundary.setCollisionResponse(response);
+	FlowField flowField;
+	flowField.setJobPool(pool);
+	flowField.initialize(bounds.min_bounds - glm::vec3(0.2f), bounds.max_bounds + glm::vec3(0.2f));
+	if(flowType == FlowFieldType::CUSTOM_GRID)
+	{
+		flowField.generateGridFromSimpleFlow(FlowFieldType::TURBULENT, 0.0f);
+	}
+	flowField.setFlowFieldType(flowType);
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<Particle> batch(4096);
+	for(Particle& particle : batch)
+	{
+		const glm::vec3 t(unit(rng), unit(rng), unit(rng));
+		particle.pos = glm::mix(bounds.min_bounds - glm::vec3(2.0f), bounds.max_bounds + glm::vec3(2.0f), t);
+		particle.velocity = (glm::vec3(unit(rng), unit(rng), unit(rng)) - 0.5f) * 20.0f;
+		particle.lifetime = 0.0f;
+		particle.life_length = 1.0f;
+	}
+	std::vector<Particle> scalar = batch;
+
+	SmokePhysics physics(PhysicsParameters(2.5f, 0.5f, 1.0f, 1.0f));
+	physics.setFlowField(&flowField);
+	physics.setJobPool(pool);
+	physics.setIntegratorSettings(integrator);
+	physics.setCollider(collider);
+	physics.setTerrain(ground);
+	for(int frame = 0; frame < 60; frame++)
+	{
+		physics.setScalarFallback(false);
+		physics.updateParticles(batch, dt, frame * dt);
+		boundary.handleCollisions(batch, pool);
+		physics.setScalarFallback(true);
+		physics.updateParticles(scalar, dt, frame * dt);
+		for(Particle& particle : scalar)
+		{
+			boundary.checkAndHandleCollision(particle);
+		}
+	}
+	return memcmp(batch.data(), scalar.data(), batch.size() * sizeof(Particle)) == 0;
+}
+
+bool parseFlowType(const char* name, FlowFieldType& type)
+{
+	static const struct
+	{
+		const char* name;
+		FlowFieldType type;
+	} types[] = {
+		{ "uniform", FlowFieldType::UNIFORM_WIND }, { "vortex", FlowFieldType::VORTEX },
+		{ "upward", FlowFieldType::UPWARD_FLOW },   { "turbulent", FlowFieldType::TURBULENT },
+		{ "curl", FlowFieldType::CURL_NOISE },      { "grid", FlowFieldType::CUSTOM_GRID },
+	};
+	for(const auto& entry : types)
+	{
+		if(strcmp(name, entry.name) == 0)
+		{
+			type = entry.type;
+			return true;
+		}
+	}
+	return false;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+#ifndef NDEBUG
+	fprintf(stderr, "Warning: this is not an optimised build, timings will not be representative.\n");
+#endif
+	const int frames = argc > 1 ? std::max(1, atoi(argv[1])) : 300;
+	const int particlesPerFrame = argc > 2 ? std::max(1, atoi(argv[2])) : 64;
+	const int threads = argc > 3 ? std::max(0, atoi(argv[3])) : 1;
+	const char* flowName = argc > 4 ? argv[4] : "turbulent";
+	FlowFieldType flowType;
+	if(!parseFlowType(flowName, flowType))
+	{
+		fprintf(stderr, "Unknown flow field type '%s'\n", flowName);
+		return 1;
+	}
+
+	// The integrators of the smoke demo, the last one with the sub-stepping
+	IntegratorSettings semiImplicit, rk2, rk4, rk4Adaptive;
+	semiImplicit.type = IntegratorType::SEMI_IMPLICIT_EULER;
+	rk2.type = IntegratorType::RK2_MIDPOINT;
+	rk4.type = IntegratorType::RK4;
+	rk4Adaptive.type = IntegratorType::RK4;
+	rk4Adaptive.adaptiveSubsteps = true;
+
+	labhelper::JobPool pool(threads);
+	SdfCollider sphere;
+	bakeSphereCollider(sphere, &pool);
+	HeightGrid hills;
+	buildHillTerrain(hills);
+
+	const BenchResult results[] = {
+		benchEngine(frames, particlesPerFrame, &pool),
+		benchSmoke("smoke", frames, particlesPerFrame, &pool, flowType, false),
+		benchSmoke("smoke_scalar", frames, particlesPerFrame, &pool, flowType, true),
+		benchSmoke("smoke_semi_implicit", frames, particlesPerFrame, &pool, flowType, false, semiImplicit),
+		benchSmoke("smoke_rk2", frames, particlesPerFrame, &pool, flowType, false, rk2),
+		benchSmoke("smoke_rk4", frames, particlesPerFrame, &pool, flowType, false, rk4),
+		benchSmoke("smoke_rk4_adaptive", frames, particlesPerFrame, &pool, flowType, false, rk4Adaptive),
+		benchSmoke("smoke_sdf", frames, particlesPerFrame, &pool, flowType, false, IntegratorSettings(), &sphere),
+		benchSmoke("smoke_terrain", frames, particlesPerFrame, &pool, flowType, false, IntegratorSettings(), nullptr,
+		           &hills),
+	};
+	const bool batchMatches = batchMatchesScalar(&pool, flowType, IntegratorSettings()) &&
+		batchMatchesScalar(&pool, flowType, rk2) && batchMatchesScalar(&pool, flowType, rk4Adaptive) &&
+		batchMatchesScalar(&pool, flowType, IntegratorSettings(), &sphere) &&
+		batchMatchesScalar(&pool, flowType, IntegratorSettings(), nullptr, &hills);
+	const double terrainHeightNs = benchTerrainQueries(hills, false);
+	const double terrainNormalNs = benchTerrainQueries(hills, true);
+
+	printf("{\n");
+	printf("  \"dt\": %.9g,\n", dt);
+	printf("  \"particles_per_frame\": %d,\n", particlesPerFrame);
+	printf("  \"threads\": %d,\n", pool.getThreadCount());
+	printf("  \"flow_field\": \"%s\",\n", flowName);
+	printf("  \"peak_memory_bytes\": %zu,\n", peakMemoryBytes());
+	printf("  \"batch_matches_scalar\": %s,\n", batchMatches ? "true" : "false");
+	printf("  \"sdf_bake_ms\": %.2f,\n", sphere.getBakeMilliseconds());
+	printf("  \"terrain_height_ns\": %.2f,\n", terrainHeightNs);
+	printf("  \"terrain_normal_ns\": %.2f,\n", terrainNormalNs);
+	printf("  \"scenarios\": [\n");
+	const int numResults = int(sizeof(results) / sizeof(results[0]));
+	for(int i = 0; i < numResults; i++)
+	{
+		const BenchResult& r = results[i];
+		printf("    {\n");
+		printf("      \"name\": \"%s\",\n", r.name);
+		printf("      \"frames\": %d,\n", r.frames);
+		printf("      \"mean_particles\": %.1f,\n", r.meanParticles);
+		printf("      \"ns_per_frame\": %.1f,\n", r.nsPerFrame);
+		printf("      \"ns_per_particle_step\": %.3f,\n", r.nsPerParticleStep);
+		printf("      \"particles_per_second\": %.0f\n", r.particlesPerSecond);
+		printf("    }%s\n", i + 1 < numResults ? "," : "");
+	}
+	printf("  ]\n");
+	printf("}\n");
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include "FixedTimestep.h"
+#include <algorithm>
+#include <cmath>
+
+namespace labhelper
+{
+FixedTimestep::FixedTimestep(float stepRate, int maxStepsPerFrame)
+{
+	setStepRate(stepRate);
+	setMaxStepsPerFrame(maxStepsPerFrame);
+}
+
+int FixedTimestep::advance(float elapsedSeconds)
+{
+	accumulator += std::max(0.0f, elapsedSeconds);
+
+	int steps = int(accumulator / stepSize);
+	if(steps > maxStepsPerFrame)
+	{
+		droppedStepCount += steps - maxStepsPerFrame;
+		steps = maxStepsPerFrame;
+		// Keep the fraction, the renderer's position between two steps stays continuous
+		accumulator = std::fmod(accumulator, double(stepSize)) + double(steps) * stepSize;
+	}
+	accumulator -= double(steps) * stepSize;
+
+	frameSteps = steps;
+	stepCount += steps;
+	time += double(steps) * stepSize;
+	return steps;
+}
+
+void FixedTimestep::setStepRate(float stepRate)
+{
+	stepSize = 1.0f / std::max(stepRate, 1.0f);
+}
+
+void FixedTimestep::setMaxStepsPerFrame(int maxSteps)
+{
+	maxStepsPerFrame = std::max(maxSteps, 1);
+}
+
+float FixedTimestep::getAlpha() const
+{
+	// The accumulator can reach a whole step through rounding, or after the step rate went up
+	return std::min(float(accumulator / stepSize), 1.0f);
+}
+
+void FixedTimestep::reset()
+{
+	accumulator = 0.0;
+	time = 0.0;
+	frameSteps = 0;
+	stepCount = 0;
+	droppedStepCount = 0;
+}
+
+int RateAccumulator::take(float ratePerSecond, float seconds)
+{
+	remainder += double(std::max(ratePerSecond, 0.0f)) * std::max(seconds, 0.0f);
+	const double count = std::floor(remainder);
+	remainder -= count;
+	return int(count);
+}
+} // namespace labhelper
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+
+namespace labhelper
+{
+///////////////////////////////////////////////////////////////////////////
+/// Accumulator for running a simulation at a fixed rate, independent of
+/// the frame rate.
+///
+/// Every frame, advance() adds the frame time to the accumulator and
+/// returns how many whole steps of getStepSize() seconds to run. The time
+/// left over is carried to the next frame, getAlpha() tells how far the
+/// renderer is between the last two simulated states.
+///
+/// A frame that would need more than getMaxStepsPerFrame() steps, after a
+/// hitch or while paused in a debugger, runs the maximum and drops the
+/// rest, so one slow frame does not make the next ones slower still.
+///////////////////////////////////////////////////////////////////////////
+class FixedTimestep
+{
+public:
+	explicit FixedTimestep(float stepRate = 60.0f, int maxStepsPerFrame = 4);
+
+	/// Accumulates `elapsedSeconds` of wall time and returns the steps to run
+	int advance(float elapsedSeconds);
+
+	/// Steps per second, changing it keeps the accumulated time
+	void setStepRate(float stepRate);
+	float getStepRate() const { return 1.0f / stepSize; }
+	float getStepSize() const { return stepSize; }
+
+	void setMaxStepsPerFrame(int maxSteps);
+	int getMaxStepsPerFrame() const { return maxStepsPerFrame; }
+
+	/// Fraction of a step accumulated since the last one, in [0, 1). The
+	/// state to render is the blend of the states before and after the last
+	/// step by this amount.
+	float getAlpha() const;
+
+	/// How far the blended state lags behind the last step, in seconds
+	float getRenderLag() const { return (1.0f - getAlpha()) * stepSize; }
+
+	/// Simulated time at the end of the last step, kept across step rate changes
+	double getTime() const { return time; }
+
+	/// Steps returned by the last advance()
+	int getFrameSteps() const { return frameSteps; }
+
+	/// Steps run since the start and steps dropped by the catch-up limit
+	uint64_t getStepCount() const { return stepCount; }
+	uint64_t getDroppedStepCount() const { return droppedStepCount; }
+
+	/// Clears the accumulator and the counters
+	void reset();
+
+private:
+	float stepSize;
+	int maxStepsPerFrame;
+	double accumulator = 0.0;
+	double time = 0.0;
+	int frameSteps = 0;
+	uint64_t stepCount = 0;
+	uint64_t droppedStepCount = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// Turns a rate per second into a whole count per step. The fractions are
+/// carried over, so the count over many steps matches the rate for any
+/// step size.
+///////////////////////////////////////////////////////////////////////////
+class RateAccumulator
+{
+public:
+	/// Whole events due in the next `seconds` at `ratePerSecond`
+	int take(float ratePerSecond, float seconds);
+
+	void reset() { remainder = 0.0; }
+
+private:
+	double remainder = 0.0;
+};
+} // namespace labhelper
@@ -0,0 +1,205 @@
+#include "JobPool.h"
+#include <algorithm>
+
+namespace labhelper
+{
+namespace
+{
+inline uint64_t packRange(uint32_t begin, uint32_t end)
+{
+	return (uint64_t(begin) << 32) | end;
+}
+
+inline uint32_t rangeBegin(uint64_t range)
+{
+	return uint32_t(range >> 32);
+}
+
+inline uint32_t rangeEnd(uint64_t range)
+{
+	return uint32_t(range);
+}
+} // namespace
+
+JobPool::JobPool(int threadCount)
+{
+	setThreadCount(threadCount);
+}
+
+JobPool::~JobPool()
+{
+	stopWorkers();
+}
+
+int JobPool::getHardwareThreadCount()
+{
+	return std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+void JobPool::setThreadCount(int threadCount)
+{
+	stopWorkers();
+	this->threadCount = threadCount > 0 ? threadCount : getHardwareThreadCount();
+	startWorkers();
+}
+
+void JobPool::startWorkers()
+{
+	queues.reset(new Queue[threadCount]);
+	for(int i = 0; i < threadCount; i++)
+	{
+		queues[i].range.store(0);
+	}
+
+	quit = false;
+	busyWorkers = 0;
+	// Queue 0 belongs to the thread calling parallelFor(). The workers are handed the current
+	// generation, a job may be posted before they get to run.
+	for(int i = 1; i < threadCount; i++)
+	{
+		workers.emplace_back(&JobPool::workerLoop, this, i, generation);
+	}
+}
+
+void JobPool::stopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wakeCondition.notify_all();
+	for(std::thread& worker : workers)
+	{
+		worker.join();
+	}
+	workers.clear();
+}
+
+void JobPool::workerLoop(int queueIndex, uint64_t seenGeneration)
+{
+	for(;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeCondition.wait(lock, [&] { return quit || generation != seenGeneration; });
+			if(quit)
+			{
+				return;
+			}
+			seenGeneration = generation;
+		}
+
+		runChunks(queueIndex);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(--busyWorkers == 0)
+			{
+				doneCondition.notify_all();
+			}
+		}
+	}
+}
+
+bool JobPool::popLocal(int queueIndex, uint32_t& chunk)
+{
+	std::atomic<uint64_t>& range = queues[queueIndex].range;
+	uint64_t current = range.load();
+	while(rangeBegin(current) < rangeEnd(current))
+	{
+		if(range.compare_exchange_weak(current, packRange(rangeBegin(current) + 1, rangeEnd(current))))
+		{
+			chunk = rangeBegin(current);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool JobPool::steal(int queueIndex, uint32_t& chunk)
+{
+	for(int offset = 1; offset < threadCount; offset++)
+	{
+		std::atomic<uint64_t>& range = queues[(queueIndex + offset) % threadCount].range;
+		uint64_t current = range.load();
+		while(rangeBegin(current) < rangeEnd(current))
+		{
+			if(range.compare_exchange_weak(current, packRange(rangeBegin(current), rangeEnd(current) - 1)))
+			{
+				chunk = rangeEnd(current) - 1;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void JobPool::runChunks(int queueIndex)
+{
+	uint32_t chunk;
+	while(popLocal(queueIndex, chunk) || steal(queueIndex, chunk))
+	{
+		const int begin = int(chunk) * jobGrain;
+		const int end = std::min(jobCount, begin + jobGrain);
+		(*jobBody)(begin, end);
+	}
+}
+
+void JobPool::parallelFor(int count, int grain, const RangeFunction& body)
+{
+	if(count <= 0)
+	{
+		return;
+	}
+	grain = std::max(1, grain);
+	const int numChunks = (count + grain - 1) / grain;
+
+	if(threadCount == 1 || numChunks == 1)
+	{
+		for(int begin = 0; begin < count; begin += grain)
+		{
+			body(begin, std::min(count, begin + grain));
+		}
+		return;
+	}
+
+	jobBody = &body;
+	jobCount = count;
+	jobGrain = grain;
+	for(int i = 0; i < threadCount; i++)
+	{
+		const uint32_t begin = uint32_t(int64_t(numChunks) * i / threadCount);
+		const uint32_t end = uint32_t(int64_t(numChunks) * (i + 1) / threadCount);
+		queues[i].range.store(packRange(begin, end));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		busyWorkers = int(workers.size());
+		generation++;
+	}
+	wakeCondition.notify_all();
+
+	runChunks(0);
+
+	// Workers may still be finishing a chunk they took before the queues ran dry
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCondition.wait(lock, [&] { return busyWorkers == 0; });
+	jobBody = nullptr;
+}
+
+void parallelFor(JobPool* pool, int count, int grain, const JobPool::RangeFunction& body)
+{
+	if(pool)
+	{
+		pool->parallelFor(count, grain, body);
+		return;
+	}
+
+	grain = std::max(1, grain);
+	for(int begin = 0; begin < count; begin += grain)
+	{
+		body(begin, std::min(count, begin + grain));
+	}
+}
+} // namespace labhelper
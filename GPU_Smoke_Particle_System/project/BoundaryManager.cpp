@@ -1,9 +1,108 @@
 #include "BoundaryManager.h"
 #include "ParticleSystem.h"
-#include <labhelper.h>
+#include "SmokePhysics.h"
+#include "JobPool.h"
+#include <algorithm>
 #include <cmath>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/type_ptr.hpp>
 #include <random>
 
+namespace
+{
+/// Clamps the particles into [boxMin, boxMax] and reflects the normal velocity of every face they
+/// touch, scaled by the restitution. The tangential velocity along a touched face loses `friction`
+/// of itself. Returns the number of particles that touched a face.
+///
+/// Blocks of particles are copied into local arrays, `Stride` floats apart in the source or
+/// `stride` for Stride 0. The locals cannot alias, and the update is compares, selects, min/max
+/// and a separate friction pass, so the compiler vectorises it. GCC does not if-convert a select
+/// with arithmetic in one of its arms, so the friction is a multiply by a 0/1 mask instead.
+template <int Stride>
+int collideWithBox(const glm::vec3& boxMin, const glm::vec3& boxMax, const CollisionResponse& response,
+    float* const position[3], float* const velocity[3], int stride, int count)
+{
+    const int step = Stride > 0 ? Stride : stride;
+    const float minX = boxMin.x, minY = boxMin.y, minZ = boxMin.z;
+    const float maxX = boxMax.x, maxY = boxMax.y, maxZ = boxMax.z;
+    const float restitution = response.restitution;
+    const float friction = response.friction;
+
+    const int blockSize = 256;
+    float posX[blockSize], posY[blockSize], posZ[blockSize];
+    float velX[blockSize], velY[blockSize], velZ[blockSize];
+    float slidingX[blockSize], slidingY[blockSize], slidingZ[blockSize];
+
+    int collisions = 0;
+    for (int begin = 0; begin < count; begin += blockSize)
+    {
+        const int n = std::min(blockSize, count - begin);
+        for (int i = 0; i < n; i++)
+        {
+            const int index = (begin + i) * step;
+            posX[i] = position[0][index];
+            posY[i] = position[1][index];
+            posZ[i] = position[2][index];
+            velX[i] = velocity[0][index];
+            velY[i] = velocity[1][index];
+            velZ[i] = velocity[2][index];
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            const float x = posX[i], y = posY[i], z = posZ[i];
+            const float vx = velX[i], vy = velY[i], vz = velZ[i];
+            const bool belowX = x <= minX, aboveX = x >= maxX;
+            const bool belowY = y <= minY, aboveY = y >= maxY;
+            const bool belowZ = z <= minZ, aboveZ = z >= maxZ;
+            const bool hitX = belowX | aboveX;
+            const bool hitY = belowY | aboveY;
+            const bool hitZ = belowZ | aboveZ;
+
+            // The normal component turns away from the face
+            const float speedX = restitution * std::abs(vx);
+            const float speedY = restitution * std::abs(vy);
+            const float speedZ = restitution * std::abs(vz);
+            const float upperX = aboveX ? -speedX : vx;
+            const float upperY = aboveY ? -speedY : vy;
+            const float upperZ = aboveZ ? -speedZ : vz;
+            velX[i] = belowX ? speedX : upperX;
+            velY[i] = belowY ? speedY : upperY;
+            velZ[i] = belowZ ? speedZ : upperZ;
+
+            // The other components slide along it
+            slidingX[i] = ((hitY | hitZ) & !hitX) ? 1.0f : 0.0f;
+            slidingY[i] = ((hitX | hitZ) & !hitY) ? 1.0f : 0.0f;
+            slidingZ[i] = ((hitX | hitY) & !hitZ) ? 1.0f : 0.0f;
+
+            posX[i] = std::min(std::max(x, minX), maxX);
+            posY[i] = std::min(std::max(y, minY), maxY);
+            posZ[i] = std::min(std::max(z, minZ), maxZ);
+            collisions += (hitX | hitY | hitZ) ? 1 : 0;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            velX[i] -= friction * slidingX[i] * velX[i];
+            velY[i] -= friction * slidingY[i] * velY[i];
+            velZ[i] -= friction * slidingZ[i] * velZ[i];
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            const int index = (begin + i) * step;
+            position[0][index] = posX[i];
+            position[1][index] = posY[i];
+            position[2][index] = posZ[i];
+            velocity[0][index] = velX[i];
+            velocity[1][index] = velY[i];
+            velocity[2][index] = velZ[i];
+        }
+    }
+    return collisions;
+}
+} // namespace
+
 BoundaryManager::BoundaryManager(const glm::vec3& center, const glm::vec3& size)
     : wireframeVAO(0), wireframeVBO(0), wireframeEBO(0)
 {
@@ -88,47 +187,72 @@ void BoundaryManager::createWireframeGeometry()
 
 bool BoundaryManager::checkAndHandleCollision(Particle& particle)
 {
-    bool collided = false;
+    // The operations of handleCollisions() for a single particle
     glm::vec3& pos = particle.pos;
     glm::vec3& vel = particle.velocity;
+    const glm::bvec3 below = glm::lessThanEqual(pos, boundingBox.min_bounds);
+    const glm::bvec3 above = glm::greaterThanEqual(pos, boundingBox.max_bounds);
+    const glm::bvec3 hit(below.x || above.x, below.y || above.y, below.z || above.z);
 
-    // Check the X-axis boundaries
-    if (pos.x <= boundingBox.min_bounds.x) {
-        pos.x = boundingBox.min_bounds.x;
-        vel.x = abs(vel.x);
-        collided = true;
-    }
-    else if (pos.x >= boundingBox.max_bounds.x) {
-        pos.x = boundingBox.max_bounds.x;
-        vel.x = -abs(vel.x);
-        collided = true;
+    glm::vec3 sliding(0.0f);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float speed = collisionResponse.restitution * std::abs(vel[axis]);
+        if (below[axis]) {
+            vel[axis] = speed;
+        }
+        else if (above[axis]) {
+            vel[axis] = -speed;
+        }
+        if (!hit[axis] && (hit[(axis + 1) % 3] || hit[(axis + 2) % 3])) {
+            sliding[axis] = 1.0f;
+        }
+        pos[axis] = std::min(std::max(pos[axis], boundingBox.min_bounds[axis]), boundingBox.max_bounds[axis]);
     }
+    vel -= collisionResponse.friction * sliding * vel;
 
-    // Check Y-axis bounds
-    if (pos.y <= boundingBox.min_bounds.y) {
-        pos.y = boundingBox.min_bounds.y;
-        vel.y = abs(vel.y);
-        collided = true;
-    }
-    else if (pos.y >= boundingBox.max_bounds.y) {
-        pos.y = boundingBox.max_bounds.y;
-        vel.y = -abs(vel.y);
-        collided = true;
-    }
+    return glm::any(hit);
+}
 
-    // Check Z-axis boundaries
-    if (pos.z <= boundingBox.min_bounds.z) {
-        pos.z = boundingBox.min_bounds.z;
-        vel.z = abs(vel.z);
-        collided = true;
-    }
-    else if (pos.z >= boundingBox.max_bounds.z) {
-        pos.z = boundingBox.max_bounds.z;
-        vel.z = -abs(vel.z);
-        collided = true;
-    }
+int BoundaryManager::handleCollisions(const ParticleSpans& particles) const
+{
+    float* const position[3] = { particles.posX, particles.posY, particles.posZ };
+    float* const velocity[3] = { particles.velX, particles.velY, particles.velZ };
+    return collideWithBox<1>(boundingBox.min_bounds, boundingBox.max_bounds, collisionResponse,
+        position, velocity, 1, particles.count);
+}
 
-    return collided;
+int BoundaryManager::handleCollisions(float* position, float* velocity, int stride, int count) const
+{
+    float* const positionAxes[3] = { position, position + 1, position + 2 };
+    float* const velocityAxes[3] = { velocity, velocity + 1, velocity + 2 };
+    return collideWithBox<0>(boundingBox.min_bounds, boundingBox.max_bounds, collisionResponse,
+        positionAxes, velocityAxes, stride, count);
+}
+
+int BoundaryManager::handleCollisions(std::vector<Particle>& particles, labhelper::JobPool* pool) const
+{
+    static_assert(sizeof(Particle) % sizeof(float) == 0, "Particle must be a whole number of floats");
+    const int stride = int(sizeof(Particle) / sizeof(float));
+
+    // One count per chunk, a chunk never shares a slot with another job
+    const int grain = 4096;
+    std::vector<int> chunkCollisions((particles.size() + grain - 1) / grain, 0);
+    labhelper::parallelFor(pool, int(particles.size()), grain, [&](int begin, int end) {
+        for (int chunk = begin; chunk < end; chunk += grain)
+        {
+            Particle* first = particles.data() + chunk;
+            chunkCollisions[chunk / grain] = handleCollisions(&first->pos.x, &first->velocity.x, stride,
+                std::min(grain, end - chunk));
+        }
+    });
+
+    int collisions = 0;
+    for (int count : chunkCollisions)
+    {
+        collisions += count;
+    }
+    return collisions;
 }
 
 glm::vec3 BoundaryManager::generateSpawnPosition(float radius)
@@ -138,7 +262,7 @@ glm::vec3 BoundaryManager::generateSpawnPosition(float radius)
     static std::uniform_real_distribution<float> dis(0.0f, 1.0f);
 
     // Randomly generate positions within a circular area
-    float angle = dis(gen) * 2.0f * M_PI;
+    float angle = dis(gen) * glm::two_pi<float>();
     float r = sqrt(dis(gen)) * radius;
 
     // Generate position on the bottom of the cube
@@ -166,11 +290,18 @@ void BoundaryManager::renderBoundary(const glm::mat4& viewMatrix, const glm::mat
     glUseProgram(shaderProgram);
     glLineWidth(2.5f);
 
+    if (boundaryUniforms.program != shaderProgram)
+    {
+        boundaryUniforms.program = shaderProgram;
+        boundaryUniforms.modelViewProjectionMatrix = glGetUniformLocation(shaderProgram, "modelViewProjectionMatrix");
+        boundaryUniforms.materialColor = glGetUniformLocation(shaderProgram, "material_color");
+    }
+
     glm::mat4 modelMatrix = glm::mat4(1.0f);
     glm::mat4 mvpMatrix = projectionMatrix * viewMatrix * modelMatrix;
 
-    labhelper::setUniformSlow(shaderProgram, "modelViewProjectionMatrix", mvpMatrix);
-    labhelper::setUniformSlow(shaderProgram, "material_color", glm::vec3(1.0f, 0.0f, 0.0f));
+    glUniformMatrix4fv(boundaryUniforms.modelViewProjectionMatrix, 1, GL_FALSE, glm::value_ptr(mvpMatrix));
+    glUniform3f(boundaryUniforms.materialColor, 1.0f, 0.0f, 0.0f);
 
     // Rendering Wireframe
     glBindVertexArray(wireframeVAO);
@@ -3,6 +3,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <GL/glew.h>
+#include <vector>
 
 struct BoundingBox
 {
@@ -12,7 +13,19 @@ struct BoundingBox
     glm::vec3 max_bounds;
 };
 
+/// How particles bounce off the boundary
+struct CollisionResponse
+{
+    float restitution = 1.0f;  // Fraction of the normal speed kept, 1 reflects it fully
+    float friction = 0.0f;     // Fraction of the tangential velocity lost against a face
+};
+
 struct Particle;
+struct ParticleSpans;
+namespace labhelper
+{
+class JobPool;
+}
 
 class BoundaryManager
 {
@@ -28,6 +41,23 @@ public:
     /// Check if the particle collides with the boundary and handles the bounce if it does
     bool checkAndHandleCollision(Particle& particle);
 
+    /// checkAndHandleCollision() for a batch given as arrays. There are no branches per particle,
+    /// the clamping and the reflection are selects, so the compiler vectorises it. Returns the
+    /// number of particles that touched the boundary.
+    int handleCollisions(const ParticleSpans& particles) const;
+
+    /// handleCollisions() for `count` particles stored `stride` floats apart. `position` and
+    /// `velocity` point at the x of the first particle, y and z follow.
+    int handleCollisions(float* position, float* velocity, int stride, int count) const;
+
+    /// handleCollisions() for a whole particle array, split over the job pool if one is given
+    int handleCollisions(std::vector<Particle>& particles, labhelper::JobPool* pool = nullptr) const;
+
+    /// Restitution and friction of the collisions
+    void setCollisionResponse(const CollisionResponse& response) { collisionResponse = response; }
+
+    const CollisionResponse& getCollisionResponse() const { return collisionResponse; }
+
     /// Generate random positions in the circular area at the bottom of the cube
     glm::vec3 generateSpawnPosition(float radius = 5.0f);
 
@@ -42,11 +72,21 @@ public:
 
 private:
     BoundingBox boundingBox;
+    CollisionResponse collisionResponse;
 
     GLuint wireframeVAO;
     GLuint wireframeVBO;
     GLuint wireframeEBO;
 
+    // Uniforms of the last program passed to renderBoundary, looked up again when it changes
+    struct BoundaryUniformLocations
+    {
+        GLuint program = 0;
+        GLint modelViewProjectionMatrix = -1;
+        GLint materialColor = -1;
+    };
+    BoundaryUniformLocations boundaryUniforms;
+
     /// Update boundary calculation
     void updateBounds();
 
@@ -4,11 +4,14 @@
 #include <fstream>
 #include <sstream>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <utility>
 //#include "../../TDA362_GPU_Smoke_Particle_System/project_others/"
 
 ComputeManager::ComputeManager()
-    : computeShaderProgram(0), particleSSBO(0), counterSSBO(0),
-    maxParticles(0), initialized(false)
+    : computeShaderProgram(0), compactShaderProgram(0), emitShaderProgram(0), particleSSBO(0),
+    particleBackSSBO(0), counterSSBO(0), groupSumSSBO(0), deadListSSBO(0), maxParticles(0), initialized(false)
 {
     physicsParams = PhysicsParametersGPU(2.5f, 0.5f, 1.0f);
 }
@@ -38,6 +41,60 @@ bool ComputeManager::initialize()
         return false;
     }
 
+    std::string compactSource = readFile("../../TDA362_GPU_Smoke_Particle_System/project_others/particle_compact.comp");
+    compactShaderProgram = compactSource.empty() ? 0 : compileComputeShader(compactSource);
+    if (compactShaderProgram == 0)
+    {
+        std::cerr << "Failed to load particle compaction compute shader!" << std::endl;
+        return false;
+    }
+    compactUniforms.count = glGetUniformLocation(compactShaderProgram, "u_count");
+    compactUniforms.groupCount = glGetUniformLocation(compactShaderProgram, "u_groupCount");
+    compactUniforms.pass = glGetUniformLocation(compactShaderProgram, "u_pass");
+
+    std::string emitSource = readFile("../../TDA362_GPU_Smoke_Particle_System/project_others/particle_emit.comp");
+    emitShaderProgram = emitSource.empty() ? 0 : compileComputeShader(emitSource);
+    if (emitShaderProgram == 0)
+    {
+        std::cerr << "Failed to load particle emission compute shader!" << std::endl;
+        return false;
+    }
+    emitUniforms.emitCount = glGetUniformLocation(emitShaderProgram, "u_emitCount");
+    emitUniforms.maxParticles = glGetUniformLocation(emitShaderProgram, "u_maxParticles");
+    emitUniforms.seed = glGetUniformLocation(emitShaderProgram, "u_seed");
+    emitUniforms.discCenter = glGetUniformLocation(emitShaderProgram, "u_discCenter");
+    emitUniforms.discRadius = glGetUniformLocation(emitShaderProgram, "u_discRadius");
+    emitUniforms.boundsMin = glGetUniformLocation(emitShaderProgram, "u_boundsMin");
+    emitUniforms.boundsMax = glGetUniformLocation(emitShaderProgram, "u_boundsMax");
+    emitUniforms.coneHalfAngle = glGetUniformLocation(emitShaderProgram, "u_coneHalfAngle");
+    emitUniforms.baseSpeed = glGetUniformLocation(emitShaderProgram, "u_baseSpeed");
+    emitUniforms.speedVariation = glGetUniformLocation(emitShaderProgram, "u_speedVariation");
+    emitUniforms.lifeLength = glGetUniformLocation(emitShaderProgram, "u_lifeLength");
+
+    std::string drawArgsSource = readFile("../../TDA362_GPU_Smoke_Particle_System/project_others/particle_draw_args.comp");
+    drawArgsShaderProgram = drawArgsSource.empty() ? 0 : compileComputeShader(drawArgsSource);
+    if (drawArgsShaderProgram == 0)
+    {
+        std::cerr << "Failed to load particle draw arguments compute shader!" << std::endl;
+        return false;
+    }
+    drawArgsUniforms.maxParticles = glGetUniformLocation(drawArgsShaderProgram, "u_maxParticles");
+    drawArgsUniforms.minCount = glGetUniformLocation(drawArgsShaderProgram, "u_minCount");
+
+    std::string sortSource = readFile("../../TDA362_GPU_Smoke_Particle_System/project_others/particle_sort.comp");
+    sortShaderProgram = sortSource.empty() ? 0 : compileComputeShader(sortSource);
+    if (sortShaderProgram == 0)
+    {
+        std::cerr << "Failed to load particle sort compute shader!" << std::endl;
+        return false;
+    }
+    sortUniforms.pass = glGetUniformLocation(sortShaderProgram, "u_pass");
+    sortUniforms.range = glGetUniformLocation(sortShaderProgram, "u_range");
+    sortUniforms.k = glGetUniformLocation(sortShaderProgram, "u_k");
+    sortUniforms.j = glGetUniformLocation(sortShaderProgram, "u_j");
+    sortUniforms.view = glGetUniformLocation(sortShaderProgram, "u_view");
+    sortUniforms.renderLag = glGetUniformLocation(sortShaderProgram, "u_renderLag");
+
     initialized = true;
     return true;
 }
@@ -67,6 +124,39 @@ void ComputeManager::setupSSBOs(unsigned int maxParticles)
     glBufferData(GL_SHADER_STORAGE_BUFFER, particleBufferSize, nullptr, GL_DYNAMIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
 
+    // Second particle buffer, the compaction pass ping-pongs between the two
+    glGenBuffers(1, &particleBackSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleBackSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, particleBufferSize, nullptr, GL_DYNAMIC_DRAW);
+
+    // One alive count per compaction workgroup, plus the live range of the source buffer
+    glGenBuffers(1, &groupSumSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, groupSumSSBO);
+    GLsizeiptr groupSumBufferSize = ((maxParticles + compactGroupSize - 1) / compactGroupSize + 1) * sizeof(GLuint);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, groupSumBufferSize, nullptr, GL_DYNAMIC_DRAW);
+
+    // Dead list, at most every slot is free at once
+    glGenBuffers(1, &deadListSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, deadListSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, maxParticles * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, deadListSSBO);
+
+    // Depth sort entries, one (key, slot) pair per slot of the padded sort size
+    sortCapacity = sortSizeFor(maxParticles);
+    glGenBuffers(2, sortBuffers);
+    for (GLuint sortBuffer : sortBuffers) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sortBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sortCapacity * 2 * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+    }
+    resetSort();
+
+    // Indirect draw command, starts out drawing nothing
+    const GLuint emptyDrawCommand[4] = { 0, 0, 0, 0 };
+    glGenBuffers(1, &drawCommandBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawCommandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(emptyDrawCommand), emptyDrawCommand, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
     // Creating Counter SSBO
     glGenBuffers(1, &counterSSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterSSBO);
@@ -74,10 +164,30 @@ void ComputeManager::setupSSBOs(unsigned int maxParticles)
     glBufferData(GL_SHADER_STORAGE_BUFFER, counterBufferSize, nullptr, GL_DYNAMIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counterSSBO);
 
+    // Parameters of the update pass, uploaded on the first dispatch
+    glGenBuffers(1, &physicsUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, physicsUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(PhysicsBlockGPU), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    physicsBlockDirty = true;
+
     // Initialize counter
     ParticleCounters initialCounters = { 0, 0, 0, 0 };
     glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ParticleCounters), &initialCounters);
 
+    // Readback ring for the counters, mapped once and read after the copy's fence has signalled
+    if (GLEW_ARB_buffer_storage)
+    {
+        const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        const GLsizeiptr readbackSize = counterReadbackRingSize * sizeof(ParticleCounters);
+        glGenBuffers(1, &counterReadbackBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, counterReadbackBuffer);
+        glBufferStorage(GL_COPY_WRITE_BUFFER, readbackSize, nullptr, flags);
+        mappedCounterReadback = static_cast<const ParticleCounters*>(
+            glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, readbackSize, flags));
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
     checkGLError("setupSSBOs");
@@ -107,19 +217,187 @@ ParticleCounters ComputeManager::getParticleCounters()
     return counters;
 }
 
-void ComputeManager::updateParticleCounters(unsigned int aliveCount, unsigned int totalCount)
+unsigned int ComputeManager::requestCounterReadback()
+{
+    if (counterSSBO == 0) {
+        return 0;
+    }
+
+    const unsigned int requestId = nextReadbackRequest;
+    if (mappedCounterReadback == nullptr)
+    {
+        syncReadbackCounters = getParticleCounters();
+        syncReadbackRequest = requestId;
+        nextReadbackRequest++;
+        return requestId;
+    }
+
+    const unsigned int slotIndex = requestId % counterReadbackRingSize;
+    CounterReadbackSlot& slot = counterReadbackSlots[slotIndex];
+    if (slot.fence != nullptr) {
+        return 0;
+    }
+
+    // Make the compute shaders' counter writes visible to the copy
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, counterSSBO);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, counterReadbackBuffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+        slotIndex * sizeof(ParticleCounters), sizeof(ParticleCounters));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.requestId = requestId;
+    nextReadbackRequest++;
+    return requestId;
+}
+
+unsigned int ComputeManager::pollCounterReadback(ParticleCounters& counters)
+{
+    if (mappedCounterReadback == nullptr)
+    {
+        const unsigned int requestId = syncReadbackRequest;
+        if (requestId != 0) {
+            counters = syncReadbackCounters;
+            syncReadbackRequest = 0;
+        }
+        return requestId;
+    }
+
+    unsigned int newestRequest = 0;
+    for (unsigned int i = 0; i < counterReadbackRingSize; i++)
+    {
+        CounterReadbackSlot& slot = counterReadbackSlots[i];
+        if (slot.fence == nullptr) {
+            continue;
+        }
+
+        // Zero timeout: only look at the fence, never wait for it
+        const GLenum result = glClientWaitSync(slot.fence, 0, 0);
+        if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED) {
+            continue;
+        }
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+
+        if (slot.requestId > newestRequest) {
+            newestRequest = slot.requestId;
+            counters = mappedCounterReadback[i];
+        }
+    }
+    return newestRequest;
+}
+
+void ComputeManager::updateParticleCounters(unsigned int aliveCount, unsigned int deadCount, unsigned int totalCount)
 {
     if (counterSSBO == 0) {
         return;
     }
 
-    ParticleCounters counters = { aliveCount, 0, totalCount, 0 };
+    ParticleCounters counters = { aliveCount, deadCount, totalCount, 0 };
 
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterSSBO);
     glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ParticleCounters), &counters);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
+void ComputeManager::compactParticles(unsigned int particleCount)
+{
+    if (compactShaderProgram == 0 || particleCount == 0) {
+        return;
+    }
+
+    const unsigned int numWorkGroups = (particleCount + compactGroupSize - 1) / compactGroupSize;
+
+    glUseProgram(compactShaderProgram);
+    glUniform1ui(compactUniforms.count, particleCount);
+    glUniform1ui(compactUniforms.groupCount, numWorkGroups);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counterSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, particleBackSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, groupSumSSBO);
+
+    // Count alive particles per workgroup
+    glUniform1i(compactUniforms.pass, 0);
+    glDispatchCompute(numWorkGroups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // Scan the workgroup counts into offsets
+    glUniform1i(compactUniforms.pass, 1);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // Scatter the survivors into the back buffer
+    glUniform1i(compactUniforms.pass, 2);
+    glDispatchCompute(numWorkGroups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    std::swap(particleSSBO, particleBackSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
+
+    // The particles moved, a sorted order refers to their old slots
+    resetSort();
+
+    glUseProgram(0);
+
+    checkGLError("compactParticles");
+}
+
+void ComputeManager::emitParticles(unsigned int count, const EmitterParametersGPU& emitter, unsigned int seed)
+{
+    if (emitShaderProgram == 0 || count == 0) {
+        return;
+    }
+
+    glUseProgram(emitShaderProgram);
+    glUniform1ui(emitUniforms.emitCount, count);
+    glUniform1ui(emitUniforms.maxParticles, maxParticles);
+    glUniform1ui(emitUniforms.seed, seed);
+
+    glUniform3fv(emitUniforms.discCenter, 1, &emitter.discCenter[0]);
+    glUniform1f(emitUniforms.discRadius, emitter.discRadius);
+    glUniform3fv(emitUniforms.boundsMin, 1, &emitter.boundsMin[0]);
+    glUniform3fv(emitUniforms.boundsMax, 1, &emitter.boundsMax[0]);
+    glUniform1f(emitUniforms.coneHalfAngle, emitter.coneHalfAngle);
+    glUniform1f(emitUniforms.baseSpeed, emitter.baseSpeed);
+    glUniform1f(emitUniforms.speedVariation, emitter.speedVariation);
+    glUniform1f(emitUniforms.lifeLength, emitter.lifeLength);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counterSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, deadListSSBO);
+
+    glDispatchCompute((count + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(0);
+
+    checkGLError("emitParticles");
+}
+
+void ComputeManager::writeDrawCommand(unsigned int minCount)
+{
+    if (drawArgsShaderProgram == 0 || drawCommandBuffer == 0) {
+        return;
+    }
+
+    glUseProgram(drawArgsShaderProgram);
+    glUniform1ui(drawArgsUniforms.maxParticles, maxParticles);
+    glUniform1ui(drawArgsUniforms.minCount, minCount);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counterSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, drawCommandBuffer);
+
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+    glUseProgram(0);
+
+    checkGLError("writeDrawCommand");
+}
+
 void ComputeManager::cleanup()
 {
     if (particleSSBO != 0) {
@@ -127,16 +405,81 @@ void ComputeManager::cleanup()
         particleSSBO = 0;
     }
 
+    if (particleBackSSBO != 0) {
+        glDeleteBuffers(1, &particleBackSSBO);
+        particleBackSSBO = 0;
+    }
+
+    if (groupSumSSBO != 0) {
+        glDeleteBuffers(1, &groupSumSSBO);
+        groupSumSSBO = 0;
+    }
+
+    if (deadListSSBO != 0) {
+        glDeleteBuffers(1, &deadListSSBO);
+        deadListSSBO = 0;
+    }
+
     if (counterSSBO != 0) {
         glDeleteBuffers(1, &counterSSBO);
         counterSSBO = 0;
     }
 
+    if (sortBuffers[0] != 0) {
+        glDeleteBuffers(2, sortBuffers);
+        sortBuffers[0] = sortBuffers[1] = 0;
+    }
+    sortCapacity = 0;
+    resetSort();
+
+    if (drawCommandBuffer != 0) {
+        glDeleteBuffers(1, &drawCommandBuffer);
+        drawCommandBuffer = 0;
+    }
+
+    if (physicsUBO != 0) {
+        glDeleteBuffers(1, &physicsUBO);
+        physicsUBO = 0;
+    }
+
+    for (CounterReadbackSlot& slot : counterReadbackSlots) {
+        if (slot.fence != nullptr) {
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+        }
+    }
+
+    if (counterReadbackBuffer != 0) {
+        glDeleteBuffers(1, &counterReadbackBuffer);
+        counterReadbackBuffer = 0;
+        mappedCounterReadback = nullptr;
+    }
+
     if (computeShaderProgram != 0) {
         glDeleteProgram(computeShaderProgram);
         computeShaderProgram = 0;
     }
 
+    if (compactShaderProgram != 0) {
+        glDeleteProgram(compactShaderProgram);
+        compactShaderProgram = 0;
+    }
+
+    if (emitShaderProgram != 0) {
+        glDeleteProgram(emitShaderProgram);
+        emitShaderProgram = 0;
+    }
+
+    if (drawArgsShaderProgram != 0) {
+        glDeleteProgram(drawArgsShaderProgram);
+        drawArgsShaderProgram = 0;
+    }
+
+    if (sortShaderProgram != 0) {
+        glDeleteProgram(sortShaderProgram);
+        sortShaderProgram = 0;
+    }
+
     initialized = false;
 }
 
@@ -198,31 +541,185 @@ void ComputeManager::checkGLError(const std::string& operation)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// physics system
+// depth sort
 ///////////////////////////////////////////////////////////////////////////////
 
-void ComputeManager::updateParticlesWithPhysics(float deltaTime, unsigned int particleCount, const PhysicsParametersGPU& physics)
+unsigned int ComputeManager::sortSizeFor(unsigned int range) const
 {
-    if (!isReady() || particleCount == 0) {
+    unsigned int size = sortBlockSize;
+    while (size < range) {
+        size <<= 1;
+    }
+    return size;
+}
+
+unsigned int ComputeManager::getSortStepCount(unsigned int range) const
+{
+    // One shared-memory sort of the blocks, then per larger stage one global step per distance
+    // down to the block size and one shared-memory merge
+    const unsigned int size = sortSizeFor(range);
+    unsigned int steps = 1;
+    for (unsigned int k = sortBlockSize * 2; k <= size; k <<= 1) {
+        for (unsigned int j = k / 2; j >= sortBlockSize; j >>= 1) {
+            steps++;
+        }
+        steps++;
+    }
+    return steps;
+}
+
+void ComputeManager::resetSort()
+{
+    sortSteps.clear();
+    nextSortStep = 0;
+    sortRange = 0;
+    sortedCount = 0;
+}
+
+void ComputeManager::sortParticlesByDepth(const glm::mat4& viewMatrix, float renderLag, unsigned int range, unsigned int maxSteps)
+{
+    if (sortShaderProgram == 0 || sortCapacity == 0) {
         return;
     }
 
-    glUseProgram(computeShaderProgram);
+    range = std::min(range, maxParticles);
+    if (range == 0) {
+        resetSort();
+        return;
+    }
+
+    glUseProgram(sortShaderProgram);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counterSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, sortBuffers[0]);
 
-    // Setting basic uniform variables
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_deltaTime"), deltaTime);
-    glUniform1ui(glGetUniformLocation(computeShaderProgram, "u_maxParticles"), maxParticles);
+    // Start a new sort, capturing this frame's depths
+    if (maxSteps == 0 || nextSortStep >= sortSteps.size())
+    {
+        sortRange = range;
+        const unsigned int size = sortSizeFor(sortRange);
+
+        sortSteps.clear();
+        nextSortStep = 0;
+        sortSteps.push_back({ 1, sortBlockSize, 0 });
+        for (unsigned int k = sortBlockSize * 2; k <= size; k <<= 1) {
+            for (unsigned int j = k / 2; j >= sortBlockSize; j >>= 1) {
+                sortSteps.push_back({ 2, k, j });
+            }
+            sortSteps.push_back({ 3, k, 0 });
+        }
+
+        glUniform1i(sortUniforms.pass, 0);
+        glUniform1ui(sortUniforms.range, sortRange);
+        glUniformMatrix4fv(sortUniforms.view, 1, GL_FALSE, &viewMatrix[0][0]);
+        glUniform1f(sortUniforms.renderLag, renderLag);
+        glDispatchCompute(size / sortGroupSize, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
 
-    // Set physical parameter uniform variables
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_gravity"), physics.gravity);
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_dragCoeff"), physics.dragCoeff);
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_particleMass"), physics.particleMass);
+    const unsigned int size = sortSizeFor(sortRange);
+    const size_t lastStep = maxSteps == 0 ? sortSteps.size() : std::min(sortSteps.size(), nextSortStep + maxSteps);
+    for (; nextSortStep < lastStep; nextSortStep++)
+    {
+        const SortStep& step = sortSteps[nextSortStep];
+        glUniform1i(sortUniforms.pass, step.pass);
+        glUniform1ui(sortUniforms.k, step.k);
+        glUniform1ui(sortUniforms.j, step.j);
+
+        // Shared-memory passes take a block per workgroup, global steps one pair per invocation
+        const unsigned int numWorkGroups = step.pass == 2 ? size / 2 / sortGroupSize : size / sortBlockSize;
+        glDispatchCompute(numWorkGroups, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
 
-    glUniform1i(glGetUniformLocation(computeShaderProgram, "u_hasFlowField"), 0);
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_flowInfluence"), 0.0f);
+    if (nextSortStep == sortSteps.size())
+    {
+        std::swap(sortBuffers[0], sortBuffers[1]);
+        sortedCount = sortRange;
+        sortSteps.clear();
+        nextSortStep = 0;
+    }
 
+    glUseProgram(0);
+
+    checkGLError("sortParticlesByDepth");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// physics system
+///////////////////////////////////////////////////////////////////////////////
+
+void ComputeManager::bindPhysicsBlock(float deltaTime, const PhysicsParametersGPU& physics, FlowFieldGPU* flowField)
+{
+    const bool hasFlowField = (flowField != nullptr && flowField->isInitialized() && flowField->isEnabled());
+
+    PhysicsBlockGPU block;
+    block.physics = physics;
+    block.deltaTime = deltaTime;
+    block.maxParticles = maxParticles;
+    block.hasFlowField = hasFlowField ? 1 : 0;
+    block.integrator = integratorSettings;
+    block.integrator.minCellSize = 0.0f;
+    block.boundary = boundaryParams;
+    block.sdf = sdfParams;
+    if (sdfTexture != 0 && sdfParams.enabled)
+    {
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_3D, sdfTexture);
+    }
+    else
+    {
+        block.sdf.enabled = 0;
+    }
+    block.terrain = terrainParams;
+    if (terrainTexture != 0 && terrainParams.enabled)
+    {
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, terrainTexture);
+    }
+    else
+    {
+        block.terrain.enabled = 0;
+    }
+    if (hasFlowField)
+    {
+        const FlowFieldBounds& bounds = flowField->getBounds();
+        block.flowFieldWorldMin = glm::vec4(bounds.worldMin, 0.0f);
+        block.flowFieldWorldMax = glm::vec4(bounds.worldMax, 0.0f);
+        block.flowInfluence = flowInfluence;
+
+        // The CFL limit of the sub-stepping is in texels of the flow texture
+        const glm::vec3 texelSize = bounds.worldSize / glm::vec3(glm::max(bounds.resolution, glm::ivec3(1)));
+        block.integrator.minCellSize = std::min(texelSize.x, std::min(texelSize.y, texelSize.z));
+
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_3D, flowField->getFlowFieldTexture());
+    }
+
+    // With a fixed timestep and unchanged settings the block stays the same frame to frame
+    if (physicsBlockDirty || std::memcmp(&block, &physicsBlock, sizeof(PhysicsBlockGPU)) != 0)
+    {
+        physicsBlock = block;
+        glBindBuffer(GL_UNIFORM_BUFFER, physicsUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(PhysicsBlockGPU), &physicsBlock);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        physicsBlockDirty = false;
+    }
+
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, physicsUBO);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counterSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, deadListSSBO);
+}
+
+void ComputeManager::updateParticlesWithPhysics(float deltaTime, unsigned int particleCount, const PhysicsParametersGPU& physics)
+{
+    if (!isReady() || particleCount == 0) {
+        return;
+    }
+
+    glUseProgram(computeShaderProgram);
+    bindPhysicsBlock(deltaTime, physics, nullptr);
 
     // Calculating the number of workgroups
     unsigned int numWorkGroups = (particleCount + 63) / 64; // Round up
@@ -257,34 +754,7 @@ void ComputeManager::updateParticlesWithPhysicsAndFlow(float deltaTime, unsigned
     }
 
     glUseProgram(computeShaderProgram);
-
-    // Setting uniform variables
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_deltaTime"), deltaTime);
-    glUniform1ui(glGetUniformLocation(computeShaderProgram, "u_maxParticles"), maxParticles);
-
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_gravity"), physics.gravity);
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_dragCoeff"), physics.dragCoeff);
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_particleMass"), physics.particleMass);
-
-    bool hasFlowField = (flowField != nullptr && flowField->isInitialized() && flowField->isEnabled());
-    glUniform1i(glGetUniformLocation(computeShaderProgram, "u_hasFlowField"), hasFlowField ? 1 : 0);
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "u_flowInfluence"), flowInfluence);
-
-    if (hasFlowField) 
-    {
-        // Binding 3D flow field texture
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_3D, flowField->getFlowFieldTexture());
-        glUniform1i(glGetUniformLocation(computeShaderProgram, "u_flowFieldTexture"), 1);
-
-        // Set flow field boundary information
-        const auto& bounds = flowField->getBounds();
-        glUniform3fv(glGetUniformLocation(computeShaderProgram, "u_flowFieldWorldMin"), 1, &bounds.worldMin[0]);
-        glUniform3fv(glGetUniformLocation(computeShaderProgram, "u_flowFieldWorldMax"), 1, &bounds.worldMax[0]);
-    }
-
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counterSSBO);
+    bindPhysicsBlock(deltaTime, physics, flowField);
 
     // Calculating the number of workgroups
     unsigned int numWorkGroups = (particleCount + 63) / 64; // Round up
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <GL/glew.h>
+#include <glm/glm.hpp>
 #include <string>
+#include <vector>
 
 class FlowFieldGPU;
 
@@ -26,6 +28,80 @@ struct PhysicsParametersGPU
     }
 };
 
+/// Integrator of particle_update.comp, the GPU side of IntegratorSettings in SmokePhysics.h
+struct IntegratorSettingsGPU
+{
+    unsigned int integrator = 0;   // IntegratorType
+    unsigned int maxSubsteps = 1;  // Sub-step budget per particle and frame, 1 turns sub-stepping off
+    float cflNumber = 0.5f;        // Flow grid cells a particle may cross per sub-step
+    float minCellSize = 0.0f;      // Texel size of the flow field, filled in when the block is bound
+};
+
+/// Box the update pass keeps the particles in, the GPU side of BoundaryManager
+struct BoundaryParametersGPU
+{
+    glm::vec4 boxMin = glm::vec4(0.0f);  // xyz used
+    glm::vec4 boxMax = glm::vec4(0.0f);  // xyz used
+    unsigned int enabled = 0;
+    float restitution = 1.0f;            // See CollisionResponse
+    float friction = 0.0f;
+    float padding = 0.0f;
+};
+
+/// Scene distance field the update pass pushes the particles out of, the GPU side of SdfCollider.
+/// The field itself is a 3D texture with one texel per node between the bounds.
+struct SdfColliderGPU
+{
+    glm::vec4 boundsMin = glm::vec4(0.0f);  // xyz first node, w surface offset
+    glm::vec4 boundsMax = glm::vec4(0.0f);  // xyz last node, w voxel size
+    unsigned int enabled = 0;
+    float restitution = 1.0f;               // See CollisionResponse
+    float friction = 0.0f;
+    float bandWidth = 0.0f;                 // Distance outside the bounds
+};
+
+/// Ground the update pass keeps the particles above, the GPU side of HeightGrid. The heights are
+/// the float texture of HeightField.
+struct TerrainGPU
+{
+    glm::vec4 texelMapping = glm::vec4(0.0f);  // See HeightGrid::getTexelMapping()
+    float heightScale = 1.0f;                  // See HeightGrid::getHeightMapping()
+    float heightOffset = 0.0f;
+    unsigned int enabled = 0;
+    float surfaceOffset = 0.0f;
+    float restitution = 1.0f;                  // See CollisionResponse
+    float friction = 0.0f;
+    float padding[2] = { 0.0f, 0.0f };
+};
+
+/// Layout of the std140 PhysicsBlock in particle_update.comp, 224 bytes
+struct PhysicsBlockGPU
+{
+    PhysicsParametersGPU physics;
+    glm::vec4 flowFieldWorldMin = glm::vec4(0.0f); // xyz used
+    glm::vec4 flowFieldWorldMax = glm::vec4(0.0f); // xyz used
+    float deltaTime = 0.0f;
+    unsigned int maxParticles = 0;
+    unsigned int hasFlowField = 0;
+    float flowInfluence = 0.0f;
+    IntegratorSettingsGPU integrator;
+    BoundaryParametersGPU boundary;
+    SdfColliderGPU sdf;
+    TerrainGPU terrain;
+};
+static_assert(sizeof(PhysicsBlockGPU) == 224, "PhysicsBlockGPU must match the std140 PhysicsBlock");
+
+struct EmitterParametersGPU
+{
+    glm::vec3 discCenter = glm::vec3(0.0f);  // Spawn disc, horizontal
+    float discRadius = 2.0f;
+    glm::vec3 boundsMin = glm::vec3(-1e6f);  // Spawn positions are clamped to these bounds
+    glm::vec3 boundsMax = glm::vec3(1e6f);
+    float coneHalfAngle = glm::radians(22.5f);
+    float baseSpeed = 10.0f;
+    float speedVariation = 0.3f;              // Relative, speeds fall in base * (1 +- variation)
+    float lifeLength = 5.0f;
+};
 
 class ComputeManager
 {
@@ -45,21 +121,81 @@ public:
     /// Perform particle update calculations
     void updateParticles(float deltaTime, unsigned int particleCount);
 
-    /// Get the particle count information on the GPU
+    /// Get the particle count information on the GPU. This stalls until the GPU has caught up,
+    /// per-frame code should use the asynchronous readback below.
     ParticleCounters getParticleCounters();
 
     /// Update particle count information
-    void updateParticleCounters(unsigned int aliveCount, unsigned int totalCount);
+    void updateParticleCounters(unsigned int aliveCount, unsigned int deadCount, unsigned int totalCount);
+
+    /// Spawns up to `count` particles on the GPU, reusing slots from the dead list first
+    void emitParticles(unsigned int count, const EmitterParametersGPU& emitter, unsigned int seed);
 
     /// Get the particle SSBO handle (for use by ParticleSystem)
     GLuint getParticleSSBO() const { return particleSSBO; }
 
+    /// Get the counter SSBO handle, total_count bounds the slots in use
+    GLuint getCounterSSBO() const { return counterSSBO; }
+
+    /// Moves the alive particles among the first `particleCount` slots (never past total_count) to the front of the other
+    /// particle buffer and swaps the two. The counters end up with alive = total and dead = 0.
+    void compactParticles(unsigned int particleCount);
+
+    /// Buffer holding the DrawArraysIndirectCommand for the SSBO particle draw
+    GLuint getDrawCommandBuffer() const { return drawCommandBuffer; }
+
+    /// Fills the draw command buffer from the current counters. Call after the last pass that
+    /// changes the counters (update, compaction, emission) and before glDrawArraysIndirect. The
+    /// vertex count is at least `minCount`, so a depth-sorted order covering more slots than the
+    /// current live range is drawn in full.
+    void writeDrawCommand(unsigned int minCount = 0);
+
     /// Cleaning up resources
     void cleanup();
 
     /// Check if compute shader is available
     bool isReady() const { return computeShaderProgram != 0; }
 
+    ///////////////////////////////////////////////////////////////////////////////
+    // asynchronous counter readback
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static const unsigned int counterReadbackRingSize = 3;
+
+    /// Copies the counters into the next slot of a persistently mapped readback ring and fences the
+    /// copy. Returns the request id (never 0), or 0 if every slot is still in flight.
+    unsigned int requestCounterReadback();
+
+    /// Fetches the newest counters whose copy has completed, without blocking. Returns the id of the
+    /// request they belong to, or 0 if nothing new has arrived. Typically the data is one or two
+    /// frames old.
+    unsigned int pollCounterReadback(ParticleCounters& counters);
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // depth sort
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /// Bitonic sort of the first `range` particle slots by depth in `viewMatrix`, farthest first.
+    /// The depths are taken at the drawn positions, `renderLag` seconds behind the last step.
+    /// A sort takes O(log^2 n) dispatches, at most `maxSteps` of them run per call and the rest are
+    /// picked up by the next calls, which keep sorting the depths captured when the sort began.
+    /// 0 runs a fresh sort to completion. Once a sort completes, its order is the one returned by
+    /// getSortedIndexBuffer() until the next one completes.
+    void sortParticlesByDepth(const glm::mat4& viewMatrix, float renderLag, unsigned int range, unsigned int maxSteps = 0);
+
+    /// Completed draw order, uvec2(key, slot) per entry, the first getSortedCount() entries are valid
+    GLuint getSortedIndexBuffer() const { return sortBuffers[1]; }
+
+    /// Slots covered by the completed draw order, 0 if there is none
+    unsigned int getSortedCount() const { return sortedCount; }
+
+    /// Dispatches one sort takes for the given range
+    unsigned int getSortStepCount(unsigned int range) const;
+
+    /// Drops the completed order and any sort in progress. Compaction moves particles between slots,
+    /// so it calls this.
+    void resetSort();
+
     ///////////////////////////////////////////////////////////////////////////////
     // physics system
     ///////////////////////////////////////////////////////////////////////////////
@@ -71,6 +207,36 @@ public:
 
     const PhysicsParametersGPU& getPhysicsParameters() const { return physicsParams; }
 
+    /// Integrator and adaptive sub-stepping of the physics passes
+    void setIntegratorSettings(const IntegratorSettingsGPU& settings) { integratorSettings = settings; }
+
+    const IntegratorSettingsGPU& getIntegratorSettings() const { return integratorSettings; }
+
+    /// Box collision at the end of the physics passes, off until a boundary is set
+    void setBoundary(const BoundaryParametersGPU& boundary) { boundaryParams = boundary; }
+
+    const BoundaryParametersGPU& getBoundary() const { return boundaryParams; }
+
+    /// Scene collision of the physics passes, before the box. `texture` holds the distances, see
+    /// SdfCollider::createTexture(); the collision stays off while it is 0.
+    void setSdfCollider(const SdfColliderGPU& collider, GLuint texture)
+    {
+        sdfParams = collider;
+        sdfTexture = texture;
+    }
+
+    const SdfColliderGPU& getSdfCollider() const { return sdfParams; }
+
+    /// Ground collision of the physics passes, after the scene collider. `texture` holds the
+    /// heights as floats; the collision stays off while it is 0.
+    void setTerrain(const TerrainGPU& ground, GLuint texture)
+    {
+        terrainParams = ground;
+        terrainTexture = texture;
+    }
+
+    const TerrainGPU& getTerrain() const { return terrainParams; }
+
 
     ///////////////////////////////////////////////////////////////////////////////
     // flow field
@@ -87,15 +253,117 @@ public:
 private:
 
     GLuint computeShaderProgram;
+    GLuint compactShaderProgram;
+    GLuint emitShaderProgram;
+    GLuint drawArgsShaderProgram = 0;
+    GLuint sortShaderProgram = 0;
 
     GLuint particleSSBO;    // Particle Data Buffer
+    GLuint particleBackSSBO; // Compaction target, swapped with particleSSBO after each compaction
     GLuint counterSSBO;     // Counter buffer
+    GLuint groupSumSSBO;    // Per-workgroup alive counts and offsets for the compaction scan
+    GLuint deadListSSBO;    // Stack of free particle slots, its size is the dead counter
+    GLuint drawCommandBuffer = 0; // DrawArraysIndirectCommand, written by particle_draw_args.comp
+
+    static const unsigned int compactGroupSize = 256; // GROUP_SIZE in particle_compact.comp
+
+    // Uniforms of particle_compact.comp, looked up once after linking
+    struct CompactUniformLocations
+    {
+        GLint count = -1;
+        GLint groupCount = -1;
+        GLint pass = -1;
+    };
+    CompactUniformLocations compactUniforms;
+
+    // Uniforms of particle_emit.comp, looked up once after linking
+    struct EmitUniformLocations
+    {
+        GLint emitCount = -1;
+        GLint maxParticles = -1;
+        GLint seed = -1;
+        GLint discCenter = -1;
+        GLint discRadius = -1;
+        GLint boundsMin = -1;
+        GLint boundsMax = -1;
+        GLint coneHalfAngle = -1;
+        GLint baseSpeed = -1;
+        GLint speedVariation = -1;
+        GLint lifeLength = -1;
+    };
+    EmitUniformLocations emitUniforms;
+
+    // Uniforms of particle_draw_args.comp, looked up once after linking
+    struct DrawArgsUniformLocations
+    {
+        GLint maxParticles = -1;
+        GLint minCount = -1;
+    };
+    DrawArgsUniformLocations drawArgsUniforms;
+
+    // Counter readback ring. Without ARB_buffer_storage the counters are read synchronously into
+    // syncReadbackCounters instead.
+    struct CounterReadbackSlot
+    {
+        GLsync fence = nullptr;
+        unsigned int requestId = 0;
+    };
+    GLuint counterReadbackBuffer = 0;
+    const ParticleCounters* mappedCounterReadback = nullptr;
+    CounterReadbackSlot counterReadbackSlots[counterReadbackRingSize];
+    unsigned int nextReadbackRequest = 1;
+    ParticleCounters syncReadbackCounters = {};
+    unsigned int syncReadbackRequest = 0;
 
     unsigned int maxParticles;
     bool initialized;
 
+    // Depth sort. sortBuffers[0] is being sorted, sortBuffers[1] holds the last completed order.
+    // Both hold the padded size, a power of two no smaller than sortBlockSize.
+    struct SortStep
+    {
+        int pass;
+        unsigned int k;
+        unsigned int j;
+    };
+    static const unsigned int sortGroupSize = 256;  // GROUP_SIZE in particle_sort.comp
+    static const unsigned int sortBlockSize = 512;  // BLOCK_SIZE in particle_sort.comp
+    GLuint sortBuffers[2] = { 0, 0 };
+    unsigned int sortCapacity = 0;
+    std::vector<SortStep> sortSteps;   // Remaining dispatches of the sort in progress
+    size_t nextSortStep = 0;
+    unsigned int sortRange = 0;        // Range of the sort in progress
+    unsigned int sortedCount = 0;
+    struct SortUniformLocations
+    {
+        GLint pass = -1;
+        GLint range = -1;
+        GLint k = -1;
+        GLint j = -1;
+        GLint view = -1;
+        GLint renderLag = -1;
+    };
+    SortUniformLocations sortUniforms;
+
+    /// Padded size of a sort over `range` slots
+    unsigned int sortSizeFor(unsigned int range) const;
+
+    // Uniform buffer behind PhysicsBlock, rewritten only when its contents change
+    GLuint physicsUBO = 0;
+    PhysicsBlockGPU physicsBlock;
+    bool physicsBlockDirty = true;
+
+    /// Refreshes the physics block and binds the buffers read by particle_update.comp
+    void bindPhysicsBlock(float deltaTime, const PhysicsParametersGPU& physics, FlowFieldGPU* flowField);
+
     float flowInfluence;
     PhysicsParametersGPU physicsParams;
+    IntegratorSettingsGPU integratorSettings;
+    BoundaryParametersGPU boundaryParams;
+    SdfColliderGPU sdfParams;
+    GLuint sdfTexture = 0;
+    TerrainGPU terrainParams;
+    GLuint terrainTexture = 0;
 
     GLuint compileComputeShader(const std::string& source);
 
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/// Orders particles back to front by view-space depth.
+///
+/// The depths are flipped to order-preserving uint32 keys and sorted with an LSD radix sort
+/// (three 11-bit digits), so the cost is linear in the particle count. When the caller knows the
+/// input is already close to sorted (for example because the particles were stored in last frame's
+/// draw order and the camera barely moved) it can ask for a coherent sort, which first tries an
+/// insertion-sort repair and only falls back to the radix sort when that gets too expensive.
+class DepthSorter
+{
+public:
+	/// Sorts `count` depths ascending (most negative view-space z, i.e. farthest, first) and
+	/// returns the permutation: element i is the index of the i-th particle to draw. The pointer
+	/// stays valid until the next call.
+	const uint32_t* sort(const float* depth, uint32_t count, bool coherent = false);
+
+	/// True if the last coherent sort was handled by the insertion-sort repair
+	bool lastSortWasRepair() const { return repaired; }
+
+private:
+	/// Insertion sort of the identity order, gives up once more than `budget` elements were shifted
+	bool insertionRepair(uint32_t count, uint64_t budget);
+
+	void radixSort(uint32_t count);
+
+	std::vector<uint32_t> keys;
+	std::vector<uint32_t> indices;
+	std::vector<uint32_t> keysTemp;
+	std::vector<uint32_t> indicesTemp;
+	std::vector<uint32_t> histograms;
+	bool repaired = false;
+};
@@ -1,4 +1,6 @@
 #include "FlowField.h"
+#include "JobPool.h"
+#include "Noise.h"
 #include <cmath>
 #include <algorithm>
 
@@ -42,6 +44,28 @@ glm::vec3 GridFlowField::getVelocity(int x, int y, int z) const
     return glm::vec3(0.0f);
 }
 
+namespace
+{
+/// The getVelocityAt() steps after the switch for a batch of points: `flow(position)` scaled by
+/// `strength` inside the bounds, zero outside
+template <typename Flow>
+void evaluatePoints(const Flow& flow, const glm::vec3& boundsMin, const glm::vec3& boundsMax, float strength,
+    const float* const position[3], float* const velocity[3], int count)
+{
+    for (int i = 0; i < count; ++i) 
+    {
+        const glm::vec3 p(position[0][i], position[1][i], position[2][i]);
+        const bool inBounds = p.x >= boundsMin.x && p.x <= boundsMax.x &&
+            p.y >= boundsMin.y && p.y <= boundsMax.y &&
+            p.z >= boundsMin.z && p.z <= boundsMax.z;
+        const glm::vec3 v = inBounds ? flow(p) * strength : glm::vec3(0.0f);
+        velocity[0][i] = v.x;
+        velocity[1][i] = v.y;
+        velocity[2][i] = v.z;
+    }
+}
+} // namespace
+
 ///////////////////////////////////////////////////////////////////////
 // Calculate different flowFields 
 ///////////////////////////////////////////////////////////////////////
@@ -56,7 +80,7 @@ void FlowField::initialize(const glm::vec3& bounds_min, const glm::vec3& bounds_
     boundsMax = bounds_max;
 
     // Creating Grid
-    gridField = std::make_unique<GridFlowField>(grid_resolution, bounds_min, bounds_max);
+    gridField = std::unique_ptr<GridFlowField>(new GridFlowField(grid_resolution, bounds_min, bounds_max));
 
     // Initialize to updraft
     generateGridFromSimpleFlow(FlowFieldType::UPWARD_FLOW, 0.0f);
@@ -85,6 +109,9 @@ glm::vec3 FlowField::getVelocityAt(const glm::vec3& position, float time) const
     case FlowFieldType::TURBULENT:
         velocity = calculateTurbulentFlow(position, time);
         break;
+    case FlowFieldType::CURL_NOISE:
+        velocity = calculateCurlNoiseFlow(position, time);
+        break;
     case FlowFieldType::CUSTOM_GRID:
         velocity = getGridVelocity(position);
         break;
@@ -93,6 +120,60 @@ glm::vec3 FlowField::getVelocityAt(const glm::vec3& position, float time) const
     return velocity * globalStrength;
 }
 
+void FlowField::getVelocitiesAt(const float* x, const float* y, const float* z, float time, float* vx, float* vy,
+    float* vz, int count) const
+{
+    if (currentType == FlowFieldType::CUSTOM_GRID) 
+    {
+        sampleGridBatch(x, y, z, vx, vy, vz, count);
+        return;
+    }
+
+    // The analytic fields take the per-point functions of getVelocityAt(), with the switch out of
+    // the loop. The wind is the same everywhere, it is only computed once.
+    const float* position[3] = { x, y, z };
+    float* velocity[3] = { vx, vy, vz };
+    switch (currentType) 
+    {
+    case FlowFieldType::UNIFORM_WIND:
+    {
+        const glm::vec3 wind = calculateUniformWind(glm::vec3(0.0f), time);
+        evaluatePoints([&](const glm::vec3&) { return wind; }, boundsMin, boundsMax, globalStrength, position, velocity, count);
+        break;
+    }
+    case FlowFieldType::VORTEX:
+    {
+        // calculateVortexFlow() with the per-call terms hoisted, like evaluateRow()
+        const glm::vec3 axis = normalize(flowParams.vortex_axis);
+        const float timeVariation = 1.0f + 0.2f * sin(time * flowParams.time_scale * 2.0f);
+        evaluatePoints([&](const glm::vec3& p) {
+            const glm::vec3 toParticle = p - flowParams.vortex_center;
+            const glm::vec3 offAxis = toParticle - dot(toParticle, axis) * axis;
+            const float axisDistance = length(offAxis);
+            if (axisDistance < 0.01f) 
+            {
+                return glm::vec3(0.0f);
+            }
+            const glm::vec3 tangential = cross(axis, normalize(offAxis));
+            const float strength = flowParams.vortex_strength / (1.0f + axisDistance * 0.1f);
+            return tangential * strength * timeVariation;
+        }, boundsMin, boundsMax, globalStrength, position, velocity, count);
+        break;
+    }
+    case FlowFieldType::UPWARD_FLOW:
+        evaluatePoints([&](const glm::vec3& p) { return calculateUpwardFlow(p, time); }, boundsMin, boundsMax, globalStrength, position, velocity, count);
+        break;
+    case FlowFieldType::TURBULENT:
+        evaluatePoints([&](const glm::vec3& p) { return calculateTurbulentFlow(p, time); }, boundsMin, boundsMax, globalStrength, position, velocity, count);
+        break;
+    case FlowFieldType::CURL_NOISE:
+        evaluatePoints([&](const glm::vec3& p) { return calculateCurlNoiseFlow(p, time); }, boundsMin, boundsMax, globalStrength, position, velocity, count);
+        break;
+    case FlowFieldType::CUSTOM_GRID:
+        break;
+    }
+}
+
 glm::vec3 FlowField::calculateUniformWind(const glm::vec3& position, float time) const
 {
     glm::vec3 wind = flowParams.wind_direction * flowParams.wind_strength;
@@ -145,7 +226,7 @@ glm::vec3 FlowField::calculateUpwardFlow(const glm::vec3& position, float time)
 
     glm::vec3 disturbance = glm::vec3(xNoise, 0.0f, zNoise) * 0.5f;
 
-    return (upward * heightMultiplier + disturbance) * (1.0f + 0.1f * sin(time * flowParams.time_scale));
+    return (upward * heightMultiplier + disturbance) * (1.0f + 0.1f * std::sin(time * flowParams.time_scale));
 }
 
 glm::vec3 FlowField::calculateTurbulentFlow(const glm::vec3& position, float time) const
@@ -171,6 +252,14 @@ glm::vec3 FlowField::calculateTurbulentFlow(const glm::vec3& position, float tim
     return turbulence;
 }
 
+glm::vec3 FlowField::calculateCurlNoiseFlow(const glm::vec3& position, float time) const
+{
+    // Shifting the potential over time animates the field, flow_field_curl.comp does the same
+    glm::vec3 samplePos = position * flowParams.curl_scale + glm::vec3(time * flowParams.time_scale * 0.1f);
+
+    return noise::curl3(samplePos) * flowParams.curl_strength + glm::vec3(0.0f, flowParams.curl_updraft, 0.0f);
+}
+
 
 ///////////////////////////////////////////////////////////////////////
 // Calculate flowFields velocity
@@ -225,108 +314,276 @@ glm::vec3 FlowField::trilinearInterpolate(const glm::vec3& position) const
     return mix(v0, v1, weight.z);
 }
 
-void FlowField::updateGridFlowField(float time)
+void FlowField::sampleGridBatch(const float* x, const float* y, const float* z, float* vx, float* vy, float* vz,
+    int count) const
 {
-    if (!gridField) return;
+    if (!gridField) 
+    {
+        std::fill(vx, vx + count, 0.0f);
+        std::fill(vy, vy + count, 0.0f);
+        std::fill(vz, vz + count, 0.0f);
+        return;
+    }
 
-    // ʹõǰ͸
-    for (int z = 0; z < gridField->resolution.z; ++z) 
+    const GridFlowField& grid = *gridField;
+    const glm::ivec3 last = grid.resolution - 1;
+    const glm::vec3* velocities = grid.velocities.data();
+    const int strideY = grid.resolution.x;
+    const int strideZ = grid.resolution.x * grid.resolution.y;
+
+    // The steps of trilinearInterpolate() in the same order, one axis at a time. The grid spans
+    // the bounds, so the corners of a point in bounds are always valid. Points out of bounds are
+    // computed through clamped indices like the rest and zeroed at the end, every lane runs the
+    // same instructions.
+    auto axis = [](float position, float boundsMin, float cellSize, int lastNode, int& index0, int& index1, float& weight) {
+        const float gridPos = (position - boundsMin) / cellSize;
+        // floor() without the library call, truncation rounds negative values up
+        const int truncated = int(gridPos);
+        const int node = truncated - (gridPos < float(truncated) ? 1 : 0);
+        index0 = std::max(node, 0);
+        index1 = std::min(node + 1, lastNode);
+        weight = glm::clamp(gridPos - float(index0), 0.0f, 1.0f);
+        index0 = std::min(index0, lastNode);
+        index1 = std::max(index1, 0);
+    };
+    auto samplePoint = [&](float px, float py, float pz, float& ox, float& oy, float& oz) {
+        int x0, x1, y0, y1, z0, z1;
+        float wx, wy, wz;
+        axis(px, grid.bounds_min.x, grid.cell_size.x, last.x, x0, x1, wx);
+        axis(py, grid.bounds_min.y, grid.cell_size.y, last.y, y0, y1, wy);
+        axis(pz, grid.bounds_min.z, grid.cell_size.z, last.z, z0, z1, wz);
+
+        const glm::vec3* row00 = velocities + y0 * strideY + z0 * strideZ;
+        const glm::vec3* row10 = velocities + y1 * strideY + z0 * strideZ;
+        const glm::vec3* row01 = velocities + y0 * strideY + z1 * strideZ;
+        const glm::vec3* row11 = velocities + y1 * strideY + z1 * strideZ;
+        const glm::vec3 v00 = glm::mix(row00[x0], row00[x1], wx);
+        const glm::vec3 v10 = glm::mix(row10[x0], row10[x1], wx);
+        const glm::vec3 v01 = glm::mix(row01[x0], row01[x1], wx);
+        const glm::vec3 v11 = glm::mix(row11[x0], row11[x1], wx);
+        const glm::vec3 v0 = glm::mix(v00, v10, wy);
+        const glm::vec3 v1 = glm::mix(v01, v11, wy);
+
+        const glm::vec3 result = isInBounds(glm::vec3(px, py, pz)) ? glm::mix(v0, v1, wz) * globalStrength : glm::vec3(0.0f);
+        ox = result.x;
+        oy = result.y;
+        oz = result.z;
+    };
+
+    int start = 0;
+    for (; start + noise::batchWidth <= count; start += noise::batchWidth) 
     {
-        for (int y = 0; y < gridField->resolution.y; ++y) 
+        float bx[noise::batchWidth], by[noise::batchWidth], bz[noise::batchWidth];
+        for (int lane = 0; lane < noise::batchWidth; ++lane) 
         {
-            for (int x = 0; x < gridField->resolution.x; ++x) 
-            {
-                // Calculate the world coordinates of the grid points
-                glm::vec3 worldPos = gridField->bounds_min +
-                    glm::vec3(x, y, z) * gridField->cell_size;
-
-                // Calculate the flow velocity at this point
-                FlowFieldType originalType = currentType;
-                currentType = FlowFieldType::UPWARD_FLOW;
-                glm::vec3 velocity = getVelocityAt(worldPos, time);
-                currentType = originalType;
-
-                gridField->setVelocity(x, y, z, velocity);
-            }
+            samplePoint(x[start + lane], y[start + lane], z[start + lane], bx[lane], by[lane], bz[lane]);
         }
+        std::copy(bx, bx + noise::batchWidth, vx + start);
+        std::copy(by, by + noise::batchWidth, vy + start);
+        std::copy(bz, bz + noise::batchWidth, vz + start);
+    }
+    for (; start < count; ++start) 
+    {
+        samplePoint(x[start], y[start], z[start], vx[start], vy[start], vz[start]);
     }
 }
 
+void FlowField::updateGridFlowField(float time)
+{
+    // Sampled like getVelocityAt() would with an updraft
+    fillGrid(FlowFieldType::UPWARD_FLOW, time, true);
+}
+
 void FlowField::generateGridFromSimpleFlow(FlowFieldType sourceType, float time)
 {
-    if (!gridField) return;
+    fillGrid(sourceType, time, false);
+}
 
-    FlowFieldType originalType = currentType;
-    currentType = sourceType;
+void FlowField::fillGrid(FlowFieldType type, float time, bool sampled)
+{
+    if (!gridField) return;
 
-    for (int z = 0; z < gridField->resolution.z; ++z) {
-        for (int y = 0; y < gridField->resolution.y; ++y) {
-            for (int x = 0; x < gridField->resolution.x; ++x) {
-                glm::vec3 worldPos = gridField->bounds_min +
-                    glm::vec3(x, y, z) * gridField->cell_size;
+    // The grid has no analytic source of its own, it would only be resampled into itself
+    if (type == FlowFieldType::CUSTOM_GRID) 
+    {
+        std::fill(gridField->velocities.begin(), gridField->velocities.end(), glm::vec3(0.0f));
+        return;
+    }
 
-                glm::vec3 velocity(0.0f);
-                switch (sourceType) 
+    // One z-slab per job, every row of a slab is written by the job that owns it
+    const GridFlowField& grid = *gridField;
+    glm::vec3* velocities = gridField->velocities.data();
+    labhelper::parallelFor(jobPool, grid.resolution.z, 1, [&](int begin, int end) {
+        RowScratch scratch(grid.resolution.x);
+        for (int z = begin; z < end; ++z) 
+        {
+            for (int y = 0; y < grid.resolution.y; ++y) 
+            {
+                glm::vec3* row = velocities + grid.getIndex(0, y, z);
+                evaluateRow(type, y, z, time, scratch, row);
+                if (sampled) 
                 {
-                case FlowFieldType::UNIFORM_WIND:
-                    velocity = calculateUniformWind(worldPos, time);
-                    break;
-                case FlowFieldType::VORTEX:
-                    velocity = calculateVortexFlow(worldPos, time);
-                    break;
-                case FlowFieldType::UPWARD_FLOW:
-                    velocity = calculateUpwardFlow(worldPos, time);
-                    break;
-                case FlowFieldType::TURBULENT:
-                    velocity = calculateTurbulentFlow(worldPos, time);
-                    break;
-                default:
-                    velocity = glm::vec3(0.0f);
-                    break;
+                    for (int x = 0; x < grid.resolution.x; ++x) 
+                    {
+                        const glm::vec3 worldPos = grid.bounds_min + glm::vec3(x, y, z) * grid.cell_size;
+                        row[x] = isInBounds(worldPos) ? row[x] * globalStrength : glm::vec3(0.0f);
+                    }
                 }
-
-                gridField->setVelocity(x, y, z, velocity);
             }
         }
-    }
-
-    currentType = originalType;
+    });
 }
 
-float FlowField::noise3D(const glm::vec3& p) const
+FlowField::RowScratch::RowScratch(int length)
+    : px(length), py(length), pz(length), sx(length), sy(length), sz(length),
+    values(length), shifted(length), cx(length), cy(length), cz(length)
 {
-    // Simple pseudo-random noise function
-    glm::vec3 i = floor(p);
-    glm::vec3 f = p - i;
+}
 
-    f = f * f * (3.0f - 2.0f * f);
+void FlowField::evaluateRow(FlowFieldType type, int y, int z, float time, RowScratch& scratch, glm::vec3* row) const
+{
+    const GridFlowField& grid = *gridField;
+    const int n = grid.resolution.x;
+    float* px = scratch.px.data();
+    float* py = scratch.py.data();
+    float* pz = scratch.pz.data();
+    float* sx = scratch.sx.data();
+    float* sy = scratch.sy.data();
+    float* sz = scratch.sz.data();
+    float* values = scratch.values.data();
+    float* shifted = scratch.shifted.data();
+
+    // Node positions, y and z are the same along the row
+    const float worldY = grid.bounds_min.y + float(y) * grid.cell_size.y;
+    const float worldZ = grid.bounds_min.z + float(z) * grid.cell_size.z;
+    for (int x = 0; x < n; ++x) 
+    {
+        px[x] = grid.bounds_min.x + float(x) * grid.cell_size.x;
+        py[x] = worldY;
+        pz[x] = worldZ;
+    }
 
-    // Hash Functions
-    auto hash = [](float n) -> float 
+    switch (type) 
+    {
+    case FlowFieldType::UNIFORM_WIND:
+    {
+        const glm::vec3 wind = calculateUniformWind(glm::vec3(0.0f), time);
+        std::fill(row, row + n, wind);
+        break;
+    }
+    case FlowFieldType::VORTEX:
+    {
+        // calculateVortexFlow() with the per-call terms hoisted out of the row
+        const glm::vec3 axis = normalize(flowParams.vortex_axis);
+        const float timeVariation = 1.0f + 0.2f * sin(time * flowParams.time_scale * 2.0f);
+        for (int x = 0; x < n; ++x) 
         {
-        return sin(n) * 43758.5453f - floor(sin(n) * 43758.5453f);
-        };
-
-    float n = i.x + i.y * 57.0f + i.z * 113.0f;
-
-    float a = hash(n);
-    float b = hash(n + 1.0f);
-    float c = hash(n + 57.0f);
-    float d = hash(n + 58.0f);
-    float e = hash(n + 113.0f);
-    float f_val = hash(n + 114.0f);
-    float g = hash(n + 170.0f);
-    float h = hash(n + 171.0f);
+            const glm::vec3 toParticle = glm::vec3(px[x], worldY, worldZ) - flowParams.vortex_center;
+            const glm::vec3 offAxis = toParticle - dot(toParticle, axis) * axis;
+            const float axisDistance = length(offAxis);
+            if (axisDistance < 0.01f) 
+            {
+                row[x] = glm::vec3(0.0f);
+                continue;
+            }
+            const glm::vec3 tangential = cross(axis, normalize(offAxis));
+            const float strength = flowParams.vortex_strength / (1.0f + axisDistance * 0.1f);
+            row[x] = tangential * strength * timeVariation;
+        }
+        break;
+    }
+    case FlowFieldType::UPWARD_FLOW:
+    {
+        // Same terms as calculateUpwardFlow(), the height factor only changes between rows
+        float heightFactor = (worldY - boundsMin.y) / (boundsMax.y - boundsMin.y);
+        heightFactor = glm::clamp(heightFactor, 0.0f, 1.0f);
+        const glm::vec3 upward = glm::vec3(0.0f, flowParams.upward_strength, 0.0f) * (1.0f - heightFactor * 0.5f);
+        const float timeVariation = 1.0f + 0.1f * std::sin(time * flowParams.time_scale);
 
-    float k0 = glm::mix(a, b, f.x);
-    float k1 = glm::mix(c, d, f.x);
-    float k2 = glm::mix(e, f_val, f.x);
-    float k3 = glm::mix(g, h, f.x);
+        for (int x = 0; x < n; ++x) 
+        {
+            sx[x] = px[x] * 0.05f + time * 0.5f;
+            sy[x] = py[x] * 0.05f + 0.0f;
+            sz[x] = pz[x] * 0.05f + 0.0f;
+        }
+        noise::simplex3Batch(sx, sy, sz, values, n);
+        for (int x = 0; x < n; ++x) 
+        {
+            sx[x] = px[x] * 0.05f + 0.0f;
+            sy[x] = py[x] * 0.05f + time * 0.5f;
+        }
+        noise::simplex3Batch(sx, sy, sz, shifted, n);
+        for (int x = 0; x < n; ++x) 
+        {
+            const glm::vec3 disturbance = glm::vec3(values[x], 0.0f, shifted[x]) * 0.5f;
+            row[x] = (upward + disturbance) * timeVariation;
+        }
+        break;
+    }
+    case FlowFieldType::TURBULENT:
+    {
+        std::fill(row, row + n, glm::vec3(0.0f));
+        for (int i = 0; i < 3; ++i) 
+        {
+            const float currentScale = flowParams.turbulence_scale * pow(2.0f, i);
+            const float currentStrength = flowParams.turbulence_strength / pow(2.0f, i);
+            const float offset = time * flowParams.time_scale;
+            for (int x = 0; x < n; ++x) 
+            {
+                sx[x] = px[x] * currentScale + offset;
+                sy[x] = py[x] * currentScale + offset;
+                sz[x] = pz[x] * currentScale + offset;
+            }
 
-    float k4 = glm::mix(k0, k1, f.y);
-    float k5 = glm::mix(k2, k3, f.y);
+            noise::simplex3Batch(sx, sy, sz, values, n);
+            for (int x = 0; x < n; ++x) 
+            {
+                row[x].x += values[x] * currentStrength;
+                shifted[x] = sx[x] + 100.0f;
+            }
+            noise::simplex3Batch(shifted, sy, sz, values, n);
+            for (int x = 0; x < n; ++x) 
+            {
+                row[x].y += values[x] * currentStrength;
+                shifted[x] = sy[x] + 100.0f;
+            }
+            noise::simplex3Batch(sx, shifted, sz, values, n);
+            for (int x = 0; x < n; ++x) 
+            {
+                row[x].z += values[x] * currentStrength;
+            }
+        }
+        break;
+    }
+    case FlowFieldType::CURL_NOISE:
+    {
+        const float offset = time * flowParams.time_scale * 0.1f;
+        for (int x = 0; x < n; ++x) 
+        {
+            sx[x] = px[x] * flowParams.curl_scale + offset;
+            sy[x] = py[x] * flowParams.curl_scale + offset;
+            sz[x] = pz[x] * flowParams.curl_scale + offset;
+        }
+        float* cx = scratch.cx.data();
+        float* cy = scratch.cy.data();
+        float* cz = scratch.cz.data();
+        noise::curl3Batch(sx, sy, sz, cx, cy, cz, n);
+        const glm::vec3 updraft(0.0f, flowParams.curl_updraft, 0.0f);
+        for (int x = 0; x < n; ++x) 
+        {
+            row[x] = glm::vec3(cx[x], cy[x], cz[x]) * flowParams.curl_strength + updraft;
+        }
+        break;
+    }
+    default:
+        std::fill(row, row + n, glm::vec3(0.0f));
+        break;
+    }
+}
 
-    return glm::mix(k4, k5, f.z) * 2.0f - 1.0f; // Normalized to[-1,1]
+float FlowField::noise3D(const glm::vec3& p) const
+{
+    return noise::simplex3(p);
 }
 
 glm::vec3 FlowField::worldToGrid(const glm::vec3& worldPos) const
@@ -4,12 +4,18 @@
 #include <vector>
 #include <memory>
 
+namespace labhelper
+{
+class JobPool;
+}
+
 enum class FlowFieldType
 {
     UNIFORM_WIND,
     VORTEX,  
     UPWARD_FLOW,
     TURBULENT, 
+    CURL_NOISE,  // Divergence-free, the curl of a noise potential
     CUSTOM_GRID
 };
 
@@ -27,6 +33,10 @@ struct FlowFieldParameters
     float turbulence_scale = 0.1f;
     float turbulence_strength = 1.0f;
 
+    float curl_scale = 0.08f;     // Noise frequency of the potential, 1 / feature size
+    float curl_strength = 1.0f;   // Scale of the curl, about 4 units/s on average at 1
+    float curl_updraft = 1.0f;    // Constant upward velocity, keeps the field divergence-free
+
     float time_scale = 1.0f;
 };
 
@@ -67,6 +77,12 @@ public:
     /// Get the flow field velocity at the specified position and time
     glm::vec3 getVelocityAt(const glm::vec3& position, float time) const;
 
+    /// getVelocityAt() of `count` points given as coordinate arrays, the velocity goes to vx, vy
+    /// and vz. The type is resolved once for the whole batch and the grid is sampled in blocks of
+    /// noise::batchWidth points. The results are the same as getVelocityAt() bit for bit.
+    void getVelocitiesAt(const float* x, const float* y, const float* z, float time, float* vx, float* vy,
+        float* vz, int count) const;
+
     /// Set the current flow field type
     void setFlowFieldType(FlowFieldType type) { currentType = type; }
 
@@ -85,12 +101,18 @@ public:
     /// Generate mesh data based on a simple flow field
     void generateGridFromSimpleFlow(FlowFieldType sourceType, float time);
 
+    /// Pool the grid generation splits its z-slabs over, null fills the grid on the calling thread
+    void setJobPool(labhelper::JobPool* pool) { jobPool = pool; }
+
     /// Set the global scaling of flow field intensity
     void setGlobalStrength(float strength) { globalStrength = strength; }
 
     /// Get global flow field strength
     float getGlobalStrength() const { return globalStrength; }
 
+    /// Spacing of the grid nodes, zero before initialize()
+    glm::vec3 getGridCellSize() const { return gridField ? gridField->cell_size : glm::vec3(0.0f); }
+
 private:
     FlowFieldType currentType;
     FlowFieldParameters flowParams;
@@ -98,6 +120,18 @@ private:
 
     // Grid data
     std::unique_ptr<GridFlowField> gridField;
+    labhelper::JobPool* jobPool = nullptr;
+
+    /// Per-job buffers for evaluating one grid row
+    struct RowScratch
+    {
+        explicit RowScratch(int length);
+
+        std::vector<float> px, py, pz;       // Node positions
+        std::vector<float> sx, sy, sz;       // Noise sample positions
+        std::vector<float> values, shifted;  // Noise results
+        std::vector<float> cx, cy, cz;       // Curl noise results
+    };
 
     // Flow field boundary
     glm::vec3 boundsMin;
@@ -115,15 +149,29 @@ private:
     /// Calculate turbulent velocity
     glm::vec3 calculateTurbulentFlow(const glm::vec3& position, float time) const;
 
+    /// Calculate curl noise velocity
+    glm::vec3 calculateCurlNoiseFlow(const glm::vec3& position, float time) const;
+
     /// Get interpolated velocity from a grid
     glm::vec3 getGridVelocity(const glm::vec3& position) const;
 
     /// Trilinear interpolation
     glm::vec3 trilinearInterpolate(const glm::vec3& position) const;
 
-    /// Simple noise function (for turbulence)
+    /// The CUSTOM_GRID case of getVelocitiesAt(), trilinearInterpolate() without branches
+    void sampleGridBatch(const float* x, const float* y, const float* z, float* vx, float* vy, float* vz,
+        int count) const;
+
+    /// Simplex noise in [-1, 1] (for turbulence), noise::simplex3()
     float noise3D(const glm::vec3& p) const;
 
+    /// Fills the grid with the `type` field. `sampled` also applies the bounds test and the global
+    /// strength, like getVelocityAt(). Only reads the flow settings, the type is resolved once.
+    void fillGrid(FlowFieldType type, float time, bool sampled);
+
+    /// Velocities of the grid nodes of the x row at (y, z), stored to `row`
+    void evaluateRow(FlowFieldType type, int y, int z, float time, RowScratch& scratch, glm::vec3* row) const;
+
     /// Convert world coordinates to grid coordinates
     glm::vec3 worldToGrid(const glm::vec3& worldPos) const;
 
@@ -5,8 +5,8 @@
 #include <cmath>
 
 FlowFieldGPU::FlowFieldGPU()
-    : flowFieldTexture3D(0), flowFieldComputeShader(0),
-    initialized(false), flowFieldEnabled(true), lastUpdateTime(0.0f)
+    : flowFieldTexture3D(0), flowFieldComputeShader(0), curlNoiseComputeShader(0),
+    fieldType(FlowFieldType::UNIFORM_WIND), initialized(false), flowFieldEnabled(true), lastUpdateTime(0.0f)
 {
 }
 
@@ -60,6 +60,13 @@ bool FlowFieldGPU::initialize(const glm::ivec3& resolution,
         return false;
     }
 
+    if (!loadCurlNoiseComputeShader("../../TDA362_GPU_Smoke_Particle_System/project_others/flow_field_curl.comp")) 
+    {
+        std::cerr << "Failed to load curl noise compute shader!" << std::endl;
+        cleanup();
+        return false;
+    }
+
     // Set default wind farm parameters
     windParams = UniformWindParameters(glm::vec3(0.0f, 1.0f, 0.0f), 3.0f, 1.0f);
 
@@ -79,7 +86,41 @@ bool FlowFieldGPU::loadFlowFieldComputeShader(const std::string& filepath)
     }
 
     flowFieldComputeShader = compileComputeShader(source);
-    return flowFieldComputeShader != 0;
+    if (flowFieldComputeShader == 0) {
+        return false;
+    }
+
+    windUniforms.windDirection = glGetUniformLocation(flowFieldComputeShader, "u_windDirection");
+    windUniforms.windStrength = glGetUniformLocation(flowFieldComputeShader, "u_windStrength");
+    windUniforms.time = glGetUniformLocation(flowFieldComputeShader, "u_time");
+    windUniforms.timeScale = glGetUniformLocation(flowFieldComputeShader, "u_timeScale");
+    windUniforms.heightVariation = glGetUniformLocation(flowFieldComputeShader, "u_heightVariation");
+    windUniforms.worldMin = glGetUniformLocation(flowFieldComputeShader, "u_worldMin");
+    windUniforms.worldMax = glGetUniformLocation(flowFieldComputeShader, "u_worldMax");
+    return true;
+}
+
+bool FlowFieldGPU::loadCurlNoiseComputeShader(const std::string& filepath)
+{
+    std::string source = readFile(filepath);
+    if (source.empty()) {
+        std::cerr << "Failed to read curl noise compute shader file: " << filepath << std::endl;
+        return false;
+    }
+
+    curlNoiseComputeShader = compileComputeShader(source);
+    if (curlNoiseComputeShader == 0) {
+        return false;
+    }
+
+    curlUniforms.scale = glGetUniformLocation(curlNoiseComputeShader, "u_scale");
+    curlUniforms.strength = glGetUniformLocation(curlNoiseComputeShader, "u_strength");
+    curlUniforms.updraft = glGetUniformLocation(curlNoiseComputeShader, "u_updraft");
+    curlUniforms.time = glGetUniformLocation(curlNoiseComputeShader, "u_time");
+    curlUniforms.timeScale = glGetUniformLocation(curlNoiseComputeShader, "u_timeScale");
+    curlUniforms.worldMin = glGetUniformLocation(curlNoiseComputeShader, "u_worldMin");
+    curlUniforms.worldMax = glGetUniformLocation(curlNoiseComputeShader, "u_worldMax");
+    return true;
 }
 
 void FlowFieldGPU::generateUniformWind(const UniformWindParameters& params, float currentTime)
@@ -97,15 +138,50 @@ void FlowFieldGPU::generateUniformWind(const UniformWindParameters& params, floa
     glBindImageTexture(0, flowFieldTexture3D, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
     // Setting uniform variables
-    glUniform3fv(glGetUniformLocation(flowFieldComputeShader, "u_windDirection"), 1, &windParams.windDirection[0]);
-    glUniform1f(glGetUniformLocation(flowFieldComputeShader, "u_windStrength"), windParams.windStrength);
-    glUniform1f(glGetUniformLocation(flowFieldComputeShader, "u_time"), currentTime);
-    glUniform1f(glGetUniformLocation(flowFieldComputeShader, "u_timeScale"), windParams.timeScale);
-    glUniform1f(glGetUniformLocation(flowFieldComputeShader, "u_heightVariation"), windParams.heightVariation);
+    glUniform3fv(windUniforms.windDirection, 1, &windParams.windDirection[0]);
+    glUniform1f(windUniforms.windStrength, windParams.windStrength);
+    glUniform1f(windUniforms.time, currentTime);
+    glUniform1f(windUniforms.timeScale, windParams.timeScale);
+    glUniform1f(windUniforms.heightVariation, windParams.heightVariation);
+
+    glUniform3fv(windUniforms.worldMin, 1, &bounds.worldMin[0]);
+    glUniform3fv(windUniforms.worldMax, 1, &bounds.worldMax[0]);
+
+    dispatchGenerator();
+
+    checkGLError("generateUniformWind");
+}
+
+void FlowFieldGPU::generateCurlNoise(const CurlNoiseParameters& params, float currentTime)
+{
+    if (!initialized || !flowFieldEnabled) {
+        return;
+    }
+
+    curlParams = params;
+    lastUpdateTime = currentTime;
+
+    glUseProgram(curlNoiseComputeShader);
+
+    // Bind a 3D texture as an image texture
+    glBindImageTexture(0, flowFieldTexture3D, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
-    glUniform3fv(glGetUniformLocation(flowFieldComputeShader, "u_worldMin"), 1, &bounds.worldMin[0]);
-    glUniform3fv(glGetUniformLocation(flowFieldComputeShader, "u_worldMax"), 1, &bounds.worldMax[0]);
+    glUniform1f(curlUniforms.scale, curlParams.scale);
+    glUniform1f(curlUniforms.strength, curlParams.strength);
+    glUniform1f(curlUniforms.updraft, curlParams.updraft);
+    glUniform1f(curlUniforms.time, currentTime);
+    glUniform1f(curlUniforms.timeScale, curlParams.timeScale);
 
+    glUniform3fv(curlUniforms.worldMin, 1, &bounds.worldMin[0]);
+    glUniform3fv(curlUniforms.worldMax, 1, &bounds.worldMax[0]);
+
+    dispatchGenerator();
+
+    checkGLError("generateCurlNoise");
+}
+
+void FlowFieldGPU::dispatchGenerator()
+{
     // Calculating the number of workgroups
     glm::ivec3 workGroups = (bounds.resolution + glm::ivec3(3)) / glm::ivec3(4);
 
@@ -114,8 +190,27 @@ void FlowFieldGPU::generateUniformWind(const UniformWindParameters& params, floa
     glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 
     glUseProgram(0);
+}
 
-    checkGLError("generateUniformWind");
+void FlowFieldGPU::setFieldType(FlowFieldType type)
+{
+    if (type != FlowFieldType::UNIFORM_WIND && type != FlowFieldType::CURL_NOISE) {
+        return;
+    }
+    fieldType = type;
+
+    // Bake the new field right away, updateFlowField() only refreshes it as time passes
+    generate(lastUpdateTime);
+}
+
+void FlowFieldGPU::generate(float currentTime)
+{
+    if (fieldType == FlowFieldType::CURL_NOISE) {
+        generateCurlNoise(curlParams, currentTime);
+    }
+    else {
+        generateUniformWind(windParams, currentTime);
+    }
 }
 
 void FlowFieldGPU::updateFlowField(float currentTime)
@@ -124,7 +219,7 @@ void FlowFieldGPU::updateFlowField(float currentTime)
     if (initialized && flowFieldEnabled &&
         std::abs(currentTime - lastUpdateTime) > 0.016f) 
     { // ~60fps
-        generateUniformWind(windParams, currentTime);
+        generate(currentTime);
     }
 }
 
@@ -149,6 +244,11 @@ void FlowFieldGPU::cleanup()
         flowFieldComputeShader = 0;
     }
 
+    if (curlNoiseComputeShader != 0) {
+        glDeleteProgram(curlNoiseComputeShader);
+        curlNoiseComputeShader = 0;
+    }
+
     initialized = false;
 }
 
@@ -195,8 +295,24 @@ std::string FlowFieldGPU::readFile(const std::string& filepath)
         return "";
     }
 
+    // GLSL has no includes, lines of the form #include "file" are replaced by the file, relative
+    // to the directory of the one being read
+    const std::string directive = "#include \"";
+    const std::string directory = filepath.substr(0, filepath.find_last_of("/\\") + 1);
     std::stringstream buffer;
-    buffer << file.rdbuf();
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, directive.size(), directive) == 0) {
+            const size_t nameEnd = line.find('"', directive.size());
+            const std::string included = readFile(directory + line.substr(directive.size(), nameEnd - directive.size()));
+            if (included.empty()) {
+                return "";
+            }
+            buffer << included << "\n";
+            continue;
+        }
+        buffer << line << "\n";
+    }
     return buffer.str();
 }
 
@@ -3,6 +3,7 @@
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <string>
+#include "FlowField.h"
 
 struct FlowFieldBounds
 {
@@ -33,6 +34,19 @@ struct UniformWindParameters
     }
 };
 
+struct CurlNoiseParameters
+{
+    float scale = 0.08f;    // Noise frequency of the potential, 1 / feature size
+    float strength = 1.0f;  // Scale of the curl, about 4 units/s on average at 1
+    float updraft = 1.0f;   // Constant upward velocity
+    float timeScale = 1.0f;
+
+    CurlNoiseParameters() = default;
+    CurlNoiseParameters(float noise_scale, float curl_strength, float updraft_speed)
+        : scale(noise_scale), strength(curl_strength), updraft(updraft_speed) {
+    }
+};
+
 class FlowFieldGPU
 {
 public:
@@ -47,6 +61,14 @@ public:
     /// Generate UNIFORM_WIND flow field data
     void generateUniformWind(const UniformWindParameters& params, float currentTime);
 
+    /// Generate CURL_NOISE flow field data
+    void generateCurlNoise(const CurlNoiseParameters& params, float currentTime);
+
+    /// Select the generator updateFlowField() runs, UNIFORM_WIND or CURL_NOISE. Other types have
+    /// no GPU generator and are ignored.
+    void setFieldType(FlowFieldType type);
+    FlowFieldType getFieldType() const { return fieldType; }
+
     /// Update flow field
     void updateFlowField(float currentTime);
 
@@ -62,6 +84,10 @@ public:
     /// Get current wind farm parameters
     const UniformWindParameters& getWindParameters() const { return windParams; }
 
+    /// Set curl noise parameters
+    void setCurlNoiseParameters(const CurlNoiseParameters& params) { curlParams = params; }
+    const CurlNoiseParameters& getCurlNoiseParameters() const { return curlParams; }
+
     /// Check if it is initialized
     bool isInitialized() const { return initialized; }
 
@@ -71,12 +97,47 @@ public:
 
     void cleanup();
 
+    /// Compiles and links a compute shader, 0 on failure. Also used by FluidSolverGPU.
+    static GLuint compileComputeShader(const std::string& source);
+
+    /// Reads a shader source, expanding #include "file" lines
+    static std::string readFile(const std::string& filepath);
+
 private:
     GLuint flowFieldTexture3D;
     GLuint flowFieldComputeShader;
+    GLuint curlNoiseComputeShader;
+
+    /// Uniform locations of flow_field_generate.comp, looked up once after linking
+    struct WindUniformLocations
+    {
+        GLint windDirection = -1;
+        GLint windStrength = -1;
+        GLint time = -1;
+        GLint timeScale = -1;
+        GLint heightVariation = -1;
+        GLint worldMin = -1;
+        GLint worldMax = -1;
+    };
+    WindUniformLocations windUniforms;
+
+    /// Uniform locations of flow_field_curl.comp
+    struct CurlUniformLocations
+    {
+        GLint scale = -1;
+        GLint strength = -1;
+        GLint updraft = -1;
+        GLint time = -1;
+        GLint timeScale = -1;
+        GLint worldMin = -1;
+        GLint worldMax = -1;
+    };
+    CurlUniformLocations curlUniforms;
 
     FlowFieldBounds bounds;
     UniformWindParameters windParams;
+    CurlNoiseParameters curlParams;
+    FlowFieldType fieldType;
 
     bool initialized;
     bool flowFieldEnabled;
@@ -85,9 +146,14 @@ private:
     /// Compile the flow field to generate the compute shader
     bool loadFlowFieldComputeShader(const std::string& filepath);
 
-    GLuint compileComputeShader(const std::string& source);
+    /// Compile the curl noise compute shader
+    bool loadCurlNoiseComputeShader(const std::string& filepath);
+
+    /// Runs the generator of the current field type
+    void generate(float currentTime);
 
-    std::string readFile(const std::string& filepath);
+    /// Runs a generator bound with its uniforms over the whole texture
+    void dispatchGenerator();
 
     void checkGLError(const std::string& operation);
 };
\ No newline at end of file
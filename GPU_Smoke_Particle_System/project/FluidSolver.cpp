@@ -0,0 +1,252 @@
+#include "FluidSolver.h"
+#include "JobPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace
+{
+typedef std::chrono::steady_clock Clock;
+
+float millisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
+
+int clampIndex(int i, int n)
+{
+    return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+/// Pressure at a node or just outside the grid. Mirrored at the walls and the floor. The pressure
+/// is zero at the open ceiling half a cell above the top nodes, so it is mirrored with the opposite
+/// sign there; that puts the ceiling in the same place on every level of MultigridSolver.
+float pressureAt(const std::vector<float>& pressure, const GridFlowField& grid, int i, int j, int k)
+{
+    const glm::ivec3 n = grid.resolution;
+    const float p = pressure[grid.getIndex(clampIndex(i, n.x), clampIndex(j, n.y), clampIndex(k, n.z))];
+    return j >= n.y ? -p : p;
+}
+
+/// Trilinear sample of node data at grid coordinate `g`, clamped to the grid like a
+/// GL_CLAMP_TO_EDGE texture fetch with linear filtering
+template <typename T>
+T sampleTrilinear(const std::vector<T>& data, const GridFlowField& grid, glm::vec3 g)
+{
+    const glm::ivec3 n = grid.resolution;
+    g = glm::clamp(g, glm::vec3(0.0f), glm::vec3(n - 1));
+    const glm::ivec3 i0 = glm::min(glm::ivec3(g), glm::max(n - 2, glm::ivec3(0)));
+    const glm::ivec3 i1 = glm::min(i0 + 1, n - 1);
+    const glm::vec3 t = g - glm::vec3(i0);
+
+    const T c00 = glm::mix(data[grid.getIndex(i0.x, i0.y, i0.z)], data[grid.getIndex(i1.x, i0.y, i0.z)], t.x);
+    const T c10 = glm::mix(data[grid.getIndex(i0.x, i1.y, i0.z)], data[grid.getIndex(i1.x, i1.y, i0.z)], t.x);
+    const T c01 = glm::mix(data[grid.getIndex(i0.x, i0.y, i1.z)], data[grid.getIndex(i1.x, i0.y, i1.z)], t.x);
+    const T c11 = glm::mix(data[grid.getIndex(i0.x, i1.y, i1.z)], data[grid.getIndex(i1.x, i1.y, i1.z)], t.x);
+    const T c0 = glm::mix(c00, c10, t.y);
+    const T c1 = glm::mix(c01, c11, t.y);
+    return glm::mix(c0, c1, t.z);
+}
+} // namespace
+
+void FluidSolver::initialize(GridFlowField* gridField)
+{
+    grid = gridField;
+    multigrid.initialize(grid->resolution, grid->cell_size);
+    pressureResiduals.clear();
+    const size_t count = grid->velocities.size();
+    density.assign(count, 0.0f);
+    pressure.assign(count, 0.0f);
+    divergence.assign(count, 0.0f);
+    vorticity.assign(count, glm::vec4(0.0f));
+    velocityTemp.assign(count, glm::vec3(0.0f));
+    densityTemp.assign(count, 0.0f);
+    pressureTemp.assign(count, 0.0f);
+}
+
+void FluidSolver::reset()
+{
+    if (!grid) return;
+
+    std::fill(grid->velocities.begin(), grid->velocities.end(), glm::vec3(0.0f));
+    std::fill(density.begin(), density.end(), 0.0f);
+    std::fill(pressure.begin(), pressure.end(), 0.0f);
+}
+
+template <typename Body>
+void FluidSolver::forEachNode(const Body& body)
+{
+    const glm::ivec3 n = grid->resolution;
+    labhelper::parallelFor(jobPool, n.z, 1, [&](int begin, int end) {
+        for (int z = begin; z < end; ++z)
+        {
+            for (int y = 0; y < n.y; ++y)
+            {
+                int index = grid->getIndex(0, y, z);
+                for (int x = 0; x < n.x; ++x, ++index)
+                {
+                    body(x, y, z, index);
+                }
+            }
+        }
+    });
+}
+
+void FluidSolver::step(float deltaTime)
+{
+    if (!grid || deltaTime <= 0.0f) return;
+
+    Clock::time_point start = Clock::now();
+    applyForces(deltaTime);
+    timings.forces = millisecondsSince(start);
+
+    start = Clock::now();
+    advect(deltaTime);
+    timings.advection = millisecondsSince(start);
+
+    start = Clock::now();
+    computeDivergence();
+    timings.divergence = millisecondsSince(start);
+
+    start = Clock::now();
+    solvePressure();
+    timings.pressure = millisecondsSince(start);
+
+    start = Clock::now();
+    project();
+    timings.projection = millisecondsSince(start);
+}
+
+void FluidSolver::applyForces(float deltaTime)
+{
+    const GridFlowField& g = *grid;
+    const glm::ivec3 n = g.resolution;
+    const glm::vec3 inverse2h = 0.5f / g.cell_size;
+    const std::vector<glm::vec3>& velocity = g.velocities;
+
+    forEachNode([&](int x, int y, int z, int index) {
+        auto at = [&](int i, int j, int k) {
+            return velocity[g.getIndex(clampIndex(i, n.x), clampIndex(j, n.y), clampIndex(k, n.z))];
+        };
+        const glm::vec3 dx = (at(x + 1, y, z) - at(x - 1, y, z)) * inverse2h.x;
+        const glm::vec3 dy = (at(x, y + 1, z) - at(x, y - 1, z)) * inverse2h.y;
+        const glm::vec3 dz = (at(x, y, z + 1) - at(x, y, z - 1)) * inverse2h.z;
+        const glm::vec3 curl(dy.z - dz.y, dz.x - dx.z, dx.y - dy.x);
+        vorticity[index] = glm::vec4(curl, glm::length(curl));
+    });
+
+    // Confinement pushes along N x w, N pointing toward stronger vorticity, which spins the small
+    // eddies the coarse grid and the advection smear out back up
+    const float confinement = fluidParams.vorticity * std::min(g.cell_size.x, std::min(g.cell_size.y, g.cell_size.z));
+    const float sourceBlend = std::min(1.0f, deltaTime * 10.0f);
+    forEachNode([&](int x, int y, int z, int index) {
+        auto strength = [&](int i, int j, int k) {
+            return vorticity[g.getIndex(clampIndex(i, n.x), clampIndex(j, n.y), clampIndex(k, n.z))].w;
+        };
+        const glm::vec3 eta = glm::vec3(strength(x + 1, y, z) - strength(x - 1, y, z),
+            strength(x, y + 1, z) - strength(x, y - 1, z),
+            strength(x, y, z + 1) - strength(x, y, z - 1)) * inverse2h;
+        const float etaLength = glm::length(eta);
+
+        glm::vec3 force(0.0f, fluidParams.buoyancy * density[index], 0.0f);
+        if (etaLength > 1e-5f)
+        {
+            force += confinement * glm::cross(eta / etaLength, glm::vec3(vorticity[index]));
+        }
+        glm::vec3 v = grid->velocities[index] + deltaTime * force;
+
+        // The source fades out linearly toward its radius
+        const glm::vec3 position = g.bounds_min + glm::vec3(x, y, z) * g.cell_size;
+        const float weight = std::max(0.0f, 1.0f - glm::length(position - fluidParams.sourceCenter) / fluidParams.sourceRadius);
+        density[index] += deltaTime * fluidParams.sourceDensity * weight;
+        grid->velocities[index] = glm::mix(v, fluidParams.sourceVelocity, weight * sourceBlend);
+    });
+}
+
+void FluidSolver::advect(float deltaTime)
+{
+    const GridFlowField& g = *grid;
+    const glm::vec3 inverseH = 1.0f / g.cell_size;
+    const float velocityDecay = 1.0f / (1.0f + deltaTime * fluidParams.velocityDissipation);
+    const float densityDecay = 1.0f / (1.0f + deltaTime * fluidParams.densityDissipation);
+
+    forEachNode([&](int x, int y, int z, int index) {
+        // Trace back along the velocity and pick up what arrives here
+        const glm::vec3 from = glm::vec3(x, y, z) - deltaTime * g.velocities[index] * inverseH;
+        velocityTemp[index] = sampleTrilinear(g.velocities, g, from) * velocityDecay;
+        densityTemp[index] = sampleTrilinear(density, g, from) * densityDecay;
+    });
+    density.swap(densityTemp);
+}
+
+void FluidSolver::computeDivergence()
+{
+    const GridFlowField& g = *grid;
+    const glm::ivec3 n = g.resolution;
+    const glm::vec3 inverse2h = 0.5f / g.cell_size;
+
+    forEachNode([&](int x, int y, int z, int index) {
+        auto at = [&](int i, int j, int k) {
+            return velocityTemp[g.getIndex(clampIndex(i, n.x), clampIndex(j, n.y), clampIndex(k, n.z))];
+        };
+        divergence[index] = (at(x + 1, y, z).x - at(x - 1, y, z).x) * inverse2h.x +
+            (at(x, y + 1, z).y - at(x, y - 1, z).y) * inverse2h.y +
+            (at(x, y, z + 1).z - at(x, y, z - 1).z) * inverse2h.z;
+    });
+}
+
+void FluidSolver::solvePressure()
+{
+    if (fluidParams.pressureSolver == PressureSolverType::MULTIGRID)
+    {
+        multigrid.setParameters(fluidParams.multigrid);
+        multigrid.solve(pressure, divergence, fluidParams.trackPressureResidual ? &pressureResiduals : nullptr);
+        return;
+    }
+
+    const GridFlowField& g = *grid;
+    const glm::vec3 w = 1.0f / (g.cell_size * g.cell_size);
+    const float inverseDiagonal = 1.0f / (2.0f * (w.x + w.y + w.z));
+
+    if (fluidParams.trackPressureResidual)
+    {
+        pressureResiduals.assign(1, multigrid.residualNorm(pressure, divergence));
+    }
+    for (int iteration = 0; iteration < fluidParams.pressureIterations; ++iteration)
+    {
+        const std::vector<float>& p = pressure;
+        forEachNode([&](int x, int y, int z, int index) {
+            auto at = [&](int i, int j, int k) { return pressureAt(p, g, i, j, k); };
+            const float sum = w.x * (at(x + 1, y, z) + at(x - 1, y, z)) +
+                w.y * (at(x, y + 1, z) + at(x, y - 1, z)) +
+                w.z * (at(x, y, z + 1) + at(x, y, z - 1));
+            pressureTemp[index] = (sum - divergence[index]) * inverseDiagonal;
+        });
+        pressure.swap(pressureTemp);
+    }
+    if (fluidParams.trackPressureResidual)
+    {
+        pressureResiduals.push_back(multigrid.residualNorm(pressure, divergence));
+    }
+}
+
+void FluidSolver::project()
+{
+    const GridFlowField& g = *grid;
+    const glm::ivec3 n = g.resolution;
+    const glm::vec3 inverse2h = 0.5f / g.cell_size;
+
+    forEachNode([&](int x, int y, int z, int index) {
+        auto at = [&](int i, int j, int k) { return pressureAt(pressure, g, i, j, k); };
+        const glm::vec3 gradient = glm::vec3(at(x + 1, y, z) - at(x - 1, y, z),
+            at(x, y + 1, z) - at(x, y - 1, z),
+            at(x, y, z + 1) - at(x, y, z - 1)) * inverse2h;
+        glm::vec3 v = velocityTemp[index] - gradient;
+
+        // Nothing flows through the walls or the floor
+        if (x == 0 || x == n.x - 1) v.x = 0.0f;
+        if (y == 0) v.y = 0.0f;
+        if (z == 0 || z == n.z - 1) v.z = 0.0f;
+        grid->velocities[index] = v;
+    });
+}
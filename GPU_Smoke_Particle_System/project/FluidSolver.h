@@ -0,0 +1,134 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "FlowField.h"
+#include "MultigridSolver.h"
+
+namespace labhelper
+{
+class JobPool;
+}
+
+/// Solver of the pressure Poisson equation in the projection
+enum class PressureSolverType
+{
+    JACOBI,     // pressureIterations Jacobi sweeps
+    MULTIGRID   // Multigrid V-cycles
+};
+
+/// Settings of the stable fluids smoke solver, shared by FluidSolver and FluidSolverGPU
+struct FluidParameters
+{
+    float buoyancy = 4.0f;              // Upward acceleration per unit of smoke density
+    float vorticity = 0.3f;             // Vorticity confinement strength
+    float velocityDissipation = 0.05f;  // Fraction of the velocity lost per second
+    float densityDissipation = 0.2f;    // Fraction of the smoke density lost per second
+    PressureSolverType pressureSolver = PressureSolverType::MULTIGRID;
+    int pressureIterations = 40;        // Jacobi sweeps of the pressure solve
+    MultigridParameters multigrid;
+    bool trackPressureResidual = false; // Record the residual of the pressure solve, see getPressureResiduals()
+
+    glm::vec3 sourceCenter = glm::vec3(0.0f);                 // Smoke source, a sphere
+    float sourceRadius = 2.0f;
+    float sourceDensity = 5.0f;                               // Density added per second at the center
+    glm::vec3 sourceVelocity = glm::vec3(0.0f, 4.0f, 0.0f);   // Inflow the source pushes toward
+};
+
+/// Time spent in each stage of one solver step, in milliseconds
+struct FluidStageTimings
+{
+    float forces = 0.0f;      // Vorticity, confinement, buoyancy and the source
+    float advection = 0.0f;
+    float divergence = 0.0f;
+    float pressure = 0.0f;
+    float projection = 0.0f;
+
+    float total() const { return forces + advection + divergence + pressure + projection; }
+};
+
+/// Stable fluids smoke solver on the nodes of a GridFlowField, the CPU reference of FluidSolverGPU.
+/// Both run the same steps with the same discretisation, so a GPU step can be checked against a
+/// step of this one from the same state.
+///
+/// A step applies the forces (vorticity confinement, buoyancy from the smoke density and the
+/// source), advects velocity and density semi-Lagrangian with trilinear sampling, then projects
+/// the velocity to be divergence-free with a Jacobi or multigrid pressure solve. Velocities and
+/// pressure live on the grid nodes and derivatives are central differences. The walls and the floor
+/// are solid (zero normal velocity, zero pressure gradient), the ceiling is open (zero pressure half
+/// a cell above the top nodes).
+class FluidSolver
+{
+public:
+    FluidSolver() = default;
+
+    /// Works on the velocities of `grid`, which must outlive the solver and keep its resolution.
+    /// The density and the pressure start at zero.
+    void initialize(GridFlowField* grid);
+
+    /// Advance the fluid by `deltaTime` seconds
+    void step(float deltaTime);
+
+    /// Zero the velocity, density and pressure
+    void reset();
+
+    void setParameters(const FluidParameters& params) { fluidParams = params; }
+    const FluidParameters& getParameters() const { return fluidParams; }
+
+    /// Pool the stages split their z-slabs over, null runs them on the calling thread
+    void setJobPool(labhelper::JobPool* pool)
+    {
+        jobPool = pool;
+        multigrid.setJobPool(pool);
+    }
+
+    /// Smoke density per grid node, same layout as GridFlowField::velocities
+    std::vector<float>& getDensity() { return density; }
+    const std::vector<float>& getDensity() const { return density; }
+
+    /// Pressure of the last projection per grid node, it warm-starts the next solve
+    std::vector<float>& getPressure() { return pressure; }
+    const std::vector<float>& getPressure() const { return pressure; }
+
+    /// Wall clock time of the stages of the last step
+    const FluidStageTimings& getTimings() const { return timings; }
+
+    /// With trackPressureResidual, the RMS residual of the last pressure solve before it and after
+    /// every V-cycle, or before and after all Jacobi sweeps
+    const std::vector<float>& getPressureResiduals() const { return pressureResiduals; }
+
+private:
+    GridFlowField* grid = nullptr;
+    FluidParameters fluidParams;
+    FluidStageTimings timings;
+    labhelper::JobPool* jobPool = nullptr;
+    MultigridSolver multigrid;
+    std::vector<float> pressureResiduals;
+
+    std::vector<float> density;
+    std::vector<float> pressure;
+    std::vector<float> divergence;
+    std::vector<glm::vec4> vorticity;      // Curl in xyz, its length in w
+    std::vector<glm::vec3> velocityTemp;   // Advected velocity, projected back into the grid
+    std::vector<float> densityTemp;
+    std::vector<float> pressureTemp;
+
+    /// Vorticity confinement, buoyancy and the source, in place
+    void applyForces(float deltaTime);
+
+    /// Semi-Lagrangian advection of the grid velocity and density into the temporaries
+    void advect(float deltaTime);
+
+    /// Divergence of the advected velocity
+    void computeDivergence();
+
+    /// Solves the pressure Poisson equation with the selected solver
+    void solvePressure();
+
+    /// Subtract the pressure gradient from the advected velocity into the grid, enforce the walls
+    void project();
+
+    /// Runs `body(x, y, z, index)` for every node, split over the job pool by z-slab
+    template <typename Body>
+    void forEachNode(const Body& body);
+};
@@ -0,0 +1,377 @@
+#include "FluidSolverGPU.h"
+#include "FlowFieldGPU.h"
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+FluidSolverGPU::FluidSolverGPU()
+    : flowField(nullptr), resolution(0), workGroups(0),
+    advectedTexture(0), vorticityTexture(0), divergenceTexture(0), currentPressure(0),
+    vorticityProgram(0), forcesProgram(0), advectProgram(0), divergenceProgram(0), jacobiProgram(0), projectProgram(0),
+    currentTimer(0), timingStep(false), initialized(false)
+{
+    pressureTextures[0] = pressureTextures[1] = 0;
+}
+
+FluidSolverGPU::~FluidSolverGPU()
+{
+    cleanup();
+}
+
+bool FluidSolverGPU::initialize(FlowFieldGPU* field)
+{
+    cleanup();
+    if (!field || !field->isInitialized()) {
+        return false;
+    }
+
+    flowField = field;
+    const FlowFieldBounds& bounds = flowField->getBounds();
+    resolution = bounds.resolution;
+    workGroups = (resolution + glm::ivec3(3)) / glm::ivec3(4);
+
+    // The source sits at the bottom center, where the smoke emitter is
+    fluidParams.sourceCenter = glm::vec3(bounds.worldMin.x + 0.5f * bounds.worldSize.x,
+        bounds.worldMin.y + 0.05f * bounds.worldSize.y,
+        bounds.worldMin.z + 0.5f * bounds.worldSize.z);
+
+    advectedTexture = createGridTexture(GL_RGBA32F, GL_RGBA, 4);
+    vorticityTexture = createGridTexture(GL_RGBA32F, GL_RGBA, 4);
+    divergenceTexture = createGridTexture(GL_R32F, GL_RED, 1);
+    pressureTextures[0] = createGridTexture(GL_R32F, GL_RED, 1);
+    pressureTextures[1] = createGridTexture(GL_R32F, GL_RED, 1);
+    currentPressure = 0;
+    checkGLError("FluidSolverGPU texture creation");
+
+    const std::string directory = "../../TDA362_GPU_Smoke_Particle_System/project_others/";
+    vorticityProgram = loadPass(directory + "fluid_vorticity.comp");
+    forcesProgram = loadPass(directory + "fluid_forces.comp");
+    advectProgram = loadPass(directory + "fluid_advect.comp");
+    divergenceProgram = loadPass(directory + "fluid_divergence.comp");
+    jacobiProgram = loadPass(directory + "fluid_jacobi.comp");
+    projectProgram = loadPass(directory + "fluid_project.comp");
+    if (!vorticityProgram || !forcesProgram || !advectProgram || !divergenceProgram || !jacobiProgram || !projectProgram) {
+        std::cerr << "Failed to load the fluid solver compute shaders!" << std::endl;
+        cleanup();
+        return false;
+    }
+    if (!multigrid.initialize(resolution, bounds.worldSize / glm::vec3(resolution - 1))) {
+        cleanup();
+        return false;
+    }
+    pressureResiduals.clear();
+
+    forcesUniforms.deltaTime = glGetUniformLocation(forcesProgram, "u_deltaTime");
+    forcesUniforms.buoyancy = glGetUniformLocation(forcesProgram, "u_buoyancy");
+    forcesUniforms.confinement = glGetUniformLocation(forcesProgram, "u_confinement");
+    forcesUniforms.sourceCenter = glGetUniformLocation(forcesProgram, "u_sourceCenter");
+    forcesUniforms.sourceRadius = glGetUniformLocation(forcesProgram, "u_sourceRadius");
+    forcesUniforms.sourceDensity = glGetUniformLocation(forcesProgram, "u_sourceDensity");
+    forcesUniforms.sourceVelocity = glGetUniformLocation(forcesProgram, "u_sourceVelocity");
+
+    advectUniforms.deltaTime = glGetUniformLocation(advectProgram, "u_deltaTime");
+    advectUniforms.velocityDecay = glGetUniformLocation(advectProgram, "u_velocityDecay");
+    advectUniforms.densityDecay = glGetUniformLocation(advectProgram, "u_densityDecay");
+
+    for (StageTimer& timer : stageTimers) {
+        glGenQueries(numTimerMarks, timer.queries);
+        timer.pending = false;
+    }
+    currentTimer = 0;
+
+    initialized = true;
+    std::cout << "FluidSolverGPU initialized with resolution: "
+        << resolution.x << "x" << resolution.y << "x" << resolution.z << std::endl;
+    return true;
+}
+
+GLuint FluidSolverGPU::loadPass(const std::string& filepath)
+{
+    std::string source = FlowFieldGPU::readFile(filepath);
+    if (source.empty()) {
+        std::cerr << "Failed to read fluid compute shader file: " << filepath << std::endl;
+        return 0;
+    }
+
+    GLuint program = FlowFieldGPU::compileComputeShader(source);
+    if (program == 0) {
+        return 0;
+    }
+
+    // The grid never changes for a program, the uniforms of fluid_common.glsl are set once
+    const FlowFieldBounds& bounds = flowField->getBounds();
+    const glm::vec3 cellSize = bounds.worldSize / glm::vec3(resolution - 1);
+    glUseProgram(program);
+    glUniform3iv(glGetUniformLocation(program, "u_resolution"), 1, &resolution[0]);
+    glUniform3fv(glGetUniformLocation(program, "u_cellSize"), 1, &cellSize[0]);
+    glUniform3fv(glGetUniformLocation(program, "u_worldMin"), 1, &bounds.worldMin[0]);
+    glUseProgram(0);
+    return program;
+}
+
+GLuint FluidSolverGPU::createGridTexture(GLenum internalFormat, GLenum format, int components)
+{
+    const std::vector<float> zeros(size_t(resolution.x) * resolution.y * resolution.z * components, 0.0f);
+
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_3D, texture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage3D(GL_TEXTURE_3D, 0, internalFormat, resolution.x, resolution.y, resolution.z,
+        0, format, GL_FLOAT, zeros.data());
+    glBindTexture(GL_TEXTURE_3D, 0);
+    return texture;
+}
+
+void FluidSolverGPU::dispatchPass()
+{
+    glDispatchCompute(workGroups.x, workGroups.y, workGroups.z);
+    // The next pass reads the result through an image, the advection and the particles through a sampler
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void FluidSolverGPU::step(float deltaTime)
+{
+    if (!initialized || deltaTime <= 0.0f) {
+        return;
+    }
+
+    const GLuint flowTexture = flowField->getFlowFieldTexture();
+    const FlowFieldBounds& bounds = flowField->getBounds();
+    const glm::vec3 cellSize = bounds.worldSize / glm::vec3(resolution - 1);
+    beginTimings();
+
+    // Forces: the vorticity first, the confinement needs its gradient
+    glUseProgram(vorticityProgram);
+    glBindImageTexture(0, flowTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(1, vorticityTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    dispatchPass();
+
+    glUseProgram(forcesProgram);
+    glUniform1f(forcesUniforms.deltaTime, deltaTime);
+    glUniform1f(forcesUniforms.buoyancy, fluidParams.buoyancy);
+    glUniform1f(forcesUniforms.confinement, fluidParams.vorticity * std::min(cellSize.x, std::min(cellSize.y, cellSize.z)));
+    glUniform3fv(forcesUniforms.sourceCenter, 1, &fluidParams.sourceCenter[0]);
+    glUniform1f(forcesUniforms.sourceRadius, fluidParams.sourceRadius);
+    glUniform1f(forcesUniforms.sourceDensity, fluidParams.sourceDensity);
+    glUniform3fv(forcesUniforms.sourceVelocity, 1, &fluidParams.sourceVelocity[0]);
+    glBindImageTexture(0, flowTexture, 0, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA32F);
+    glBindImageTexture(1, vorticityTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA32F);
+    dispatchPass();
+    markTiming(1);
+
+    // Advection, the texture unit does the trilinear sampling
+    glUseProgram(advectProgram);
+    glUniform1f(advectUniforms.deltaTime, deltaTime);
+    glUniform1f(advectUniforms.velocityDecay, 1.0f / (1.0f + deltaTime * fluidParams.velocityDissipation));
+    glUniform1f(advectUniforms.densityDecay, 1.0f / (1.0f + deltaTime * fluidParams.densityDissipation));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, flowTexture);
+    glBindImageTexture(0, advectedTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    dispatchPass();
+    glBindTexture(GL_TEXTURE_3D, 0);
+    markTiming(2);
+
+    glUseProgram(divergenceProgram);
+    glBindImageTexture(0, advectedTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(1, divergenceTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+    dispatchPass();
+    markTiming(3);
+
+    solvePressure();
+    markTiming(4);
+
+    glUseProgram(projectProgram);
+    glBindImageTexture(0, advectedTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(1, pressureTextures[currentPressure], 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    glBindImageTexture(2, flowTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    dispatchPass();
+    markTiming(5);
+
+    glUseProgram(0);
+    endTimings();
+
+    checkGLError("FluidSolverGPU::step");
+}
+
+void FluidSolverGPU::solvePressure()
+{
+    // Warm-started from the previous step's solution
+    std::vector<float>* residuals = fluidParams.trackPressureResidual ? &pressureResiduals : nullptr;
+    if (fluidParams.pressureSolver == PressureSolverType::MULTIGRID) {
+        multigrid.setParameters(fluidParams.multigrid);
+        multigrid.solve(pressureTextures[currentPressure], divergenceTexture, residuals);
+        return;
+    }
+
+    if (residuals) {
+        residuals->assign(1, multigrid.residualNorm(pressureTextures[currentPressure], divergenceTexture));
+    }
+    glUseProgram(jacobiProgram);
+    glBindImageTexture(1, divergenceTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    for (int i = 0; i < fluidParams.pressureIterations; i++) {
+        glBindImageTexture(0, pressureTextures[currentPressure], 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(2, pressureTextures[1 - currentPressure], 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+        dispatchPass();
+        currentPressure = 1 - currentPressure;
+    }
+    if (residuals) {
+        residuals->push_back(multigrid.residualNorm(pressureTextures[currentPressure], divergenceTexture));
+    }
+}
+
+void FluidSolverGPU::reset()
+{
+    if (!initialized) {
+        return;
+    }
+
+    const std::vector<float> zeros(size_t(resolution.x) * resolution.y * resolution.z * 4, 0.0f);
+    glBindTexture(GL_TEXTURE_3D, flowField->getFlowFieldTexture());
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, resolution.x, resolution.y, resolution.z, GL_RGBA, GL_FLOAT, zeros.data());
+    for (GLuint pressure : pressureTextures) {
+        glBindTexture(GL_TEXTURE_3D, pressure);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, resolution.x, resolution.y, resolution.z, GL_RED, GL_FLOAT, zeros.data());
+    }
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    checkGLError("FluidSolverGPU::reset");
+}
+
+float FluidSolverGPU::validateAgainstCPU(float deltaTime, float* maxSpeed)
+{
+    if (maxSpeed) {
+        *maxSpeed = 0.0f;
+    }
+    if (!initialized) {
+        return 0.0f;
+    }
+
+    const FlowFieldBounds& bounds = flowField->getBounds();
+    const GLuint flowTexture = flowField->getFlowFieldTexture();
+    GridFlowField grid(resolution, bounds.worldMin, bounds.worldMax);
+    FluidSolver reference;
+    reference.initialize(&grid);
+    reference.setParameters(fluidParams);
+
+    // Same starting point: velocity, density and the pressure the GPU solve warm-starts from
+    std::vector<glm::vec4> state(grid.velocities.size());
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glBindTexture(GL_TEXTURE_3D, flowTexture);
+    glGetTexImage(GL_TEXTURE_3D, 0, GL_RGBA, GL_FLOAT, state.data());
+    glBindTexture(GL_TEXTURE_3D, pressureTextures[currentPressure]);
+    glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_FLOAT, reference.getPressure().data());
+    for (size_t i = 0; i < state.size(); i++) {
+        grid.velocities[i] = glm::vec3(state[i]);
+        reference.getDensity()[i] = state[i].w;
+    }
+
+    reference.step(deltaTime);
+    step(deltaTime);
+
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glBindTexture(GL_TEXTURE_3D, flowTexture);
+    glGetTexImage(GL_TEXTURE_3D, 0, GL_RGBA, GL_FLOAT, state.data());
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    float maxError = 0.0f;
+    for (size_t i = 0; i < state.size(); i++) {
+        maxError = std::max(maxError, glm::length(glm::vec3(state[i]) - grid.velocities[i]));
+        if (maxSpeed) {
+            *maxSpeed = std::max(*maxSpeed, glm::length(grid.velocities[i]));
+        }
+    }
+
+    checkGLError("FluidSolverGPU::validateAgainstCPU");
+    return maxError;
+}
+
+void FluidSolverGPU::beginTimings()
+{
+    StageTimer& timer = stageTimers[currentTimer];
+    if (timer.pending) {
+        GLint available = 0;
+        glGetQueryObjectiv(timer.queries[numTimerMarks - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            timingStep = false;
+            return;
+        }
+
+        GLuint64 marks[numTimerMarks];
+        for (int i = 0; i < numTimerMarks; i++) {
+            glGetQueryObjectui64v(timer.queries[i], GL_QUERY_RESULT, &marks[i]);
+        }
+        float* stages[numTimerMarks - 1] = {
+            &timings.forces, &timings.advection, &timings.divergence, &timings.pressure, &timings.projection
+        };
+        for (int i = 0; i < numTimerMarks - 1; i++) {
+            *stages[i] = glm::mix(*stages[i], float(marks[i + 1] - marks[i]) * 1e-6f, 0.05f);
+        }
+        timer.pending = false;
+    }
+
+    timingStep = true;
+    glQueryCounter(timer.queries[0], GL_TIMESTAMP);
+}
+
+void FluidSolverGPU::markTiming(int stage)
+{
+    if (timingStep) {
+        glQueryCounter(stageTimers[currentTimer].queries[stage], GL_TIMESTAMP);
+    }
+}
+
+void FluidSolverGPU::endTimings()
+{
+    if (timingStep) {
+        stageTimers[currentTimer].pending = true;
+        currentTimer = 1 - currentTimer;
+    }
+}
+
+void FluidSolverGPU::deleteTextures()
+{
+    GLuint textures[] = { advectedTexture, vorticityTexture, divergenceTexture, pressureTextures[0], pressureTextures[1] };
+    for (GLuint texture : textures) {
+        if (texture != 0) {
+            glDeleteTextures(1, &texture);
+        }
+    }
+    advectedTexture = vorticityTexture = divergenceTexture = 0;
+    pressureTextures[0] = pressureTextures[1] = 0;
+}
+
+void FluidSolverGPU::cleanup()
+{
+    deleteTextures();
+    multigrid.cleanup();
+
+    GLuint* programs[] = { &vorticityProgram, &forcesProgram, &advectProgram, &divergenceProgram, &jacobiProgram, &projectProgram };
+    for (GLuint* program : programs) {
+        if (*program != 0) {
+            glDeleteProgram(*program);
+            *program = 0;
+        }
+    }
+
+    for (StageTimer& timer : stageTimers) {
+        if (timer.queries[0] != 0) {
+            glDeleteQueries(numTimerMarks, timer.queries);
+        }
+        for (GLuint& query : timer.queries) {
+            query = 0;
+        }
+        timer.pending = false;
+    }
+
+    initialized = false;
+}
+
+void FluidSolverGPU::checkGLError(const std::string& operation)
+{
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR) {
+        std::cerr << "OpenGL error in " << operation << ": " << error << std::endl;
+    }
+}
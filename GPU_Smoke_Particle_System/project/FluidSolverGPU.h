@@ -0,0 +1,141 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <string>
+#include "FluidSolver.h"
+#include "MultigridSolverGPU.h"
+
+class FlowFieldGPU;
+
+/// Stable fluids smoke solver running as compute shaders on FlowFieldGPU's 3D texture, the GPU side
+/// of FluidSolver with the same stages and discretisation. The flow field texture holds the
+/// velocity in xyz and the smoke density in w, so the particles keep sampling it as before.
+///
+/// A step runs fluid_vorticity and fluid_forces in place on the flow field, fluid_advect into a
+/// scratch texture, fluid_divergence, the pressure solve (pressureIterations sweeps of fluid_jacobi
+/// or the V-cycles of MultigridSolverGPU) and finally fluid_project, which writes the
+/// divergence-free velocity back into the flow field.
+class FluidSolverGPU
+{
+public:
+    FluidSolverGPU();
+    ~FluidSolverGPU();
+
+    /// Creates the scratch textures for the grid of `flowField` and loads the passes. Call again
+    /// after the flow field was re-initialised, the previous textures are released.
+    bool initialize(FlowFieldGPU* flowField);
+
+    /// Advance the fluid by `deltaTime` seconds
+    void step(float deltaTime);
+
+    /// Zero the velocity, density and pressure
+    void reset();
+
+    /// Runs one FluidSolver step from a copy of the current GPU state next to one GPU step and
+    /// returns the largest difference of the resulting node velocities, `maxSpeed` receives the
+    /// largest CPU speed for scale. Reads the textures back and stalls, meant for checking the
+    /// passes. Expect small differences, the texture unit filters with reduced precision weights.
+    float validateAgainstCPU(float deltaTime, float* maxSpeed = nullptr);
+
+    void setParameters(const FluidParameters& params) { fluidParams = params; }
+    const FluidParameters& getParameters() const { return fluidParams; }
+
+    /// GPU time of the stages, smoothed over recent steps. The timer queries are read a step or
+    /// two late, so the CPU never waits for them.
+    const FluidStageTimings& getTimings() const { return timings; }
+
+    /// With trackPressureResidual, the RMS residual of the last pressure solve before it and after
+    /// every V-cycle, or before and after all Jacobi sweeps. Measuring it stalls the step.
+    const std::vector<float>& getPressureResiduals() const { return pressureResiduals; }
+
+    /// Levels of the multigrid hierarchy after capping to the grid size
+    int getMultigridLevelCount() const { return multigrid.getLevelCount(); }
+
+    bool isInitialized() const { return initialized; }
+
+    void cleanup();
+
+private:
+    FlowFieldGPU* flowField;
+    FluidParameters fluidParams;
+    FluidStageTimings timings;
+    glm::ivec3 resolution;
+    glm::ivec3 workGroups;
+
+    GLuint advectedTexture;      // rgba32f, velocity and density after advection
+    GLuint vorticityTexture;     // rgba32f, curl and its length
+    GLuint divergenceTexture;    // r32f
+    GLuint pressureTextures[2];  // r32f, ping-ponged by the Jacobi sweeps
+    int currentPressure;         // Holds the latest solution, warm-starts the next solve
+
+    MultigridSolverGPU multigrid;
+    std::vector<float> pressureResiduals;
+
+    GLuint vorticityProgram;
+    GLuint forcesProgram;
+    GLuint advectProgram;
+    GLuint divergenceProgram;
+    GLuint jacobiProgram;
+    GLuint projectProgram;
+
+    /// Uniform locations of fluid_forces.comp
+    struct ForcesUniformLocations
+    {
+        GLint deltaTime = -1;
+        GLint buoyancy = -1;
+        GLint confinement = -1;
+        GLint sourceCenter = -1;
+        GLint sourceRadius = -1;
+        GLint sourceDensity = -1;
+        GLint sourceVelocity = -1;
+    };
+    ForcesUniformLocations forcesUniforms;
+
+    /// Uniform locations of fluid_advect.comp
+    struct AdvectUniformLocations
+    {
+        GLint deltaTime = -1;
+        GLint velocityDecay = -1;
+        GLint densityDecay = -1;
+    };
+    AdvectUniformLocations advectUniforms;
+
+    /// GL_TIMESTAMP queries before the first and after each of the five stages. Two sets, a set is
+    /// read back the next time it comes up and skipped while its results are still in flight.
+    static const int numTimerMarks = 6;
+    struct StageTimer
+    {
+        GLuint queries[numTimerMarks] = {};
+        bool pending = false;
+    };
+    StageTimer stageTimers[2];
+    int currentTimer;
+    bool timingStep;
+
+    bool initialized;
+
+    /// Compiles one of the passes and sets the grid uniforms of fluid_common.glsl
+    GLuint loadPass(const std::string& filepath);
+
+    /// Creates a 3D texture of the grid size filled with zeros
+    GLuint createGridTexture(GLenum internalFormat, GLenum format, int components);
+
+    /// Runs the bound pass over the whole grid and makes its writes visible to the next one
+    void dispatchPass();
+
+    /// Solves for the pressure into pressureTextures[currentPressure] with the selected solver
+    void solvePressure();
+
+    /// Reads back the set of the current timer if it is done and starts timing this step
+    void beginTimings();
+
+    /// Marks the end of stage `stage` (1 to numTimerMarks - 1)
+    void markTiming(int stage);
+
+    void endTimings();
+
+    void deleteTextures();
+
+    void checkGLError(const std::string& operation);
+};
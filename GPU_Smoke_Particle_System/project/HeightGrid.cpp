@@ -0,0 +1,407 @@
+#include "HeightGrid.h"
+#include "ParticleSystem.h"
+#include "SmokePhysics.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+/// Texel coordinate of a world position, clamped to the grid like GL_CLAMP_TO_EDGE
+inline float clampTexel(float texel, int size)
+{
+    return std::min(std::max(texel, 0.0f), float(size - 1));
+}
+
+/// Cell holding clamped texel coordinate `texel`, the last cell for the last texel
+inline int cellOf(float texel, int size)
+{
+    return std::min(int(texel), size - 2);
+}
+
+/// Positions of a block of queries in the grid and the four texels around each. Filled in
+/// passes: the cells and the weights, which is plain arithmetic, then the texel fetches. The
+/// kernels then interpolate over the arrays, so the compiler vectorises all but the fetches.
+struct CellBlock
+{
+    static const int size = 256;
+    int cell[size];                                  // Lower left texel
+    float tx[size], tz[size];                        // Position in the cell
+    float insideX[size], insideZ[size];              // 1 inside the grid, 0 on the clamped outside
+    float h00[size], h10[size], h01[size], h11[size];
+};
+
+template <typename T>
+inline void fetchCells(const T* data, int width, int depth, const glm::vec2& scale, const glm::vec2& offset,
+    const float* x, const float* z, int count, CellBlock& block)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        const float gx = x[i] * scale.x + offset.x;
+        const float gz = z[i] * scale.y + offset.y;
+        const float cx = clampTexel(gx, width);
+        const float cz = clampTexel(gz, depth);
+        const int ix = cellOf(cx, width);
+        const int iz = cellOf(cz, depth);
+        block.cell[i] = iz * width + ix;
+        block.tx[i] = cx - float(ix);
+        block.tz[i] = cz - float(iz);
+        block.insideX[i] = gx == cx ? 1.0f : 0.0f;
+        block.insideZ[i] = gz == cz ? 1.0f : 0.0f;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        const T* corner = data + block.cell[i];
+        block.h00[i] = float(corner[0]);
+        block.h10[i] = float(corner[1]);
+        block.h01[i] = float(corner[width]);
+        block.h11[i] = float(corner[width + 1]);
+    }
+}
+
+template <typename T>
+void heightKernel(const T* data, int width, int depth, const glm::vec2& scale, const glm::vec2& offset,
+    float sampleScale, float sampleOffset, const float* x, const float* z, float* heights, int count)
+{
+    CellBlock block;
+    for (int begin = 0; begin < count; begin += CellBlock::size)
+    {
+        const int n = std::min(int(CellBlock::size), count - begin);
+        fetchCells(data, width, depth, scale, offset, x + begin, z + begin, n, block);
+        for (int i = 0; i < n; ++i)
+        {
+            const float h0 = block.h00[i] + (block.h10[i] - block.h00[i]) * block.tx[i];
+            const float h1 = block.h01[i] + (block.h11[i] - block.h01[i]) * block.tx[i];
+            heights[begin + i] = (h0 + (h1 - h0) * block.tz[i]) * sampleScale + sampleOffset;
+        }
+    }
+}
+
+/// Normals of the bilinear surface, from its slopes along the texel axes. The clamped outside of
+/// the grid is flat.
+template <typename T>
+void normalKernel(const T* data, int width, int depth, const glm::vec2& scale, const glm::vec2& offset,
+    float sampleScale, const float* x, const float* z, float* normalX, float* normalY, float* normalZ, int count)
+{
+    const float gradientX = sampleScale * scale.x;
+    const float gradientZ = sampleScale * scale.y;
+    CellBlock block;
+    for (int begin = 0; begin < count; begin += CellBlock::size)
+    {
+        const int n = std::min(int(CellBlock::size), count - begin);
+        fetchCells(data, width, depth, scale, offset, x + begin, z + begin, n, block);
+        // The world slopes go into the weights, which are no longer needed, and the square roots
+        // get a loop of their own, as their errno check keeps the compiler from vectorising
+        float* slopeX = block.tx;
+        float* slopeZ = block.tz;
+        float* length = block.h00;
+        for (int i = 0; i < n; ++i)
+        {
+            const float slopeX0 = block.h10[i] - block.h00[i], slopeX1 = block.h11[i] - block.h01[i];
+            const float slopeZ0 = block.h01[i] - block.h00[i], slopeZ1 = block.h11[i] - block.h10[i];
+            const float tx = block.tx[i], tz = block.tz[i];
+            slopeX[i] = (slopeX0 + (slopeX1 - slopeX0) * tz) * block.insideX[i] * gradientX;
+            slopeZ[i] = (slopeZ0 + (slopeZ1 - slopeZ0) * tx) * block.insideZ[i] * gradientZ;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            length[i] = std::sqrt(slopeX[i] * slopeX[i] + 1.0f + slopeZ[i] * slopeZ[i]);
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            const float inverseLength = 1.0f / length[i];
+            normalX[begin + i] = -slopeX[i] * inverseLength;
+            normalY[begin + i] = inverseLength;
+            normalZ[begin + i] = -slopeZ[i] * inverseLength;
+        }
+    }
+}
+} // namespace
+
+void HeightGrid::build(const float* data, int gridWidth, int gridDepth, bool quantize)
+{
+    clear();
+    if (!data || gridWidth < 2 || gridDepth < 2) return;
+
+    width = gridWidth;
+    depth = gridDepth;
+    const size_t count = size_t(width) * depth;
+    if (quantize)
+    {
+        const float lowest = *std::min_element(data, data + count);
+        const float highest = *std::max_element(data, data + count);
+        quantizedMin = lowest;
+        quantizedStep = (highest - lowest) / 65535.0f;
+        const float inverseStep = quantizedStep > 0.0f ? 1.0f / quantizedStep : 0.0f;
+        quantizedHeights.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            quantizedHeights[i] = uint16_t(std::min((data[i] - lowest) * inverseStep + 0.5f, 65535.0f));
+        }
+    }
+    else
+    {
+        heights.assign(data, data + count);
+    }
+    buildPyramid();
+    updateMapping();
+}
+
+void HeightGrid::clear()
+{
+    heights.clear();
+    heights.shrink_to_fit();
+    quantizedHeights.clear();
+    quantizedHeights.shrink_to_fit();
+    pyramid.clear();
+    width = 0;
+    depth = 0;
+}
+
+size_t HeightGrid::getMemoryBytes() const
+{
+    size_t bytes = heights.size() * sizeof(float) + quantizedHeights.size() * sizeof(uint16_t);
+    for (const PyramidLevel& level : pyramid)
+    {
+        bytes += (level.minimum.size() + level.maximum.size()) * sizeof(float);
+    }
+    return bytes;
+}
+
+void HeightGrid::buildPyramid()
+{
+    // The first level bounds tiles of pyramidTileSize^2 cells, a cell spanning the four texels
+    // between which it interpolates
+    const int cellsX = width - 1;
+    const int cellsZ = depth - 1;
+    PyramidLevel tiles;
+    tiles.width = (cellsX + pyramidTileSize - 1) / pyramidTileSize;
+    tiles.depth = (cellsZ + pyramidTileSize - 1) / pyramidTileSize;
+    tiles.minimum.resize(size_t(tiles.width) * tiles.depth);
+    tiles.maximum.resize(tiles.minimum.size());
+    for (int tz = 0; tz < tiles.depth; ++tz)
+    {
+        for (int tx = 0; tx < tiles.width; ++tx)
+        {
+            float lowest = INFINITY, highest = -INFINITY;
+            const int lastX = std::min((tx + 1) * pyramidTileSize, cellsX);
+            const int lastZ = std::min((tz + 1) * pyramidTileSize, cellsZ);
+            for (int z = tz * pyramidTileSize; z <= lastZ; ++z)
+            {
+                for (int x = tx * pyramidTileSize; x <= lastX; ++x)
+                {
+                    const size_t index = size_t(z) * width + x;
+                    const float h = isQuantized() ? float(quantizedHeights[index]) : heights[index];
+                    lowest = std::min(lowest, h);
+                    highest = std::max(highest, h);
+                }
+            }
+            tiles.minimum[size_t(tz) * tiles.width + tx] = lowest;
+            tiles.maximum[size_t(tz) * tiles.width + tx] = highest;
+        }
+    }
+    pyramid.push_back(tiles);
+
+    // Every further level bounds 2x2 tiles of the one below, down to a single tile
+    while (pyramid.back().width > 1 || pyramid.back().depth > 1)
+    {
+        const PyramidLevel& fine = pyramid.back();
+        PyramidLevel coarse;
+        coarse.width = (fine.width + 1) / 2;
+        coarse.depth = (fine.depth + 1) / 2;
+        coarse.minimum.resize(size_t(coarse.width) * coarse.depth);
+        coarse.maximum.resize(coarse.minimum.size());
+        for (int z = 0; z < coarse.depth; ++z)
+        {
+            for (int x = 0; x < coarse.width; ++x)
+            {
+                float lowest = INFINITY, highest = -INFINITY;
+                for (int k = 0; k < 4; ++k)
+                {
+                    const int fx = std::min(2 * x + (k & 1), fine.width - 1);
+                    const int fz = std::min(2 * z + (k >> 1), fine.depth - 1);
+                    lowest = std::min(lowest, fine.minimum[size_t(fz) * fine.width + fx]);
+                    highest = std::max(highest, fine.maximum[size_t(fz) * fine.width + fx]);
+                }
+                coarse.minimum[size_t(z) * coarse.width + x] = lowest;
+                coarse.maximum[size_t(z) * coarse.width + x] = highest;
+            }
+        }
+        pyramid.push_back(coarse);
+    }
+}
+
+void HeightGrid::setTransform(const glm::mat4& matrix, float scale)
+{
+    modelMatrix = matrix;
+    heightScale = scale;
+    updateMapping();
+}
+
+void HeightGrid::updateMapping()
+{
+    // Texel i of n is centered at local (i + 0.5) / n * 2 - 1, like a texture fetch
+    const glm::vec2 size(width, depth);
+    const glm::vec2 axisScale(modelMatrix[0][0], modelMatrix[2][2]);
+    const glm::vec2 translation(modelMatrix[3][0], modelMatrix[3][2]);
+    texelScale = 0.5f * size / axisScale;
+    texelOffset = 0.5f * size * (1.0f - translation / axisScale) - 0.5f;
+
+    worldHeightScale = modelMatrix[1][1] * heightScale;
+    worldHeightOffset = modelMatrix[3][1];
+    sampleScale = isQuantized() ? quantizedStep * worldHeightScale : worldHeightScale;
+    sampleOffset = isQuantized() ? quantizedMin * worldHeightScale + worldHeightOffset : worldHeightOffset;
+}
+
+float HeightGrid::heightAt(float x, float z) const
+{
+    float height = 0.0f;
+    heightAt(&x, &z, &height, 1);
+    return height;
+}
+
+void HeightGrid::heightAt(const float* x, const float* z, float* result, int count) const
+{
+    if (empty())
+    {
+        std::fill(result, result + count, 0.0f);
+        return;
+    }
+    if (isQuantized())
+    {
+        heightKernel(quantizedHeights.data(), width, depth, texelScale, texelOffset, sampleScale, sampleOffset, x, z, result, count);
+    }
+    else
+    {
+        heightKernel(heights.data(), width, depth, texelScale, texelOffset, sampleScale, sampleOffset, x, z, result, count);
+    }
+}
+
+glm::vec3 HeightGrid::normalAt(float x, float z) const
+{
+    glm::vec3 normal;
+    normalAt(&x, &z, &normal.x, &normal.y, &normal.z, 1);
+    return normal;
+}
+
+void HeightGrid::normalAt(const float* x, const float* z, float* normalX, float* normalY, float* normalZ, int count) const
+{
+    if (empty())
+    {
+        std::fill(normalX, normalX + count, 0.0f);
+        std::fill(normalY, normalY + count, 1.0f);
+        std::fill(normalZ, normalZ + count, 0.0f);
+        return;
+    }
+    if (isQuantized())
+    {
+        normalKernel(quantizedHeights.data(), width, depth, texelScale, texelOffset, sampleScale, x, z, normalX, normalY, normalZ, count);
+    }
+    else
+    {
+        normalKernel(heights.data(), width, depth, texelScale, texelOffset, sampleScale, x, z, normalX, normalY, normalZ, count);
+    }
+}
+
+glm::vec2 HeightGrid::heightRange(const glm::vec2& min, const glm::vec2& max) const
+{
+    if (empty()) return glm::vec2(0.0f);
+
+    // Cells under the corners, in order even if the transform mirrors an axis
+    const int firstX = cellOf(clampTexel(min.x * texelScale.x + texelOffset.x, width), width);
+    const int firstZ = cellOf(clampTexel(min.y * texelScale.y + texelOffset.y, depth), depth);
+    const int lastX = cellOf(clampTexel(max.x * texelScale.x + texelOffset.x, width), width);
+    const int lastZ = cellOf(clampTexel(max.y * texelScale.y + texelOffset.y, depth), depth);
+    glm::ivec2 tileMin = glm::ivec2(std::min(firstX, lastX), std::min(firstZ, lastZ)) / pyramidTileSize;
+    glm::ivec2 tileMax = glm::ivec2(std::max(firstX, lastX), std::max(firstZ, lastZ)) / pyramidTileSize;
+
+    // The finest level where the rectangle covers at most 2x2 tiles
+    size_t level = 0;
+    while (level + 1 < pyramid.size() && (tileMax.x - tileMin.x > 1 || tileMax.y - tileMin.y > 1))
+    {
+        tileMin /= 2;
+        tileMax /= 2;
+        ++level;
+    }
+
+    const PyramidLevel& tiles = pyramid[level];
+    float lowest = INFINITY, highest = -INFINITY;
+    for (int z = tileMin.y; z <= tileMax.y; ++z)
+    {
+        for (int x = tileMin.x; x <= tileMax.x; ++x)
+        {
+            lowest = std::min(lowest, tiles.minimum[size_t(z) * tiles.width + x]);
+            highest = std::max(highest, tiles.maximum[size_t(z) * tiles.width + x]);
+        }
+    }
+
+    // Widened a little, so the rounding of the bilinear interpolation cannot leave the range
+    const float a = lowest * sampleScale + sampleOffset;
+    const float b = highest * sampleScale + sampleOffset;
+    const float margin = 1e-5f * std::max(std::abs(a), std::abs(b)) + 1e-6f;
+    return glm::vec2(std::min(a, b) - margin, std::max(a, b) + margin);
+}
+
+bool HeightGrid::collide(glm::vec3& position, glm::vec3& velocity, float height) const
+{
+    const float ground = height + surfaceOffset;
+    if (position.y >= ground) return false;
+
+    const glm::vec3 normal = normalAt(position.x, position.z);
+    position.y = ground;
+
+    // Only a velocity into the ground bounces, the part along it slides
+    const float normalSpeed = glm::dot(velocity, normal);
+    if (normalSpeed < 0.0f)
+    {
+        const glm::vec3 tangent = velocity - normalSpeed * normal;
+        velocity = (1.0f - collisionResponse.friction) * tangent - collisionResponse.restitution * normalSpeed * normal;
+    }
+    return true;
+}
+
+bool HeightGrid::handleCollision(Particle& particle) const
+{
+    if (empty()) return false;
+    return collide(particle.pos, particle.velocity, heightAt(particle.pos.x, particle.pos.z));
+}
+
+int HeightGrid::handleCollisions(const ParticleSpans& particles) const
+{
+    if (empty() || particles.count == 0) return 0;
+
+    // A batch entirely above the highest ground under it cannot collide
+    glm::vec2 lo(particles.posX[0], particles.posZ[0]);
+    glm::vec2 hi = lo;
+    float lowestY = particles.posY[0];
+    for (int i = 1; i < particles.count; ++i)
+    {
+        lo = glm::min(lo, glm::vec2(particles.posX[i], particles.posZ[i]));
+        hi = glm::max(hi, glm::vec2(particles.posX[i], particles.posZ[i]));
+        lowestY = std::min(lowestY, particles.posY[i]);
+    }
+    if (lowestY >= heightRange(lo, hi).y + surfaceOffset) return 0;
+
+    const int blockSize = 256;
+    float ground[blockSize];
+    int collisions = 0;
+    for (int begin = 0; begin < particles.count; begin += blockSize)
+    {
+        const int n = std::min(blockSize, particles.count - begin);
+        heightAt(particles.posX + begin, particles.posZ + begin, ground, n);
+        for (int i = 0; i < n; ++i)
+        {
+            const int index = begin + i;
+            if (particles.posY[index] >= ground[i] + surfaceOffset) continue;
+
+            glm::vec3 position(particles.posX[index], particles.posY[index], particles.posZ[index]);
+            glm::vec3 velocity(particles.velX[index], particles.velY[index], particles.velZ[index]);
+            collide(position, velocity, ground[i]);
+            particles.posY[index] = position.y;
+            particles.velX[index] = velocity.x;
+            particles.velY[index] = velocity.y;
+            particles.velZ[index] = velocity.z;
+            ++collisions;
+        }
+    }
+    return collisions;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+#include "BoundaryManager.h"
+
+struct Particle;
+struct ParticleSpans;
+
+/// CPU copy of a height field that particles collide with, kept next to its texture by HeightField.
+///
+/// The heights are stored as floats or quantised to 16 bits between their minimum and maximum,
+/// and read back with bilinear interpolation between the texels, the same as a GL_LINEAR fetch of
+/// the texture with clamping to the edge. A min/max pyramid over tiles of pyramidTileSize^2 cells
+/// bounds the height of any rectangle, so batches of particles far above the ground skip the
+/// lookups.
+///
+/// The grid lies where heightfield.vert puts it: local x and z in [-1, 1] cover the texture and
+/// the local height is the texel times the height scale, all placed by the model matrix.
+class HeightGrid
+{
+public:
+    HeightGrid() = default;
+
+    /// Copies `width` x `depth` heights, x fastest and rows along z, quantised to 16 bits if
+    /// `quantize` is set, and builds the pyramid
+    void build(const float* heights, int width, int depth, bool quantize);
+
+    void clear();
+
+    bool empty() const { return width == 0; }
+    bool isQuantized() const { return !quantizedHeights.empty(); }
+    int getWidth() const { return width; }
+    int getDepth() const { return depth; }
+
+    /// Bytes held by the heights and the pyramid
+    size_t getMemoryBytes() const;
+
+    /// Places the grid with an axis aligned `modelMatrix` and the `heightScale` of
+    /// heightfield.vert. Rotations are ignored.
+    void setTransform(const glm::mat4& modelMatrix, float heightScale);
+
+    ///////////////////////////////////////////////////////////////////////
+    // Queries, all in world space
+    ///////////////////////////////////////////////////////////////////////
+
+    float heightAt(float x, float z) const;
+
+    /// heightAt() for `count` positions given as arrays
+    void heightAt(const float* x, const float* z, float* heights, int count) const;
+
+    /// Normal of the bilinear surface, pointing up
+    glm::vec3 normalAt(float x, float z) const;
+
+    /// normalAt() for `count` positions given as arrays
+    void normalAt(const float* x, const float* z, float* normalX, float* normalY, float* normalZ, int count) const;
+
+    /// Lowest and highest ground over the rectangle between `min` and `max` (x and z), from the
+    /// pyramid. May be wider than the exact range, never narrower.
+    glm::vec2 heightRange(const glm::vec2& min, const glm::vec2& max) const;
+
+    ///////////////////////////////////////////////////////////////////////
+    // Collision
+    ///////////////////////////////////////////////////////////////////////
+
+    /// Lifts the particle to surfaceOffset above the ground if it is lower, and reflects the
+    /// velocity into the ground with the collision response, so particles slide along it. Returns
+    /// whether it collided.
+    bool handleCollision(Particle& particle) const;
+
+    /// handleCollision() for a batch given as arrays, returns the number of particles that
+    /// collided. Gives the same results as handleCollision() bit for bit.
+    int handleCollisions(const ParticleSpans& particles) const;
+
+    void setCollisionResponse(const CollisionResponse& response) { collisionResponse = response; }
+    const CollisionResponse& getCollisionResponse() const { return collisionResponse; }
+
+    /// Height above the ground particles are kept at, about their radius
+    void setSurfaceOffset(float offset) { surfaceOffset = offset; }
+    float getSurfaceOffset() const { return surfaceOffset; }
+
+    ///////////////////////////////////////////////////////////////////////
+    // Mapping of the texture
+    ///////////////////////////////////////////////////////////////////////
+
+    /// World x and z to texel coordinates, texel = world * scale + offset: (x scale, x offset,
+    /// z scale, z offset)
+    glm::vec4 getTexelMapping() const { return glm::vec4(texelScale.x, texelOffset.x, texelScale.y, texelOffset.y); }
+
+    /// A float texel to world height, world = texel * scale + offset: (scale, offset)
+    glm::vec2 getHeightMapping() const { return glm::vec2(worldHeightScale, worldHeightOffset); }
+
+    /// Cells per pyramid tile side
+    static const int pyramidTileSize = 8;
+
+private:
+    struct PyramidLevel
+    {
+        int width = 0;
+        int depth = 0;
+        std::vector<float> minimum;  // Stored heights, quantised or not, before the world transform
+        std::vector<float> maximum;
+    };
+
+    std::vector<float> heights;
+    std::vector<uint16_t> quantizedHeights;
+    int width = 0;
+    int depth = 0;
+    float quantizedMin = 0.0f;   // Float height of quantised 0
+    float quantizedStep = 0.0f;  // Float height of one quantised step
+
+    std::vector<PyramidLevel> pyramid;
+
+    glm::mat4 modelMatrix = glm::mat4(1.0f);
+    float heightScale = 1.0f;
+
+    // Derived from the size and the transform by updateMapping()
+    glm::vec2 texelScale = glm::vec2(0.0f);
+    glm::vec2 texelOffset = glm::vec2(0.0f);
+    float worldHeightScale = 1.0f;   // Float texel to world height
+    float worldHeightOffset = 0.0f;
+    float sampleScale = 1.0f;        // Stored height, quantised or not, to world height
+    float sampleOffset = 0.0f;
+
+    CollisionResponse collisionResponse;
+    float surfaceOffset = 0.1f;
+
+    void buildPyramid();
+    void updateMapping();
+
+    /// Collision of one particle, shared by the single and the batch path
+    bool collide(glm::vec3& position, glm::vec3& velocity, float height) const;
+};
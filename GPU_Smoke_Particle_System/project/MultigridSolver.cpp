@@ -0,0 +1,252 @@
+#include "MultigridSolver.h"
+#include "JobPool.h"
+#include <cmath>
+
+namespace
+{
+int nodeIndex(const glm::ivec3& n, int x, int y, int z)
+{
+    return (z * n.y + y) * n.x + x;
+}
+
+/// Sum over the axes of w * (left + right neighbour). Mirrored at the walls and the floor and
+/// mirrored with the opposite sign above the open ceiling, like FluidSolver's pressure. That puts
+/// the zero pressure of the ceiling half a cell above the top nodes, which is the same place on
+/// every level.
+float neighbourSum(const float* p, const glm::ivec3& n, const glm::vec3& w, int x, int y, int z, int index)
+{
+    const int strideY = n.x;
+    const int strideZ = n.x * n.y;
+    const float xm = p[index - (x > 0 ? 1 : 0)];
+    const float xp = p[index + (x < n.x - 1 ? 1 : 0)];
+    const float ym = p[index - (y > 0 ? strideY : 0)];
+    const float yp = y < n.y - 1 ? p[index + strideY] : -p[index];
+    const float zm = p[index - (z > 0 ? strideZ : 0)];
+    const float zp = p[index + (z < n.z - 1 ? strideZ : 0)];
+    return w.x * (xm + xp) + w.y * (ym + yp) + w.z * (zm + zp);
+}
+
+glm::vec3 laplacianWeights(const glm::vec3& cellSize)
+{
+    return 1.0f / (cellSize * cellSize);
+}
+
+/// rhs - laplacian(p) at one node
+float nodeResidual(const float* p, const float* rhs, const glm::ivec3& n, const glm::vec3& w, float diagonal,
+    int x, int y, int z, int index)
+{
+    return rhs[index] - (neighbourSum(p, n, w, x, y, z, index) - diagonal * p[index]);
+}
+} // namespace
+
+void MultigridSolver::initialize(const glm::ivec3& resolution, const glm::vec3& cellSize)
+{
+    levels.clear();
+    Level finest;
+    finest.resolution = resolution;
+    finest.cellSize = cellSize;
+    levels.push_back(finest);
+    buildLevels();
+}
+
+void MultigridSolver::buildLevels()
+{
+    if (levels.empty()) return;
+
+    // Halve while every axis is even, so each coarse cell covers exactly 2x2x2 fine ones and the
+    // domains line up, and no axis drops below 2 nodes
+    int count = 1;
+    glm::ivec3 n = levels[0].resolution;
+    while (count < multigridParams.levels && n.x % 2 == 0 && n.y % 2 == 0 && n.z % 2 == 0 &&
+        glm::all(glm::greaterThanEqual(n / 2, glm::ivec3(2))))
+    {
+        n = n / 2;
+        ++count;
+    }
+    if (count == int(levels.size())) return;
+
+    levels.resize(1);
+    for (int i = 1; i < count; ++i)
+    {
+        const Level& fine = levels.back();
+        Level coarse;
+        coarse.resolution = fine.resolution / 2;
+        coarse.cellSize = fine.cellSize * 2.0f;
+        const size_t size = size_t(coarse.resolution.x) * coarse.resolution.y * coarse.resolution.z;
+        coarse.pressure.assign(size, 0.0f);
+        coarse.rhs.assign(size, 0.0f);
+        levels.push_back(coarse);
+    }
+}
+
+void MultigridSolver::solve(std::vector<float>& pressure, const std::vector<float>& rhs, std::vector<float>* residuals)
+{
+    if (levels.empty()) return;
+    buildLevels();
+
+    if (residuals)
+    {
+        residuals->clear();
+        residuals->push_back(residualNorm(levels[0], pressure.data(), rhs.data()));
+    }
+    for (int cycle = 0; cycle < multigridParams.cycles; ++cycle)
+    {
+        vCycle(0, pressure.data(), rhs.data());
+        if (residuals)
+        {
+            residuals->push_back(residualNorm(levels[0], pressure.data(), rhs.data()));
+        }
+    }
+}
+
+float MultigridSolver::residualNorm(const std::vector<float>& pressure, const std::vector<float>& rhs)
+{
+    return levels.empty() ? 0.0f : residualNorm(levels[0], pressure.data(), rhs.data());
+}
+
+void MultigridSolver::vCycle(int level, float* pressure, const float* rhs)
+{
+    const Level& current = levels[level];
+    if (level == int(levels.size()) - 1)
+    {
+        smooth(current, pressure, rhs, multigridParams.coarseSmoothing);
+        return;
+    }
+
+    smooth(current, pressure, rhs, multigridParams.preSmoothing);
+
+    // The coarse grid solves for the error of this one, starting from zero
+    Level& coarse = levels[level + 1];
+    restrictResidual(current, pressure, rhs, coarse);
+    vCycle(level + 1, coarse.pressure.data(), coarse.rhs.data());
+    prolongate(coarse, current, pressure);
+
+    smooth(current, pressure, rhs, multigridParams.postSmoothing);
+}
+
+void MultigridSolver::smooth(const Level& level, float* pressure, const float* rhs, int sweeps)
+{
+    const glm::ivec3 n = level.resolution;
+    const glm::vec3 w = laplacianWeights(level.cellSize);
+    const float inverseDiagonal = 1.0f / (2.0f * (w.x + w.y + w.z));
+
+    for (int sweep = 0; sweep < sweeps; ++sweep)
+    {
+        // A node of one color only has neighbours of the other
+        for (int color = 0; color < 2; ++color)
+        {
+            labhelper::parallelFor(jobPool, n.z, 1, [&](int begin, int end) {
+                for (int z = begin; z < end; ++z)
+                {
+                    for (int y = 0; y < n.y; ++y)
+                    {
+                        for (int x = (color + y + z) & 1; x < n.x; x += 2)
+                        {
+                            const int index = nodeIndex(n, x, y, z);
+                            pressure[index] = (neighbourSum(pressure, n, w, x, y, z, index) - rhs[index]) * inverseDiagonal;
+                        }
+                    }
+                }
+            });
+        }
+    }
+}
+
+void MultigridSolver::restrictResidual(const Level& fine, const float* pressure, const float* rhs, Level& coarse)
+{
+    const glm::ivec3 n = fine.resolution;
+    const glm::ivec3 nc = coarse.resolution;
+    const glm::vec3 w = laplacianWeights(fine.cellSize);
+    const float diagonal = 2.0f * (w.x + w.y + w.z);
+
+    labhelper::parallelFor(jobPool, nc.z, 1, [&](int begin, int end) {
+        for (int z = begin; z < end; ++z)
+        {
+            for (int y = 0; y < nc.y; ++y)
+            {
+                for (int x = 0; x < nc.x; ++x)
+                {
+                    float sum = 0.0f;
+                    for (int k = 0; k < 8; ++k)
+                    {
+                        const int fx = 2 * x + (k & 1);
+                        const int fy = 2 * y + ((k >> 1) & 1);
+                        const int fz = 2 * z + (k >> 2);
+                        sum += nodeResidual(pressure, rhs, n, w, diagonal, fx, fy, fz, nodeIndex(n, fx, fy, fz));
+                    }
+                    const int index = nodeIndex(nc, x, y, z);
+                    coarse.rhs[index] = 0.125f * sum;
+                    coarse.pressure[index] = 0.0f;
+                }
+            }
+        }
+    });
+}
+
+void MultigridSolver::prolongate(const Level& coarse, const Level& fine, float* pressure)
+{
+    const glm::ivec3 n = fine.resolution;
+    const glm::ivec3 nc = coarse.resolution;
+    const float* correction = coarse.pressure.data();
+
+    // Same boundaries as neighbourSum()
+    auto coarseAt = [&](int x, int y, int z) {
+        const float value = correction[nodeIndex(nc, glm::clamp(x, 0, nc.x - 1), glm::clamp(y, 0, nc.y - 1), glm::clamp(z, 0, nc.z - 1))];
+        return y >= nc.y ? -value : value;
+    };
+
+    labhelper::parallelFor(jobPool, n.z, 1, [&](int begin, int end) {
+        for (int z = begin; z < end; ++z)
+        {
+            for (int y = 0; y < n.y; ++y)
+            {
+                for (int x = 0; x < n.x; ++x)
+                {
+                    // Fine cell centers sit a quarter of a coarse cell off the coarse ones
+                    const glm::vec3 c = glm::vec3(x, y, z) * 0.5f - 0.25f;
+                    const glm::vec3 f = glm::floor(c);
+                    const glm::ivec3 i = glm::ivec3(f);
+                    const glm::vec3 t = c - f;
+
+                    const float c00 = glm::mix(coarseAt(i.x, i.y, i.z), coarseAt(i.x + 1, i.y, i.z), t.x);
+                    const float c10 = glm::mix(coarseAt(i.x, i.y + 1, i.z), coarseAt(i.x + 1, i.y + 1, i.z), t.x);
+                    const float c01 = glm::mix(coarseAt(i.x, i.y, i.z + 1), coarseAt(i.x + 1, i.y, i.z + 1), t.x);
+                    const float c11 = glm::mix(coarseAt(i.x, i.y + 1, i.z + 1), coarseAt(i.x + 1, i.y + 1, i.z + 1), t.x);
+                    pressure[nodeIndex(n, x, y, z)] += glm::mix(glm::mix(c00, c10, t.y), glm::mix(c01, c11, t.y), t.z);
+                }
+            }
+        }
+    });
+}
+
+float MultigridSolver::residualNorm(const Level& level, const float* pressure, const float* rhs)
+{
+    const glm::ivec3 n = level.resolution;
+    const glm::vec3 w = laplacianWeights(level.cellSize);
+    const float diagonal = 2.0f * (w.x + w.y + w.z);
+
+    // One partial sum per slab, added up in order so the result does not depend on the threads
+    partialSums.assign(n.z, 0.0f);
+    labhelper::parallelFor(jobPool, n.z, 1, [&](int begin, int end) {
+        for (int z = begin; z < end; ++z)
+        {
+            double sum = 0.0;
+            for (int y = 0; y < n.y; ++y)
+            {
+                for (int x = 0; x < n.x; ++x)
+                {
+                    const float r = nodeResidual(pressure, rhs, n, w, diagonal, x, y, z, nodeIndex(n, x, y, z));
+                    sum += double(r) * r;
+                }
+            }
+            partialSums[z] = float(sum);
+        }
+    });
+
+    double total = 0.0;
+    for (float sum : partialSums)
+    {
+        total += sum;
+    }
+    return float(std::sqrt(total / (double(n.x) * n.y * n.z)));
+}
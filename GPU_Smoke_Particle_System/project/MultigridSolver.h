@@ -0,0 +1,86 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace labhelper
+{
+class JobPool;
+}
+
+/// Settings of the multigrid pressure solvers, shared by MultigridSolver and MultigridSolverGPU
+struct MultigridParameters
+{
+    int levels = 5;            // Grids in the hierarchy, each half the resolution of the one above
+    int preSmoothing = 2;      // Red-black Gauss-Seidel sweeps before restricting the residual
+    int postSmoothing = 2;     // Sweeps after adding the coarse correction
+    int coarseSmoothing = 16;  // Sweeps on the coarsest grid, in place of an exact solve
+    int cycles = 3;            // V-cycles per solve
+};
+
+/// Geometric multigrid solver of the pressure Poisson equation laplacian(p) = rhs on the nodes of
+/// a flow grid, with the boundary conditions of FluidSolver: mirrored at the walls and the floor,
+/// mirrored with the opposite sign above the open ceiling, which puts the zero pressure half a cell
+/// above the top nodes. MultigridSolverGPU runs the same cycle as compute shaders.
+///
+/// The nodes are treated as cells of a cell-centered hierarchy. A coarse cell covers 2x2x2 fine
+/// ones, the residual is restricted by averaging them and the correction comes back by trilinear
+/// interpolation. Every level uses the 7-point Laplacian with its own cell size and is smoothed
+/// with red-black Gauss-Seidel, whose half-sweeps only read the other color, so they run in
+/// parallel in place.
+class MultigridSolver
+{
+public:
+    MultigridSolver() = default;
+
+    /// Builds the hierarchy below a grid of `resolution` nodes `cellSize` apart
+    void initialize(const glm::ivec3& resolution, const glm::vec3& cellSize);
+
+    /// Takes effect with the next solve, a new level count rebuilds the hierarchy
+    void setParameters(const MultigridParameters& params) { multigridParams = params; }
+    const MultigridParameters& getParameters() const { return multigridParams; }
+
+    /// Pool the sweeps split their z-slabs over, null runs them on the calling thread
+    void setJobPool(labhelper::JobPool* pool) { jobPool = pool; }
+
+    /// Runs the V-cycles on `pressure`, which holds the initial guess. With `residuals`, the RMS
+    /// residual before the first cycle and after every cycle is stored there.
+    void solve(std::vector<float>& pressure, const std::vector<float>& rhs, std::vector<float>* residuals = nullptr);
+
+    /// RMS of rhs - laplacian(pressure) on the finest grid
+    float residualNorm(const std::vector<float>& pressure, const std::vector<float>& rhs);
+
+    /// Levels of the current hierarchy, after capping to the grid size
+    int getLevelCount() const { return int(levels.size()); }
+
+private:
+    struct Level
+    {
+        glm::ivec3 resolution;
+        glm::vec3 cellSize;
+        std::vector<float> pressure;  // Correction on the coarse levels, unused on the finest
+        std::vector<float> rhs;       // Restricted residual on the coarse levels, unused on the finest
+    };
+
+    MultigridParameters multigridParams;
+    std::vector<Level> levels;
+    std::vector<float> partialSums;  // Per z-slab sums of the residual norm
+    labhelper::JobPool* jobPool = nullptr;
+
+    /// Rebuilds the hierarchy if the level count changed
+    void buildLevels();
+
+    void vCycle(int level, float* pressure, const float* rhs);
+
+    /// Red-black Gauss-Seidel sweeps, in place
+    void smooth(const Level& level, float* pressure, const float* rhs, int sweeps);
+
+    /// Averages the residual of each 2x2x2 block of `fine` into the rhs of `coarse` and zeroes the
+    /// coarse pressure
+    void restrictResidual(const Level& fine, const float* pressure, const float* rhs, Level& coarse);
+
+    /// Adds the trilinearly interpolated coarse pressure to the fine one
+    void prolongate(const Level& coarse, const Level& fine, float* pressure);
+
+    float residualNorm(const Level& level, const float* pressure, const float* rhs);
+};
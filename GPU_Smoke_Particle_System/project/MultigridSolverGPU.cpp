@@ -0,0 +1,291 @@
+#include "MultigridSolverGPU.h"
+#include "FlowFieldGPU.h"
+#include <cmath>
+#include <iostream>
+
+namespace
+{
+glm::ivec3 groupCount(const glm::ivec3& nodes)
+{
+    return (nodes + glm::ivec3(3)) / glm::ivec3(4);
+}
+
+/// Runs the bound pass and makes its image writes visible to the next one
+void dispatchPass(const glm::ivec3& groups)
+{
+    glDispatchCompute(groups.x, groups.y, groups.z);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
+} // namespace
+
+MultigridSolverGPU::MultigridSolverGPU()
+    : smoothProgram(0), restrictProgram(0), prolongProgram(0), residualProgram(0), colorLocation(-1),
+    residualBuffer(0), initialized(false)
+{
+}
+
+MultigridSolverGPU::~MultigridSolverGPU()
+{
+    cleanup();
+}
+
+bool MultigridSolverGPU::initialize(const glm::ivec3& resolution, const glm::vec3& cellSize)
+{
+    cleanup();
+
+    const std::string directory = "../../TDA362_GPU_Smoke_Particle_System/project_others/";
+    smoothProgram = loadPass(directory + "mg_smooth.comp", smoothUniforms);
+    restrictProgram = loadPass(directory + "mg_restrict.comp", restrictUniforms);
+    prolongProgram = loadPass(directory + "mg_prolong.comp", prolongUniforms);
+    residualProgram = loadPass(directory + "mg_residual.comp", residualUniforms);
+    if (!smoothProgram || !restrictProgram || !prolongProgram || !residualProgram) {
+        std::cerr << "Failed to load the multigrid compute shaders!" << std::endl;
+        cleanup();
+        return false;
+    }
+    colorLocation = glGetUniformLocation(smoothProgram, "u_color");
+
+    Level finest;
+    finest.resolution = resolution;
+    finest.cellSize = cellSize;
+    levels.push_back(finest);
+    buildLevels();
+
+    const glm::ivec3 groups = groupCount(resolution);
+    groupSums.resize(size_t(groups.x) * groups.y * groups.z);
+    glGenBuffers(1, &residualBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, residualBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, groupSums.size() * sizeof(float), nullptr, GL_DYNAMIC_READ);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    checkGLError("MultigridSolverGPU::initialize");
+
+    initialized = true;
+    return true;
+}
+
+GLuint MultigridSolverGPU::loadPass(const std::string& filepath, GridUniformLocations& uniforms)
+{
+    std::string source = FlowFieldGPU::readFile(filepath);
+    if (source.empty()) {
+        std::cerr << "Failed to read multigrid compute shader file: " << filepath << std::endl;
+        return 0;
+    }
+
+    GLuint program = FlowFieldGPU::compileComputeShader(source);
+    if (program == 0) {
+        return 0;
+    }
+
+    uniforms.resolution = glGetUniformLocation(program, "u_resolution");
+    uniforms.cellSize = glGetUniformLocation(program, "u_cellSize");
+    uniforms.coarseResolution = glGetUniformLocation(program, "u_coarseResolution");
+    return program;
+}
+
+void MultigridSolverGPU::buildLevels()
+{
+    if (levels.empty()) {
+        return;
+    }
+
+    // Same hierarchy as MultigridSolver::buildLevels()
+    int count = 1;
+    glm::ivec3 n = levels[0].resolution;
+    while (count < multigridParams.levels && n.x % 2 == 0 && n.y % 2 == 0 && n.z % 2 == 0 &&
+        glm::all(glm::greaterThanEqual(n / 2, glm::ivec3(2)))) {
+        n = n / 2;
+        ++count;
+    }
+    if (count == int(levels.size())) {
+        return;
+    }
+
+    deleteLevelTextures();
+    levels.resize(1);
+    for (int i = 1; i < count; i++) {
+        const Level& fine = levels.back();
+        Level coarse;
+        coarse.resolution = fine.resolution / 2;
+        coarse.cellSize = fine.cellSize * 2.0f;
+
+        // Filled by mg_restrict before anything reads them
+        GLuint textures[2];
+        glGenTextures(2, textures);
+        for (GLuint texture : textures) {
+            glBindTexture(GL_TEXTURE_3D, texture);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, coarse.resolution.x, coarse.resolution.y, coarse.resolution.z,
+                0, GL_RED, GL_FLOAT, nullptr);
+        }
+        glBindTexture(GL_TEXTURE_3D, 0);
+        coarse.pressureTexture = textures[0];
+        coarse.rhsTexture = textures[1];
+        levels.push_back(coarse);
+    }
+    checkGLError("MultigridSolverGPU level creation");
+}
+
+void MultigridSolverGPU::useLevel(GLuint program, const GridUniformLocations& uniforms, int level)
+{
+    glUseProgram(program);
+    glUniform3iv(uniforms.resolution, 1, &levels[level].resolution[0]);
+    glUniform3fv(uniforms.cellSize, 1, &levels[level].cellSize[0]);
+    if (uniforms.coarseResolution >= 0) {
+        glUniform3iv(uniforms.coarseResolution, 1, &levels[level + 1].resolution[0]);
+    }
+}
+
+void MultigridSolverGPU::solve(GLuint pressureTexture, GLuint rhsTexture, std::vector<float>* residuals)
+{
+    if (!initialized) {
+        return;
+    }
+    buildLevels();
+    levels[0].pressureTexture = pressureTexture;
+    levels[0].rhsTexture = rhsTexture;
+
+    if (residuals) {
+        residuals->clear();
+        residuals->push_back(residualNorm(0));
+    }
+    for (int cycle = 0; cycle < multigridParams.cycles; cycle++) {
+        vCycle(0);
+        if (residuals) {
+            residuals->push_back(residualNorm(0));
+        }
+    }
+    glUseProgram(0);
+
+    checkGLError("MultigridSolverGPU::solve");
+}
+
+float MultigridSolverGPU::residualNorm(GLuint pressureTexture, GLuint rhsTexture)
+{
+    if (!initialized) {
+        return 0.0f;
+    }
+    levels[0].pressureTexture = pressureTexture;
+    levels[0].rhsTexture = rhsTexture;
+    const float norm = residualNorm(0);
+    glUseProgram(0);
+    return norm;
+}
+
+void MultigridSolverGPU::vCycle(int level)
+{
+    if (level == int(levels.size()) - 1) {
+        smooth(level, multigridParams.coarseSmoothing);
+        return;
+    }
+
+    smooth(level, multigridParams.preSmoothing);
+    restrictResidual(level);
+    vCycle(level + 1);
+    prolongate(level);
+    smooth(level, multigridParams.postSmoothing);
+}
+
+void MultigridSolverGPU::smooth(int level, int sweeps)
+{
+    const Level& current = levels[level];
+    useLevel(smoothProgram, smoothUniforms, level);
+    glBindImageTexture(0, current.pressureTexture, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32F);
+    glBindImageTexture(1, current.rhsTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+
+    // A thread per node of one color, half the grid in x
+    const glm::ivec3 n = current.resolution;
+    const glm::ivec3 groups = groupCount(glm::ivec3((n.x + 1) / 2, n.y, n.z));
+    for (int sweep = 0; sweep < sweeps; sweep++) {
+        for (int color = 0; color < 2; color++) {
+            glUniform1i(colorLocation, color);
+            dispatchPass(groups);
+        }
+    }
+}
+
+void MultigridSolverGPU::restrictResidual(int level)
+{
+    const Level& fine = levels[level];
+    const Level& coarse = levels[level + 1];
+    useLevel(restrictProgram, restrictUniforms, level);
+    glBindImageTexture(0, fine.pressureTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    glBindImageTexture(1, fine.rhsTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    glBindImageTexture(2, coarse.rhsTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+    glBindImageTexture(3, coarse.pressureTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+    dispatchPass(groupCount(coarse.resolution));
+}
+
+void MultigridSolverGPU::prolongate(int level)
+{
+    const Level& fine = levels[level];
+    useLevel(prolongProgram, prolongUniforms, level);
+    glBindImageTexture(0, fine.pressureTexture, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32F);
+    glBindImageTexture(1, levels[level + 1].pressureTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    dispatchPass(groupCount(fine.resolution));
+}
+
+float MultigridSolverGPU::residualNorm(int level)
+{
+    const Level& current = levels[level];
+    useLevel(residualProgram, residualUniforms, level);
+    glBindImageTexture(0, current.pressureTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    glBindImageTexture(1, current.rhsTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, residualBuffer);
+
+    const glm::ivec3 groups = groupCount(current.resolution);
+    glDispatchCompute(groups.x, groups.y, groups.z);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    // Added up in order in double, like MultigridSolver::residualNorm()
+    const size_t count = size_t(groups.x) * groups.y * groups.z;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, residualBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(float), groupSums.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    double total = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        total += groupSums[i];
+    }
+    const glm::ivec3 n = current.resolution;
+    return float(std::sqrt(total / (double(n.x) * n.y * n.z)));
+}
+
+void MultigridSolverGPU::deleteLevelTextures()
+{
+    // The finest level's textures belong to the caller
+    for (size_t i = 1; i < levels.size(); i++) {
+        GLuint textures[] = { levels[i].pressureTexture, levels[i].rhsTexture };
+        glDeleteTextures(2, textures);
+    }
+}
+
+void MultigridSolverGPU::cleanup()
+{
+    deleteLevelTextures();
+    levels.clear();
+
+    GLuint* programs[] = { &smoothProgram, &restrictProgram, &prolongProgram, &residualProgram };
+    for (GLuint* program : programs) {
+        if (*program != 0) {
+            glDeleteProgram(*program);
+            *program = 0;
+        }
+    }
+
+    if (residualBuffer != 0) {
+        glDeleteBuffers(1, &residualBuffer);
+        residualBuffer = 0;
+    }
+    groupSums.clear();
+
+    initialized = false;
+}
+
+void MultigridSolverGPU::checkGLError(const std::string& operation)
+{
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR) {
+        std::cerr << "OpenGL error in " << operation << ": " << error << std::endl;
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include "MultigridSolver.h"
+
+/// Geometric multigrid pressure solver running as compute shaders, the GPU side of MultigridSolver
+/// with the same hierarchy, smoother and transfers. The finest level is the pressure and rhs
+/// textures handed to solve(), the coarse levels are r32f textures owned by the solver.
+///
+/// A V-cycle runs mg_smooth red-black half-sweeps, mg_restrict into the level below, recurses,
+/// then mg_prolong and the post-smoothing back on the way up. mg_residual reduces the squared
+/// residual per workgroup into an SSBO; reading it back stalls the pipeline, so the residual is
+/// only measured when asked for.
+class MultigridSolverGPU
+{
+public:
+    MultigridSolverGPU();
+    ~MultigridSolverGPU();
+
+    /// Loads the passes and builds the hierarchy below a grid of `resolution` nodes `cellSize`
+    /// apart. Call again when the grid changes, the previous textures are released.
+    bool initialize(const glm::ivec3& resolution, const glm::vec3& cellSize);
+
+    /// Takes effect with the next solve, a new level count rebuilds the hierarchy
+    void setParameters(const MultigridParameters& params) { multigridParams = params; }
+    const MultigridParameters& getParameters() const { return multigridParams; }
+
+    /// Runs the V-cycles on the r32f `pressureTexture`, which holds the initial guess, against
+    /// `rhsTexture`. With `residuals`, the RMS residual before the first cycle and after every
+    /// cycle is stored there, which waits for the GPU after each cycle.
+    void solve(GLuint pressureTexture, GLuint rhsTexture, std::vector<float>* residuals = nullptr);
+
+    /// RMS of rhs - laplacian(pressure) on the finest grid. Waits for the GPU.
+    float residualNorm(GLuint pressureTexture, GLuint rhsTexture);
+
+    /// Levels of the current hierarchy, after capping to the grid size
+    int getLevelCount() const { return int(levels.size()); }
+
+    bool isInitialized() const { return initialized; }
+
+    void cleanup();
+
+private:
+    struct Level
+    {
+        glm::ivec3 resolution;
+        glm::vec3 cellSize;
+        GLuint pressureTexture = 0;  // Correction on the coarse levels, the caller's on the finest
+        GLuint rhsTexture = 0;       // Restricted residual on the coarse levels, the caller's on the finest
+    };
+
+    /// Locations of the grid uniforms of fluid_common.glsl, which change with the level
+    struct GridUniformLocations
+    {
+        GLint resolution = -1;
+        GLint cellSize = -1;
+        GLint coarseResolution = -1;  // mg_restrict and mg_prolong only
+    };
+
+    MultigridParameters multigridParams;
+    std::vector<Level> levels;
+
+    GLuint smoothProgram;
+    GLuint restrictProgram;
+    GLuint prolongProgram;
+    GLuint residualProgram;
+    GridUniformLocations smoothUniforms;
+    GridUniformLocations restrictUniforms;
+    GridUniformLocations prolongUniforms;
+    GridUniformLocations residualUniforms;
+    GLint colorLocation;
+
+    GLuint residualBuffer;  // One float per workgroup of the finest level
+    std::vector<float> groupSums;
+
+    bool initialized;
+
+    GLuint loadPass(const std::string& filepath, GridUniformLocations& uniforms);
+
+    /// Rebuilds the hierarchy if the level count changed
+    void buildLevels();
+
+    void deleteLevelTextures();
+
+    /// Binds the program and sets the grid uniforms of `level`, plus the coarse resolution of the
+    /// level below for the transfers
+    void useLevel(GLuint program, const GridUniformLocations& uniforms, int level);
+
+    void vCycle(int level);
+
+    /// Red-black Gauss-Seidel sweeps, in place
+    void smooth(int level, int sweeps);
+
+    /// Averages the residual of `level` into the rhs of the level below and zeroes its pressure
+    void restrictResidual(int level);
+
+    /// Adds the interpolated correction of the level below to the pressure of `level`
+    void prolongate(int level);
+
+    float residualNorm(int level);
+
+    void checkGLError(const std::string& operation);
+};
@@ -0,0 +1,326 @@
+#include "Noise.h"
+#include <algorithm>
+#include <cmath>
+
+// Every step below has a line-for-line counterpart in project_others/noise.glsl, keep them in sync.
+// The per-point functions avoid anything the compiler could turn into a branch, so the loops of
+// the batch functions vectorise. They are force-inlined, the loops only vectorise with the whole
+// point in their body.
+
+#if defined(_MSC_VER)
+#define NOISE_INLINE __forceinline
+#else
+#define NOISE_INLINE inline __attribute__((always_inline))
+#endif
+
+namespace
+{
+const float F3 = 1.0f / 3.0f;  // Skews a point into simplex cell space
+const float G3 = 1.0f / 6.0f;  // Unskews it back
+
+// Offsets of the second and third potential of curl3(), far enough apart to be uncorrelated
+const glm::vec3 curlOffsetB(31.341f, -43.277f, 12.685f);
+const glm::vec3 curlOffsetC(-57.925f, 24.117f, -71.439f);
+
+/// floor() for values that fit an int. Unlike floor() it vectorises without SSE4.1.
+NOISE_INLINE float fastFloor(float v)
+{
+    const int truncated = int(v);
+    return float(truncated - int(v < float(truncated)));
+}
+
+/// Avalanching integer hash (lowbias32)
+NOISE_INLINE uint32_t hashMix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return h;
+}
+
+NOISE_INLINE uint32_t cornerHash(int32_t i, int32_t j, int32_t k)
+{
+    return hashMix((uint32_t(i) * 73856093U) ^ (uint32_t(j) * 19349663U) ^ (uint32_t(k) * 83492791U));
+}
+
+/// One of the 12 cube edge directions of improved Perlin noise (4 of them twice), picked by the
+/// low 4 bits of `h`
+NOISE_INLINE void gradient(uint32_t h, float& gx, float& gy, float& gz)
+{
+    // Bit arithmetic instead of comparisons, the compiler would turn those into branches. Signed,
+    // x86 has no unsigned to float conversion before AVX-512.
+    const int32_t b = int32_t(h & 15U);
+    const int32_t b0 = b & 1;
+    const int32_t b1 = (b >> 1) & 1;
+    const int32_t b2 = (b >> 2) & 1;
+    const int32_t b3 = b >> 3;
+    const float su = float(1 - 2 * b0);
+    const float sv = float(1 - 2 * b1);
+    const float uIsX = float(1 - b3);              // b < 8
+    const float vIsY = float((1 - b3) * (1 - b2)); // b < 4
+    const float vIsX = float(b3 * b2 * (1 - b0));  // b is 12 or 14
+    gx = uIsX * su + vIsX * sv;
+    gy = (1.0f - uIsX) * su + vIsY * sv;
+    gz = (1.0f - vIsY - vIsX) * sv;
+}
+
+NOISE_INLINE float gradientDot(uint32_t h, float x, float y, float z)
+{
+    float gx, gy, gz;
+    gradient(h, gx, gy, gz);
+    return gx * x + gy * y + gz * z;
+}
+
+/// Contribution of one simplex corner at offset (x, y, z), its gradient is added to d
+NOISE_INLINE float simplexCorner(uint32_t h, float x, float y, float z, float& dx, float& dy, float& dz)
+{
+    float gx, gy, gz;
+    gradient(h, gx, gy, gz);
+    // Falloff radius^2 of 0.5 rather than the common 0.6, the corners then do not reach past the
+    // simplex and the noise and its gradient are continuous. max(t0, 0) is written so the compiler
+    // cannot split the loop on t0 > 0, the result is the same.
+    const float t0 = 0.5f - x * x - y * y - z * z;
+    const float t = 0.5f * (t0 + std::fabs(t0));
+    const float t2 = t * t;
+    const float t4 = t2 * t2;
+    const float g = gx * x + gy * y + gz * z;
+
+    // d/dp (t^4 g) = t^4 grad - 8 t^3 g p
+    const float radial = 8.0f * t2 * t * g;
+    dx += t4 * gx - radial * x;
+    dy += t4 * gy - radial * y;
+    dz += t4 * gz - radial * z;
+    return t4 * g;
+}
+
+/// Offsets of the second and third simplex corners from the first. `xy`, `yz` and `xz` are 1 where
+/// the first named coordinate of the offset to the first corner is at least the second. The second
+/// corner steps along the largest axis, the third along the two largest.
+NOISE_INLINE void cornerOffsets(int32_t xy, int32_t yz, int32_t xz, int32_t& i1, int32_t& j1, int32_t& k1,
+    int32_t& i2, int32_t& j2, int32_t& k2)
+{
+    i1 = xy & xz;
+    j1 = yz & (xy ^ 1);
+    k1 = (yz ^ 1) & (xz ^ 1);
+    i2 = xy | xz;
+    j2 = yz | (xy ^ 1);
+    k2 = (yz ^ 1) | (xz ^ 1);
+}
+
+NOISE_INLINE float simplexPoint(float x, float y, float z, float& dx, float& dy, float& dz)
+{
+    // Cell of the skewed lattice and the offset to its first corner
+    const float s = (x + y + z) * F3;
+    const float fi = fastFloor(x + s);
+    const float fj = fastFloor(y + s);
+    const float fk = fastFloor(z + s);
+    const float t = (fi + fj + fk) * G3;
+    const float x0 = x - (fi - t);
+    const float y0 = y - (fj - t);
+    const float z0 = z - (fk - t);
+
+    // The other corners follow the axes ordered by offset
+    int32_t i1, j1, k1, i2, j2, k2;
+    cornerOffsets(int32_t(x0 >= y0), int32_t(y0 >= z0), int32_t(x0 >= z0), i1, j1, k1, i2, j2, k2);
+
+    const float x1 = x0 - float(i1) + G3;
+    const float y1 = y0 - float(j1) + G3;
+    const float z1 = z0 - float(k1) + G3;
+    const float x2 = x0 - float(i2) + 2.0f * G3;
+    const float y2 = y0 - float(j2) + 2.0f * G3;
+    const float z2 = z0 - float(k2) + 2.0f * G3;
+    const float x3 = x0 - 1.0f + 3.0f * G3;
+    const float y3 = y0 - 1.0f + 3.0f * G3;
+    const float z3 = z0 - 1.0f + 3.0f * G3;
+
+    const int32_t i = int32_t(fi);
+    const int32_t j = int32_t(fj);
+    const int32_t k = int32_t(fk);
+    dx = dy = dz = 0.0f;
+    float n = simplexCorner(cornerHash(i, j, k), x0, y0, z0, dx, dy, dz);
+    n += simplexCorner(cornerHash(i + i1, j + j1, k + k1), x1, y1, z1, dx, dy, dz);
+    n += simplexCorner(cornerHash(i + i2, j + j2, k + k2), x2, y2, z2, dx, dy, dz);
+    n += simplexCorner(cornerHash(i + 1, j + 1, k + 1), x3, y3, z3, dx, dy, dz);
+
+    // Scales the peaks to about +-1
+    dx *= 76.0f;
+    dy *= 76.0f;
+    dz *= 76.0f;
+    return 76.0f * n;
+}
+
+NOISE_INLINE void curlPoint(float x, float y, float z, float& vx, float& vy, float& vz)
+{
+    float ax, ay, az, bx, by, bz, cx, cy, cz;
+    simplexPoint(x, y, z, ax, ay, az);
+    simplexPoint(x + curlOffsetB.x, y + curlOffsetB.y, z + curlOffsetB.z, bx, by, bz);
+    simplexPoint(x + curlOffsetC.x, y + curlOffsetC.y, z + curlOffsetC.z, cx, cy, cz);
+    vx = cy - bz;
+    vy = az - cx;
+    vz = bx - ay;
+}
+
+NOISE_INLINE float fade(float t)
+{
+    return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+}
+
+NOISE_INLINE float lerp(float a, float b, float t)
+{
+    return a + t * (b - a);
+}
+
+NOISE_INLINE float perlinPoint(float x, float y, float z)
+{
+    const float fi = fastFloor(x);
+    const float fj = fastFloor(y);
+    const float fk = fastFloor(z);
+    const float x0 = x - fi;
+    const float y0 = y - fj;
+    const float z0 = z - fk;
+    const float x1 = x0 - 1.0f;
+    const float y1 = y0 - 1.0f;
+    const float z1 = z0 - 1.0f;
+    const float u = fade(x0);
+    const float v = fade(y0);
+    const float w = fade(z0);
+
+    const int32_t i = int32_t(fi);
+    const int32_t j = int32_t(fj);
+    const int32_t k = int32_t(fk);
+    const float n000 = gradientDot(cornerHash(i, j, k), x0, y0, z0);
+    const float n100 = gradientDot(cornerHash(i + 1, j, k), x1, y0, z0);
+    const float n010 = gradientDot(cornerHash(i, j + 1, k), x0, y1, z0);
+    const float n110 = gradientDot(cornerHash(i + 1, j + 1, k), x1, y1, z0);
+    const float n001 = gradientDot(cornerHash(i, j, k + 1), x0, y0, z1);
+    const float n101 = gradientDot(cornerHash(i + 1, j, k + 1), x1, y0, z1);
+    const float n011 = gradientDot(cornerHash(i, j + 1, k + 1), x0, y1, z1);
+    const float n111 = gradientDot(cornerHash(i + 1, j + 1, k + 1), x1, y1, z1);
+
+    const float nx00 = lerp(n000, n100, u);
+    const float nx10 = lerp(n010, n110, u);
+    const float nx01 = lerp(n001, n101, u);
+    const float nx11 = lerp(n011, n111, u);
+    return lerp(lerp(nx00, nx10, v), lerp(nx01, nx11, v), w);
+}
+}
+
+namespace noise
+{
+uint32_t latticeHash(int32_t i, int32_t j, int32_t k)
+{
+    return cornerHash(i, j, k);
+}
+
+void simplexCornerOffsets(int32_t xy, int32_t yz, int32_t xz, int32_t first[3], int32_t second[3])
+{
+    cornerOffsets(xy, yz, xz, first[0], first[1], first[2], second[0], second[1], second[2]);
+}
+
+float simplex3(const glm::vec3& p)
+{
+    float dx, dy, dz;
+    return simplexPoint(p.x, p.y, p.z, dx, dy, dz);
+}
+
+float simplex3(const glm::vec3& p, glm::vec3& gradient)
+{
+    return simplexPoint(p.x, p.y, p.z, gradient.x, gradient.y, gradient.z);
+}
+
+float perlin3(const glm::vec3& p)
+{
+    return perlinPoint(p.x, p.y, p.z);
+}
+
+glm::vec3 curl3(const glm::vec3& p)
+{
+    glm::vec3 v;
+    curlPoint(p.x, p.y, p.z, v.x, v.y, v.z);
+    return v;
+}
+
+void simplex3Batch(const float* x, const float* y, const float* z, float* result, int count)
+{
+    // Full blocks go through local arrays, the compiler can tell they do not alias and keeps
+    // batchWidth points in flight. The unused gradient is dropped by the optimiser.
+    int start = 0;
+    for (; start + batchWidth <= count; start += batchWidth)
+    {
+        float block[batchWidth];
+        for (int lane = 0; lane < batchWidth; ++lane)
+        {
+            float dx, dy, dz;
+            block[lane] = simplexPoint(x[start + lane], y[start + lane], z[start + lane], dx, dy, dz);
+        }
+        std::copy(block, block + batchWidth, result + start);
+    }
+    for (; start < count; ++start)
+    {
+        float dx, dy, dz;
+        result[start] = simplexPoint(x[start], y[start], z[start], dx, dy, dz);
+    }
+}
+
+void simplex3Batch(const float* x, const float* y, const float* z, float* result, float* dx, float* dy,
+    float* dz, int count)
+{
+    int start = 0;
+    for (; start + batchWidth <= count; start += batchWidth)
+    {
+        float block[batchWidth], bx[batchWidth], by[batchWidth], bz[batchWidth];
+        for (int lane = 0; lane < batchWidth; ++lane)
+        {
+            block[lane] = simplexPoint(x[start + lane], y[start + lane], z[start + lane], bx[lane], by[lane], bz[lane]);
+        }
+        std::copy(block, block + batchWidth, result + start);
+        std::copy(bx, bx + batchWidth, dx + start);
+        std::copy(by, by + batchWidth, dy + start);
+        std::copy(bz, bz + batchWidth, dz + start);
+    }
+    for (; start < count; ++start)
+    {
+        result[start] = simplexPoint(x[start], y[start], z[start], dx[start], dy[start], dz[start]);
+    }
+}
+
+void perlin3Batch(const float* x, const float* y, const float* z, float* result, int count)
+{
+    int start = 0;
+    for (; start + batchWidth <= count; start += batchWidth)
+    {
+        float block[batchWidth];
+        for (int lane = 0; lane < batchWidth; ++lane)
+        {
+            block[lane] = perlinPoint(x[start + lane], y[start + lane], z[start + lane]);
+        }
+        std::copy(block, block + batchWidth, result + start);
+    }
+    for (; start < count; ++start)
+    {
+        result[start] = perlinPoint(x[start], y[start], z[start]);
+    }
+}
+
+void curl3Batch(const float* x, const float* y, const float* z, float* vx, float* vy, float* vz, int count)
+{
+    int start = 0;
+    for (; start + batchWidth <= count; start += batchWidth)
+    {
+        float bx[batchWidth], by[batchWidth], bz[batchWidth];
+        for (int lane = 0; lane < batchWidth; ++lane)
+        {
+            curlPoint(x[start + lane], y[start + lane], z[start + lane], bx[lane], by[lane], bz[lane]);
+        }
+        std::copy(bx, bx + batchWidth, vx + start);
+        std::copy(by, by + batchWidth, vy + start);
+        std::copy(bz, bz + batchWidth, vz + start);
+    }
+    for (; start < count; ++start)
+    {
+        curlPoint(x[start], y[start], z[start], vx[start], vy[start], vz[start]);
+    }
+}
+} // namespace noise
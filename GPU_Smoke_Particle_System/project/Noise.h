@@ -0,0 +1,52 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+
+/// Gradient noise shared by the CPU flow field and the compute shaders. The lattice gradients come
+/// from an integer hash instead of a sin() based one, so no transcendental functions are involved.
+/// project_others/noise.glsl is the GLSL version: it uses the same hash, gradient set and
+/// arithmetic, so both sides pick the same gradients and agree up to float rounding.
+///
+/// The batch functions evaluate structure-of-arrays input in blocks of batchWidth points. The
+/// per-point code is branch-free, the compiler turns each block into SIMD instructions (8 lanes
+/// with AVX2, two 4 lane halves with SSE).
+namespace noise
+{
+/// Points per block of the batch functions
+const int batchWidth = 8;
+
+/// Hash of an integer lattice point
+uint32_t latticeHash(int32_t i, int32_t j, int32_t k);
+
+/// Lattice offsets of the second and third corners of the simplex a point falls in, relative to
+/// the first. `xy`, `yz` and `xz` are the 0/1 results of x0 >= y0, y0 >= z0 and x0 >= z0 on the
+/// point's offset from the first corner. Exposed so tests can check it against noise.glsl.
+void simplexCornerOffsets(int32_t xy, int32_t yz, int32_t xz, int32_t first[3], int32_t second[3]);
+
+/// 3D simplex noise, roughly in [-1, 1]
+float simplex3(const glm::vec3& p);
+
+/// 3D simplex noise and its analytic gradient
+float simplex3(const glm::vec3& p, glm::vec3& gradient);
+
+/// 3D improved Perlin noise with quintic fade, roughly in [-1, 1]
+float perlin3(const glm::vec3& p);
+
+/// Curl of the vector potential (simplex3(p), simplex3(p + b), simplex3(p + c)) with fixed offsets
+/// b and c, taken from the analytic gradients. The field is divergence-free.
+glm::vec3 curl3(const glm::vec3& p);
+
+/// simplex3() of `count` points given as coordinate arrays
+void simplex3Batch(const float* x, const float* y, const float* z, float* result, int count);
+
+/// simplex3() with gradient of `count` points, the gradient goes to dx, dy and dz
+void simplex3Batch(const float* x, const float* y, const float* z, float* result, float* dx, float* dy,
+    float* dz, int count);
+
+/// perlin3() of `count` points given as coordinate arrays
+void perlin3Batch(const float* x, const float* y, const float* z, float* result, int count);
+
+/// curl3() of `count` points given as coordinate arrays, the curl goes to vx, vy and vz
+void curl3Batch(const float* x, const float* y, const float* z, float* vx, float* vy, float* vz, int count);
+} // namespace noise
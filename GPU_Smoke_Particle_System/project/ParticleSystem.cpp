@@ -2,17 +2,20 @@
 #include "ComputeManager.h"
 #include"SmokePhysics.h"
 #include "FlowFieldGPU.h"
+#include "FluidSolverGPU.h"
+#include "JobPool.h"
 #include <algorithm> 
 #include <iostream>
 
 ParticleSystem::ParticleSystem(int capacity)
     : max_size(capacity), activeParticleCount(0), totalParticleCount(0), useGPUCompute(false)
 {
-    gl_data_temp_buffer.resize(max_size);
+    gl_depth_temp_buffer.resize(max_size);
     particles.reserve(max_size);
     newParticles.reserve(100);
 
     flowFieldGPU = new FlowFieldGPU();
+    fluidSolver = new FluidSolverGPU();
 }
 
 ParticleSystem::~ParticleSystem()
@@ -20,9 +23,20 @@ ParticleSystem::~ParticleSystem()
     if (gl_vao != 0) {
         glDeleteVertexArrays(1, &gl_vao);
     }
+    if (ssboVAO != 0) {
+        glDeleteVertexArrays(1, &ssboVAO);
+    }
+    for (GLsync& fence : uploadFences) {
+        if (fence != nullptr) {
+            glDeleteSync(fence);
+        }
+    }
     if (gl_buffer != 0) {
         glDeleteBuffers(1, &gl_buffer);
     }
+    // The solver works on the flow field's texture, it goes first
+    delete fluidSolver;
+    fluidSolver = nullptr;
     if (flowFieldGPU) 
     {
         delete flowFieldGPU;
@@ -42,7 +56,20 @@ void ParticleSystem::init_gpu_data()
 
     // Allocate GPU memory space, each particle requires a vec4 (4 floats)
     GLsizeiptr bufferSize = max_size * sizeof(glm::vec4);
-    glBufferData(GL_ARRAY_BUFFER, bufferSize, nullptr, GL_DYNAMIC_DRAW);
+    if (GLEW_ARB_buffer_storage)
+    {
+        // One region per frame in flight, mapped once for the lifetime of the buffer. Coherent
+        // mapping makes the writes visible to the GPU without explicit flushes.
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, bufferSize * numUploadRegions, nullptr, flags);
+        mappedVertexData = static_cast<glm::vec4*>(
+            glMapBufferRange(GL_ARRAY_BUFFER, 0, bufferSize * numUploadRegions, flags));
+    }
+    if (mappedVertexData == nullptr)
+    {
+        glBufferData(GL_ARRAY_BUFFER, bufferSize, nullptr, GL_DYNAMIC_DRAW);
+        gl_data_temp_buffer.resize(max_size);
+    }
 
     // Setting vertex attributes
     glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)0);
@@ -50,17 +77,67 @@ void ParticleSystem::init_gpu_data()
 
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glGenVertexArrays(1, &ssboVAO);
 }
 
-void ParticleSystem::process_particles(float dt)
+glm::vec4* ParticleSystem::beginUpload()
+{
+    if (mappedVertexData == nullptr)
+    {
+        return gl_data_temp_buffer.data();
+    }
+
+    // The previous region's draw has been issued by now, fence it so we know when it is free again
+    if (uploadRegion >= 0)
+    {
+        uploadFences[uploadRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    uploadRegion = (uploadRegion + 1) % numUploadRegions;
+
+    // Normally the region was released two frames ago and this returns at once
+    GLsync& fence = uploadFences[uploadRegion];
+    if (fence != nullptr)
+    {
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        while (result == GL_TIMEOUT_EXPIRED)
+        {
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        }
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+    return mappedVertexData + size_t(uploadRegion) * max_size;
+}
+
+void ParticleSystem::endUpload(unsigned int numParticles)
 {
-    // First loop: Update alive particles
-    for (unsigned i = 0; i < particles.size(); ++i) 
+    glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+    if (mappedVertexData == nullptr)
     {
-        Particle& particle = particles[i];
-        particle.pos += particle.velocity * dt;
-        particle.lifetime += dt;
+        GLsizeiptr dataSize = numParticles * sizeof(glm::vec4);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, dataSize, gl_data_temp_buffer.data());
+        return;
     }
+
+    // Point the vao at the region that was just written
+    const size_t offset = size_t(uploadRegion) * max_size * sizeof(glm::vec4);
+    glBindVertexArray(gl_vao);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)offset);
+    glBindVertexArray(0);
+}
+
+void ParticleSystem::process_particles(float dt)
+{
+    // First loop: Update alive particles, in parallel chunks
+    labhelper::parallelFor(jobPool, int(particles.size()), jobGrain, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            Particle& particle = particles[i];
+            particle.pos += particle.velocity * dt;
+            particle.lifetime += dt;
+        }
+    });
     // Second loop: Kill dead particles (iterate backwards to handle index changes)
     for (int i = particles.size() - 1; i >= 0; --i) {
         const Particle& particle = particles[i];
@@ -72,6 +149,9 @@ void ParticleSystem::process_particles(float dt)
 
 void ParticleSystem::submit_to_gpu(const glm::mat4& viewMat)
 {
+    if (isRenderingFromSSBO()) {
+        return;
+    }
     if (useGPUCompute) {
         syncGPUData();
     }
@@ -82,33 +162,44 @@ void ParticleSystem::submit_to_gpu(const glm::mat4& viewMat)
         return;
     }
 
-    // Extract and convert particle data
-    for (unsigned int i = 0; i < num_active_particles; i++)
+    const uint32_t* order = nullptr;
+    if (depthSort)
     {
-        const Particle& particle = particles[i];
+        // The sort only needs the view space depth, which is the third row of the view matrix
+        const glm::vec4 depthRow(viewMat[0][2], viewMat[1][2], viewMat[2][2], viewMat[3][2]);
+        labhelper::parallelFor(jobPool, num_active_particles, jobGrain, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                const glm::vec3 pos = particles[i].pos - particles[i].velocity * renderLag;
+                gl_depth_temp_buffer[i] = depthRow.x * pos.x + depthRow.y * pos.y + depthRow.z * pos.z + depthRow.w;
+            }
+        });
 
-        // Convert particle positions to view space
-        glm::vec4 viewSpacePos = viewMat * glm::vec4(particle.pos, 1.0f);
+        // Sort particles by depth, back to front. The particles are rebuilt from the GPU buffer
+        // every frame, so there is no previous order worth repairing.
+        order = depth_sorter.sort(gl_depth_temp_buffer.data(), num_active_particles);
+    }
 
-        // Normalized lifespan: 0 = just created, 1 = about to die
-        float normalizedLifetime = particle.lifetime / particle.life_length;
-        normalizedLifetime = glm::clamp(normalizedLifetime, 0.0f, 1.0f);
+    // Extract and convert particle data in sorted order, straight into the upload region
+    glm::vec4* destination = beginUpload();
+    labhelper::parallelFor(jobPool, num_active_particles, jobGrain, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            const Particle& particle = particles[order ? order[i] : i];
 
-        // Pack the data into a vec4: xyz is the view space position, w is the normalized lifetime
-        gl_data_temp_buffer[i] = glm::vec4(viewSpacePos.x, viewSpacePos.y, viewSpacePos.z, normalizedLifetime);
-    }
+            // Convert particle positions to view space
+            glm::vec4 viewSpacePos = viewMat * glm::vec4(particle.pos - particle.velocity * renderLag, 1.0f);
 
-    // Sort particles by depth
-    std::sort(gl_data_temp_buffer.begin(),
-        std::next(gl_data_temp_buffer.begin(), num_active_particles),
-        [](const glm::vec4& lhs, const glm::vec4& rhs) {
-            return lhs.z < rhs.z;
-        });
+            // Normalized lifespan: 0 = just created, 1 = about to die
+            float normalizedLifetime = (particle.lifetime - renderLag) / particle.life_length;
+            normalizedLifetime = glm::clamp(normalizedLifetime, 0.0f, 1.0f);
 
-    // Upload data to GPU
-    glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
-    GLsizeiptr dataSize = num_active_particles * sizeof(glm::vec4);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, dataSize, gl_data_temp_buffer.data());
+            // Pack the data into a vec4: xyz is the view space position, w is the normalized lifetime
+            destination[i] = glm::vec4(viewSpacePos.x, viewSpacePos.y, viewSpacePos.z, normalizedLifetime);
+        }
+    });
+
+    endUpload(num_active_particles);
 }
 
 
@@ -173,7 +264,12 @@ void ParticleSystem::updateParticlesGPU(float deltaTime, float currentTime)
 
         if (useFlowField && flowFieldGPU) 
         {
-            flowFieldGPU->updateFlowField(currentTime);
+            if (useFluidSolver && fluidSolver->isInitialized()) {
+                fluidSolver->step(deltaTime);
+            }
+            else {
+                flowFieldGPU->updateFlowField(currentTime);
+            }
             computeManager->updateParticlesWithPhysicsAndFlow(deltaTime, totalParticleCount, physicsParams, flowFieldGPU);
         }
         else
@@ -181,25 +277,72 @@ void ParticleSystem::updateParticlesGPU(float deltaTime, float currentTime)
             computeManager->updateParticlesWithPhysics(deltaTime, totalParticleCount, physicsParams);
         }
 
-        // Get updated count information
-        auto counters = computeManager->getParticleCounters();
-        activeParticleCount = counters.alive_count;
-
-        // Periodically compress the particle array
-        static float accumTime = 0.0f;
-        accumTime += deltaTime;
-        if (accumTime > compactInterval && counters.dead_count > max_size / 4) {
-            compactParticles();
-            accumTime = 0.0f;
+        // Squeeze out the dead particles so the next dispatch only covers live ones. The emitter
+        // reuses dead slots anyway, so compaction can also wait until the holes pile up. The dead
+        // count is a few frames old and is dropped after a compaction until a newer one arrives,
+        // so a single pile-up does not trigger several compactions in a row.
+        // An amortised depth sort refers to slots, so particles must not move under it.
+        const bool sortNeedsStableSlots = gpuDepthSort && gpuSortStepsPerFrame != 0;
+        if (!sortNeedsStableSlots && (compactEveryFrame || deadParticleCount > totalParticleCount / 4)) {
+            computeManager->compactParticles(totalParticleCount);
+            compactionCount++;
+            deadParticleCount = 0;
         }
+        requestCounters();
     }
+    pollCounters();
 
-    if (totalParticleCount > 0) 
+    // The SSBO path draws from the GPU buffer, the particles never come back to the CPU
+    if (totalParticleCount > 0 && !isRenderingFromSSBO()) 
     {
         syncGPUData();
     }
 }
 
+GLsizei ParticleSystem::getDrawParticleCount() const
+{
+    if (isRenderingFromSSBO()) {
+        return static_cast<GLsizei>(totalParticleCount);
+    }
+    return get_particle_count();
+}
+
+void ParticleSystem::sortParticlesGPU(const glm::mat4& viewMat)
+{
+    if (!isRenderingFromSSBO() || !gpuDepthSort) {
+        return;
+    }
+    computeManager->sortParticlesByDepth(viewMat, renderLag, totalParticleCount, gpuSortStepsPerFrame);
+}
+
+unsigned int ParticleSystem::getSortedParticleCount() const
+{
+    if (!isRenderingFromSSBO() || !gpuDepthSort) {
+        return 0;
+    }
+    return computeManager->getSortedCount();
+}
+
+void ParticleSystem::drawFromSSBO()
+{
+    if (!isRenderingFromSSBO() || totalParticleCount == 0) {
+        return;
+    }
+
+    // The vertex count comes from the GPU counters, totalParticleCount is only an upper bound. The
+    // command is written here since emission runs after the update pass.
+    computeManager->writeDrawCommand(getSortedParticleCount());
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, computeManager->getParticleSSBO());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, computeManager->getCounterSSBO());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, computeManager->getSortedIndexBuffer());
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, computeManager->getDrawCommandBuffer());
+    glBindVertexArray(ssboVAO);
+    glDrawArraysIndirect(GL_POINTS, nullptr);
+    glBindVertexArray(0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
 void ParticleSystem::uploadNewParticles()
 {
     if (newParticles.empty() || !computeManager) {
@@ -211,6 +354,9 @@ void ParticleSystem::uploadNewParticles()
         return;
     }
 
+    // The emitter may have changed the counters since the last read
+    refreshCounters();
+
     unsigned int canAdd = std::min(static_cast<unsigned int>(newParticles.size()),
         max_size - totalParticleCount);
 
@@ -247,9 +393,10 @@ void ParticleSystem::uploadNewParticles()
     // Update count
     totalParticleCount += canAdd;
     activeParticleCount += canAdd;
+    emittedParticles += canAdd;
 
     // Update the counter on the GPU side
-    computeManager->updateParticleCounters(activeParticleCount, totalParticleCount);
+    computeManager->updateParticleCounters(activeParticleCount, deadParticleCount, totalParticleCount);
 
     newParticles.clear();
 }
@@ -264,7 +411,14 @@ void ParticleSystem::syncGPUData()
 
 void ParticleSystem::downloadParticleData()
 {
-    if (!computeManager || totalParticleCount == 0) {
+    if (!computeManager) {
+        return;
+    }
+
+    // totalParticleCount is only an upper bound after an emission
+    refreshCounters();
+    if (totalParticleCount == 0) {
+        particles.clear();
         return;
     }
 
@@ -303,57 +457,67 @@ void ParticleSystem::downloadParticleData()
 
 void ParticleSystem::compactParticles()
 {
-    if (!useGPUCompute || !computeManager) {
+    if (!useGPUCompute || !computeManager || totalParticleCount == 0) {
         return;
     }
 
-    downloadParticleData();
+    computeManager->compactParticles(totalParticleCount);
+    compactionCount++;
+    deadParticleCount = 0;
+}
 
-    // Re-upload the compressed data
-    GLuint particleSSBO = computeManager->getParticleSSBO();
-    if (particleSSBO == 0 || particles.empty()) {
+void ParticleSystem::refreshCounters()
+{
+    auto counters = computeManager->getParticleCounters();
+    activeParticleCount = counters.alive_count;
+    deadParticleCount = counters.dead_count;
+    totalParticleCount = counters.total_count;
+}
+
+void ParticleSystem::requestCounters()
+{
+    const unsigned int requestId = computeManager->requestCounterReadback();
+    if (requestId == 0) {
         return;
     }
 
-    // Preparing compressed data
-    std::vector<float> compactData;
-    compactData.reserve(particles.size() * 8);
+    CounterRequest& request = counterRequests[requestId % ComputeManager::counterReadbackRingSize];
+    request.emittedParticles = emittedParticles;
+    request.compactionCount = compactionCount;
+}
 
-    for (const auto& p : particles) 
-    {
-        compactData.push_back(p.pos.x);
-        compactData.push_back(p.pos.y);
-        compactData.push_back(p.pos.z);
-        compactData.push_back(p.lifetime);
-        compactData.push_back(p.velocity.x);
-        compactData.push_back(p.velocity.y);
-        compactData.push_back(p.velocity.z);
-        compactData.push_back(p.life_length);
+void ParticleSystem::pollCounters()
+{
+    ParticleCounters counters;
+    const unsigned int requestId = computeManager->pollCounterReadback(counters);
+    if (requestId == 0) {
+        return;
     }
 
-    // Upload compressed data
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleSSBO);
-    GLsizeiptr dataSize = compactData.size() * sizeof(float);
-    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, dataSize, compactData.data());
-
-    // Clear the remaining part
-    if (particles.size() < totalParticleCount) {
-        GLsizeiptr clearOffset = dataSize;
-        GLsizeiptr clearSize = (totalParticleCount - particles.size()) * 8 * sizeof(float);
-        std::vector<float> zeroData(clearSize / sizeof(float), 0.0f);
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, clearOffset, clearSize, zeroData.data());
-    }
+    // The counters describe the buffer a few frames ago. Compactions since then only shrink the live
+    // range, while emissions may have grown it by at most the number of particles emitted since.
+    const CounterRequest& request = counterRequests[requestId % ComputeManager::counterReadbackRingSize];
+    const unsigned int emittedSince = emittedParticles - request.emittedParticles;
+    totalParticleCount = std::min(static_cast<unsigned int>(max_size), counters.total_count + emittedSince);
+    activeParticleCount = std::min(totalParticleCount, counters.alive_count + emittedSince);
 
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    // A dead count from before the last compaction no longer describes any hole
+    deadParticleCount = (request.compactionCount == compactionCount) ? counters.dead_count : 0;
+}
 
-    // Update count
-    totalParticleCount = particles.size();
-    activeParticleCount = particles.size();
+void ParticleSystem::emitParticlesGPU(unsigned int count, const EmitterParametersGPU& emitter)
+{
+    if (!useGPUCompute || !computeManager || count == 0) {
+        return;
+    }
 
-    // Update GPU counters
-    computeManager->updateParticleCounters(activeParticleCount, totalParticleCount);
+    computeManager->emitParticles(count, emitter, emitSeed++);
+    emittedParticles += count;
 
-    std::cout << "Compacted particles: " << totalParticleCount << " alive" << std::endl;
+    // Exact counts come with the next counter read, until then assume the worst case so the update
+    // dispatch covers every slot the emitter may have taken from the end of the live range
+    totalParticleCount = std::min(static_cast<unsigned int>(max_size), totalParticleCount + count);
+    activeParticleCount = std::min(totalParticleCount, activeParticleCount + count);
 }
 
 
@@ -383,6 +547,13 @@ void ParticleSystem::syncPhysicsFromCPU(const SmokePhysics* smokePhysics)
 
         computeManager->setPhysicsParameters(gpuParams);
 
+        const IntegratorSettings& integrator = cpuParams.integrator;
+        IntegratorSettingsGPU gpuIntegrator;
+        gpuIntegrator.integrator = static_cast<unsigned int>(integrator.type);
+        gpuIntegrator.maxSubsteps = integrator.adaptiveSubsteps ? static_cast<unsigned int>(std::max(1, integrator.maxSubsteps)) : 1u;
+        gpuIntegrator.cflNumber = integrator.cflNumber;
+        computeManager->setIntegratorSettings(gpuIntegrator);
+
         std::cout << "Synced physics parameters from CPU to GPU" << std::endl;
     }
 }
@@ -405,7 +576,9 @@ void ParticleSystem::setFlowFieldParameters(const glm::vec3& windDir, float stre
         }
 
         // Generate flow field data
-        flowFieldGPU->generateUniformWind(windParams, 0.0f);
+        if (flowFieldGPU->getFieldType() == FlowFieldType::UNIFORM_WIND) {
+            flowFieldGPU->generateUniformWind(windParams, 0.0f);
+        }
 
         std::cout << "Flow field parameters updated: direction=("
             << windDir.x << "," << windDir.y << "," << windDir.z
@@ -414,6 +587,28 @@ void ParticleSystem::setFlowFieldParameters(const glm::vec3& windDir, float stre
     }
 }
 
+void ParticleSystem::setCurlNoiseParameters(const CurlNoiseParameters& params, float influence)
+{
+    if (flowFieldGPU && useGPUCompute) 
+    {
+        flowFieldGPU->setCurlNoiseParameters(params);
+        if (computeManager) {
+            computeManager->setFlowInfluence(influence);
+        }
+
+        if (flowFieldGPU->getFieldType() == FlowFieldType::CURL_NOISE) {
+            flowFieldGPU->generateCurlNoise(params, 0.0f);
+        }
+    }
+}
+
+void ParticleSystem::setFlowFieldType(FlowFieldType type)
+{
+    if (flowFieldGPU) {
+        flowFieldGPU->setFieldType(type);
+    }
+}
+
 void ParticleSystem::enableFlowField(bool enable)
 {
     useFlowField = enable;
@@ -436,5 +631,38 @@ void ParticleSystem::initializeFlowFieldWithBounds(const glm::vec3& worldMin, co
     if (flowFieldGPU && useGPUCompute) 
     {
         flowFieldGPU->initialize(glm::ivec3(64, 64, 64), worldMin, worldMax);
+        fluidSolver->initialize(flowFieldGPU);
+    }
+}
+
+void ParticleSystem::setFlowFieldResolution(int resolution)
+{
+    if (!flowFieldGPU || !flowFieldGPU->isInitialized() || flowFieldGPU->getBounds().resolution == glm::ivec3(resolution)) {
+        return;
+    }
+
+    // initialize() restores the default wind, keep the current one
+    const FlowFieldBounds bounds = flowFieldGPU->getBounds();
+    const UniformWindParameters windParams = flowFieldGPU->getWindParameters();
+    flowFieldGPU->cleanup();
+    if (!flowFieldGPU->initialize(glm::ivec3(resolution), bounds.worldMin, bounds.worldMax)) {
+        return;
+    }
+    flowFieldGPU->setWindParameters(windParams);
+
+    // The solver keeps its parameters but starts from the analytic field
+    const FluidParameters fluidParams = fluidSolver->getParameters();
+    fluidSolver->initialize(flowFieldGPU);
+    fluidSolver->setParameters(fluidParams);
+    flowFieldGPU->setFieldType(flowFieldGPU->getFieldType());
+}
+
+void ParticleSystem::enableFluidSolver(bool enable)
+{
+    useFluidSolver = enable;
+
+    // Put the analytic field back, the generator only refreshes it as time passes
+    if (!enable && flowFieldGPU) {
+        flowFieldGPU->setFieldType(flowFieldGPU->getFieldType());
     }
 }
\ No newline at end of file
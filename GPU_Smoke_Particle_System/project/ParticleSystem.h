@@ -4,9 +4,18 @@
 #include <vector>
 #include <glm/detail/type_vec3.hpp>
 #include <glm/mat4x4.hpp>
+#include "DepthSort.h"
+#include "ComputeManager.h"
 
-class ComputeManager;
 class FlowFieldGPU;
+class FluidSolverGPU;
+struct CurlNoiseParameters;
+enum class FlowFieldType;
+struct EmitterParametersGPU;
+namespace labhelper
+{
+class JobPool;
+}
 
 struct Particle
 {
@@ -34,12 +43,28 @@ public:
 	/// that are past their life_length
 	void process_particles(float dt);
 
-	/// Updates the vertex buffer with the current particle properties, and renders them
+	/// Updates the vertex buffer with the current particle properties, and renders them. With
+	/// ARB_buffer_storage the vertices are written straight into a persistently mapped ring of
+	/// `numUploadRegions` regions, so the upload never waits for the previous frame's draw.
 	void submit_to_gpu(const glm::mat4& viewMat);
 
 	GLuint getVAO() const { return gl_vao; }
 	GLsizei get_particle_count() const { return static_cast<GLsizei>(particles.size()); }
 
+	/// Disables the back to front sort of the CPU path, for blending modes that do not depend on
+	/// draw order. The SSBO path has its own switch, setGPUDepthSort().
+	void setDepthSort(bool enable) { depthSort = enable; }
+
+	/// Draws every particle `seconds` behind its simulated state. A particle moves by velocity * dt
+	/// in a step, so a lag of (1 - alpha) * dt draws the blend of the last two steps of a fixed
+	/// timestep without keeping the previous positions around. The SSBO path leaves it to the
+	/// vertex shader, particle_ssbo.vert takes it as `render_lag`.
+	void setRenderLag(float seconds) { renderLag = seconds; }
+	float getRenderLag() const { return renderLag; }
+
+	/// Splits the CPU update and the view transform over `pool`, null runs them on the calling thread
+	void setJobPool(labhelper::JobPool* pool) { jobPool = pool; }
+
 	///////////////////////////////////////////////////////////////////////
 	// GPU compute
 	///////////////////////////////////////////////////////////////////////
@@ -53,12 +78,50 @@ public:
 	/// Synchronize GPU data to CPU (for rendering)
 	void syncGPUData();
 
-	/// Get the actual number of surviving particles
+	/// Get the number of surviving particles. The GPU counters are read back asynchronously, so this
+	/// is an estimate from a counter read a few frames ago plus the particles emitted since.
 	unsigned int getAliveParticleCount() const { return activeParticleCount; }
 
-	/// Compress particle array and remove dead particles (called periodically)
+	/// Draw particles straight from the compute SSBO instead of reading them back every frame
+	void setRenderFromSSBO(bool enable) { renderFromSSBO = enable; }
+
+	/// True if the particles are drawn with drawFromSSBO() rather than submit_to_gpu()
+	bool isRenderingFromSSBO() const { return useGPUCompute && renderFromSSBO; }
+
+	/// Upper bound on the points the next draw emits, dead SSBO slots included. The SSBO path only
+	/// uses it to skip empty draws, the actual count is read from the GPU counters.
+	GLsizei getDrawParticleCount() const;
+
+	/// Issues an indirect draw for the SSBO path, sized by the GPU counters. The caller binds a
+	/// program using particle_ssbo.vert
+	void drawFromSSBO();
+
+	/// Compress particle array and remove dead particles on the GPU
 	void compactParticles();
 
+	/// Compact after every update, otherwise only once a quarter of the live range is dead
+	void setCompactEveryFrame(bool enable) { compactEveryFrame = enable; }
+
+	/// Sorts the particles back to front on the GPU for the SSBO draw. Call after the last emission
+	/// of the frame and before drawFromSSBO().
+	void sortParticlesGPU(const glm::mat4& viewMat);
+
+	/// Enables the GPU depth sort, without it the SSBO path draws in slot order
+	void setGPUDepthSort(bool enable) { gpuDepthSort = enable; }
+
+	/// Caps the sort dispatches per frame, 0 sorts completely every frame. With a cap, a sort of
+	/// one frame's depths is spread over several frames and the previous completed order is drawn
+	/// meanwhile. Compaction would invalidate that order, so it is skipped while a cap is set; the
+	/// dead list still keeps the live range from growing.
+	void setGPUSortStepsPerFrame(unsigned int steps) { gpuSortStepsPerFrame = steps; }
+
+	/// Slots covered by the sorted draw order, 0 when drawing in slot order. particle_ssbo.vert
+	/// takes it as `sorted_count`.
+	unsigned int getSortedParticleCount() const;
+
+	/// Spawns `count` particles with the emission compute shader, only a few uniforms are uploaded
+	void emitParticlesGPU(unsigned int count, const EmitterParametersGPU& emitter);
+
 	///////////////////////////////////////////////////////////////////////
 	// GPU Physics Control
 	///////////////////////////////////////////////////////////////////////
@@ -76,6 +139,12 @@ public:
 	/// Setting flow field parameters	
 	void setFlowFieldParameters(const glm::vec3& windDir, float strength, float influence);
 
+	/// Setting curl noise flow field parameters
+	void setCurlNoiseParameters(const CurlNoiseParameters& params, float influence);
+
+	/// Select the flow field generator, UNIFORM_WIND or CURL_NOISE
+	void setFlowFieldType(FlowFieldType type);
+
 	/// Enable/disable flow field
 	void enableFlowField(bool enable);
 
@@ -86,6 +155,16 @@ public:
 	void setFlowInfluence(float influence);
 
 	void initializeFlowFieldWithBounds(const glm::vec3& worldMin, const glm::vec3& worldMax);
+
+	/// Recreate the flow field, and the fluid solver on it, with `resolution` nodes per axis
+	void setFlowFieldResolution(int resolution);
+
+	/// Let the fluid solver drive the flow field instead of the analytic generator
+	void enableFluidSolver(bool enable);
+	bool isFluidSolverEnabled() const { return useFluidSolver; }
+
+	/// Get the fluid solver (for external configuration)
+	FluidSolverGPU* getFluidSolver() { return fluidSolver; }
 	
 
 private:
@@ -100,8 +179,29 @@ private:
 
 	GLuint gl_vao = 0;
 	GLuint gl_buffer = 0;
+
+	/// Returns where this frame's vertices go, waiting for the ring region to be released if needed
+	glm::vec4* beginUpload();
+
+	/// Makes the vertices written since beginUpload() the ones the vao draws
+	void endUpload(unsigned int numParticles);
+
+	// Upload ring, gl_data_temp_buffer is only used when persistent mapping is unavailable
+	static const int numUploadRegions = 3;
+	glm::vec4* mappedVertexData = nullptr;
+	GLsync uploadFences[numUploadRegions] = {};
+	int uploadRegion = -1;
 	std::vector<glm::vec4> gl_data_temp_buffer;
 
+	labhelper::JobPool* jobPool = nullptr;
+	static const int jobGrain = 4096;
+	float renderLag = 0.0f;
+
+	// Depth sorting
+	DepthSorter depth_sorter;
+	std::vector<float> gl_depth_temp_buffer;
+	bool depthSort = true;
+
 	///////////////////////////////////////////////////////////////////////
 	// GPU compute
 	///////////////////////////////////////////////////////////////////////
@@ -112,24 +212,53 @@ private:
 	/// Download particle data from GPU
 	void downloadParticleData();
 
+	/// Reads the alive, dead and total counters back from the GPU, waiting for the GPU to catch up.
+	/// Only used on paths that need exact counts, such as uploading CPU-spawned particles.
+	void refreshCounters();
+
+	/// Queues an asynchronous counter readback and remembers the CPU-side state it relates to
+	void requestCounters();
+
+	/// Applies the newest completed counter readback, if any
+	void pollCounters();
+
 	// Member variables
 	unsigned int activeParticleCount;
 	unsigned int totalParticleCount;
+	unsigned int deadParticleCount = 0; // Size of the GPU dead list at the last counter read
+
+	// totalParticleCount is an upper bound on the GPU's live range between counter reads, kept
+	// valid by adding every particle emitted since the read the counters came from
+	struct CounterRequest
+	{
+		unsigned int emittedParticles = 0;
+		unsigned int compactionCount = 0;
+	};
+	CounterRequest counterRequests[ComputeManager::counterReadbackRingSize]; // One per readback slot
+	unsigned int emittedParticles = 0; // Running total, wraps
+	unsigned int compactionCount = 0;
+	unsigned int emitSeed = 1;
+	bool compactEveryFrame = true;
+	bool gpuDepthSort = true;
+	unsigned int gpuSortStepsPerFrame = 0;
 
 	ComputeManager* computeManager = nullptr;
 	bool useGPUCompute = false;
+	bool renderFromSSBO = true;
+	GLuint ssboVAO = 0; // Attribute-less vao, the vertex shader fetches from the SSBO
 
 	// CPU-side particle buffer (for new particle generation and GPU synchronization)
 	std::vector<Particle> newParticles;  // New particles waiting to be uploaded to the GPU
 	std::vector<Particle> particles;
 
-	float lastCompactTime = 0.0f;       // Last compression time
-	const float compactInterval = 2.0f;  // Compression interval (seconds)
-
 	///////////////////////////////////////////////////////////////////////
 	// GPU Flow Field
 	///////////////////////////////////////////////////////////////////////
 
 	class FlowFieldGPU* flowFieldGPU = nullptr;
 	bool useFlowField = false;
+
+	// Steps the flow field texture instead of the generator when enabled
+	FluidSolverGPU* fluidSolver = nullptr;
+	bool useFluidSolver = false;
 };
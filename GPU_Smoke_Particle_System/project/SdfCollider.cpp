@@ -0,0 +1,459 @@
+#include "SdfCollider.h"
+#include "ParticleSystem.h"
+#include "SmokePhysics.h"
+#include "JobPool.h"
+#include "Model.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+namespace
+{
+typedef std::chrono::steady_clock Clock;
+
+const char cacheMagic[4] = { 'S', 'D', 'F', '1' };
+const uint32_t cacheVersion = 1;
+
+/// Layout of the start of a cache file, followed by the distances
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    int32_t resolution[3];
+    float boundsMin[3];
+    float voxelSize;
+    float bandWidth;
+};
+
+/// A triangle of the bake with its unit normal and the box it reaches with the band around it
+struct BakeTriangle
+{
+    glm::vec3 a, b, c;
+    glm::vec3 normal;
+    glm::vec3 reachMin, reachMax;
+};
+
+/// FNV-1a over raw bytes, continuing from `hash`
+uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/// Closest point to `p` on triangle abc, from its Voronoi regions (Ericson, Real-Time Collision
+/// Detection, 5.1.5)
+glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+    const glm::vec3 ab = b - a;
+    const glm::vec3 ac = c - a;
+    const glm::vec3 ap = p - a;
+    const float d1 = glm::dot(ab, ap);
+    const float d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+    const glm::vec3 bp = p - b;
+    const float d3 = glm::dot(ab, bp);
+    const float d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) return b;
+
+    const float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+    const glm::vec3 cp = p - c;
+    const float d5 = glm::dot(ab, cp);
+    const float d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) return c;
+
+    const float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+    const float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+    {
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    const float denominator = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+} // namespace
+
+SdfCollider::~SdfCollider()
+{
+    if (texture)
+    {
+        glDeleteTextures(1, &texture);
+    }
+}
+
+void SdfCollider::addModel(const labhelper::Model& model, const glm::mat4& modelMatrix)
+{
+    trianglePositions.reserve(trianglePositions.size() + model.m_positions.size());
+    for (const glm::vec3& position : model.m_positions)
+    {
+        trianglePositions.push_back(glm::vec3(modelMatrix * glm::vec4(position, 1.0f)));
+    }
+}
+
+void SdfCollider::addTriangles(const std::vector<glm::vec3>& positions)
+{
+    trianglePositions.insert(trianglePositions.end(), positions.begin(), positions.end() - positions.size() % 3);
+}
+
+bool SdfCollider::bake(const SdfBakeSettings& settings, const std::string& cachePath)
+{
+    if (trianglePositions.size() < 3) return false;
+
+    const Clock::time_point start = Clock::now();
+    layoutGrid(settings);
+    const uint64_t key = cacheKey();
+
+    loadedFromCache = !cachePath.empty() && loadCache(cachePath, key);
+    if (!loadedFromCache)
+    {
+        bakeDistances();
+        if (!cachePath.empty())
+        {
+            saveCache(cachePath, key);
+        }
+    }
+    bakeMilliseconds = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+
+    // Keep an uploaded field in step with the new one
+    if (texture)
+    {
+        createTexture();
+    }
+    return true;
+}
+
+void SdfCollider::layoutGrid(const SdfBakeSettings& settings)
+{
+    glm::vec3 lo = trianglePositions[0];
+    glm::vec3 hi = trianglePositions[0];
+    for (const glm::vec3& position : trianglePositions)
+    {
+        lo = glm::min(lo, position);
+        hi = glm::max(hi, position);
+    }
+
+    bandWidth = std::max(settings.bandWidth, 1e-4f);
+    lo -= glm::vec3(bandWidth);
+    hi += glm::vec3(bandWidth);
+
+    // Coarser voxels where the requested ones would not fit in maxResolution nodes
+    const glm::vec3 extent = hi - lo;
+    const int maxResolution = std::max(settings.maxResolution, 2);
+    const float largest = std::max(extent.x, std::max(extent.y, extent.z));
+    voxelSize = std::max(settings.voxelSize, largest / float(maxResolution - 1));
+    resolution = glm::min(glm::ivec3(glm::ceil(extent / voxelSize)) + 1, glm::ivec3(maxResolution));
+    resolution = glm::max(resolution, glm::ivec3(2));
+    boundsMin = lo;
+}
+
+void SdfCollider::bakeDistances()
+{
+    const glm::ivec3 n = resolution;
+    const float inverseVoxel = 1.0f / voxelSize;
+
+    std::vector<BakeTriangle> triangles;
+    triangles.reserve(trianglePositions.size() / 3);
+    for (size_t i = 0; i + 2 < trianglePositions.size(); i += 3)
+    {
+        BakeTriangle triangle;
+        triangle.a = trianglePositions[i];
+        triangle.b = trianglePositions[i + 1];
+        triangle.c = trianglePositions[i + 2];
+        const glm::vec3 normal = glm::cross(triangle.b - triangle.a, triangle.c - triangle.a);
+        const float area = glm::length(normal);
+        if (area <= 0.0f) continue;
+        triangle.normal = normal / area;
+        triangle.reachMin = glm::min(triangle.a, glm::min(triangle.b, triangle.c)) - bandWidth;
+        triangle.reachMax = glm::max(triangle.a, glm::max(triangle.b, triangle.c)) + bandWidth;
+        triangles.push_back(triangle);
+    }
+
+    // Buckets of bucketSize^3 nodes, each listing the triangles whose reach overlaps it, stored as
+    // offsets into one array of triangle indices
+    const glm::ivec3 buckets = (n + bucketSize - 1) / bucketSize;
+    auto bucketRange = [&](const BakeTriangle& triangle, glm::ivec3& first, glm::ivec3& last) {
+        first = glm::ivec3(glm::floor((triangle.reachMin - boundsMin) * inverseVoxel)) / bucketSize;
+        last = glm::ivec3(glm::ceil((triangle.reachMax - boundsMin) * inverseVoxel)) / bucketSize;
+        first = glm::clamp(first, glm::ivec3(0), buckets - 1);
+        last = glm::clamp(last, glm::ivec3(0), buckets - 1);
+    };
+    auto bucketIndex = [&](int x, int y, int z) { return (z * buckets.y + y) * buckets.x + x; };
+
+    std::vector<int> bucketStart(size_t(buckets.x) * buckets.y * buckets.z + 1, 0);
+    for (const BakeTriangle& triangle : triangles)
+    {
+        glm::ivec3 first, last;
+        bucketRange(triangle, first, last);
+        for (int z = first.z; z <= last.z; ++z)
+            for (int y = first.y; y <= last.y; ++y)
+                for (int x = first.x; x <= last.x; ++x)
+                    ++bucketStart[bucketIndex(x, y, z) + 1];
+    }
+    for (size_t i = 1; i < bucketStart.size(); ++i)
+    {
+        bucketStart[i] += bucketStart[i - 1];
+    }
+    std::vector<int> bucketTriangles(bucketStart.back());
+    std::vector<int> fill(bucketStart.begin(), bucketStart.end() - 1);
+    for (int t = 0; t < int(triangles.size()); ++t)
+    {
+        glm::ivec3 first, last;
+        bucketRange(triangles[t], first, last);
+        for (int z = first.z; z <= last.z; ++z)
+            for (int y = first.y; y <= last.y; ++y)
+                for (int x = first.x; x <= last.x; ++x)
+                    bucketTriangles[fill[bucketIndex(x, y, z)]++] = t;
+    }
+
+    // Every bucket lists its triangles by their distance from its center, so a node can stop at
+    // the first one that cannot be closer than the best so far even from the bucket's corner
+    const float bucketRadius = 0.5f * std::sqrt(3.0f) * float(bucketSize - 1) * voxelSize;
+    std::vector<float> bucketDistances(bucketTriangles.size());
+    labhelper::parallelFor(jobPool, buckets.z, 1, [&](int begin, int end) {
+        std::vector<std::pair<float, int>> order;
+        for (int z = begin; z < end; ++z)
+        {
+            for (int y = 0; y < buckets.y; ++y)
+            {
+                for (int x = 0; x < buckets.x; ++x)
+                {
+                    const int bucket = bucketIndex(x, y, z);
+                    const glm::vec3 center = boundsMin + (glm::vec3(x, y, z) * float(bucketSize) + 0.5f * float(bucketSize - 1)) * voxelSize;
+                    order.clear();
+                    for (int i = bucketStart[bucket]; i < bucketStart[bucket + 1]; ++i)
+                    {
+                        const BakeTriangle& triangle = triangles[bucketTriangles[i]];
+                        const float distance = glm::length(center - closestPointOnTriangle(center, triangle.a, triangle.b, triangle.c));
+                        order.push_back(std::make_pair(distance, bucketTriangles[i]));
+                    }
+                    std::sort(order.begin(), order.end());
+                    for (size_t i = 0; i < order.size(); ++i)
+                    {
+                        bucketDistances[bucketStart[bucket] + i] = order[i].first;
+                        bucketTriangles[bucketStart[bucket] + i] = order[i].second;
+                    }
+                }
+            }
+        }
+    });
+
+    distances.assign(size_t(n.x) * n.y * n.z, bandWidth);
+    labhelper::parallelFor(jobPool, n.z, 1, [&](int begin, int end) {
+        for (int z = begin; z < end; ++z)
+        {
+            for (int y = 0; y < n.y; ++y)
+            {
+                for (int x = 0; x < n.x; ++x)
+                {
+                    const glm::vec3 p = boundsMin + glm::vec3(x, y, z) * voxelSize;
+                    const int bucket = bucketIndex(x / bucketSize, y / bucketSize, z / bucketSize);
+
+                    // The sign comes from the closest triangle. Where several are equally close,
+                    // at an edge or a corner, the one `p` lies most squarely in front of or
+                    // behind decides, which is the one whose face is closest in the first place.
+                    float bestSquared = bandWidth * bandWidth;
+                    float bestAlignment = -1.0f;
+                    float bestSide = 1.0f;
+                    for (int i = bucketStart[bucket]; i < bucketStart[bucket + 1]; ++i)
+                    {
+                        const float lowerBound = bucketDistances[i] - bucketRadius;
+                        if (lowerBound > 0.0f && lowerBound * lowerBound > bestSquared * 1.0001f) break;
+
+                        const BakeTriangle& triangle = triangles[bucketTriangles[i]];
+                        if (glm::any(glm::lessThan(p, triangle.reachMin)) ||
+                            glm::any(glm::greaterThan(p, triangle.reachMax)))
+                        {
+                            continue;
+                        }
+                        const float plane = glm::dot(p - triangle.a, triangle.normal);
+                        if (plane * plane > bestSquared * 1.0001f) continue;
+
+                        const glm::vec3 offset = p - closestPointOnTriangle(p, triangle.a, triangle.b, triangle.c);
+                        const float squared = glm::dot(offset, offset);
+                        if (squared > bestSquared * 1.0001f) continue;
+
+                        const float side = glm::dot(offset, triangle.normal);
+                        const float alignment = squared > 0.0f ? std::abs(side) / std::sqrt(squared) : 1.0f;
+                        if (squared < bestSquared * 0.9999f || alignment > bestAlignment)
+                        {
+                            bestSquared = std::min(squared, bestSquared);
+                            bestAlignment = alignment;
+                            bestSide = side < 0.0f ? -1.0f : 1.0f;
+                        }
+                    }
+                    distances[(size_t(z) * n.y + y) * n.x + x] = bestSide * std::min(std::sqrt(bestSquared), bandWidth);
+                }
+            }
+        }
+    });
+}
+
+uint64_t SdfCollider::cacheKey() const
+{
+    uint64_t hash = 14695981039346656037ull;
+    hash = hashBytes(hash, trianglePositions.data(), trianglePositions.size() * sizeof(glm::vec3));
+    hash = hashBytes(hash, &resolution, sizeof(resolution));
+    hash = hashBytes(hash, &boundsMin, sizeof(boundsMin));
+    hash = hashBytes(hash, &voxelSize, sizeof(voxelSize));
+    hash = hashBytes(hash, &bandWidth, sizeof(bandWidth));
+    return hash;
+}
+
+bool SdfCollider::loadCache(const std::string& path, uint64_t key)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    CacheHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion ||
+        header.key != key || glm::ivec3(header.resolution[0], header.resolution[1], header.resolution[2]) != resolution)
+    {
+        return false;
+    }
+
+    std::vector<float> cached(size_t(resolution.x) * resolution.y * resolution.z);
+    if (!file.read(reinterpret_cast<char*>(cached.data()), cached.size() * sizeof(float))) return false;
+    distances.swap(cached);
+    return true;
+}
+
+bool SdfCollider::saveCache(const std::string& path, uint64_t key) const
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return false;
+
+    CacheHeader header;
+    std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.key = key;
+    for (int i = 0; i < 3; ++i)
+    {
+        header.resolution[i] = resolution[i];
+        header.boundsMin[i] = boundsMin[i];
+    }
+    header.voxelSize = voxelSize;
+    header.bandWidth = bandWidth;
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(distances.data()), distances.size() * sizeof(float));
+    return bool(file);
+}
+
+float SdfCollider::distanceAt(const glm::vec3& position) const
+{
+    if (distances.empty()) return bandWidth;
+
+    const glm::ivec3 n = resolution;
+    const glm::vec3 g = (position - boundsMin) / voxelSize;
+    if (glm::any(glm::lessThan(g, glm::vec3(0.0f))) || glm::any(glm::greaterThan(g, glm::vec3(n - 1))))
+    {
+        return bandWidth;
+    }
+
+    const glm::ivec3 i0 = glm::min(glm::ivec3(g), n - 2);
+    const glm::vec3 t = g - glm::vec3(i0);
+    const size_t strideY = size_t(n.x);
+    const size_t strideZ = size_t(n.x) * n.y;
+    const float* d = distances.data() + i0.z * strideZ + i0.y * strideY + i0.x;
+
+    const float c00 = glm::mix(d[0], d[1], t.x);
+    const float c10 = glm::mix(d[strideY], d[strideY + 1], t.x);
+    const float c01 = glm::mix(d[strideZ], d[strideZ + 1], t.x);
+    const float c11 = glm::mix(d[strideZ + strideY], d[strideZ + strideY + 1], t.x);
+    return glm::mix(glm::mix(c00, c10, t.y), glm::mix(c01, c11, t.y), t.z);
+}
+
+glm::vec3 SdfCollider::gradientAt(const glm::vec3& position) const
+{
+    const float h = voxelSize;
+    return glm::vec3(distanceAt(position + glm::vec3(h, 0.0f, 0.0f)) - distanceAt(position - glm::vec3(h, 0.0f, 0.0f)),
+        distanceAt(position + glm::vec3(0.0f, h, 0.0f)) - distanceAt(position - glm::vec3(0.0f, h, 0.0f)),
+        distanceAt(position + glm::vec3(0.0f, 0.0f, h)) - distanceAt(position - glm::vec3(0.0f, 0.0f, h))) / (2.0f * h);
+}
+
+bool SdfCollider::collide(glm::vec3& position, glm::vec3& velocity) const
+{
+    const float distance = distanceAt(position);
+    if (distance >= surfaceOffset) return false;
+
+    const glm::vec3 gradient = gradientAt(position);
+    const float length = glm::length(gradient);
+    if (length < 1e-6f) return false;
+    const glm::vec3 normal = gradient / length;
+
+    position += (surfaceOffset - distance) * normal;
+
+    // Only a velocity into the surface bounces, the part along it slides
+    const float normalSpeed = glm::dot(velocity, normal);
+    if (normalSpeed < 0.0f)
+    {
+        const glm::vec3 tangent = velocity - normalSpeed * normal;
+        velocity = (1.0f - collisionResponse.friction) * tangent - collisionResponse.restitution * normalSpeed * normal;
+    }
+    return true;
+}
+
+bool SdfCollider::handleCollision(Particle& particle) const
+{
+    return collide(particle.pos, particle.velocity);
+}
+
+int SdfCollider::handleCollisions(const ParticleSpans& particles) const
+{
+    if (distances.empty()) return 0;
+
+    int collisions = 0;
+    for (int i = 0; i < particles.count; ++i)
+    {
+        glm::vec3 position(particles.posX[i], particles.posY[i], particles.posZ[i]);
+        glm::vec3 velocity(particles.velX[i], particles.velY[i], particles.velZ[i]);
+        if (!collide(position, velocity)) continue;
+
+        particles.posX[i] = position.x;
+        particles.posY[i] = position.y;
+        particles.posZ[i] = position.z;
+        particles.velX[i] = velocity.x;
+        particles.velY[i] = velocity.y;
+        particles.velZ[i] = velocity.z;
+        ++collisions;
+    }
+    return collisions;
+}
+
+void SdfCollider::createTexture()
+{
+    if (distances.empty()) return;
+
+    if (texture)
+    {
+        glDeleteTextures(1, &texture);
+    }
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_3D, texture);
+
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, resolution.x, resolution.y, resolution.z, 0, GL_RED, GL_FLOAT,
+        distances.data());
+
+    glBindTexture(GL_TEXTURE_3D, 0);
+}
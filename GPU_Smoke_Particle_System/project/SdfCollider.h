@@ -0,0 +1,154 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "BoundaryManager.h"
+
+struct Particle;
+struct ParticleSpans;
+namespace labhelper
+{
+class JobPool;
+class Model;
+}
+
+/// Settings of an SdfCollider bake
+struct SdfBakeSettings
+{
+    float voxelSize = 0.25f;  // Spacing of the distance samples, grows if the grid would pass maxResolution
+    float bandWidth = 1.0f;   // Distances are exact up to this far from the surface and clamped beyond
+    int maxResolution = 128;  // Samples per axis at most
+};
+
+/// Signed distance field of static scene meshes that particles collide with, baked on the CPU and
+/// sampled by SmokePhysics and, as a 3D texture, by particle_update.comp.
+///
+/// The distances are stored at the nodes of a grid covering the triangles plus the band, positive
+/// outside and negative inside, and read back with trilinear interpolation. Only a narrow band
+/// around the surface is exact: beyond bandWidth and outside the grid the distance is bandWidth,
+/// so a particle deep inside a large mesh is not pushed out. The sign comes from the normal of the
+/// closest triangle, so the meshes should be closed and consistently wound.
+///
+/// The bake sorts the triangles into buckets of bucketSize^3 nodes, each holding the triangles
+/// within the band of it, and every node only measures the triangles of its bucket. A finished
+/// bake can be written to a cache file that is keyed by the triangles and the settings, so an
+/// unchanged scene loads instead of baking again.
+class SdfCollider
+{
+public:
+    SdfCollider() = default;
+    ~SdfCollider();
+
+    SdfCollider(const SdfCollider&) = delete;
+    SdfCollider& operator=(const SdfCollider&) = delete;
+
+    /// Adds the triangles of `model` placed by `modelMatrix` to the next bake
+    void addModel(const labhelper::Model& model, const glm::mat4& modelMatrix);
+
+    /// Adds world space triangles, three positions each
+    void addTriangles(const std::vector<glm::vec3>& positions);
+
+    /// Drops the triangles added so far, the baked field stays
+    void clearTriangles() { trianglePositions.clear(); }
+
+    /// Bakes the field of the added triangles. With a `cachePath`, a cached bake of the same
+    /// triangles and settings is loaded from there instead, and a fresh bake is written there.
+    /// Returns false if there is nothing to bake.
+    bool bake(const SdfBakeSettings& settings, const std::string& cachePath = std::string());
+
+    bool isBaked() const { return !distances.empty(); }
+
+    /// Whether the last bake() came from the cache
+    bool wasLoadedFromCache() const { return loadedFromCache; }
+
+    /// Wall clock time of the last bake() in milliseconds, loading included
+    float getBakeMilliseconds() const { return bakeMilliseconds; }
+
+    /// Pool the bake splits its z-slabs over, null bakes on the calling thread
+    void setJobPool(labhelper::JobPool* pool) { jobPool = pool; }
+
+    ///////////////////////////////////////////////////////////////////////
+    // Queries and collision
+    ///////////////////////////////////////////////////////////////////////
+
+    /// Signed distance at a world position, bandWidth outside the grid
+    float distanceAt(const glm::vec3& position) const;
+
+    /// Gradient of distanceAt() by central differences one voxel apart, it points away from the
+    /// surface
+    glm::vec3 gradientAt(const glm::vec3& position) const;
+
+    /// Pushes the particle out to surfaceOffset from the surface if it is closer, and reflects
+    /// the velocity into the surface with the collision response. Returns whether it collided.
+    bool handleCollision(Particle& particle) const;
+
+    /// handleCollision() for a batch given as arrays, returns the number of particles that
+    /// collided. Gives the same results as handleCollision() bit for bit.
+    int handleCollisions(const ParticleSpans& particles) const;
+
+    void setCollisionResponse(const CollisionResponse& response) { collisionResponse = response; }
+    const CollisionResponse& getCollisionResponse() const { return collisionResponse; }
+
+    /// Distance from the surface particles are kept at, about their radius
+    void setSurfaceOffset(float offset) { surfaceOffset = offset; }
+    float getSurfaceOffset() const { return surfaceOffset; }
+
+    ///////////////////////////////////////////////////////////////////////
+    // Field data
+    ///////////////////////////////////////////////////////////////////////
+
+    /// Uploads the distances into an r32f 3D texture with linear filtering, one texel per node
+    void createTexture();
+
+    /// The texture of createTexture(), 0 before
+    GLuint getTexture() const { return texture; }
+
+    /// Position of the first and the last node
+    const glm::vec3& getBoundsMin() const { return boundsMin; }
+    glm::vec3 getBoundsMax() const { return boundsMin + glm::vec3(resolution - 1) * voxelSize; }
+
+    const glm::ivec3& getResolution() const { return resolution; }
+    float getVoxelSize() const { return voxelSize; }
+    float getBandWidth() const { return bandWidth; }
+    size_t getTriangleCount() const { return trianglePositions.size() / 3; }
+
+    /// Distance per node, x fastest
+    const std::vector<float>& getDistances() const { return distances; }
+
+    /// Nodes per bucket side of the bake
+    static const int bucketSize = 4;
+
+private:
+    std::vector<glm::vec3> trianglePositions;
+    std::vector<float> distances;
+    glm::ivec3 resolution = glm::ivec3(0);
+    glm::vec3 boundsMin = glm::vec3(0.0f);
+    float voxelSize = 1.0f;
+    float bandWidth = 1.0f;
+
+    CollisionResponse collisionResponse;
+    float surfaceOffset = 0.1f;
+
+    GLuint texture = 0;
+    labhelper::JobPool* jobPool = nullptr;
+    bool loadedFromCache = false;
+    float bakeMilliseconds = 0.0f;
+
+    /// Fits the grid around the triangles
+    void layoutGrid(const SdfBakeSettings& settings);
+
+    /// Measures every node against the triangles of its bucket
+    void bakeDistances();
+
+    /// Key of the triangles and the grid in the cache
+    uint64_t cacheKey() const;
+
+    bool loadCache(const std::string& path, uint64_t key);
+    bool saveCache(const std::string& path, uint64_t key) const;
+
+    /// Collision of one particle, shared by the single and the batch path
+    bool collide(glm::vec3& position, glm::vec3& velocity) const;
+};
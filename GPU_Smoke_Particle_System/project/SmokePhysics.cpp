@@ -1,7 +1,120 @@
 #include "SmokePhysics.h"
 #include "ParticleSystem.h"
 #include "FlowField.h"
+#include "SdfCollider.h"
+#include "HeightGrid.h"
+#include "JobPool.h"
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+/// dv/dt = gravity + flowRate * flow - dragRate * v, the equation every integrator solves here
+/// and in particle_update.comp. The flow pulls the velocity towards it with flow_influence / mass
+/// on top of the drag, so dragRate is (drag_coefficient + flow_influence) / mass.
+struct Motion
+{
+    glm::vec3 gravity;
+    float flowRate;
+    float dragRate;
+};
+
+Motion motionOf(const PhysicsParameters& params)
+{
+    Motion motion;
+    motion.gravity = glm::vec3(0.0f, -params.gravity_strength, 0.0f);
+    motion.flowRate = params.flow_influence / params.particle_mass;
+    motion.dragRate = (params.drag_coefficient + params.flow_influence) / params.particle_mass;
+    return motion;
+}
+
+/// A particle partway through a sub-step. Each stage samples the flow at stagePosition and takes
+/// the slopes at stagePosition and stageVelocity.
+struct StepState
+{
+    glm::vec3 position;
+    glm::vec3 velocity;
+    glm::vec3 stagePosition;
+    glm::vec3 stageVelocity;
+    glm::vec3 slopePosition;  // Weighted sum of the RK4 slopes so far
+    glm::vec3 slopeVelocity;
+};
+
+int stageCount(IntegratorType type)
+{
+    switch (type)
+    {
+    case IntegratorType::RK2_MIDPOINT:
+        return 2;
+    case IntegratorType::RK4:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+void beginSubstep(StepState& state)
+{
+    state.stagePosition = state.position;
+    state.stageVelocity = state.velocity;
+    state.slopePosition = glm::vec3(0.0f);
+    state.slopeVelocity = glm::vec3(0.0f);
+}
+
+/// Stage `stage` of a sub-step of `h` seconds, `flow` is sampled at state.stagePosition
+void applyStage(IntegratorType type, int stage, const Motion& motion, float h, const glm::vec3& flow, StepState& state)
+{
+    if (type == IntegratorType::IMPLICIT_EULER)
+    {
+        // Same operations as implicitEulerIntegration()
+        const glm::vec3 newVelocity = (state.velocity + h * motion.gravity + flow * motion.flowRate * h) /
+            (1.0f + h * motion.dragRate);
+        state.position += h * newVelocity;
+        state.velocity = newVelocity;
+        return;
+    }
+
+    const glm::vec3 dx = state.stageVelocity;
+    const glm::vec3 dv = motion.gravity + motion.flowRate * flow - motion.dragRate * state.stageVelocity;
+    if (type == IntegratorType::SEMI_IMPLICIT_EULER)
+    {
+        state.velocity += h * dv;
+        state.position += h * state.velocity;
+    }
+    else if (type == IntegratorType::RK2_MIDPOINT)
+    {
+        if (stage == 0)
+        {
+            state.stagePosition = state.position + 0.5f * h * dx;
+            state.stageVelocity = state.velocity + 0.5f * h * dv;
+        }
+        else
+        {
+            state.position += h * dx;
+            state.velocity += h * dv;
+        }
+    }
+    else
+    {
+        // RK4, the two middle slopes count twice
+        const float weight = (stage == 1 || stage == 2) ? 2.0f : 1.0f;
+        state.slopePosition += weight * dx;
+        state.slopeVelocity += weight * dv;
+        if (stage < 3)
+        {
+            const float reach = stage == 2 ? h : 0.5f * h;
+            state.stagePosition = state.position + reach * dx;
+            state.stageVelocity = state.velocity + reach * dv;
+        }
+        else
+        {
+            state.position += (h / 6.0f) * state.slopePosition;
+            state.velocity += (h / 6.0f) * state.slopeVelocity;
+        }
+    }
+}
+} // namespace
 
 //SmokePhysics::SmokePhysics()
 //    : physicsParams(9.81f, 0.6f, 2.0f)
@@ -15,15 +128,251 @@ SmokePhysics::SmokePhysics(const PhysicsParameters& params)
 
 void SmokePhysics::updateParticle(Particle& particle, float deltaTime, float time)
 {
-    implicitEulerIntegration(particle, deltaTime, time);
+    if (usesSubsteps())
+    {
+        substepIntegration(particle, deltaTime, time);
+    }
+    else
+    {
+        implicitEulerIntegration(particle, deltaTime, time);
+    }
+    if (collider)
+    {
+        collider->handleCollision(particle);
+    }
+    if (terrain)
+    {
+        terrain->handleCollision(particle);
+    }
+}
+
+bool SmokePhysics::usesSubsteps() const
+{
+    return physicsParams.integrator.type != IntegratorType::IMPLICIT_EULER || physicsParams.integrator.adaptiveSubsteps;
+}
+
+float SmokePhysics::minFlowCellSize() const
+{
+    const glm::vec3 cellSize = flowField ? flowField->getGridCellSize() : glm::vec3(0.0f);
+    return std::min(cellSize.x, std::min(cellSize.y, cellSize.z));
+}
+
+int SmokePhysics::getSubstepCount(const glm::vec3& velocity, float deltaTime) const
+{
+    return substepCount(glm::length(velocity), deltaTime, minFlowCellSize());
+}
+
+int SmokePhysics::substepCount(float speed, float deltaTime, float minCellSize) const
+{
+    const IntegratorSettings& settings = physicsParams.integrator;
+    if (!settings.adaptiveSubsteps || settings.maxSubsteps <= 1)
+    {
+        return 1;
+    }
+
+    float substeps = 1.0f;
+    if (minCellSize > 0.0f && settings.cflNumber > 0.0f)
+    {
+        substeps = std::max(substeps, speed * deltaTime / (settings.cflNumber * minCellSize));
+    }
+    // The explicit integrators go unstable once h * dragRate nears 2, keep it at or below 1
+    if (settings.type != IntegratorType::IMPLICIT_EULER)
+    {
+        substeps = std::max(substeps, deltaTime * motionOf(physicsParams).dragRate);
+    }
+    return int(std::ceil(std::min(substeps, float(settings.maxSubsteps))));
 }
 
 // For GPU usage
 void SmokePhysics::updateParticles(std::vector<Particle>& particles, float deltaTime, float time)
 {
-    for (auto& particle : particles)
+    // Every particle is updated independently, so any split gives the same result
+    const int grain = 2048;
+    if (scalarFallback)
     {
-        updateParticle(particle, deltaTime, time);
+        labhelper::parallelFor(jobPool, int(particles.size()), grain, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                updateParticle(particles[i], deltaTime, time);
+            }
+        });
+        return;
+    }
+
+    labhelper::parallelFor(jobPool, int(particles.size()), grain, [&](int begin, int end) {
+        // Small enough to stay in L1 while the block is gathered, integrated and scattered
+        const int blockSize = 256;
+        float posX[blockSize], posY[blockSize], posZ[blockSize];
+        float velX[blockSize], velY[blockSize], velZ[blockSize];
+        ParticleSpans block;
+        block.posX = posX;
+        block.posY = posY;
+        block.posZ = posZ;
+        block.velX = velX;
+        block.velY = velY;
+        block.velZ = velZ;
+
+        for (int blockBegin = begin; blockBegin < end; blockBegin += blockSize)
+        {
+            block.count = std::min(blockSize, end - blockBegin);
+            Particle* blockParticles = particles.data() + blockBegin;
+            for (int i = 0; i < block.count; i++)
+            {
+                posX[i] = blockParticles[i].pos.x;
+                posY[i] = blockParticles[i].pos.y;
+                posZ[i] = blockParticles[i].pos.z;
+                velX[i] = blockParticles[i].velocity.x;
+                velY[i] = blockParticles[i].velocity.y;
+                velZ[i] = blockParticles[i].velocity.z;
+            }
+            integrateBatch(block, deltaTime, time);
+            if (collider)
+            {
+                collider->handleCollisions(block);
+            }
+            if (terrain)
+            {
+                terrain->handleCollisions(block);
+            }
+            for (int i = 0; i < block.count; i++)
+            {
+                blockParticles[i].pos = glm::vec3(posX[i], posY[i], posZ[i]);
+                blockParticles[i].velocity = glm::vec3(velX[i], velY[i], velZ[i]);
+            }
+        }
+    });
+}
+
+void SmokePhysics::integrateBatch(const ParticleSpans& particles, float deltaTime, float time)
+{
+    if (usesSubsteps())
+    {
+        integrateBatchSubsteps(particles, deltaTime, time);
+        return;
+    }
+
+    // The terms of implicitEulerIntegration() that are the same for every particle
+    const glm::vec3 gravity = glm::vec3(0.0f, -physicsParams.gravity_strength, 0.0f);
+    const glm::vec3 gravityContribution = deltaTime * gravity;
+    const Motion motion = motionOf(physicsParams);
+    const float flowRate = motion.flowRate;
+    const float dampingFactor = 1.0f + deltaTime * motion.dragRate;
+
+    // The flow velocity of the block, sampled in one call
+    const int blockSize = 256;
+    float flowX[blockSize], flowY[blockSize], flowZ[blockSize];
+
+    for (int begin = 0; begin < particles.count; begin += blockSize)
+    {
+        const int count = std::min(blockSize, particles.count - begin);
+        float* posX = particles.posX + begin;
+        float* posY = particles.posY + begin;
+        float* posZ = particles.posZ + begin;
+        float* velX = particles.velX + begin;
+        float* velY = particles.velY + begin;
+        float* velZ = particles.velZ + begin;
+
+        if (flowField)
+        {
+            flowField->getVelocitiesAt(posX, posY, posZ, time, flowX, flowY, flowZ, count);
+        }
+        else
+        {
+            std::fill(flowX, flowX + count, 0.0f);
+            std::fill(flowY, flowY + count, 0.0f);
+            std::fill(flowZ, flowZ + count, 0.0f);
+        }
+
+        // Same operations in the same order as the scalar step, per component
+        for (int i = 0; i < count; i++)
+        {
+            const float newX = (velX[i] + gravityContribution.x + flowX[i] * flowRate * deltaTime) / dampingFactor;
+            const float newY = (velY[i] + gravityContribution.y + flowY[i] * flowRate * deltaTime) / dampingFactor;
+            const float newZ = (velZ[i] + gravityContribution.z + flowZ[i] * flowRate * deltaTime) / dampingFactor;
+            posX[i] += deltaTime * newX;
+            posY[i] += deltaTime * newY;
+            posZ[i] += deltaTime * newZ;
+            velX[i] = newX;
+            velY[i] = newY;
+            velZ[i] = newZ;
+        }
+    }
+}
+
+void SmokePhysics::integrateBatchSubsteps(const ParticleSpans& particles, float deltaTime, float time)
+{
+    const IntegratorType type = physicsParams.integrator.type;
+    const int stages = stageCount(type);
+    const Motion motion = motionOf(physicsParams);
+    const float minCellSize = minFlowCellSize();
+
+    const int blockSize = 256;
+    StepState states[blockSize];
+    int substeps[blockSize];
+    float stageX[blockSize], stageY[blockSize], stageZ[blockSize];
+    float flowX[blockSize], flowY[blockSize], flowZ[blockSize];
+
+    for (int begin = 0; begin < particles.count; begin += blockSize)
+    {
+        const int count = std::min(blockSize, particles.count - begin);
+        int blockSubsteps = 1;
+        for (int i = 0; i < count; i++)
+        {
+            const int index = begin + i;
+            states[i].position = glm::vec3(particles.posX[index], particles.posY[index], particles.posZ[index]);
+            states[i].velocity = glm::vec3(particles.velX[index], particles.velY[index], particles.velZ[index]);
+            substeps[i] = substepCount(glm::length(states[i].velocity), deltaTime, minCellSize);
+            blockSubsteps = std::max(blockSubsteps, substeps[i]);
+        }
+
+        // The block runs as many sub-steps as its fastest particle needs, the particles that are
+        // done sit out the rest. The flow of every stage is sampled for the whole block at once.
+        for (int substep = 0; substep < blockSubsteps; substep++)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                if (substep < substeps[i]) beginSubstep(states[i]);
+            }
+            for (int stage = 0; stage < stages; stage++)
+            {
+                if (flowField)
+                {
+                    for (int i = 0; i < count; i++)
+                    {
+                        stageX[i] = states[i].stagePosition.x;
+                        stageY[i] = states[i].stagePosition.y;
+                        stageZ[i] = states[i].stagePosition.z;
+                    }
+                    flowField->getVelocitiesAt(stageX, stageY, stageZ, time, flowX, flowY, flowZ, count);
+                }
+                else
+                {
+                    std::fill(flowX, flowX + count, 0.0f);
+                    std::fill(flowY, flowY + count, 0.0f);
+                    std::fill(flowZ, flowZ + count, 0.0f);
+                }
+
+                for (int i = 0; i < count; i++)
+                {
+                    if (substep < substeps[i])
+                    {
+                        const float h = deltaTime / float(substeps[i]);
+                        applyStage(type, stage, motion, h, glm::vec3(flowX[i], flowY[i], flowZ[i]), states[i]);
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            const int index = begin + i;
+            particles.posX[index] = states[i].position.x;
+            particles.posY[index] = states[i].position.y;
+            particles.posZ[index] = states[i].position.z;
+            particles.velX[index] = states[i].velocity.x;
+            particles.velY[index] = states[i].velocity.y;
+            particles.velZ[index] = states[i].velocity.z;
+        }
     }
 }
 
@@ -62,21 +411,19 @@ glm::vec3 SmokePhysics::calculateTotalForce(const Particle& particle, float time
 
 void SmokePhysics::implicitEulerIntegration(Particle& particle, float deltaTime, float time)
 {
-    float mass = physicsParams.particle_mass;
-    float dragCoeff = physicsParams.drag_coefficient;
-    glm::vec3 gravity = glm::vec3(0.0f, -physicsParams.gravity_strength, 0.0f);
+    const Motion motion = motionOf(physicsParams);
+    glm::vec3 gravity = motion.gravity;
 
     // Current velocity v_n
     glm::vec3 currentVelocity = particle.velocity;
 
     // Calculating flow field contributions
     glm::vec3 flowContribution(0.0f);
-    glm::vec3 flowVelocity = flowField->getVelocityAt(particle.pos, time);
-    float flowInfluence = physicsParams.flow_influence;
-    flowContribution = flowVelocity * flowInfluence * deltaTime;
+    glm::vec3 flowVelocity = flowField ? flowField->getVelocityAt(particle.pos, time) : glm::vec3(0.0f);
+    flowContribution = flowVelocity * motion.flowRate * deltaTime;
 
-    // Analytical solution of implicit Euler v_{n+1} = (v_n + dt*g) / (1 + dt*k/m)
-    float dampingFactor = 1.0f + deltaTime * (dragCoeff / mass);
+    // Analytical solution of implicit Euler: v_{n+1} = (v_n + dt*g + dt*flowRate*flow) / (1 + dt*dragRate)
+    float dampingFactor = 1.0f + deltaTime * motion.dragRate;
     glm::vec3 gravityContribution = deltaTime * gravity;
 
     // update velocity
@@ -89,6 +436,31 @@ void SmokePhysics::implicitEulerIntegration(Particle& particle, float deltaTime,
 }
 
 
+void SmokePhysics::substepIntegration(Particle& particle, float deltaTime, float time)
+{
+    const IntegratorType type = physicsParams.integrator.type;
+    const int stages = stageCount(type);
+    const Motion motion = motionOf(physicsParams);
+    const int substeps = getSubstepCount(particle.velocity, deltaTime);
+    const float h = deltaTime / float(substeps);
+
+    StepState state;
+    state.position = particle.pos;
+    state.velocity = particle.velocity;
+    for (int substep = 0; substep < substeps; substep++)
+    {
+        beginSubstep(state);
+        for (int stage = 0; stage < stages; stage++)
+        {
+            const glm::vec3 flow = flowField ? flowField->getVelocityAt(state.stagePosition, time) : glm::vec3(0.0f);
+            applyStage(type, stage, motion, h, flow, state);
+        }
+    }
+
+    particle.pos = state.position;
+    particle.velocity = state.velocity;
+}
+
 glm::vec3 SmokePhysics::calculateFlowForce(const Particle& particle, float time) const
 {
     if (!flowField) 
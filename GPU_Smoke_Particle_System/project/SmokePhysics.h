@@ -5,6 +5,30 @@
 
 struct Particle;
 class FlowField;
+class SdfCollider;
+class HeightGrid;
+namespace labhelper
+{
+class JobPool;
+}
+
+/// Time integration of the particle velocity and position
+enum class IntegratorType
+{
+    IMPLICIT_EULER,       // Drag taken implicitly, unconditionally stable, the default
+    SEMI_IMPLICIT_EULER,  // Velocity first, then the position with the new velocity
+    RK2_MIDPOINT,         // Explicit midpoint, two flow samples per step
+    RK4                   // Classic Runge-Kutta, four flow samples per step
+};
+
+/// How a frame's step is integrated, shared by SmokePhysics and particle_update.comp
+struct IntegratorSettings
+{
+    IntegratorType type = IntegratorType::IMPLICIT_EULER;
+    bool adaptiveSubsteps = false;  // Split the step of fast particles, see cflNumber
+    float cflNumber = 0.5f;         // Flow grid cells a particle may cross per sub-step
+    int maxSubsteps = 8;            // Sub-step budget per particle and frame
+};
 
 struct PhysicsParameters
 {
@@ -12,6 +36,7 @@ struct PhysicsParameters
     float drag_coefficient = 0.5f;
     float particle_mass = 1.0f;
     float flow_influence = 1.0f;
+    IntegratorSettings integrator;
 
     PhysicsParameters() = default;
     PhysicsParameters(float gravity, float drag, float mass, float flow = 1.0f)
@@ -20,6 +45,18 @@ struct PhysicsParameters
     }
 };
 
+/// Structure-of-arrays view of the particles integrateBatch() works on, updated in place
+struct ParticleSpans
+{
+    float* posX = nullptr;
+    float* posY = nullptr;
+    float* posZ = nullptr;
+    float* velX = nullptr;
+    float* velY = nullptr;
+    float* velZ = nullptr;
+    int count = 0;
+};
+
 class SmokePhysics
 {
 public:
@@ -34,9 +71,29 @@ public:
     /// Update the physics state of a single particle
     void updateParticle(Particle& particle, float deltaTime, float time);
 
-    /// Batch update the physics state of multiple particles
+    /// Batch update the physics state of multiple particles, split over the job pool if one is set.
+    /// Blocks of particles are copied into arrays and go through integrateBatch().
     void updateParticles(std::vector<Particle>& particles, float deltaTime, float time);
 
+    /// The step of updateParticle() for a batch of particles given as arrays. The flow field is
+    /// sampled for the whole batch with FlowField::getVelocitiesAt(), once per integrator stage,
+    /// and the default implicit Euler update runs over the arrays, so the compiler vectorises it.
+    void integrateBatch(const ParticleSpans& particles, float deltaTime, float time);
+
+    /// Sub-steps a particle moving at `velocity` takes this frame. 1 unless adaptive sub-stepping
+    /// is on, then enough that it crosses at most cflNumber cells of the flow grid per sub-step and
+    /// the explicit integrators stay stable under the drag and the pull of the flow, capped at
+    /// maxSubsteps. particle_update.comp applies the same rule.
+    int getSubstepCount(const glm::vec3& velocity, float deltaTime) const;
+
+    /// With the scalar fallback, updateParticles() calls updateParticle() for every particle
+    /// instead. Both paths give the same results bit for bit.
+    void setScalarFallback(bool enabled) { scalarFallback = enabled; }
+    bool isScalarFallback() const { return scalarFallback; }
+
+    /// Pool used by updateParticles(), null runs the update on the calling thread
+    void setJobPool(labhelper::JobPool* pool) { jobPool = pool; }
+
     /// Calculate the gravitational force on a particle
     glm::vec3 calculateGravityForce(const Particle& particle) const;
 
@@ -61,6 +118,9 @@ public:
     /// Setting particle quality
     void setParticleMass(float mass) { physicsParams.particle_mass = mass; }
 
+    /// Set the integrator and the sub-stepping
+    void setIntegratorSettings(const IntegratorSettings& settings) { physicsParams.integrator = settings; }
+
     ///////////////////////////////////////////////////////////////////////
     // Flow Field physics
     ///////////////////////////////////////////////////////////////////////
@@ -74,10 +134,40 @@ public:
     /// Set the flow field influence strength
     void setFlowInfluence(float influence) { physicsParams.flow_influence = influence; }
 
+    ///////////////////////////////////////////////////////////////////////
+    // Scene collision
+    ///////////////////////////////////////////////////////////////////////
+
+    /// Scene meshes the particles collide with after every step, null for none
+    void setCollider(const SdfCollider* sceneCollider) { collider = sceneCollider; }
+
+    /// Ground the particles land on after the collider, null for none
+    void setTerrain(const HeightGrid* ground) { terrain = ground; }
+
 private:
     PhysicsParameters physicsParams;
     FlowField* flowField = nullptr;
+    const SdfCollider* collider = nullptr;
+    const HeightGrid* terrain = nullptr;
+    labhelper::JobPool* jobPool = nullptr;
+    bool scalarFallback = false;
 
     /// Integration using implicit Euler method
     void implicitEulerIntegration(Particle& particle, float deltaTime, float time);
+
+    /// Integration with the selected integrator and sub-steps, the flow is sampled at `time`
+    /// for every sub-step
+    void substepIntegration(Particle& particle, float deltaTime, float time);
+
+    /// Batch version of substepIntegration(), for integrateBatch()
+    void integrateBatchSubsteps(const ParticleSpans& particles, float deltaTime, float time);
+
+    /// Whether the selected integrator or the sub-stepping needs substepIntegration()
+    bool usesSubsteps() const;
+
+    /// Smallest spacing of the flow grid, 0 without a flow field
+    float minFlowCellSize() const;
+
+    /// getSubstepCount() with the speed and the cell size already worked out
+    int substepCount(float speed, float deltaTime, float minCellSize) const;
 };
\ No newline at end of file
@@ -48,9 +48,18 @@ void FboInfo::resize(int w, int h)
 		glTexImage2D(GL_TEXTURE_2D, 0, colorTargetType, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 	}
 
+	const bool hasStencil = (depthTargetType == GL_DEPTH24_STENCIL8);
 	glBindTexture(GL_TEXTURE_2D, depthBuffer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT,
-	             nullptr);
+	if(hasStencil)
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, depthTargetType, width, height, 0, GL_DEPTH_STENCIL,
+		             GL_UNSIGNED_INT_24_8, nullptr);
+	}
+	else
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, depthTargetType, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT,
+		             nullptr);
+	}
 
 	///////////////////////////////////////////////////////////////////////
 	// Bind textures to framebuffer (if not already done)
@@ -75,7 +84,8 @@ void FboInfo::resize(int w, int h)
 		glDrawBuffers(int(colorTextureTargets.size()), attachments);
 
 		// bind the texture as depth attachment (to the currently bound framebuffer)
-		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthBuffer, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, hasStencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
+		                       GL_TEXTURE_2D, depthBuffer, 0);
 
 		// check if framebuffer is complete
 		isComplete = checkFramebufferComplete();
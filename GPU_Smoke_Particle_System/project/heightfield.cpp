@@ -26,7 +26,7 @@ HeightField::HeightField(void)
 {
 }
 
-void HeightField::loadHeightField(const std::string& heigtFieldPath)
+void HeightField::loadHeightField(const std::string& heigtFieldPath, bool quantizeHeights)
 {
 	int width, height, components;
 	stbi_set_flip_vertically_on_load(true);
@@ -49,7 +49,10 @@ void HeightField::loadHeightField(const std::string& heigtFieldPath)
 
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT,
 		data); // just one component (float)
-//stbi_image_free(data);
+
+	// Rows are flipped like the texture, so the grid lines up with the texture coordinates
+	m_heightGrid.build(data, width, height, quantizeHeights);
+	stbi_image_free(data);
 //m_heightFieldPath = heigtFieldPath;
 	std::cout << "Successfully loaded heigh field texture: " << heigtFieldPath << ".\n";
 }
@@ -106,6 +109,7 @@ void HeightField::loadDiffuseTexture(const std::string& diffusePath)
 
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data); // plain RGB
 	glGenerateMipmap(GL_TEXTURE_2D);
+	stbi_image_free(data);
 
 	std::cout << "Successfully loaded diffuse texture: " << diffusePath << ".\n";
 }
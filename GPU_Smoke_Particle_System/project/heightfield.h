@@ -1,5 +1,6 @@
 #include <string>
 #include <GL/glew.h>
+#include "HeightGrid.h"
 
 class HeightField
 {
@@ -13,13 +14,36 @@ public:
 	GLuint m_uvBuffer;
 	GLuint m_indexBuffer;
 	GLuint m_numIndices;
+	HeightGrid m_heightGrid; // CPU copy of the heights for collisions
 	//std::string m_heightFieldPath;
 	//std::string m_diffuseTexturePath;
 
 	HeightField(void);
 
-	/// Load height field
-	void loadHeightField(const std::string& heigtFieldPath);
+	/// Load height field, into the texture and into m_heightGrid, quantised to 16 bits there if
+	/// `quantizeHeights` is set
+	void loadHeightField(const std::string& heigtFieldPath, bool quantizeHeights = true);
+
+	/// Place m_heightGrid where the height field is drawn with `modelMatrix` and `scale`
+	void setTransform(const glm::mat4& modelMatrix, float scale) { m_heightGrid.setTransform(modelMatrix, scale); }
+
+	/// World height of the ground below x, z
+	float heightAt(float x, float z) const { return m_heightGrid.heightAt(x, z); }
+
+	/// heightAt() for `count` positions given as arrays
+	void heightAt(const float* x, const float* z, float* heights, int count) const
+	{
+		m_heightGrid.heightAt(x, z, heights, count);
+	}
+
+	/// Up facing normal of the ground below x, z
+	glm::vec3 normalAt(float x, float z) const { return m_heightGrid.normalAt(x, z); }
+
+	/// normalAt() for `count` positions given as arrays
+	void normalAt(const float* x, const float* z, float* normalX, float* normalY, float* normalZ, int count) const
+	{
+		m_heightGrid.normalAt(x, z, normalX, normalY, normalZ, count);
+	}
 
 	/// Load shininess map
 	void loadShininess(const std::string& shininessPath);
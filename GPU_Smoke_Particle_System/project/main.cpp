@@ -20,14 +20,18 @@ using namespace glm;
 
 #include <Model.h>
 #include "hdr.h"
+#include "JobPool.h"
+#include "FixedTimestep.h"
 #include "fbo.h"
 #include "heightfield.h"
 
 #include "ParticleSystem.h"
 #include "BoundaryManager.h"
+#include "SdfCollider.h"
 #include "SmokePhysics.h"
 #include "FlowField.h"
 #include "FlowFieldGPU.h"
+#include "FluidSolverGPU.h"
 
 
 #include "ComputeManager.h"
@@ -46,7 +50,15 @@ using std::max;
 // Function declarations
 ///////////////////////////////////////////////////////////////////////////////
 void drawSmokeParticles(const mat4& viewMatrix, const mat4& projectionMatrix);
-void generateSmokeParticles();
+void generateSmokeParticles(float dt);
+void simulateParticles();
+void syncBoundaryToGPU();
+void syncSceneColliderToGPU();
+void syncTerrainToGPU();
+void beginParticleOIT();
+void compositeParticleOIT();
+void beginParticleTimer();
+void endParticleTimer(int mode);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Class globals
@@ -54,8 +66,37 @@ void generateSmokeParticles();
 
 ParticleSystem particleSystem(50000);
 GLuint particleShaderProgram = 0;
+GLuint particleSSBOShaderProgram = 0;
+bool renderParticlesFromSSBO = true;
+bool compactEveryFrame = true;
+bool gpuDepthSort = true;
+int gpuSortStepsPerFrame = 0;
+
+// Weighted blended order-independent transparency. Target 0 accumulates the weighted premultiplied
+// colors and alphas, target 1 holds the revealage in r. 32-bit floats, dense particle clouds
+// overflow the sums in half floats.
+FboInfo oitFB(2);
+GLuint particleOITShaderProgram = 0;
+GLuint particleSSBOOITShaderProgram = 0;
+GLuint oitCompositeProgram = 0;
+bool useParticleOIT = false;
+
+// Particle pass timings in ms, smoothed. [0] = sorted alpha blending, [1] = OIT.
+float particleCPUTime[2] = { 0.0f, 0.0f };
+float particleGPUTime[2] = { 0.0f, 0.0f };
+GLuint particleTimerQueries[2] = { 0, 0 }; // Alternating, each one is read a frame after it ends
+int particleTimerModes[2] = { -1, -1 };    // Mode measured by each query, -1 once it has been read
+int particleTimerFrame = 0;
+std::chrono::high_resolution_clock::time_point particleTimerStart;
 
 BoundaryManager* boundaryManager = nullptr;
+bool gpuBoundaryCollision = true; // The update pass keeps the particles in the boundary box
+
+// Landing pad distance field, baked once and cached next to the model
+SdfCollider* sceneCollider = nullptr;
+SdfBakeSettings sceneColliderSettings;
+const char* sceneColliderCache = "../scenes/landingpad.sdf";
+bool sceneCollision = true;
 
 ComputeManager* computeManager = nullptr;
 
@@ -89,11 +130,22 @@ GLuint explosionTexture = 0;
 float particleBaseSize = 20.0f;      
 float particleSpeedMultiplier = 15.0f;
 float particleLifespan = 5.0f;
-int particlesPerFrame = 64;
+float particlesPerSecond = 3840.0f;
+labhelper::RateAccumulator smokeEmission;
+
+// The particles are simulated at a fixed rate, whatever the frame rate
+labhelper::FixedTimestep simulationClock(60.0f, 4);
+float simulationRate = 60.0f;
+int maxSimulationSteps = 4;
+bool interpolateParticles = true;
 
 // SmokePhysics
 SmokePhysics* smokePhysics = nullptr;
 
+// CPU worker threads
+labhelper::JobPool jobPool;
+int workerThreads = 1;
+
 // flowField
 glm::vec3 flowFieldMin, flowFieldMax;
 bool showFlowFieldBounds = true;
@@ -185,6 +237,7 @@ HeightField terrain;
 mat4 terrainModelMatrix;
 int terrainResolution = 1500; // Based on half of height map resolution.
 float terrainScale = 0.1;
+bool terrainCollision = true; // Particles slide along the ground, on the CPU and on the GPU
 // And so the good book said:
 // "Water shall have fresnel F0 of 0.02 and stone that of 0.035–0.056".
 float terrainShininess = 50.0;
@@ -227,6 +280,35 @@ void loadShaders(bool is_reload)
 		particleShaderProgram = shader;
 	}
 
+	// Same particle look, fetched straight from the compute SSBO
+	shader = labhelper::loadShaderProgram("../project/particle_ssbo.vert", "../project/particle.frag", is_reload);
+	if (shader != 0)
+	{
+		particleSSBOShaderProgram = shader;
+	}
+
+	// Weighted blended OIT variants of the two particle programs
+	shader = labhelper::loadShaderProgram("../project/particle.vert", "../project/particle_oit.frag", is_reload);
+	if (shader != 0)
+	{
+		glDeleteProgram(particleOITShaderProgram);
+		particleOITShaderProgram = shader;
+	}
+
+	shader = labhelper::loadShaderProgram("../project/particle_ssbo.vert", "../project/particle_oit.frag", is_reload);
+	if (shader != 0)
+	{
+		glDeleteProgram(particleSSBOOITShaderProgram);
+		particleSSBOOITShaderProgram = shader;
+	}
+
+	shader = labhelper::loadShaderProgram("../project/fullscreenQuad.vert", "../project/oit_composite.frag", is_reload);
+	if (shader != 0)
+	{
+		glDeleteProgram(oitCompositeProgram);
+		oitCompositeProgram = shader;
+	}
+
 	////Loading simple green particle shader
 	//shader = labhelper::loadShaderProgram("../project/particle_simple.vert", "../project/particle_simple.frag", is_reload);
 	//if (shader != 0)
@@ -291,6 +373,7 @@ void initialize()
 
 
 	terrain.loadHeightField("../scenes/nlsFinland/L3123F.png");
+	terrain.setTransform(terrainModelMatrix, terrainScale);
 	terrain.loadDiffuseTexture("../scenes/nlsFinland/L3123F_downscaled.jpg");
 	terrain.loadShininess("../scenes/nlsFinland/L3123F_downscaled.jpg");
 	terrain.generateMesh(terrainResolution);
@@ -299,6 +382,18 @@ void initialize()
 	glEnable(GL_DEPTH_TEST);	// enable Z-buffering 
 	glEnable(GL_CULL_FACE);		// enables backface culling
 
+	///////////////////////////////////////////////////////////////////////
+	// Setup Framebuffer for order-independent transparency
+	///////////////////////////////////////////////////////////////////////
+	// The scene depth is blitted in before the particles, which needs matching depth formats
+	GLint depthBits = 0, stencilBits = 0;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_DEPTH, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+	glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_STENCIL, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+	oitFB.colorTargetType = GL_RGBA32F;
+	oitFB.depthTargetType = stencilBits > 0 ? GL_DEPTH24_STENCIL8 : (depthBits == 32 ? GL_DEPTH_COMPONENT32 : GL_DEPTH_COMPONENT24);
+	glGenQueries(2, particleTimerQueries);
+
 	///////////////////////////////////////////////////////////////////////
 	// Initialize Particle System
 	///////////////////////////////////////////////////////////////////////
@@ -327,6 +422,13 @@ void initialize()
 	boundaryManager = new BoundaryManager(glm::vec3(0.0f, 50.0f, 0.0f), glm::vec3(10.0f, 20.0f, 10.0f));
 	boundaryManager->initRenderData();
 
+	// Smoke mostly slides along the walls and the ceiling rather than bouncing off them
+	CollisionResponse collisionResponse;
+	collisionResponse.restitution = 0.2f;
+	collisionResponse.friction = 0.1f;
+	boundaryManager->setCollisionResponse(collisionResponse);
+	syncBoundaryToGPU();
+
 	///////////////////////////////////////////////////////////////////////
 	// Initialize Smoke Physics
 	///////////////////////////////////////////////////////////////////////
@@ -334,6 +436,33 @@ void initialize()
 	smokePhysics = new SmokePhysics(physicsParams);
 	particleSystem.syncPhysicsFromCPU(smokePhysics);
 
+	workerThreads = jobPool.getThreadCount();
+	smokePhysics->setJobPool(&jobPool);
+	particleSystem.setJobPool(&jobPool);
+
+	///////////////////////////////////////////////////////////////////////
+	// Initialize Scene Collider
+	///////////////////////////////////////////////////////////////////////
+	sceneColliderSettings.voxelSize = 0.5f;
+	sceneColliderSettings.bandWidth = 2.0f;
+	sceneCollider = new SdfCollider();
+	sceneCollider->setJobPool(&jobPool);
+	sceneCollider->addModel(*landingpadModel, landingPadModelMatrix);
+	sceneCollider->setCollisionResponse(collisionResponse);
+	sceneCollider->setSurfaceOffset(0.2f);
+	if (sceneCollider->bake(sceneColliderSettings, sceneColliderCache))
+	{
+		sceneCollider->createTexture();
+	}
+	syncSceneColliderToGPU();
+
+	///////////////////////////////////////////////////////////////////////
+	// Initialize Terrain Collision
+	///////////////////////////////////////////////////////////////////////
+	terrain.m_heightGrid.setCollisionResponse(collisionResponse);
+	terrain.m_heightGrid.setSurfaceOffset(0.2f);
+	syncTerrainToGPU();
+
 	///////////////////////////////////////////////////////////////////////
 	// Initialize Flow Field with Boundary Manager dimensions
 	///////////////////////////////////////////////////////////////////////
@@ -347,14 +476,34 @@ void initialize()
 	}
 }
 
-void generateSmokeParticles()
+void generateSmokeParticles(float dt)
 {
 	if (!isGenerate) 
 	{
+		smokeEmission.reset();
 		return;
 	}
+	const int count = smokeEmission.take(particlesPerSecond, dt);
 
-	for (int i = 0; i < particlesPerFrame; i++)
+	// GPU emission: the compute shader allocates and initialises the particles, only the emitter
+	// parameters are uploaded
+	if (computeManager && computeManager->isReady())
+	{
+		const BoundingBox& bounds = boundaryManager->getBoundingBox();
+		EmitterParametersGPU emitter;
+		emitter.discCenter = glm::vec3(bounds.center.x, bounds.min_bounds.y + 0.1f, bounds.center.z);
+		emitter.discRadius = 2.0f;
+		emitter.boundsMin = bounds.min_bounds;
+		emitter.boundsMax = bounds.max_bounds;
+		emitter.coneHalfAngle = glm::radians(22.5f);
+		emitter.baseSpeed = 10.0f;
+		emitter.speedVariation = 0.3f;
+		emitter.lifeLength = particleLifespan;
+		particleSystem.emitParticlesGPU(count, emitter);
+		return;
+	}
+
+	for (int i = 0; i < count; i++)
 	{
 		Particle particle;
 
@@ -596,8 +745,10 @@ void display(void)
 	///////////////////////////////////////////////////////////////////////////
 	// GPU Particle Update and Rendering
 	///////////////////////////////////////////////////////////////////////////
-	particleSystem.updateParticlesGPU(deltaTime, currentTime);
+	simulateParticles();
+	beginParticleTimer();
 	drawSmokeParticles(viewMatrix, projMatrix);
+	endParticleTimer(useParticleOIT ? 1 : 0);
 	debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
 
 	///////////////////////////////////////////////////////////////////////////
@@ -606,37 +757,234 @@ void display(void)
 	boundaryManager->renderBoundary(viewMatrix, projMatrix, simpleShaderProgram);
 }
 
-void drawSmokeParticles(const mat4& viewMatrix, const mat4& projectionMatrix)
+///////////////////////////////////////////////////////////////////////////////
+/// Times the particle pass on the CPU and, through a query read back a frame later, on the GPU
+///////////////////////////////////////////////////////////////////////////////
+void beginParticleTimer()
+{
+	const int previous = 1 - particleTimerFrame;
+	GLint resultAvailable = 0;
+	if (particleTimerModes[previous] >= 0)
+	{
+		glGetQueryObjectiv(particleTimerQueries[previous], GL_QUERY_RESULT_AVAILABLE, &resultAvailable);
+	}
+	if (resultAvailable)
+	{
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(particleTimerQueries[previous], GL_QUERY_RESULT, &elapsed);
+		float& gpuTime = particleGPUTime[particleTimerModes[previous]];
+		gpuTime = mix(gpuTime, float(elapsed) * 1e-6f, 0.05f);
+		particleTimerModes[previous] = -1;
+	}
+
+	particleTimerStart = std::chrono::high_resolution_clock::now();
+	glBeginQuery(GL_TIME_ELAPSED, particleTimerQueries[particleTimerFrame]);
+}
+
+void endParticleTimer(int mode)
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	std::chrono::duration<float, std::milli> cpuTime = std::chrono::high_resolution_clock::now() - particleTimerStart;
+	particleCPUTime[mode] = mix(particleCPUTime[mode], cpuTime.count(), 0.05f);
+
+	particleTimerModes[particleTimerFrame] = mode;
+	particleTimerFrame = 1 - particleTimerFrame;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Redirects the particle draw into the OIT targets, depth tested against the scene drawn so far
+///////////////////////////////////////////////////////////////////////////////
+void beginParticleOIT()
+{
+	if (oitFB.width != windowWidth || oitFB.height != windowHeight)
+	{
+		oitFB.resize(windowWidth, windowHeight);
+	}
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, oitFB.framebufferId);
+	glBlitFramebuffer(0, 0, windowWidth, windowHeight, 0, 0, windowWidth, windowHeight, GL_DEPTH_BUFFER_BIT,
+	                  GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, oitFB.framebufferId);
+
+	const float clearAccumulation[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	const float clearRevealage[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	glClearBufferfv(GL_COLOR, 0, clearAccumulation);
+	glClearBufferfv(GL_COLOR, 1, clearRevealage);
+
+	glEnable(GL_BLEND);
+	glBlendFunci(0, GL_ONE, GL_ONE);
+	glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Blends the resolved OIT targets over the default framebuffer
+///////////////////////////////////////////////////////////////////////////////
+void compositeParticleOIT()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, windowWidth, windowHeight);
+
+	glUseProgram(oitCompositeProgram);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, oitFB.colorTextureTargets[0]);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, oitFB.colorTextureTargets[1]);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+	labhelper::drawFullScreenQuad();
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+/// Hands the boundary box and its collision response to the GPU update pass
+void syncBoundaryToGPU()
 {
-	generateSmokeParticles();
+	if (!computeManager || !boundaryManager)
+	{
+		return;
+	}
+	const BoundingBox& bounds = boundaryManager->getBoundingBox();
+	const CollisionResponse& response = boundaryManager->getCollisionResponse();
+	BoundaryParametersGPU boundary;
+	boundary.boxMin = glm::vec4(bounds.min_bounds, 0.0f);
+	boundary.boxMax = glm::vec4(bounds.max_bounds, 0.0f);
+	boundary.enabled = gpuBoundaryCollision ? 1 : 0;
+	boundary.restitution = response.restitution;
+	boundary.friction = response.friction;
+	computeManager->setBoundary(boundary);
+}
 
+/// Hands the landing pad collider to the CPU physics and to the GPU update pass
+void syncSceneColliderToGPU()
+{
+	if (!sceneCollider)
+	{
+		return;
+	}
+	const bool enabled = sceneCollision && sceneCollider->isBaked();
+	if (smokePhysics)
+	{
+		smokePhysics->setCollider(enabled ? sceneCollider : nullptr);
+	}
+	if (!computeManager)
+	{
+		return;
+	}
+	const CollisionResponse& response = sceneCollider->getCollisionResponse();
+	SdfColliderGPU collider;
+	collider.boundsMin = glm::vec4(sceneCollider->getBoundsMin(), sceneCollider->getSurfaceOffset());
+	collider.boundsMax = glm::vec4(sceneCollider->getBoundsMax(), sceneCollider->getVoxelSize());
+	collider.enabled = enabled ? 1 : 0;
+	collider.restitution = response.restitution;
+	collider.friction = response.friction;
+	collider.bandWidth = sceneCollider->getBandWidth();
+	computeManager->setSdfCollider(collider, sceneCollider->getTexture());
+}
+
+/// Hands the terrain height grid to the CPU physics and its height texture to the GPU update pass
+void syncTerrainToGPU()
+{
+	const HeightGrid& grid = terrain.m_heightGrid;
+	const bool enabled = terrainCollision && !grid.empty();
+	if (smokePhysics)
+	{
+		smokePhysics->setTerrain(enabled ? &grid : nullptr);
+	}
+	if (!computeManager)
+	{
+		return;
+	}
+	const CollisionResponse& response = grid.getCollisionResponse();
+	const glm::vec2 heightMapping = grid.getHeightMapping();
+	TerrainGPU ground;
+	ground.texelMapping = grid.getTexelMapping();
+	ground.heightScale = heightMapping.x;
+	ground.heightOffset = heightMapping.y;
+	ground.enabled = enabled ? 1 : 0;
+	ground.surfaceOffset = grid.getSurfaceOffset();
+	ground.restitution = response.restitution;
+	ground.friction = response.friction;
+	computeManager->setTerrain(ground, terrain.m_texid_hf);
+}
+
+/// Runs the simulation steps due this frame, each one followed by its share of the emission
+void simulateParticles()
+{
+	const float dt = simulationClock.getStepSize();
+	const int steps = simulationClock.getFrameSteps();
+	for (int i = 0; i < steps; i++)
+	{
+		const float stepEndTime = float(simulationClock.getTime() - double(steps - 1 - i) * dt);
+		particleSystem.updateParticlesGPU(dt, stepEndTime);
+		generateSmokeParticles(dt);
+	}
+	particleSystem.setRenderLag(interpolateParticles ? simulationClock.getRenderLag() : 0.0f);
+}
+
+void drawSmokeParticles(const mat4& viewMatrix, const mat4& projectionMatrix)
+{
 	// no particles, no rendering
-	if (particleSystem.get_particle_count() == 0) 
+	if (particleSystem.getDrawParticleCount() == 0) 
 	{
 		return;
 	}
 
 	glEnable(GL_PROGRAM_POINT_SIZE);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (useParticleOIT)
+	{
+		beginParticleOIT();
+	}
+	else
+	{
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
 	glDepthMask(GL_FALSE);
 
 	// particle shader program
-	glUseProgram(particleShaderProgram);
-	labhelper::setUniformSlow(particleShaderProgram, "P", projectionMatrix);
-	labhelper::setUniformSlow(particleShaderProgram, "screen_x", float(windowWidth));
-	labhelper::setUniformSlow(particleShaderProgram, "screen_y", float(windowHeight));
+	const bool fromSSBO = particleSystem.isRenderingFromSSBO();
+	GLuint program = fromSSBO ? particleSSBOShaderProgram : particleShaderProgram;
+	if (useParticleOIT)
+	{
+		program = fromSSBO ? particleSSBOOITShaderProgram : particleOITShaderProgram;
+	}
+	glUseProgram(program);
+	labhelper::setUniformSlow(program, "P", projectionMatrix);
+	labhelper::setUniformSlow(program, "screen_x", float(windowWidth));
+	labhelper::setUniformSlow(program, "screen_y", float(windowHeight));
 
 	// Bind the explosion texture to texture unit 0
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, explosionTexture);
-	labhelper::setUniformSlow(particleShaderProgram, "colortexture", 0);
+	labhelper::setUniformSlow(program, "colortexture", 0);
 
 	///////// RENDER /////////
-	particleSystem.submit_to_gpu(viewMatrix);
-	glBindVertexArray(particleSystem.getVAO());
-	glDrawArrays(GL_POINTS, 0, particleSystem.get_particle_count());
-	glBindVertexArray(0);
+	if (fromSSBO)
+	{
+		// The vertex shader transforms the particles, nothing is read back to the CPU
+		particleSystem.sortParticlesGPU(viewMatrix);
+		glUseProgram(program);
+		labhelper::setUniformSlow(program, "V", viewMatrix);
+		labhelper::setUniformSlow(program, "sorted_count", GLuint(particleSystem.getSortedParticleCount()));
+		labhelper::setUniformSlow(program, "render_lag", particleSystem.getRenderLag());
+		particleSystem.drawFromSSBO();
+	}
+	else
+	{
+		particleSystem.submit_to_gpu(viewMatrix);
+		glBindVertexArray(particleSystem.getVAO());
+		glDrawArrays(GL_POINTS, 0, particleSystem.get_particle_count());
+		glBindVertexArray(0);
+	}
+
+	if (useParticleOIT)
+	{
+		compositeParticleOIT();
+	}
 
 	// Restoring OpenGL state
 	glDepthMask(GL_TRUE);             
@@ -776,6 +1124,16 @@ void gui()
 		if (ImGui::Button("Compact Particles")) {
 			particleSystem.compactParticles();
 		}
+		if (ImGui::Checkbox("Compact every frame", &compactEveryFrame)) {
+			particleSystem.setCompactEveryFrame(compactEveryFrame);
+		}
+		if (ImGui::Checkbox("GPU depth sort", &gpuDepthSort)) {
+			particleSystem.setGPUDepthSort(gpuDepthSort && !useParticleOIT);
+		}
+		// 0 sorts completely every frame
+		if (ImGui::SliderInt("Sort passes per frame", &gpuSortStepsPerFrame, 0, 32)) {
+			particleSystem.setGPUSortStepsPerFrame(unsigned(gpuSortStepsPerFrame));
+		}
 	}
 	else {
 		ImGui::Text("GPU Compute: DISABLED");
@@ -786,8 +1144,36 @@ void gui()
 	ImGui::Text("GPU Particle System");
 	ImGui::Text("Active particles: %d", particleSystem.get_particle_count());
 	ImGui::Text("Alive particles: %d", particleSystem.getAliveParticleCount());
+	if (ImGui::Checkbox("Render from SSBO", &renderParticlesFromSSBO))
+	{
+		particleSystem.setRenderFromSSBO(renderParticlesFromSSBO);
+	}
 	ImGui::SliderFloat("Particle Lifespan", &particleLifespan, 1.0f, 10.0f);
-	ImGui::SliderInt("Particles Per Frame", &particlesPerFrame, 1, 200);
+	ImGui::SliderFloat("Particles Per Second", &particlesPerSecond, 60.0f, 12000.0f);
+	if (ImGui::SliderFloat("Simulation rate (Hz)", &simulationRate, 10.0f, 240.0f))
+	{
+		simulationClock.setStepRate(simulationRate);
+	}
+	if (ImGui::SliderInt("Max steps per frame", &maxSimulationSteps, 1, 16))
+	{
+		simulationClock.setMaxStepsPerFrame(maxSimulationSteps);
+	}
+	ImGui::Checkbox("Interpolate particles", &interpolateParticles);
+	ImGui::Text("Steps this frame: %d, dropped: %llu", simulationClock.getFrameSteps(),
+	            (unsigned long long)simulationClock.getDroppedStepCount());
+	if (ImGui::SliderInt("Worker threads", &workerThreads, 1, labhelper::JobPool::getHardwareThreadCount()))
+	{
+		jobPool.setThreadCount(workerThreads);
+	}
+	// OIT blends in any order, so both depth sorts are skipped
+	if (ImGui::Checkbox("Order-independent transparency", &useParticleOIT))
+	{
+		particleSystem.setDepthSort(!useParticleOIT);
+		particleSystem.setGPUDepthSort(gpuDepthSort && !useParticleOIT);
+	}
+	ImGui::Text("Particle pass    CPU ms   GPU ms");
+	ImGui::Text("  Sorted blend  %7.3f  %7.3f", particleCPUTime[0], particleGPUTime[0]);
+	ImGui::Text("  Weighted OIT  %7.3f  %7.3f", particleCPUTime[1], particleGPUTime[1]);
 
 	// ----------------- Boundary Control ----------------
 	ImGui::Separator();
@@ -795,11 +1181,92 @@ void gui()
 	glm::vec3 center = boundaryManager->getBoundingBox().center;
 	glm::vec3 size = boundaryManager->getBoundingBox().size;
 
+	CollisionResponse response = boundaryManager->getCollisionResponse();
+	bool boundaryChanged = false;
+
 	if (ImGui::DragFloat3("Boundary Center", &center.x, 0.5f, -50.0f, 50.0f)) {
 		boundaryManager->setBoundary(center, size);
+		boundaryChanged = true;
 	}
 	if (ImGui::DragFloat3("Boundary Size", &size.x, 0.5f, 5.0f, 100.0f)) {
 		boundaryManager->setBoundary(center, size);
+		boundaryChanged = true;
+	}
+	if (ImGui::Checkbox("Boundary Collision (GPU)", &gpuBoundaryCollision)) {
+		boundaryChanged = true;
+	}
+	if (ImGui::SliderFloat("Restitution", &response.restitution, 0.0f, 1.0f, "%.2f")) {
+		boundaryChanged = true;
+	}
+	if (ImGui::SliderFloat("Wall Friction", &response.friction, 0.0f, 1.0f, "%.2f")) {
+		boundaryChanged = true;
+	}
+	if (boundaryChanged) {
+		boundaryManager->setCollisionResponse(response);
+		syncBoundaryToGPU();
+	}
+
+	// ----------------- Scene Collision ----------------
+	ImGui::Separator();
+	ImGui::Text("Landing Pad Collision");
+	CollisionResponse padResponse = sceneCollider->getCollisionResponse();
+	float surfaceOffset = sceneCollider->getSurfaceOffset();
+	bool colliderChanged = false;
+
+	if (ImGui::Checkbox("Pad Collision", &sceneCollision)) {
+		colliderChanged = true;
+	}
+	if (ImGui::SliderFloat("Pad Restitution", &padResponse.restitution, 0.0f, 1.0f, "%.2f")) {
+		colliderChanged = true;
+	}
+	if (ImGui::SliderFloat("Pad Friction", &padResponse.friction, 0.0f, 1.0f, "%.2f")) {
+		colliderChanged = true;
+	}
+	if (ImGui::SliderFloat("Surface Offset", &surfaceOffset, 0.0f, 1.0f, "%.2f")) {
+		colliderChanged = true;
+	}
+	ImGui::SliderFloat("SDF Voxel Size", &sceneColliderSettings.voxelSize, 0.1f, 2.0f, "%.2f");
+	ImGui::SliderFloat("SDF Band Width", &sceneColliderSettings.bandWidth, 0.5f, 8.0f, "%.1f");
+	if (ImGui::Button("Rebake Pad SDF")) {
+		sceneCollider->bake(sceneColliderSettings, sceneColliderCache);
+		colliderChanged = true;
+	}
+	const glm::ivec3 sdfResolution = sceneCollider->getResolution();
+	ImGui::Text("%dx%dx%d nodes of %.2f, %s in %.1f ms", sdfResolution.x, sdfResolution.y, sdfResolution.z,
+		sceneCollider->getVoxelSize(), sceneCollider->wasLoadedFromCache() ? "loaded" : "baked",
+		sceneCollider->getBakeMilliseconds());
+	if (colliderChanged) {
+		sceneCollider->setCollisionResponse(padResponse);
+		sceneCollider->setSurfaceOffset(surfaceOffset);
+		syncSceneColliderToGPU();
+	}
+
+	// ----------------- Terrain Collision ----------------
+	ImGui::Separator();
+	ImGui::Text("Terrain Collision");
+	CollisionResponse groundResponse = terrain.m_heightGrid.getCollisionResponse();
+	float groundOffset = terrain.m_heightGrid.getSurfaceOffset();
+	bool terrainChanged = false;
+
+	if (ImGui::Checkbox("Ground Collision", &terrainCollision)) {
+		terrainChanged = true;
+	}
+	if (ImGui::SliderFloat("Ground Restitution", &groundResponse.restitution, 0.0f, 1.0f, "%.2f")) {
+		terrainChanged = true;
+	}
+	if (ImGui::SliderFloat("Ground Friction", &groundResponse.friction, 0.0f, 1.0f, "%.2f")) {
+		terrainChanged = true;
+	}
+	if (ImGui::SliderFloat("Ground Offset", &groundOffset, 0.0f, 1.0f, "%.2f")) {
+		terrainChanged = true;
+	}
+	ImGui::Text("%dx%d heights, %s, %.1f MB", terrain.m_heightGrid.getWidth(), terrain.m_heightGrid.getDepth(),
+		terrain.m_heightGrid.isQuantized() ? "16-bit" : "float",
+		terrain.m_heightGrid.getMemoryBytes() / (1024.0f * 1024.0f));
+	if (terrainChanged) {
+		terrain.m_heightGrid.setCollisionResponse(groundResponse);
+		terrain.m_heightGrid.setSurfaceOffset(groundOffset);
+		syncTerrainToGPU();
 	}
 
 	// ----------------- GPU Physics Control ----------------
@@ -824,8 +1291,28 @@ void gui()
 			physicsChanged = true;
 		}
 
+		// Integrator and sub-stepping, shared by the CPU and the GPU update
+		IntegratorSettings integrator = currentParams.integrator;
+		int integratorIndex = static_cast<int>(integrator.type);
+		if (ImGui::Combo("Integrator", &integratorIndex, "Implicit Euler\0Semi-Implicit Euler\0RK2 Midpoint\0RK4\0")) {
+			integrator.type = static_cast<IntegratorType>(integratorIndex);
+			physicsChanged = true;
+		}
+		if (ImGui::Checkbox("Adaptive Sub-steps", &integrator.adaptiveSubsteps)) {
+			physicsChanged = true;
+		}
+		if (integrator.adaptiveSubsteps) {
+			if (ImGui::SliderFloat("CFL Number", &integrator.cflNumber, 0.1f, 2.0f, "%.2f")) {
+				physicsChanged = true;
+			}
+			if (ImGui::SliderInt("Max Sub-steps", &integrator.maxSubsteps, 1, 32)) {
+				physicsChanged = true;
+			}
+		}
+
 		if (physicsChanged) {
 			PhysicsParameters newParams(gravity, dragCoeff, particleMass, currentParams.flow_influence);
+			newParams.integrator = integrator;
 			smokePhysics->setParameters(newParams);
 			particleSystem.syncPhysicsFromCPU(smokePhysics);
 
@@ -857,26 +1344,142 @@ void gui()
 
 		if (flowFieldEnabled) 
 		{
-			if (ImGui::SliderFloat3("Wind Direction", windDirection, -1.0f, 1.0f, "%.2f")) {
-				flowFieldChanged = true;
+			static int fieldType = 0;
+			if (ImGui::Combo("Field Type", &fieldType, "Uniform Wind\0Curl Noise\0Fluid Solver\0")) 
+			{
+				if (fieldType == 2) 
+				{
+					particleSystem.enableFluidSolver(true);
+				}
+				else 
+				{
+					particleSystem.setFlowFieldType(fieldType == 1 ? FlowFieldType::CURL_NOISE : FlowFieldType::UNIFORM_WIND);
+					particleSystem.enableFluidSolver(false);
+				}
 			}
 
-			if (ImGui::SliderFloat("Wind Strength", &windStrength, 0.0f, 10.0f, "%.2f")) {
-				flowFieldChanged = true;
+			static int gridResolution = 0;
+			if (ImGui::Combo("Grid", &gridResolution, "64^3\0" "96^3\0" "128^3\0")) 
+			{
+				particleSystem.setFlowFieldResolution(64 + 32 * gridResolution);
 			}
 
-			if (ImGui::SliderFloat("Flow Influence", &flowInfluence, 0.0f, 5.0f, "%.2f")) {
-				flowFieldChanged = true;
+			if (fieldType == 0) 
+			{
+				if (ImGui::SliderFloat3("Wind Direction", windDirection, -1.0f, 1.0f, "%.2f")) {
+					flowFieldChanged = true;
+				}
+
+				if (ImGui::SliderFloat("Wind Strength", &windStrength, 0.0f, 10.0f, "%.2f")) {
+					flowFieldChanged = true;
+				}
+
+				if (ImGui::SliderFloat("Flow Influence", &flowInfluence, 0.0f, 5.0f, "%.2f")) {
+					flowFieldChanged = true;
+				}
+
+				if (flowFieldChanged) 
+				{
+					glm::vec3 windDir(windDirection[0], windDirection[1], windDirection[2]);
+					particleSystem.setFlowFieldParameters(windDir, windStrength, flowInfluence);
+				}
+
+				ImGui::Text("Current Wind: (%.2f, %.2f, %.2f)", windDirection[0], windDirection[1], windDirection[2]);
+				ImGui::Text("Strength: %.2f, Influence: %.2f", windStrength, flowInfluence);
 			}
-
-			if (flowFieldChanged) 
+			else if (fieldType == 2) 
 			{
-				glm::vec3 windDir(windDirection[0], windDirection[1], windDirection[2]);
-				particleSystem.setFlowFieldParameters(windDir, windStrength, flowInfluence);
+				// Buoyant smoke from a source at the bottom, stirred by the grid solver
+				FluidSolverGPU* fluidSolver = particleSystem.getFluidSolver();
+				FluidParameters fluidParams = fluidSolver->getParameters();
+				bool fluidChanged = false;
+				fluidChanged |= ImGui::SliderFloat("Buoyancy", &fluidParams.buoyancy, 0.0f, 20.0f, "%.2f");
+				fluidChanged |= ImGui::SliderFloat("Vorticity", &fluidParams.vorticity, 0.0f, 2.0f, "%.2f");
+				fluidChanged |= ImGui::SliderFloat("Velocity Dissipation", &fluidParams.velocityDissipation, 0.0f, 2.0f, "%.2f");
+				fluidChanged |= ImGui::SliderFloat("Density Dissipation", &fluidParams.densityDissipation, 0.0f, 2.0f, "%.2f");
+				int pressureSolver = int(fluidParams.pressureSolver);
+				if (ImGui::Combo("Pressure Solver", &pressureSolver, "Jacobi\0Multigrid\0")) 
+				{
+					fluidParams.pressureSolver = PressureSolverType(pressureSolver);
+					fluidChanged = true;
+				}
+				if (fluidParams.pressureSolver == PressureSolverType::JACOBI) 
+				{
+					fluidChanged |= ImGui::SliderInt("Pressure Iterations", &fluidParams.pressureIterations, 1, 200);
+				}
+				else 
+				{
+					MultigridParameters& mg = fluidParams.multigrid;
+					fluidChanged |= ImGui::SliderInt("Levels", &mg.levels, 1, 8);
+					fluidChanged |= ImGui::SliderInt("Pre Smoothing", &mg.preSmoothing, 0, 8);
+					fluidChanged |= ImGui::SliderInt("Post Smoothing", &mg.postSmoothing, 0, 8);
+					fluidChanged |= ImGui::SliderInt("Coarse Smoothing", &mg.coarseSmoothing, 1, 64);
+					fluidChanged |= ImGui::SliderInt("V-Cycles", &mg.cycles, 1, 10);
+					ImGui::Text("Levels in use: %d", fluidSolver->getMultigridLevelCount());
+				}
+				fluidChanged |= ImGui::Checkbox("Track Residual (stalls)", &fluidParams.trackPressureResidual);
+				fluidChanged |= ImGui::SliderFloat("Source Radius", &fluidParams.sourceRadius, 0.5f, 8.0f, "%.2f");
+				fluidChanged |= ImGui::SliderFloat("Source Density", &fluidParams.sourceDensity, 0.0f, 20.0f, "%.2f");
+				fluidChanged |= ImGui::SliderFloat("Inflow Speed", &fluidParams.sourceVelocity.y, 0.0f, 20.0f, "%.2f");
+				if (fluidChanged) 
+				{
+					fluidSolver->setParameters(fluidParams);
+				}
+				if (ImGui::SliderFloat("Flow Influence", &flowInfluence, 0.0f, 5.0f, "%.2f")) 
+				{
+					particleSystem.setFlowInfluence(flowInfluence);
+				}
+
+				if (ImGui::Button("Reset Fluid")) 
+				{
+					fluidSolver->reset();
+				}
+				ImGui::SameLine();
+				static float validationError = -1.0f;
+				static float validationSpeed = 0.0f;
+				if (ImGui::Button("Validate Against CPU")) 
+				{
+					validationError = fluidSolver->validateAgainstCPU(simulationClock.getStepSize(), &validationSpeed);
+				}
+				if (validationError >= 0.0f) 
+				{
+					ImGui::Text("Max difference %.5f (max speed %.2f)", validationError, validationSpeed);
+				}
+
+				const FluidStageTimings& fluidTimings = fluidSolver->getTimings();
+				ImGui::Text("Fluid stage      GPU ms");
+				ImGui::Text("  Forces       %7.3f", fluidTimings.forces);
+				ImGui::Text("  Advection    %7.3f", fluidTimings.advection);
+				ImGui::Text("  Divergence   %7.3f", fluidTimings.divergence);
+				ImGui::Text("  Pressure     %7.3f", fluidTimings.pressure);
+				ImGui::Text("  Projection   %7.3f", fluidTimings.projection);
+				ImGui::Text("  Total        %7.3f", fluidTimings.total());
+
+				if (fluidParams.trackPressureResidual) 
+				{
+					// First entry before the solve, then after every V-cycle (or all Jacobi sweeps)
+					const std::vector<float>& residuals = fluidSolver->getPressureResiduals();
+					for (int i = 0; i < int(residuals.size()); i++) 
+					{
+						ImGui::Text("  Residual %d    %.3e", i, residuals[i]);
+					}
+				}
+			}
+			else 
+			{
+				// Divergence-free, the smoke swirls without collecting in sinks
+				static CurlNoiseParameters curlParams;
+				flowFieldChanged |= ImGui::SliderFloat("Noise Scale", &curlParams.scale, 0.01f, 0.5f, "%.3f");
+				flowFieldChanged |= ImGui::SliderFloat("Curl Strength", &curlParams.strength, 0.0f, 5.0f, "%.2f");
+				flowFieldChanged |= ImGui::SliderFloat("Updraft", &curlParams.updraft, 0.0f, 10.0f, "%.2f");
+				flowFieldChanged |= ImGui::SliderFloat("Time Scale", &curlParams.timeScale, 0.0f, 5.0f, "%.2f");
+				flowFieldChanged |= ImGui::SliderFloat("Flow Influence", &flowInfluence, 0.0f, 5.0f, "%.2f");
+
+				if (flowFieldChanged) 
+				{
+					particleSystem.setCurlNoiseParameters(curlParams, flowInfluence);
+				}
 			}
-
-			ImGui::Text("Current Wind: (%.2f, %.2f, %.2f)", windDirection[0], windDirection[1], windDirection[2]);
-			ImGui::Text("Strength: %.2f, Influence: %.2f", windStrength, flowInfluence);
 		}
 	}
 
@@ -889,15 +1492,16 @@ int main(int argc, char* argv[])
 	initialize();
 
 	bool stopRendering = false;
-	auto startTime = std::chrono::system_clock::now();
+	auto startTime = std::chrono::steady_clock::now();
 
 	while (!stopRendering)
 	{
 		//update currentTime
-		std::chrono::duration<float> timeSinceStart = std::chrono::system_clock::now() - startTime;
+		std::chrono::duration<float> timeSinceStart = std::chrono::steady_clock::now() - startTime;
 		previousTime = currentTime;
 		currentTime = timeSinceStart.count();
 		deltaTime = currentTime - previousTime;
+		simulationClock.advance(deltaTime);
 
 		// Inform imgui of new frame
 		ImGui_ImplSdlGL3_NewFrame(g_window);
@@ -928,11 +1532,21 @@ int main(int argc, char* argv[])
 	delete boundaryManager;
 	delete computeManager;
 	delete smokePhysics;
+	delete sceneCollider;
 
 	// Free Models
 	//labhelper::freeModel(fighterModel);
 	labhelper::freeModel(landingpadModel);
 
+	// Free the OIT targets and particle timers
+	glDeleteQueries(2, particleTimerQueries);
+	glDeleteProgram(particleOITShaderProgram);
+	glDeleteProgram(particleSSBOOITShaderProgram);
+	glDeleteProgram(oitCompositeProgram);
+	glDeleteFramebuffers(1, &oitFB.framebufferId);
+	glDeleteTextures(GLsizei(oitFB.colorTextureTargets.size()), oitFB.colorTextureTargets.data());
+	glDeleteTextures(1, &oitFB.depthBuffer);
+
 	// Shut down everything. This includes the window and all other subsystems.
 	labhelper::shutDown(g_window);
 	return 0;
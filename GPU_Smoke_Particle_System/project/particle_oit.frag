@@ -0,0 +1,25 @@
+#version 420
+// particle.frag for weighted blended order-independent transparency (McGuire and Bavoil 2013).
+// Writes into the two targets of the OIT framebuffer, blended additively and multiplicatively, so
+// the particles can be drawn in any order. oit_composite.frag resolves them.
+in float life;
+uniform float screen_x;
+uniform float screen_y;
+layout(binding = 0) uniform sampler2D colortexture;
+layout(location = 0) out vec4 accumulation;
+layout(location = 1) out vec4 revealage;
+
+void main()
+{
+	// Same shading as particle.frag
+	vec4 color = texture2D(colortexture, gl_PointCoord);
+	float brightness = 0.3 * color.r + 0.6 * color.g + 0.1 * color.b;
+	color.rgb = vec3(brightness) * 0.5;
+	color.a *= (1.0 - pow(life, 4.0)) * 0.05;
+
+	// Nearer and more opaque fragments weigh more
+	float weight = clamp(pow(min(1.0, color.a * 10.0) + 0.01, 3.0) * 1e8 * pow(1.0 - gl_FragCoord.z * 0.9, 3.0),
+	                     1e-2, 3e3);
+	accumulation = vec4(color.rgb * color.a, color.a) * weight;
+	revealage = vec4(color.a);
+}
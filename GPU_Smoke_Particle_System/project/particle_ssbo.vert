@@ -0,0 +1,68 @@
+#version 430
+
+// Draws the particles straight from the compute shader's particle buffer, one point per slot.
+// Dead slots (lifetime < 0) and slots past total_count are moved outside the clip volume so they
+// never reach the rasterizer. When a depth-sorted order is available, the first sorted_count
+// vertices fetch their slot through it, the vertices after it are slots the sort did not cover.
+// The particles are drawn render_lag seconds behind the last simulation step, to blend between
+// fixed timesteps.
+
+struct Particle
+{
+	vec3 position;
+	float lifetime;
+	vec3 velocity;
+	float life_length;
+};
+
+layout(std430, binding = 0) readonly buffer ParticleBuffer
+{
+	Particle particles[];
+};
+
+layout(std430, binding = 1) readonly buffer CounterBuffer
+{
+	uint alive_count;
+	uint dead_count;
+	uint total_count;
+	uint padding;
+};
+
+layout(std430, binding = 6) readonly buffer SortBuffer
+{
+	uvec2 sort_entries[]; // x = depth key, y = slot
+};
+
+uniform uint sorted_count;
+uniform float render_lag;
+uniform mat4 V;
+uniform mat4 P;
+uniform float screen_x;
+uniform float screen_y;
+out float life;
+void main()
+{
+	uint slot = uint(gl_VertexID) < sorted_count ? sort_entries[gl_VertexID].y : uint(gl_VertexID);
+	if(slot >= total_count || particles[slot].lifetime < 0.0)
+	{
+		life = 1.0;
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+		gl_PointSize = 1.0;
+		return;
+	}
+
+	Particle particle = particles[slot];
+
+	// Normalized lifespan: 0 = just created, 1 = about to die
+	life = clamp((particle.lifetime - render_lag) / particle.life_length, 0.0, 1.0);
+	vec4 particle_vs = V * vec4(particle.position - particle.velocity * render_lag, 1.0);
+	// Calculate one projected corner of a quad at the particles view space depth.
+	vec4 proj_quad = P * vec4(1.0, 1.0, particle_vs.z, particle_vs.w);
+	// Calculate the projected pixel size.
+	vec2 proj_pixel = vec2(screen_x, screen_y) * proj_quad.xy / proj_quad.w;
+	// Use scale factor as sum of x and y sizes.
+	float scale_factor = (proj_pixel.x + proj_pixel.y);
+	// Transform position.
+	gl_Position = P * particle_vs;
+	gl_PointSize = scale_factor * 1.0;
+}
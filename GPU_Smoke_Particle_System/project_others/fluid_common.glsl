@@ -0,0 +1,26 @@
+// Grid helpers shared by the fluid_*.comp passes of FluidSolverGPU, pulled in with
+// #include "fluid_common.glsl". The texels are the grid nodes, node (0, 0, 0) sits on the minimum
+// corner of the flow field like in GridFlowField. FluidSolver.cpp is the CPU side of these passes,
+// keep the two in sync.
+
+uniform ivec3 u_resolution;
+uniform vec3 u_cellSize;
+
+bool outsideGrid(ivec3 node)
+{
+    return any(greaterThanEqual(node, u_resolution));
+}
+
+// Neighbours outside the grid read the nearest node
+ivec3 clampNode(ivec3 node)
+{
+    return clamp(node, ivec3(0), u_resolution - 1);
+}
+
+// The ceiling is open, the pressure is zero half a cell above the top nodes. The pressure above
+// it mirrors the top nodes with the opposite sign, which keeps the ceiling in the same place on
+// every multigrid level.
+bool aboveCeiling(ivec3 node)
+{
+    return node.y >= u_resolution.y;
+}
@@ -0,0 +1,32 @@
+// Laplacian of the mg_*.comp passes of MultigridSolverGPU, pulled in with
+// #include "multigrid_common.glsl" after fluid_common.glsl. The including pass declares the r32f
+// images pressureTexture and rhsTexture of the level it works on. MultigridSolver.cpp is the CPU
+// side, keep the two in sync.
+
+// Mirrored at the walls and the floor, with the opposite sign above the open ceiling
+float pressureAt(ivec3 node)
+{
+    float pressure = imageLoad(pressureTexture, clampNode(node)).x;
+    return aboveCeiling(node) ? -pressure : pressure;
+}
+
+vec3 laplacianWeights()
+{
+    return 1.0 / (u_cellSize * u_cellSize);
+}
+
+// Sum over the axes of w * (left + right neighbour)
+float neighbourSum(ivec3 node, vec3 w)
+{
+    return w.x * (pressureAt(node + ivec3(1, 0, 0)) + pressureAt(node - ivec3(1, 0, 0))) +
+           w.y * (pressureAt(node + ivec3(0, 1, 0)) + pressureAt(node - ivec3(0, 1, 0))) +
+           w.z * (pressureAt(node + ivec3(0, 0, 1)) + pressureAt(node - ivec3(0, 0, 1)));
+}
+
+// rhs - laplacian(p) at one node
+float nodeResidual(ivec3 node)
+{
+    vec3 w = laplacianWeights();
+    float diagonal = 2.0 * (w.x + w.y + w.z);
+    return imageLoad(rhsTexture, node).x - (neighbourSum(node, w) - diagonal * imageLoad(pressureTexture, node).x);
+}
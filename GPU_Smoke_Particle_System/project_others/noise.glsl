@@ -0,0 +1,152 @@
+// Gradient noise shared by the compute shaders, pulled in with #include "noise.glsl" (expanded by
+// FlowFieldGPU::readFile). This is the GLSL side of project/Noise.cpp: same integer hash, gradient
+// set and arithmetic, so the CPU and GPU fields pick the same gradients and agree up to float
+// rounding. Keep the two in sync.
+
+const float NOISE_F3 = 1.0 / 3.0; // Skews a point into simplex cell space
+const float NOISE_G3 = 1.0 / 6.0; // Unskews it back
+
+// Offsets of the second and third potential of curl3()
+const vec3 NOISE_CURL_OFFSET_B = vec3(31.341, -43.277, 12.685);
+const vec3 NOISE_CURL_OFFSET_C = vec3(-57.925, 24.117, -71.439);
+
+// Avalanching integer hash (lowbias32)
+uint noiseHashMix(uint h)
+{
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+uint noiseLatticeHash(ivec3 c)
+{
+    return noiseHashMix((uint(c.x) * 73856093u) ^ (uint(c.y) * 19349663u) ^ (uint(c.z) * 83492791u));
+}
+
+// One of the 12 cube edge directions of improved Perlin noise (4 of them twice), picked by the
+// low 4 bits of h
+vec3 noiseGradient(uint h)
+{
+    int b = int(h & 15u);
+    int b0 = b & 1;
+    int b1 = (b >> 1) & 1;
+    int b2 = (b >> 2) & 1;
+    int b3 = b >> 3;
+    float su = float(1 - 2 * b0);
+    float sv = float(1 - 2 * b1);
+    float uIsX = float(1 - b3);              // b < 8
+    float vIsY = float((1 - b3) * (1 - b2)); // b < 4
+    float vIsX = float(b3 * b2 * (1 - b0));  // b is 12 or 14
+    return vec3(uIsX * su + vIsX * sv,
+                (1.0 - uIsX) * su + vIsY * sv,
+                (1.0 - vIsY - vIsX) * sv);
+}
+
+// Contribution of one simplex corner at offset p, its gradient is added to d
+float simplexCorner(uint h, vec3 p, inout vec3 d)
+{
+    vec3 g = noiseGradient(h);
+    // Falloff radius^2 of 0.5, see Noise.cpp
+    float t0 = 0.5 - p.x * p.x - p.y * p.y - p.z * p.z;
+    float t = 0.5 * (t0 + abs(t0));
+    float t2 = t * t;
+    float t4 = t2 * t2;
+    float gp = g.x * p.x + g.y * p.y + g.z * p.z;
+
+    // d/dp (t^4 g) = t^4 grad - 8 t^3 g p
+    float radial = 8.0 * t2 * t * gp;
+    d += t4 * g - radial * p;
+    return t4 * gp;
+}
+
+// 3D simplex noise, roughly in [-1, 1], and its analytic gradient
+float simplex3(vec3 p, out vec3 gradient)
+{
+    // Cell of the skewed lattice and the offset to its first corner
+    float s = (p.x + p.y + p.z) * NOISE_F3;
+    vec3 f = floor(p + s);
+    float t = (f.x + f.y + f.z) * NOISE_G3;
+    vec3 p0 = p - (f - t);
+
+    // The other corners follow the axes ordered by offset
+    int xy = int(p0.x >= p0.y);
+    int yz = int(p0.y >= p0.z);
+    int xz = int(p0.x >= p0.z);
+    ivec3 o1 = ivec3(xy & xz, yz & (xy ^ 1), (yz ^ 1) & (xz ^ 1));
+    ivec3 o2 = ivec3(xy | xz, yz | (xy ^ 1), (yz ^ 1) | (xz ^ 1));
+
+    vec3 p1 = p0 - vec3(o1) + NOISE_G3;
+    vec3 p2 = p0 - vec3(o2) + 2.0 * NOISE_G3;
+    vec3 p3 = p0 - 1.0 + 3.0 * NOISE_G3;
+
+    ivec3 c = ivec3(f);
+    vec3 d = vec3(0.0);
+    float n = simplexCorner(noiseLatticeHash(c), p0, d);
+    n += simplexCorner(noiseLatticeHash(c + o1), p1, d);
+    n += simplexCorner(noiseLatticeHash(c + o2), p2, d);
+    n += simplexCorner(noiseLatticeHash(c + 1), p3, d);
+
+    gradient = d * 76.0;
+    return 76.0 * n;
+}
+
+// 3D simplex noise, roughly in [-1, 1]
+float simplex3(vec3 p)
+{
+    vec3 gradient;
+    return simplex3(p, gradient);
+}
+
+// Curl of the vector potential (simplex3(p), simplex3(p + b), simplex3(p + c)), divergence-free
+vec3 curl3(vec3 p)
+{
+    vec3 a, b, c;
+    simplex3(p, a);
+    simplex3(p + NOISE_CURL_OFFSET_B, b);
+    simplex3(p + NOISE_CURL_OFFSET_C, c);
+    return vec3(c.y - b.z, a.z - c.x, b.x - a.y);
+}
+
+float noiseFade(float t)
+{
+    return t * t * t * (t * (t * 6.0 - 15.0) + 10.0);
+}
+
+float noiseGradientDot(ivec3 c, vec3 p)
+{
+    vec3 g = noiseGradient(noiseLatticeHash(c));
+    return g.x * p.x + g.y * p.y + g.z * p.z;
+}
+
+// 3D improved Perlin noise with quintic fade, roughly in [-1, 1]
+float perlin3(vec3 p)
+{
+    vec3 f = floor(p);
+    vec3 p0 = p - f;
+    vec3 p1 = p0 - 1.0;
+    float u = noiseFade(p0.x);
+    float v = noiseFade(p0.y);
+    float w = noiseFade(p0.z);
+
+    ivec3 c = ivec3(f);
+    float n000 = noiseGradientDot(c, p0);
+    float n100 = noiseGradientDot(c + ivec3(1, 0, 0), vec3(p1.x, p0.y, p0.z));
+    float n010 = noiseGradientDot(c + ivec3(0, 1, 0), vec3(p0.x, p1.y, p0.z));
+    float n110 = noiseGradientDot(c + ivec3(1, 1, 0), vec3(p1.x, p1.y, p0.z));
+    float n001 = noiseGradientDot(c + ivec3(0, 0, 1), vec3(p0.x, p0.y, p1.z));
+    float n101 = noiseGradientDot(c + ivec3(1, 0, 1), vec3(p1.x, p0.y, p1.z));
+    float n011 = noiseGradientDot(c + ivec3(0, 1, 1), vec3(p0.x, p1.y, p1.z));
+    float n111 = noiseGradientDot(c + ivec3(1, 1, 1), p1);
+
+    // a + t * (b - a) like the C++ side, mix() may be evaluated differently
+    float nx00 = n000 + u * (n100 - n000);
+    float nx10 = n010 + u * (n110 - n010);
+    float nx01 = n001 + u * (n101 - n001);
+    float nx11 = n011 + u * (n111 - n011);
+    float nxy0 = nx00 + v * (nx10 - nx00);
+    float nxy1 = nx01 + v * (nx11 - nx01);
+    return nxy0 + w * (nxy1 - nxy0);
+}